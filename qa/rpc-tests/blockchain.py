@@ -57,7 +57,7 @@ class BlockchainTest(BitcoinTestFramework):
         assert_equal(res['txouts'], 200)
         assert_equal(res['bytes_serialized'], 13924),
         assert_equal(len(res['bestblock']), 64)
-        assert_equal(len(res['hash_serialized']), 64)
+        assert_equal(len(res['hash_serialized_2']), 64)
 
     def _test_getblockheader(self):
         node = self.nodes[0]
@@ -57,4 +57,45 @@ static void CoinSelection(benchmark::State& state)
     }
 }
 
+// Large wallets: every value differs, so selection cannot stop at the
+// first coin of the right size, and the candidate set below the target is
+// large. The coins are sorted once per transaction, as in CreateTransaction.
+static void CoinSelectionLarge(benchmark::State& state, bool fExact)
+{
+    const CWallet wallet;
+    std::vector<COutput> vCoins;
+    LOCK(wallet.cs_wallet);
+
+    for (int i = 0; i < 100000; i++)
+        addCoin((i + 1) * CENT + i % 7, wallet, vCoins);
+
+    // Coin i is worth (i + 1) cents and i % 7 satoshis; the first target is
+    // the sum of three coins, the second cannot be met exactly, so the
+    // search runs to its bound before the stochastic approximation
+    const CAmount nTarget = fExact ? (100 * CENT + 1) + (2000 * CENT + 4) + (30000 * CENT + 4) : 50000 * CENT + CENT / 2;
+    while (state.KeepRunning()) {
+        const CSelectableCoins coins(vCoins);
+        std::set<std::pair<const CWalletTx*, unsigned int> > setCoinsRet;
+        CAmount nValueRet;
+        bool success = wallet.SelectCoinsMinConf(nTarget, 1, 6, 0, coins, setCoinsRet, nValueRet);
+        assert(success);
+        assert(!fExact || nValueRet == nTarget);
+    }
+
+    BOOST_FOREACH (COutput output, vCoins)
+        delete output.tx;
+}
+
+static void CoinSelectionLargeExact(benchmark::State& state)
+{
+    CoinSelectionLarge(state, true);
+}
+
+static void CoinSelectionLargeInexact(benchmark::State& state)
+{
+    CoinSelectionLarge(state, false);
+}
+
 BENCHMARK(CoinSelection);
+BENCHMARK(CoinSelectionLargeExact);
+BENCHMARK(CoinSelectionLargeInexact);
@@ -41,3 +41,14 @@ static void RollingBloom(benchmark::State& state)
 }
 
 BENCHMARK(RollingBloom);
+
+static void RollingBloomConstruct(benchmark::State& state)
+{
+    // The filters every peer gets when it connects
+    while (state.KeepRunning()) {
+        CRollingBloomFilter addrKnown(5000, 0.001);
+        CRollingBloomFilter filterInventoryKnown(50000, 0.000001);
+    }
+}
+
+BENCHMARK(RollingBloomConstruct);
@@ -3,14 +3,18 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "bench.h"
+#include "arith_uint256.h"
 #include "key.h"
 #if defined(HAVE_CONSENSUS_LIB)
 #include "script/bitcoinconsensus.h"
 #endif
 #include "script/script.h"
 #include "script/sign.h"
+#include "script/standard.h"
 #include "streams.h"
 
+#include <memory>
+
 // FIXME: Dedup with BuildCreditingTransaction in test/script_tests.cpp.
 static CMutableTransaction BuildCreditingTransaction(const CScript& scriptPubKey)
 {
@@ -99,4 +103,109 @@ static void VerifyScriptBench(benchmark::State& state)
     }
 }
 
+// Microbenchmark for verification of a P2PKH spend, the most common script
+// template, which runs entirely on the legacy (non-witness) code path.
+static void VerifyScriptP2PKHBench(benchmark::State& state)
+{
+    const int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC | SCRIPT_VERIFY_DERSIG | SCRIPT_VERIFY_LOW_S;
+
+    CKey key;
+    const unsigned char vchKey[32] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+    key.Set(vchKey, vchKey + 32, true);
+    CPubKey pubkey = key.GetPubKey();
+
+    CScript scriptPubKey = GetScriptForDestination(pubkey.GetID());
+    CTransaction txCredit = BuildCreditingTransaction(scriptPubKey);
+    CMutableTransaction txSpend = BuildSpendingTransaction(CScript(), txCredit);
+    std::vector<unsigned char> vchSig;
+    key.Sign(SignatureHash(scriptPubKey, txSpend, 0, SIGHASH_ALL, txCredit.vout[0].nValue, SIGVERSION_BASE), vchSig);
+    vchSig.push_back(static_cast<unsigned char>(SIGHASH_ALL));
+    txSpend.vin[0].scriptSig = CScript() << vchSig << ToByteVector(pubkey);
+
+    while (state.KeepRunning()) {
+        ScriptError err;
+        bool success = VerifyScript(
+            txSpend.vin[0].scriptSig,
+            txCredit.vout[0].scriptPubKey,
+            &txSpend.vin[0].scriptWitness,
+            flags,
+            MutableTransactionSignatureChecker(&txSpend, 0, txCredit.vout[0].nValue),
+            &err);
+        assert(err == SCRIPT_ERR_OK);
+        assert(success);
+    }
+}
+
+// Signature-free script exercising pushes, stack manipulation, hashing and
+// arithmetic, so that the interpreter itself (and any per-element allocation
+// it does) dominates rather than ECDSA verification.
+static void VerifyScriptHashLockBench(benchmark::State& state)
+{
+    const int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_MINIMALDATA;
+
+    const std::vector<unsigned char> vchPreimage(32, 0x42);
+    uint160 hash;
+    CHash160().Write(vchPreimage.data(), vchPreimage.size()).Finalize(hash.begin());
+
+    CScript scriptPubKey = CScript() << OP_DUP << OP_SIZE << 32 << OP_EQUALVERIFY
+        << OP_HASH160 << ToByteVector(hash) << OP_EQUALVERIFY
+        << OP_1 << OP_2 << OP_ADD << 3 << OP_NUMEQUALVERIFY
+        << OP_DROP << OP_TRUE;
+    CScript scriptSig = CScript() << vchPreimage;
+
+    while (state.KeepRunning()) {
+        ScriptError err;
+        bool success = VerifyScript(scriptSig, scriptPubKey, NULL, flags, BaseSignatureChecker(), &err);
+        assert(err == SCRIPT_ERR_OK);
+        assert(success);
+    }
+}
+
+// Legacy signature hashes for every input of a large non-segwit sweep, as
+// done when validating it. Quadratic in the number of inputs without the
+// precomputed layout; the Precomputed variant includes building it.
+static CMutableTransaction BuildSweepTransaction(unsigned int nInputs)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(nInputs);
+    for (unsigned int i = 0; i < nInputs; i++) {
+        tx.vin[i].prevout.hash = ArithToUint256(arith_uint256(i + 1));
+        tx.vin[i].prevout.n = i;
+        tx.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72, 1) << std::vector<unsigned char>(33, 2);
+    }
+    tx.vout.resize(2);
+    tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 3) << OP_EQUALVERIFY << OP_CHECKSIG;
+    tx.vout[1].scriptPubKey = tx.vout[0].scriptPubKey;
+    return tx;
+}
+
+static void SighashLegacySweep(benchmark::State& state, bool fPrecompute)
+{
+    const CTransaction tx(BuildSweepTransaction(500));
+    const CScript scriptCode = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 4) << OP_EQUALVERIFY << OP_CHECKSIG;
+
+    while (state.KeepRunning()) {
+        std::unique_ptr<PrecomputedTransactionData> txdata;
+        if (fPrecompute)
+            txdata.reset(new PrecomputedTransactionData(tx));
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++) {
+            SignatureHash(scriptCode, tx, nIn, SIGHASH_ALL, 0, SIGVERSION_BASE, txdata.get());
+        }
+    }
+}
+
+static void SighashLegacySweepBench(benchmark::State& state)
+{
+    SighashLegacySweep(state, false);
+}
+
+static void SighashLegacySweepPrecomputedBench(benchmark::State& state)
+{
+    SighashLegacySweep(state, true);
+}
+
 BENCHMARK(VerifyScriptBench);
+BENCHMARK(VerifyScriptP2PKHBench);
+BENCHMARK(VerifyScriptHashLockBench);
+BENCHMARK(SighashLegacySweepBench);
+BENCHMARK(SighashLegacySweepPrecomputedBench);
@@ -0,0 +1,205 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+
+#include "util.h"
+
+#include <algorithm>
+#include <errno.h>
+
+#ifdef WIN32
+#include "compat.h"
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CBlockFile::CBlockFile() :
+#ifdef WIN32
+    file(NULL),
+#else
+    fd(-1),
+#endif
+    pMap(NULL), nMapSize(0)
+{
+}
+
+CBlockFile::~CBlockFile()
+{
+#ifdef WIN32
+    if (file != NULL)
+        fclose(file);
+#else
+    if (pMap != NULL)
+        munmap((void*)pMap, nMapSize);
+    if (fd != -1)
+        close(fd);
+#endif
+}
+
+std::shared_ptr<CBlockFile> CBlockFile::Open(const boost::filesystem::path& path, bool fMap)
+{
+    std::shared_ptr<CBlockFile> file(new CBlockFile());
+#ifdef WIN32
+    file->file = fopen(path.string().c_str(), "rb");
+    if (file->file == NULL) {
+        LogPrintf("Unable to open file %s\n", path.string());
+        return std::shared_ptr<CBlockFile>();
+    }
+#else
+    file->fd = open(path.string().c_str(), O_RDONLY);
+    if (file->fd == -1) {
+        LogPrintf("Unable to open file %s\n", path.string());
+        return std::shared_ptr<CBlockFile>();
+    }
+    if (fMap && sizeof(void*) >= 8) {
+        // Only map on 64-bit platforms; 32-bit ones would run out of address space
+        struct stat st;
+        if (fstat(file->fd, &st) == 0 && st.st_size > 0) {
+            void* pMap = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, file->fd, 0);
+            if (pMap != MAP_FAILED) {
+                file->pMap = (const unsigned char*)pMap;
+                file->nMapSize = st.st_size;
+            } else {
+                LogPrint("blockfile", "Unable to map %s, reading it instead\n", path.string());
+            }
+        }
+    }
+#endif
+    return file;
+}
+
+size_t CBlockFile::Read(uint64_t nPos, unsigned char* pch, size_t nSize) const
+{
+    size_t nRead = 0;
+    const unsigned char* pData = Data(nPos, 0);
+    if (pData != NULL) {
+        nRead = std::min<uint64_t>(nSize, nMapSize - nPos);
+        memcpy(pch, pData, nRead);
+    }
+#ifdef WIN32
+    if (nRead < nSize) {
+        LOCK(cs);
+        if (fseek(file, nPos + nRead, SEEK_SET) == 0)
+            nRead += fread(pch + nRead, 1, nSize - nRead, file);
+    }
+#else
+    while (nRead < nSize) {
+        ssize_t nNow = pread(fd, pch + nRead, nSize - nRead, nPos + nRead);
+        if (nNow < 0 && errno == EINTR)
+            continue;
+        if (nNow <= 0)
+            break;
+        nRead += nNow;
+    }
+#endif
+    return nRead;
+}
+
+void CBlockFile::Prefetch(uint64_t nPos, size_t nSize) const
+{
+#ifndef WIN32
+    if (pMap != NULL && nPos < nMapSize) {
+        // madvise wants a page aligned address
+        static const uint64_t nPageSize = sysconf(_SC_PAGESIZE);
+        const uint64_t nStart = nPos - nPos % nPageSize;
+        const uint64_t nEnd = std::min<uint64_t>(nPos + nSize, nMapSize);
+        posix_madvise((void*)(pMap + nStart), nEnd - nStart, POSIX_MADV_WILLNEED);
+        return;
+    }
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, nPos, nSize, POSIX_FADV_WILLNEED);
+#endif
+#endif
+}
+
+void CBlockFileReader::ReadUnmapped(unsigned char* pch, size_t nSize)
+{
+    // Whatever the read-ahead buffer already holds
+    if (nPos >= nBufferPos && nPos < nBufferPos + vBuffer.size()) {
+        size_t nNow = std::min<uint64_t>(nSize, nBufferPos + vBuffer.size() - nPos);
+        memcpy(pch, &vBuffer[nPos - nBufferPos], nNow);
+        pch += nNow;
+        nSize -= nNow;
+        nPos += nNow;
+    }
+    if (nSize == 0)
+        return;
+
+    if (nSize >= READAHEAD_SIZE) {
+        // Large reads go straight into the destination
+        if (file->Read(nPos, pch, nSize) != nSize)
+            throw std::ios_base::failure("CBlockFileReader::read: end of file");
+        nPos += nSize;
+        return;
+    }
+
+    vBuffer.resize(READAHEAD_SIZE);
+    nBufferPos = nPos;
+    vBuffer.resize(file->Read(nPos, vBuffer.data(), READAHEAD_SIZE));
+    if (vBuffer.size() < nSize)
+        throw std::ios_base::failure("CBlockFileReader::read: end of file");
+    memcpy(pch, vBuffer.data(), nSize);
+    nPos += nSize;
+}
+
+std::shared_ptr<const CBlockFile> CBlockFileCache::Get(const std::string& strPrefix, int nFile, const boost::filesystem::path& path, bool fFinalized)
+{
+    const FileKey key(strPrefix, nFile);
+    LOCK(cs);
+    std::map<FileKey, std::list<CacheEntry>::iterator>::iterator it = mapFiles.find(key);
+    if (it != mapFiles.end()) {
+        // A file opened while it was still being written is reopened, and mapped, once it is complete
+        if (!fFinalized || it->second->fFinalized) {
+            listFiles.splice(listFiles.begin(), listFiles, it->second);
+            return it->second->file;
+        }
+        listFiles.erase(it->second);
+        mapFiles.erase(it);
+    }
+
+    std::shared_ptr<CBlockFile> file = CBlockFile::Open(path, fFinalized);
+    if (!file)
+        return std::shared_ptr<const CBlockFile>();
+
+    listFiles.push_front(CacheEntry());
+    listFiles.front().key = key;
+    listFiles.front().file = file;
+    listFiles.front().fFinalized = fFinalized;
+    mapFiles[key] = listFiles.begin();
+    while (listFiles.size() > nMaxFiles) {
+        mapFiles.erase(listFiles.back().key);
+        listFiles.pop_back();
+    }
+    return file;
+}
+
+void CBlockFileCache::Erase(int nFile)
+{
+    LOCK(cs);
+    for (std::list<CacheEntry>::iterator it = listFiles.begin(); it != listFiles.end(); ) {
+        if (it->key.second == nFile) {
+            mapFiles.erase(it->key);
+            it = listFiles.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void CBlockFileCache::Clear()
+{
+    LOCK(cs);
+    mapFiles.clear();
+    listFiles.clear();
+}
+
+size_t CBlockFileCache::Size()
+{
+    LOCK(cs);
+    return listFiles.size();
+}
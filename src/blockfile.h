@@ -0,0 +1,174 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILE_H
+#define BITCOIN_BLOCKFILE_H
+
+#include "serialize.h"
+#include "sync.h"
+
+#include <ios>
+#include <list>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+/** Number of blk/rev files kept open for reading */
+static const size_t DEFAULT_BLOCKFILE_CACHE_SIZE = 16;
+
+/**
+ * A read-only handle on a blk or rev file, shared by all readers.
+ *
+ * Files that no longer grow are mapped into memory, and reads from them are
+ * plain copies. The mapping covers the file as it was when it was opened;
+ * anything past that (undo data appended to an older rev file), and every
+ * read from a file that is still being written, goes through pread, which
+ * needs no lock and no seek.
+ */
+class CBlockFile
+{
+private:
+#ifdef WIN32
+    FILE* file;
+    mutable CCriticalSection cs;
+#else
+    int fd;
+#endif
+    const unsigned char* pMap;
+    size_t nMapSize;
+
+    CBlockFile();
+    CBlockFile(const CBlockFile&);
+    CBlockFile& operator=(const CBlockFile&);
+
+public:
+    ~CBlockFile();
+
+    /** Open a file for reading, mapping it if fMap; returns NULL if it cannot be opened */
+    static std::shared_ptr<CBlockFile> Open(const boost::filesystem::path& path, bool fMap);
+
+    bool IsMapped() const { return pMap != NULL; }
+
+    /** The mapped bytes [nPos, nPos + nSize), or NULL if they are not all mapped */
+    const unsigned char* Data(uint64_t nPos, size_t nSize) const
+    {
+        if (pMap == NULL || nPos > nMapSize || nSize > nMapSize - nPos)
+            return NULL;
+        return pMap + nPos;
+    }
+
+    /** Read up to nSize bytes at nPos; returns the number of bytes read */
+    size_t Read(uint64_t nPos, unsigned char* pch, size_t nSize) const;
+
+    /** Hint that [nPos, nPos + nSize) will be read soon, so the OS can start reading it in */
+    void Prefetch(uint64_t nPos, size_t nSize) const;
+};
+
+/**
+ * Stream that deserializes from a CBlockFile starting at a given position.
+ * Mapped bytes are copied directly; otherwise the file is read ahead in
+ * chunks so that small fields do not cost a system call each.
+ */
+class CBlockFileReader
+{
+private:
+    static const size_t READAHEAD_SIZE = 64 * 1024;
+
+    std::shared_ptr<const CBlockFile> file;
+    const int nType;
+    const int nVersion;
+    uint64_t nPos;
+
+    std::vector<unsigned char> vBuffer;
+    uint64_t nBufferPos; //!< File position of vBuffer[0]
+
+public:
+    CBlockFileReader(std::shared_ptr<const CBlockFile> fileIn, uint64_t nPosIn, int nTypeIn, int nVersionIn)
+        : file(fileIn), nType(nTypeIn), nVersion(nVersionIn), nPos(nPosIn), nBufferPos(0) {}
+
+    bool IsNull() const { return !file; }
+
+    //
+    // Stream subset
+    //
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+
+    void read(char* pch, size_t nSize)
+    {
+        if (!file)
+            throw std::ios_base::failure("CBlockFileReader::read: file handle is NULL");
+        const unsigned char* pData = file->Data(nPos, nSize);
+        if (pData != NULL) {
+            memcpy(pch, pData, nSize);
+            nPos += nSize;
+            return;
+        }
+        ReadUnmapped((unsigned char*)pch, nSize);
+    }
+
+    /** Skip nSize bytes without reading them */
+    void ignore(size_t nSize)
+    {
+        nPos += nSize;
+    }
+
+    template <typename T>
+    CBlockFileReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        if (!file)
+            throw std::ios_base::failure("CBlockFileReader::operator>>: file handle is NULL");
+        ::Unserialize(*this, obj);
+        return (*this);
+    }
+
+private:
+    void ReadUnmapped(unsigned char* pch, size_t nSize);
+};
+
+/**
+ * Bounded cache of the blk and rev files open for reading, least recently
+ * used first out. Evicted files stay open until their last reader is done.
+ */
+class CBlockFileCache
+{
+private:
+    typedef std::pair<std::string, int> FileKey;
+    struct CacheEntry {
+        FileKey key;
+        std::shared_ptr<CBlockFile> file;
+        bool fFinalized;
+    };
+
+    CCriticalSection cs;
+    std::list<CacheEntry> listFiles; //!< Most recently used first
+    std::map<FileKey, std::list<CacheEntry>::iterator> mapFiles;
+    size_t nMaxFiles;
+
+public:
+    explicit CBlockFileCache(size_t nMaxFilesIn = DEFAULT_BLOCKFILE_CACHE_SIZE) : nMaxFiles(nMaxFilesIn) {}
+
+    /**
+     * Get file nFile with the given prefix ("blk" or "rev"). fFinalized tells
+     * whether the file is complete, so that it can be mapped.
+     */
+    std::shared_ptr<const CBlockFile> Get(const std::string& strPrefix, int nFile, const boost::filesystem::path& path, bool fFinalized);
+
+    /** Forget about both files of nFile, e.g. after they have been pruned */
+    void Erase(int nFile);
+
+    void Clear();
+
+    size_t Size();
+};
+
+#endif // BITCOIN_BLOCKFILE_H
@@ -0,0 +1,295 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "hash.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "streams.h"
+#include "undo.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+#include <boost/foreach.hpp>
+
+namespace {
+
+/** Appends bits to a byte vector, most significant bit first */
+class BitWriter
+{
+private:
+    std::vector<unsigned char>& vData;
+    uint8_t nBuffer;
+    int nBits; //!< Bits used in nBuffer
+
+public:
+    explicit BitWriter(std::vector<unsigned char>& vDataIn) : vData(vDataIn), nBuffer(0), nBits(0) {}
+
+    /** Write the nCount (at most 64) low bits of nValue */
+    void Write(uint64_t nValue, int nCount)
+    {
+        while (nCount > 0) {
+            int nTake = std::min(8 - nBits, nCount);
+            uint8_t nChunk = (nValue >> (nCount - nTake)) & ((1 << nTake) - 1);
+            nBuffer |= nChunk << (8 - nBits - nTake);
+            nBits += nTake;
+            nCount -= nTake;
+            if (nBits == 8)
+                Flush();
+        }
+    }
+
+    /** Write out a partial byte, padded with zero bits */
+    void Flush()
+    {
+        if (nBits == 0)
+            return;
+        vData.push_back(nBuffer);
+        nBuffer = 0;
+        nBits = 0;
+    }
+};
+
+/** Reads bits from a byte vector, most significant bit first */
+class BitReader
+{
+private:
+    const std::vector<unsigned char>& vData;
+    size_t nPos;
+    uint8_t nBuffer;
+    int nBits; //!< Bits left in nBuffer
+
+public:
+    BitReader(const std::vector<unsigned char>& vDataIn, size_t nPosIn) : vData(vDataIn), nPos(nPosIn), nBuffer(0), nBits(0) {}
+
+    /** Read nCount (at most 64) bits */
+    uint64_t Read(int nCount)
+    {
+        uint64_t nResult = 0;
+        while (nCount > 0) {
+            if (nBits == 0) {
+                if (nPos >= vData.size())
+                    throw std::ios_base::failure("GCS filter ends early");
+                nBuffer = vData[nPos++];
+                nBits = 8;
+            }
+            int nTake = std::min(nBits, nCount);
+            nResult = (nResult << nTake) | ((nBuffer >> (nBits - nTake)) & ((1 << nTake) - 1));
+            nBits -= nTake;
+            nCount -= nTake;
+        }
+        return nResult;
+    }
+};
+
+/** Golomb-Rice code: the quotient x >> P in unary, then the P low bits of x */
+void GolombRiceEncode(BitWriter& writer, uint8_t nP, uint64_t x)
+{
+    uint64_t q = x >> nP;
+    while (q > 0) {
+        int nBits = (int)std::min<uint64_t>(q, 64);
+        writer.Write(~(uint64_t)0, nBits);
+        q -= nBits;
+    }
+    writer.Write(0, 1);
+    writer.Write(x, nP);
+}
+
+uint64_t GolombRiceDecode(BitReader& reader, uint8_t nP)
+{
+    uint64_t q = 0;
+    while (reader.Read(1) == 1)
+        q++;
+    return (q << nP) + reader.Read(nP);
+}
+
+/** Map x uniformly into [0, n), as (x * n) >> 64 */
+uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+#ifdef __SIZEOF_INT128__
+    return ((unsigned __int128)x * (unsigned __int128)n) >> 64;
+#else
+    // Multiply the 32-bit halves separately to keep the high word
+    uint64_t x_hi = x >> 32, x_lo = x & 0xFFFFFFFF;
+    uint64_t n_hi = n >> 32, n_lo = n & 0xFFFFFFFF;
+    uint64_t ac = x_hi * n_hi;
+    uint64_t ad = x_hi * n_lo;
+    uint64_t bc = x_lo * n_hi;
+    uint64_t bd = x_lo * n_lo;
+    uint64_t mid34 = (bd >> 32) + (bc & 0xFFFFFFFF) + (ad & 0xFFFFFFFF);
+    return ac + (bc >> 32) + (ad >> 32) + (mid34 >> 32);
+#endif
+}
+
+} // namespace
+
+GCSFilter::GCSFilter(uint64_t nSipK0In, uint64_t nSipK1In, uint8_t nPIn, uint32_t nMIn)
+    : nSipK0(nSipK0In), nSipK1(nSipK1In), nP(nPIn), nM(nMIn), nN(0), nF(0)
+{
+    CVectorWriter(SER_NETWORK, 0, vEncoded, 0) << COMPACTSIZE((uint64_t)nN);
+}
+
+GCSFilter::GCSFilter(uint64_t nSipK0In, uint64_t nSipK1In, uint8_t nPIn, uint32_t nMIn, const std::vector<unsigned char>& vEncodedIn)
+    : nSipK0(nSipK0In), nSipK1(nSipK1In), nP(nPIn), nM(nMIn), vEncoded(vEncodedIn)
+{
+    const size_t nPrefix = std::min<size_t>(vEncoded.size(), 9);
+    CDataStream stream((const char*)vEncoded.data(), (const char*)vEncoded.data() + nPrefix, SER_NETWORK, 0);
+    uint64_t nCount = ReadCompactSize(stream);
+    if (nCount > std::numeric_limits<uint32_t>::max())
+        throw std::ios_base::failure("N must be <2^32");
+    nN = nCount;
+    nF = (uint64_t)nN * nM;
+
+    // Decode all elements once, so that a malformed filter is caught here
+    BitReader reader(vEncoded, nPrefix - stream.size());
+    for (uint32_t i = 0; i < nN; i++)
+        GolombRiceDecode(reader, nP);
+}
+
+GCSFilter::GCSFilter(uint64_t nSipK0In, uint64_t nSipK1In, uint8_t nPIn, uint32_t nMIn, const ElementSet& elements)
+    : nSipK0(nSipK0In), nSipK1(nSipK1In), nP(nPIn), nM(nMIn)
+{
+    if (elements.size() > std::numeric_limits<uint32_t>::max())
+        throw std::invalid_argument("N must be <2^32");
+    nN = elements.size();
+    nF = (uint64_t)nN * nM;
+
+    CVectorWriter(SER_NETWORK, 0, vEncoded, 0) << COMPACTSIZE((uint64_t)nN);
+    if (elements.empty())
+        return;
+
+    BitWriter writer(vEncoded);
+    uint64_t nLast = 0;
+    BOOST_FOREACH(uint64_t nHash, BuildHashedSet(elements)) {
+        GolombRiceEncode(writer, nP, nHash - nLast);
+        nLast = nHash;
+    }
+    writer.Flush();
+}
+
+uint64_t GCSFilter::HashToRange(const Element& element) const
+{
+    uint64_t nHash = CSipHasher(nSipK0, nSipK1).Write(element.data(), element.size()).Finalize();
+    return MapIntoRange(nHash, nF);
+}
+
+std::vector<uint64_t> GCSFilter::BuildHashedSet(const ElementSet& elements) const
+{
+    std::vector<uint64_t> vHashes;
+    vHashes.reserve(elements.size());
+    BOOST_FOREACH(const Element& element, elements)
+        vHashes.push_back(HashToRange(element));
+    std::sort(vHashes.begin(), vHashes.end());
+    return vHashes;
+}
+
+bool GCSFilter::MatchInternal(const uint64_t* pHashes, size_t nSize) const
+{
+    const size_t nPrefix = GetSizeOfCompactSize(nN);
+    BitReader reader(vEncoded, nPrefix);
+
+    // Merge the sorted query hashes against the sorted filter hashes
+    uint64_t nValue = 0;
+    size_t nQuery = 0;
+    for (uint32_t i = 0; i < nN && nQuery < nSize; i++) {
+        nValue += GolombRiceDecode(reader, nP);
+        while (nQuery < nSize && pHashes[nQuery] < nValue)
+            nQuery++;
+        if (nQuery < nSize && pHashes[nQuery] == nValue)
+            return true;
+    }
+    return false;
+}
+
+bool GCSFilter::Match(const Element& element) const
+{
+    if (nN == 0)
+        return false;
+    uint64_t nHash = HashToRange(element);
+    return MatchInternal(&nHash, 1);
+}
+
+bool GCSFilter::MatchAny(const ElementSet& elements) const
+{
+    if (nN == 0 || elements.empty())
+        return false;
+    const std::vector<uint64_t> vHashes = BuildHashedSet(elements);
+    return MatchInternal(vHashes.data(), vHashes.size());
+}
+
+static GCSFilter::ElementSet BasicFilterElements(const CBlock& block, const CBlockUndo& blockundo)
+{
+    GCSFilter::ElementSet elements;
+
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx) {
+        BOOST_FOREACH(const CTxOut& txout, tx->vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.insert(GCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+
+    BOOST_FOREACH(const CTxUndo& txundo, blockundo.vtxundo) {
+        BOOST_FOREACH(const CTxInUndo& prevout, txundo.vprevout) {
+            const CScript& script = prevout.txout.scriptPubKey;
+            if (script.empty())
+                continue;
+            elements.insert(GCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+
+    return elements;
+}
+
+BlockFilter::BlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn, const std::vector<unsigned char>& vFilter)
+    : filterType(filterTypeIn), hashBlock(hashBlockIn)
+{
+    uint64_t nSipK0, nSipK1;
+    uint8_t nP;
+    uint32_t nM;
+    if (!BuildParams(nSipK0, nSipK1, nP, nM))
+        throw std::invalid_argument("unknown filter type");
+    filter = GCSFilter(nSipK0, nSipK1, nP, nM, vFilter);
+}
+
+BlockFilter::BlockFilter(BlockFilterType filterTypeIn, const CBlock& block, const CBlockUndo& blockundo)
+    : filterType(filterTypeIn), hashBlock(block.GetHash())
+{
+    uint64_t nSipK0, nSipK1;
+    uint8_t nP;
+    uint32_t nM;
+    if (!BuildParams(nSipK0, nSipK1, nP, nM))
+        throw std::invalid_argument("unknown filter type");
+    filter = GCSFilter(nSipK0, nSipK1, nP, nM, BasicFilterElements(block, blockundo));
+}
+
+bool BlockFilter::BuildParams(uint64_t& nSipK0, uint64_t& nSipK1, uint8_t& nP, uint32_t& nM) const
+{
+    switch (filterType) {
+    case BlockFilterType::BASIC:
+        // The SipHash key is the first 16 bytes of the block hash
+        nSipK0 = hashBlock.GetUint64(0);
+        nSipK1 = hashBlock.GetUint64(1);
+        nP = BASIC_FILTER_P;
+        nM = BASIC_FILTER_M;
+        return true;
+    }
+    return false;
+}
+
+uint256 BlockFilter::GetHash() const
+{
+    const std::vector<unsigned char>& vData = filter.GetEncoded();
+    return Hash(vData.begin(), vData.end());
+}
+
+uint256 BlockFilter::ComputeHeader(const uint256& prevHeader) const
+{
+    const uint256 hashFilter = GetHash();
+    return Hash(hashFilter.begin(), hashFilter.end(), prevHeader.begin(), prevHeader.end());
+}
@@ -0,0 +1,129 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILTER_H
+#define BITCOIN_BLOCKFILTER_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <ios>
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+class CBlock;
+class CBlockUndo;
+
+/**
+ * A Golomb-coded set (BIP 158): a compact probabilistic set of byte strings.
+ * Elements are hashed with SipHash into [0, N * M), and the sorted hashes are
+ * stored as Golomb-Rice coded differences with parameter P. Looking up an
+ * element that is not in the set succeeds with probability 1 / M.
+ */
+class GCSFilter
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+    GCSFilter(uint64_t nSipK0In = 0, uint64_t nSipK1In = 0, uint8_t nPIn = 0, uint32_t nMIn = 0);
+
+    /** Wrap an encoded filter; throws std::ios_base::failure if it is malformed */
+    GCSFilter(uint64_t nSipK0In, uint64_t nSipK1In, uint8_t nPIn, uint32_t nMIn, const std::vector<unsigned char>& vEncodedIn);
+
+    /** Build the filter of a set of elements */
+    GCSFilter(uint64_t nSipK0In, uint64_t nSipK1In, uint8_t nPIn, uint32_t nMIn, const ElementSet& elements);
+
+    uint32_t GetN() const { return nN; }
+    const std::vector<unsigned char>& GetEncoded() const { return vEncoded; }
+
+    /** Whether the element may be in the set; false positives occur with probability 1 / M */
+    bool Match(const Element& element) const;
+    /** Whether any of the elements may be in the set, in a single pass over the filter */
+    bool MatchAny(const ElementSet& elements) const;
+
+private:
+    uint64_t nSipK0;
+    uint64_t nSipK1;
+    uint8_t nP;
+    uint32_t nM;
+    uint32_t nN;
+    uint64_t nF; //!< Range of element hashes, N * M
+    std::vector<unsigned char> vEncoded;
+
+    uint64_t HashToRange(const Element& element) const;
+    std::vector<uint64_t> BuildHashedSet(const ElementSet& elements) const;
+    /** Match against sorted element hashes */
+    bool MatchInternal(const uint64_t* pHashes, size_t nSize) const;
+};
+
+enum class BlockFilterType : uint8_t
+{
+    BASIC = 0,
+};
+
+//! Golomb-Rice parameter and inverse false positive rate of basic filters (BIP 158)
+static const uint8_t BASIC_FILTER_P = 19;
+static const uint32_t BASIC_FILTER_M = 784931;
+
+/**
+ * The compact filter of a block. A basic filter holds every output script the
+ * block creates (except OP_RETURN outputs) and every output script it spends,
+ * so a light client can tell from the filter alone whether it has to download
+ * the block.
+ */
+class BlockFilter
+{
+private:
+    BlockFilterType filterType;
+    uint256 hashBlock;
+    GCSFilter filter;
+
+    bool BuildParams(uint64_t& nSipK0, uint64_t& nSipK1, uint8_t& nP, uint32_t& nM) const;
+
+public:
+    BlockFilter() : filterType(BlockFilterType::BASIC) {}
+
+    /** Reconstruct a filter from its encoding; throws std::ios_base::failure if it is malformed */
+    BlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn, const std::vector<unsigned char>& vFilter);
+
+    /** Compute the filter of a block; the undo data supplies the spent output scripts */
+    BlockFilter(BlockFilterType filterTypeIn, const CBlock& block, const CBlockUndo& blockundo);
+
+    BlockFilterType GetFilterType() const { return filterType; }
+    const uint256& GetBlockHash() const { return hashBlock; }
+    const GCSFilter& GetFilter() const { return filter; }
+    const std::vector<unsigned char>& GetEncodedFilter() const { return filter.GetEncoded(); }
+
+    /** Double SHA256 of the encoded filter */
+    uint256 GetHash() const;
+
+    /** The filter header, which commits to this filter and to all filters before it */
+    uint256 ComputeHeader(const uint256& prevHeader) const;
+
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        s << (uint8_t)filterType << hashBlock << filter.GetEncoded();
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s)
+    {
+        std::vector<unsigned char> vEncoded;
+        uint8_t nFilterType;
+        s >> nFilterType >> hashBlock >> vEncoded;
+        filterType = (BlockFilterType)nFilterType;
+
+        uint64_t nSipK0, nSipK1;
+        uint8_t nP;
+        uint32_t nM;
+        if (!BuildParams(nSipK0, nSipK1, nP, nM))
+            throw std::ios_base::failure("unknown filter type");
+        filter = GCSFilter(nSipK0, nSipK1, nP, nM, vEncoded);
+    }
+};
+
+#endif // BITCOIN_BLOCKFILTER_H
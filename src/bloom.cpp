@@ -6,11 +6,14 @@
 
 #include "primitives/transaction.h"
 #include "hash.h"
+#include "memusage.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "random.h"
 #include "streams.h"
+#include "sync.h"
 
+#include <map>
 #include <math.h>
 #include <stdlib.h>
 
@@ -214,15 +217,65 @@ void CBloomFilter::UpdateEmptyFull()
     isEmpty = empty;
 }
 
-CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
+/** Most lines an element of a CRollingBloomFilter is spread over */
+static const int MAX_LINES_PER_ELEMENT = 4;
+
+/**
+ * False positive rate of a blocked filter with nLines lines of 256 positions,
+ * holding nElements elements that each set nHashFuncs distinct probes in each
+ * of nParts lines. The number of probe sets in a line is Poisson distributed,
+ * and in a line holding j of them a position is set with probability
+ * 1 - (1 - nHashFuncs / 256)^j. An element only matches if all its lines do.
+ */
+static double BlockedFPRate(int nHashFuncs, int nParts, uint32_t nElements, uint32_t nLines)
+{
+    const double lambda = (double)nElements * nParts / nLines;
+    const double logLambda = log(lambda);
+    const double logUnset = log(1.0 - nHashFuncs / 256.0);
+    const int nMaxPerLine = (int)ceil(lambda + 10 * sqrt(lambda) + 10);
+    double rate = 0;
+    for (int j = 0; j <= nMaxPerLine; j++) {
+        const double p = exp(j * logLambda - lambda - lgamma(j + 1.0));
+        rate += p * pow(1.0 - exp(j * logUnset), nHashFuncs);
+    }
+    return pow(rate, nParts);
+}
+
+//! Smallest number of lines, at least nMinLines, for which BlockedFPRate() does not exceed fpRate
+static uint32_t BlockedLines(int nHashFuncs, int nParts, uint32_t nElements, double fpRate, uint32_t nMinLines)
 {
+    uint32_t nLow = nMinLines, nHigh = nMinLines;
+    while (BlockedFPRate(nHashFuncs, nParts, nElements, nHigh) > fpRate) {
+        nLow = nHigh + 1;
+        nHigh *= 2;
+    }
+    while (nLow < nHigh) {
+        uint32_t nMid = nLow + (nHigh - nLow) / 2;
+        if (BlockedFPRate(nHashFuncs, nParts, nElements, nMid) > fpRate)
+            nLow = nMid + 1;
+        else
+            nHigh = nMid;
+    }
+    return nLow;
+}
+
+namespace {
+/** Layout of a CRollingBloomFilter, which only depends on its size and false positive rate */
+struct CRollingBloomParams
+{
+    uint32_t nLines;
+    int nHashFuncs;
+    int nLinesPerElement;
+};
+}
+
+static CRollingBloomParams ComputeRollingBloomParams(uint32_t nMaxElements, double fpRate)
+{
+    CRollingBloomParams params;
     double logFpRate = log(fpRate);
     /* The optimal number of hash functions is log(fpRate) / log(0.5), but
      * restrict it to the range 1-50. */
-    nHashFuncs = std::max(1, std::min((int)round(logFpRate / log(0.5)), 50));
-    /* In this rolling bloom filter, we'll store between 2 and 3 generations of nElements / 2 entries. */
-    nEntriesPerGeneration = (nElements + 1) / 2;
-    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    const int nMaxHashFuncs = std::max(1, std::min((int)round(logFpRate / log(0.5)), 50));
     /* The maximum fpRate = pow(1.0 - exp(-nHashFuncs * nMaxElements / nFilterBits), nHashFuncs)
      * =>          pow(fpRate, 1.0 / nHashFuncs) = 1.0 - exp(-nHashFuncs * nMaxElements / nFilterBits)
      * =>          1.0 - pow(fpRate, 1.0 / nHashFuncs) = exp(-nHashFuncs * nMaxElements / nFilterBits)
@@ -230,23 +283,104 @@ CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
      * =>          nFilterBits = -nHashFuncs * nMaxElements / log(1.0 - pow(fpRate, 1.0 / nHashFuncs))
      * =>          nFilterBits = -nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs))
      */
-    uint32_t nFilterBits = (uint32_t)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+    uint32_t nFilterBits = (uint32_t)ceil(-1.0 * nMaxHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nMaxHashFuncs)));
+    /* That is the size of an unblocked filter, and a lower bound for the
+     * blocked one. Blocking raises the false positive rate the more, the more
+     * probes share a line, which low rates need many of. Spread each element
+     * over as few lines as keep the filter within an eighth of the unblocked
+     * size, splitting the probes between them, and for that many lines use
+     * the number of probes per line that needs the fewest lines. */
+    const uint32_t nMinLines = std::max<uint32_t>(1, (nFilterBits + 255) / 256);
+    params.nLines = std::numeric_limits<uint32_t>::max();
+    params.nHashFuncs = nMaxHashFuncs;
+    params.nLinesPerElement = 1;
+    for (int nParts = 1; nParts <= MAX_LINES_PER_ELEMENT; nParts++) {
+        for (int k = 1; k <= (nMaxHashFuncs + nParts - 1) / nParts; k++) {
+            uint32_t n = BlockedLines(k, nParts, nMaxElements, fpRate, nMinLines);
+            if (n < params.nLines) {
+                params.nLines = n;
+                params.nHashFuncs = k;
+                params.nLinesPerElement = nParts;
+            }
+        }
+        if ((uint64_t)params.nLines * 256 <= (uint64_t)nFilterBits * 9 / 8)
+            break;
+    }
+    return params;
+}
+
+/**
+ * Every peer has filters of the same few sizes, so the search above, which
+ * takes a few milliseconds, is only done once for each of them.
+ */
+static CRollingBloomParams GetRollingBloomParams(uint32_t nMaxElements, double fpRate)
+{
+    static CCriticalSection cs;
+    static std::map<std::pair<uint32_t, double>, CRollingBloomParams> mapParams;
+    const std::pair<uint32_t, double> key(nMaxElements, fpRate);
+    {
+        LOCK(cs);
+        std::map<std::pair<uint32_t, double>, CRollingBloomParams>::const_iterator it = mapParams.find(key);
+        if (it != mapParams.end())
+            return it->second;
+    }
+    const CRollingBloomParams params = ComputeRollingBloomParams(nMaxElements, fpRate);
+    LOCK(cs);
+    mapParams.insert(std::make_pair(key, params));
+    return params;
+}
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    /* In this rolling bloom filter, we'll store between 2 and 3 generations of nElements / 2 entries. */
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    const CRollingBloomParams params = GetRollingBloomParams(nMaxElements, fpRate);
+    nLines = params.nLines;
+    nHashFuncs = params.nHashFuncs;
+    nLinesPerElement = params.nLinesPerElement;
     data.clear();
     /* For each data element we need to store 2 bits. If both bits are 0, the
      * bit is treated as unset. If the bits are (01), (10), or (11), the bit is
      * treated as set in generation 1, 2, or 3 respectively.
-     * These bits are stored in separate integers: position P corresponds to bit
-     * (P & 63) of the integers data[(P >> 6) * 2] and data[(P >> 6) * 2 + 1]. */
-    data.resize(((nFilterBits + 63) / 64) << 1);
+     * These bits are stored in separate integers: position P of line L
+     * corresponds to bit (P & 63) of the integers data[L * 8 + (P >> 6) * 2]
+     * and data[L * 8 + (P >> 6) * 2 + 1]. */
+    data.resize(nLines * 8);
     reset();
 }
 
-/* Similar to CBloomFilter::Hash */
-static inline uint32_t RollingBloomHash(unsigned int nHashNum, uint32_t nTweak, const std::vector<unsigned char>& vDataToHash) {
-    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash);
+static inline uint64_t SplitMix64(uint64_t& state)
+{
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
 }
 
-void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+void CRollingBloomFilter::GetProbes(uint64_t& state, uint32_t& nLine, uint64_t mask[4]) const
+{
+    /* The upper half of the next value in the stream picks the line; the probe
+     * positions, 8 bits each, are drawn from the values after it, skipping
+     * repeats so that every element sets exactly nHashFuncs bits in it. */
+    nLine = ((SplitMix64(state) >> 32) * nLines) >> 32;
+    mask[0] = mask[1] = mask[2] = mask[3] = 0;
+    int nProbes = 0;
+    while (true) {
+        uint64_t bits = SplitMix64(state);
+        for (int i = 0; i < 8; i++, bits >>= 8) {
+            uint64_t& word = mask[(bits >> 6) & 3];
+            const uint64_t bit = ((uint64_t)1) << (bits & 63);
+            if (!(word & bit)) {
+                word |= bit;
+                if (++nProbes == nHashFuncs)
+                    return;
+            }
+        }
+    }
+}
+
+void CRollingBloomFilter::insert(uint64_t nHash)
 {
     if (nEntriesThisGeneration == nEntriesPerGeneration) {
         nEntriesThisGeneration = 0;
@@ -266,48 +400,72 @@ void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
     }
     nEntriesThisGeneration++;
 
-    for (int n = 0; n < nHashFuncs; n++) {
-        uint32_t h = RollingBloomHash(n, nTweak, vKey);
-        int bit = h & 0x3F;
-        uint32_t pos = (h >> 6) % data.size();
-        /* The lowest bit of pos is ignored, and set to zero for the first bit, and to one for the second. */
-        data[pos & ~1] = (data[pos & ~1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration & 1)) << bit;
-        data[pos | 1] = (data[pos | 1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration >> 1)) << bit;
+    const uint64_t nGenerationMask1 = -(uint64_t)(nGeneration & 1);
+    const uint64_t nGenerationMask2 = -(uint64_t)(nGeneration >> 1);
+    uint64_t state = nHash;
+    for (int nPart = 0; nPart < nLinesPerElement; nPart++) {
+        uint32_t nLine;
+        uint64_t mask[4];
+        GetProbes(state, nLine, mask);
+        uint64_t* line = &data[nLine * 8];
+        for (int i = 0; i < 4; i++) {
+            line[i * 2] = (line[i * 2] & ~mask[i]) | (mask[i] & nGenerationMask1);
+            line[i * 2 + 1] = (line[i * 2 + 1] & ~mask[i]) | (mask[i] & nGenerationMask2);
+        }
+    }
+}
+
+bool CRollingBloomFilter::contains(uint64_t nHash) const
+{
+    uint64_t state = nHash;
+    for (int nPart = 0; nPart < nLinesPerElement; nPart++) {
+        uint32_t nLine;
+        uint64_t mask[4];
+        GetProbes(state, nLine, mask);
+        /* A probed position is unset if its bit is clear in both words of its pair */
+        const uint64_t* line = &data[nLine * 8];
+        uint64_t nMissing = 0;
+        for (int i = 0; i < 4; i++)
+            nMissing |= mask[i] & ~(line[i * 2] | line[i * 2 + 1]);
+        if (nMissing != 0)
+            return false;
     }
+    return true;
+}
+
+/* A uint256 hashes the same as the vector of its bytes */
+void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    insert(CSipHasher(nTweak0, nTweak1).Write(vKey.data(), vKey.size()).Finalize());
 }
 
 void CRollingBloomFilter::insert(const uint256& hash)
 {
-    std::vector<unsigned char> vData(hash.begin(), hash.end());
-    insert(vData);
+    insert(SipHashUint256(nTweak0, nTweak1, hash));
 }
 
 bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
 {
-    for (int n = 0; n < nHashFuncs; n++) {
-        uint32_t h = RollingBloomHash(n, nTweak, vKey);
-        int bit = h & 0x3F;
-        uint32_t pos = (h >> 6) % data.size();
-        /* If the relevant bit is not set in either data[pos & ~1] or data[pos | 1], the filter does not contain vKey */
-        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1)) {
-            return false;
-        }
-    }
-    return true;
+    return contains(CSipHasher(nTweak0, nTweak1).Write(vKey.data(), vKey.size()).Finalize());
 }
 
 bool CRollingBloomFilter::contains(const uint256& hash) const
 {
-    std::vector<unsigned char> vData(hash.begin(), hash.end());
-    return contains(vData);
+    return contains(SipHashUint256(nTweak0, nTweak1, hash));
+}
+
+size_t CRollingBloomFilter::DynamicMemoryUsage() const
+{
+    return memusage::MallocUsage(data.capacity() * sizeof(uint64_t));
 }
 
 void CRollingBloomFilter::reset()
 {
-    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+    nTweak0 = GetRand(std::numeric_limits<uint64_t>::max());
+    nTweak1 = GetRand(std::numeric_limits<uint64_t>::max());
     nEntriesThisGeneration = 0;
     nGeneration = 1;
-    for (std::vector<uint64_t>::iterator it = data.begin(); it != data.end(); it++) {
+    for (std::vector<uint64_t, aligned_allocator<uint64_t, 64> >::iterator it = data.begin(); it != data.end(); it++) {
         *it = 0;
     }
 }
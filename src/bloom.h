@@ -6,6 +6,7 @@
 #define BITCOIN_BLOOM_H
 
 #include "serialize.h"
+#include "support/allocators/aligned.h"
 
 #include <vector>
 
@@ -115,6 +116,15 @@ public:
  *
  * It needs around 1.8 bytes per element per factor 0.1 of false positive rate.
  * (More accurately: 3/(log(256)*log(2)) * log(1/fpRate) * nElements bytes)
+ *
+ * The filter is blocked: an element is hashed once with SipHash, which picks
+ * a few 64-byte lines of the filter, and its probes in each are distinct bits
+ * within that line. A lookup therefore touches only those cache lines and
+ * tests all probes in a line at once with word-wide masks. Blocking raises the
+ * false positive rate for a given size, the more the more probes share a line,
+ * so elements are spread over as few lines (at most 4) as keep the filter
+ * within an eighth of the figure above: two lines at a rate of 0.001, three
+ * at 0.000001.
  */
 class CRollingBloomFilter
 {
@@ -131,13 +141,25 @@ public:
 
     void reset();
 
+    size_t DynamicMemoryUsage() const;
+
 private:
     int nEntriesPerGeneration;
     int nEntriesThisGeneration;
     int nGeneration;
-    std::vector<uint64_t> data;
-    unsigned int nTweak;
+    //! Lines of 8 words: 4 pairs of generation words, covering 256 positions
+    std::vector<uint64_t, aligned_allocator<uint64_t, 64> > data;
+    uint32_t nLines;
+    uint64_t nTweak0, nTweak1;
+    //! Probes per line
     int nHashFuncs;
+    //! Lines every element is spread over
+    int nLinesPerElement;
+
+    //! Select the next line of an element and the mask of probed positions in it, from a stream seeded with its hash
+    void GetProbes(uint64_t& state, uint32_t& nLine, uint64_t mask[4]) const;
+    void insert(uint64_t nHash);
+    bool contains(uint64_t nHash) const;
 };
 
 #endif // BITCOIN_BLOOM_H
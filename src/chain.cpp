@@ -5,6 +5,32 @@
 
 #include "chain.h"
 
+const size_t CBlockIndexArena::CHUNK_SIZE;
+
+CBlockIndex* CBlockIndexArena::New()
+{
+    if (nUsed == CHUNK_SIZE) {
+        vChunks.push_back(new CBlockIndex[CHUNK_SIZE]);
+        nUsed = 0;
+    }
+    return &vChunks.back()[nUsed++];
+}
+
+CBlockIndex* CBlockIndexArena::New(const CBlockHeader& block)
+{
+    CBlockIndex* pindex = New();
+    *pindex = CBlockIndex(block);
+    return pindex;
+}
+
+void CBlockIndexArena::Clear()
+{
+    for (std::vector<CBlockIndex*>::iterator it = vChunks.begin(); it != vChunks.end(); ++it)
+        delete[] *it;
+    vChunks.clear();
+    nUsed = CHUNK_SIZE;
+}
+
 /**
  * CChain implementation
  */
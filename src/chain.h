@@ -14,6 +14,11 @@
 
 #include <vector>
 
+enum BlockFileFlags {
+    //! Blocks are stored in this file with CBlockCompressor where possible
+    BLOCKFILE_COMPRESSED = 1,
+};
+
 class CBlockFileInfo
 {
 public:
@@ -24,6 +29,7 @@ public:
     unsigned int nHeightLast;  //!< highest height of block in file
     uint64_t nTimeFirst;       //!< earliest time of block in file
     uint64_t nTimeLast;        //!< latest time of block in file
+    unsigned int nFlags;       //!< BlockFileFlags
 
     ADD_SERIALIZE_METHODS;
 
@@ -36,6 +42,11 @@ public:
         READWRITE(VARINT(nHeightLast));
         READWRITE(VARINT(nTimeFirst));
         READWRITE(VARINT(nTimeLast));
+        // Entries written before nFlags existed end here
+        if (!ser_action.ForRead() || !s.empty())
+            READWRITE(VARINT(nFlags));
+        else
+            nFlags = 0;
     }
 
      void SetNull() {
@@ -46,6 +57,7 @@ public:
          nHeightLast = 0;
          nTimeFirst = 0;
          nTimeLast = 0;
+         nFlags = 0;
      }
 
      CBlockFileInfo() {
@@ -146,6 +158,7 @@ enum BlockStatus: uint32_t {
     BLOCK_FAILED_MASK        =   BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 
     BLOCK_OPT_WITNESS       =   128, //!< block data in blk*.data was received with a witness-enforcing client
+    BLOCK_COMPRESSED        =   256, //!< block data in blk*.dat is stored with CBlockCompressor
 };
 
 /** The block chain is a tree shaped structure starting with the
@@ -419,6 +432,39 @@ public:
     }
 };
 
+/**
+ * Owner of block index entries. They are allocated in large contiguous
+ * chunks rather than one at a time, which saves the per-allocation overhead
+ * and keeps entries loaded together close in memory, and are all freed at
+ * once by Clear().
+ */
+class CBlockIndexArena
+{
+private:
+    std::vector<CBlockIndex*> vChunks;
+    size_t nUsed; //!< Entries handed out from the last chunk
+
+    CBlockIndexArena(const CBlockIndexArena&);
+    CBlockIndexArena& operator=(const CBlockIndexArena&);
+
+public:
+    static const size_t CHUNK_SIZE = 4096;
+
+    CBlockIndexArena() : nUsed(CHUNK_SIZE) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    /** Like new CBlockIndex(), but owned by the arena */
+    CBlockIndex* New();
+    /** Like new CBlockIndex(block), but owned by the arena */
+    CBlockIndex* New(const CBlockHeader& block);
+
+    /** Free every entry; pointers to them are invalidated */
+    void Clear();
+
+    /** Number of entries handed out */
+    size_t Size() const { return vChunks.empty() ? 0 : (vChunks.size() - 1) * CHUNK_SIZE + nUsed; }
+};
+
 /** An in-memory indexed chain of blocks. */
 class CChain {
 private:
@@ -7,7 +7,9 @@
 #include "memusage.h"
 #include "random.h"
 
+#include <algorithm>
 #include <assert.h>
+#include <map>
 
 /**
  * calculate number of bytes for the bitmask, and its number of non-zero bytes
@@ -58,7 +60,7 @@ CCoinsViewCursor *CCoinsViewBacked::Cursor() const { return base->Cursor(); }
 
 SaltedTxidHasher::SaltedTxidHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0), nEpoch(0), nWritingUsage(0) { }
 
 CCoinsViewCache::~CCoinsViewCache()
 {
@@ -66,18 +68,32 @@ CCoinsViewCache::~CCoinsViewCache()
 }
 
 size_t CCoinsViewCache::DynamicMemoryUsage() const {
-    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage + nWritingUsage;
+}
+
+bool CCoinsViewCache::GetBaseCoins(const uint256 &txid, CCoins &coins) const {
+    if (pcoinsWriting) {
+        CCoinsMap::const_iterator it = pcoinsWriting->find(txid);
+        if (it != pcoinsWriting->end()) {
+            coins = it->second.coins;
+            return true;
+        }
+    }
+    return base->GetCoins(txid, coins);
 }
 
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const {
     CCoinsMap::iterator it = cacheCoins.find(txid);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        it->second.nLastUse = nEpoch;
         return it;
+    }
     CCoins tmp;
-    if (!base->GetCoins(txid, tmp))
+    if (!GetBaseCoins(txid, tmp))
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
     tmp.swap(ret->second.coins);
+    ret->second.nLastUse = nEpoch;
     if (ret->second.coins.IsPruned()) {
         // The parent only has an empty entry for this txid; we can consider our
         // version as fresh.
@@ -101,7 +117,7 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
     size_t cachedCoinUsage = 0;
     if (ret.second) {
-        if (!base->GetCoins(txid, ret.first->second.coins)) {
+        if (!GetBaseCoins(txid, ret.first->second.coins)) {
             // The parent view does not have this entry; mark it as fresh.
             ret.first->second.coins.Clear();
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
@@ -114,6 +130,7 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     }
     // Assume that whenever ModifyCoins is called, the entry will be modified.
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
+    ret.first->second.nLastUse = nEpoch;
     return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
 
@@ -149,6 +166,7 @@ CCoinsModifier CCoinsViewCache::ModifyNewCoins(const uint256 &txid, bool coinbas
     }
     ret.first->second.coins.Clear();
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
+    ret.first->second.nLastUse = nEpoch;
     return CCoinsModifier(*this, ret.first, 0);
 }
 
@@ -200,6 +218,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     entry.coins.swap(it->second.coins);
                     cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
                     entry.flags = CCoinsCacheEntry::DIRTY;
+                    entry.nLastUse = nEpoch;
                     // We can mark it FRESH in the parent if it was FRESH in the child
                     // Otherwise it might have just been flushed from the parent's cache
                     // and already exist in the grandparent
@@ -227,6 +246,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     itUs->second.coins.swap(it->second.coins);
                     cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    itUs->second.nLastUse = nEpoch;
                     // NOTE: It is possible the child has a FRESH flag here in
                     // the event the entry we found in the parent is pruned. But
                     // we must not copy that FRESH flag to the parent as that
@@ -239,16 +259,124 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
         mapCoins.erase(itOld);
     }
     hashBlock = hashBlockIn;
+    nEpoch++;
     return true;
 }
 
 bool CCoinsViewCache::Flush() {
+    assert(!pcoinsWriting);
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
     cachedCoinsUsage = 0;
     return fOk;
 }
 
+std::shared_ptr<const CCoinsMap> CCoinsViewCache::StartWrite() {
+    assert(!hasModifier && !pcoinsWriting);
+    std::shared_ptr<CCoinsMap> pcoins(new CCoinsMap());
+    size_t nUsage = 0;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY)) {
+            ++it;
+            continue;
+        }
+        // Modified entries move to the write, so the cache does not hold a
+        // second copy of them; lookups find them there until it is done.
+        // Spent entries only need writing if the base may have an unspent
+        // version.
+        cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage();
+        if (!it->second.coins.IsPruned() || !(it->second.flags & CCoinsCacheEntry::FRESH)) {
+            CCoinsCacheEntry& entry = (*pcoins)[it->first];
+            entry.coins.swap(it->second.coins);
+            entry.flags = CCoinsCacheEntry::DIRTY;
+            entry.nLastUse = it->second.nLastUse;
+            nUsage += entry.coins.DynamicMemoryUsage();
+        }
+        cacheCoins.erase(it++);
+    }
+    pcoinsWriting = pcoins;
+    nWritingUsage = memusage::DynamicUsage(*pcoinsWriting) + nUsage;
+    return pcoinsWriting;
+}
+
+void CCoinsViewCache::FinishWrite() {
+    if (!pcoinsWriting)
+        return;
+    // Keep the written coins cached, unless the cache has a newer version.
+    // Once the writer has let go of the map they can be moved back.
+    const bool fMove = pcoinsWriting.unique();
+    for (CCoinsMap::iterator it = pcoinsWriting->begin(); it != pcoinsWriting->end(); it++) {
+        if (it->second.coins.IsPruned())
+            continue;
+        std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(it->first, CCoinsCacheEntry()));
+        if (!ret.second)
+            continue;
+        if (fMove)
+            ret.first->second.coins.swap(it->second.coins);
+        else
+            ret.first->second.coins = it->second.coins;
+        ret.first->second.nLastUse = it->second.nLastUse;
+        cachedCoinsUsage += ret.first->second.coins.DynamicMemoryUsage();
+    }
+    pcoinsWriting.reset();
+    nWritingUsage = 0;
+}
+
+void CCoinsViewCache::Trim(size_t nMaxUsage) {
+    assert(!hasModifier);
+    size_t nUsage = DynamicMemoryUsage() - nWritingUsage;
+    if (nUsage <= nMaxUsage)
+        return;
+
+    // Memory held by the unmodified entries last used in each epoch
+    const size_t nEntryUsage = memusage::MallocUsage(sizeof(memusage::boost_unordered_node<CCoinsMap::value_type>));
+    std::map<uint32_t, size_t> mapEpochUsage;
+    for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+        if (it->second.flags == 0)
+            mapEpochUsage[it->second.nLastUse] += nEntryUsage + it->second.coins.DynamicMemoryUsage();
+    }
+
+    // Evict whole epochs, oldest first, until enough is freed
+    std::map<uint32_t, size_t>::const_iterator itEpoch = mapEpochUsage.begin();
+    if (itEpoch == mapEpochUsage.end())
+        return;
+    uint32_t nLastEvicted = itEpoch->first;
+    for (; itEpoch != mapEpochUsage.end() && nUsage > nMaxUsage; itEpoch++) {
+        nUsage -= std::min(nUsage, itEpoch->second);
+        nLastEvicted = itEpoch->first;
+    }
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (it->second.flags == 0 && it->second.nLastUse <= nLastEvicted) {
+            cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage();
+            cacheCoins.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void CCoinsViewCache::GetHotCoins(std::vector<uint256>& vTxid, size_t nMaxUsage) const {
+    const size_t nEntryUsage = memusage::MallocUsage(sizeof(memusage::boost_unordered_node<CCoinsMap::value_type>));
+    std::vector<std::pair<uint32_t, CCoinsMap::const_iterator> > vByUse;
+    vByUse.reserve(cacheCoins.size());
+    for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+        if (!it->second.coins.IsPruned())
+            vByUse.push_back(std::make_pair(it->second.nLastUse, it));
+    }
+    std::sort(vByUse.begin(), vByUse.end(), [](const std::pair<uint32_t, CCoinsMap::const_iterator>& a, const std::pair<uint32_t, CCoinsMap::const_iterator>& b) {
+        return a.first > b.first;
+    });
+
+    size_t nUsage = 0;
+    vTxid.clear();
+    for (size_t i = 0; i < vByUse.size(); i++) {
+        nUsage += nEntryUsage + vByUse[i].second->second.coins.DynamicMemoryUsage();
+        if (nUsage > nMaxUsage)
+            break;
+        vTxid.push_back(vByUse[i].second->first);
+    }
+}
+
 void CCoinsViewCache::Uncache(const uint256& hash)
 {
     CCoinsMap::iterator it = cacheCoins.find(hash);
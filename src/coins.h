@@ -14,6 +14,7 @@
 #include "uint256.h"
 
 #include <assert.h>
+#include <memory>
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
@@ -265,6 +266,7 @@ struct CCoinsCacheEntry
 {
     CCoins coins; // The actual cached data.
     unsigned char flags;
+    uint32_t nLastUse; // The owning cache's epoch when this entry was last used.
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
@@ -276,7 +278,7 @@ struct CCoinsCacheEntry
          */
     };
 
-    CCoinsCacheEntry() : coins(), flags(0) {}
+    CCoinsCacheEntry() : coins(), flags(0), nLastUse(0) {}
 };
 
 typedef boost::unordered_map<uint256, CCoinsCacheEntry, SaltedTxidHasher> CCoinsMap;
@@ -385,6 +387,17 @@ protected:
     /* Cached dynamic memory usage for the inner CCoins objects. */
     mutable size_t cachedCoinsUsage;
 
+    /* Advanced with every batch written into this cache, so entries can be evicted least recently used first. */
+    uint32_t nEpoch;
+
+    /* Modified entries handed out by StartWrite that the base view may not have stored yet. */
+    std::shared_ptr<CCoinsMap> pcoinsWriting;
+
+    /* Dynamic memory usage of pcoinsWriting, which counts towards DynamicMemoryUsage() as well. */
+    size_t nWritingUsage;
+
+    bool GetBaseCoins(const uint256 &txid, CCoins &coins) const;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
     ~CCoinsViewCache();
@@ -435,6 +448,36 @@ public:
      */
     bool Flush();
 
+    /**
+     * Hand out the modifications applied to this cache, for writing them to
+     * its base elsewhere, e.g. on another thread. The modified entries move
+     * out of the cache into the returned map. Until FinishWrite is called,
+     * lookups that miss the cache are answered from that map before the base.
+     * FinishWrite then takes the unspent entries back as unmodified ones.
+     */
+    std::shared_ptr<const CCoinsMap> StartWrite();
+
+    //! The map returned by StartWrite has been written to the base
+    void FinishWrite();
+
+    bool IsWriting() const { return pcoinsWriting != NULL; }
+
+    //! Part of DynamicMemoryUsage() held by the map returned by StartWrite
+    size_t WritingMemoryUsage() const { return nWritingUsage; }
+
+    /**
+     * Evict unmodified entries, least recently used first, until the cache
+     * uses at most nMaxUsage bytes or only modified entries are left. A
+     * pending write is not counted, as evicting cannot free it.
+     */
+    void Trim(size_t nMaxUsage);
+
+    /**
+     * Txids of the cached unspent entries, most recently used first, as far
+     * as their memory adds up to at most nMaxUsage bytes.
+     */
+    void GetHotCoins(std::vector<uint256>& vTxid, size_t nMaxUsage) const;
+
     /**
      * Removes the transaction with the given hash from the cache, if it is
      * not modified.
@@ -444,7 +487,7 @@ public:
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
-    //! Calculate the size of the cache (in bytes)
+    //! Calculate the size of the cache (in bytes), including a pending write
     size_t DynamicMemoryUsage() const;
 
     /** 
@@ -0,0 +1,136 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinstats.h"
+
+#include "coins.h"
+#include "hash.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+namespace {
+
+/** Statistics about the transactions whose txid starts with a byte in [nBegin, nEnd) */
+struct CCoinsStatsRange
+{
+    unsigned int nBegin;
+    unsigned int nEnd;
+    bool fOk;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    uint64_t nSerializedSize;
+    uint256 hashSerialized;
+    CAmount nTotalAmount;
+
+    CCoinsStatsRange() : nBegin(0), nEnd(0), fOk(false), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+};
+
+void StatsRange(const CCoinsViewDB* view, const CDBSnapshot* snapshot, CCoinsStatsRange& range, std::atomic<bool>& fAbort)
+{
+    uint256 hashStart;
+    *hashStart.begin() = range.nBegin;
+    std::unique_ptr<CCoinsViewCursor> pcursor(view->Cursor(*snapshot, hashStart));
+
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    while (pcursor->Valid() && !fAbort) {
+        uint256 key;
+        CCoins coins;
+        if (!pcursor->GetKey(key) || !pcursor->GetValue(coins)) {
+            LogPrintf("%s: unable to read value\n", __func__);
+            fAbort = true;
+            return;
+        }
+        if (*key.begin() >= range.nEnd)
+            break;
+        range.nTransactions++;
+        ss << key;
+        ss << VARINT(coins.nVersion);
+        ss << (coins.fCoinBase ? 'c' : 'n');
+        ss << VARINT(coins.nHeight);
+        for (unsigned int i = 0; i < coins.vout.size(); i++) {
+            const CTxOut &out = coins.vout[i];
+            if (!out.IsNull()) {
+                range.nTransactionOutputs++;
+                ss << VARINT(i+1);
+                ss << out;
+                range.nTotalAmount += out.nValue;
+            }
+        }
+        range.nSerializedSize += 32 + pcursor->GetValueSize();
+        ss << VARINT(0);
+        pcursor->Next();
+    }
+    range.hashSerialized = ss.GetHash();
+    range.fOk = !fAbort;
+}
+
+void StatsThread(const CCoinsViewDB* view, const CDBSnapshot* snapshot, std::vector<CCoinsStatsRange>* vRanges, std::atomic<int>* nNext, std::atomic<bool>* fAbort)
+{
+    int nRange;
+    while (!*fAbort && (nRange = (*nNext)++) < (int)vRanges->size())
+        StatsRange(view, snapshot, (*vRanges)[nRange], *fAbort);
+}
+
+} // namespace
+
+bool GetUTXOStats(CCoinsViewDB* view, CCoinsStats& stats, int nThreads)
+{
+    std::unique_ptr<CDBSnapshot> snapshot(view->Snapshot());
+    {
+        std::unique_ptr<CCoinsViewCursor> pcursor(view->Cursor(*snapshot, uint256()));
+        stats.hashBlock = pcursor->GetBestBlock();
+    }
+
+    std::vector<CCoinsStatsRange> vRanges(UTXO_STATS_RANGES);
+    for (int i = 0; i < UTXO_STATS_RANGES; i++) {
+        vRanges[i].nBegin = 256 * i / UTXO_STATS_RANGES;
+        vRanges[i].nEnd = 256 * (i + 1) / UTXO_STATS_RANGES;
+    }
+    std::atomic<int> nNext(0);
+    std::atomic<bool> fAbort(false);
+    nThreads = std::max(1, std::min(nThreads, UTXO_STATS_RANGES));
+    if (nThreads == 1) {
+        StatsThread(view, snapshot.get(), &vRanges, &nNext, &fAbort);
+    } else {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&StatsThread, view, snapshot.get(), &vRanges, &nNext, &fAbort));
+        {
+            // The workers use the snapshot and the ranges, so they have to be
+            // done before this returns, even when the caller is interrupted
+            boost::this_thread::disable_interruption di;
+            threadGroup.join_all();
+        }
+    }
+    boost::this_thread::interruption_point();
+
+    // The ranges are combined in txid order, so the hash does not depend on
+    // how they were spread over the threads
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << stats.hashBlock;
+    stats.nTransactions = 0;
+    stats.nTransactionOutputs = 0;
+    stats.nSerializedSize = 0;
+    stats.nTotalAmount = 0;
+    BOOST_FOREACH(const CCoinsStatsRange& range, vRanges) {
+        if (!range.fOk)
+            return error("%s: unable to read the UTXO set", __func__);
+        ss << range.hashSerialized;
+        stats.nTransactions += range.nTransactions;
+        stats.nTransactionOutputs += range.nTransactionOutputs;
+        stats.nSerializedSize += range.nSerializedSize;
+        stats.nTotalAmount += range.nTotalAmount;
+    }
+    stats.hashSerialized = ss.GetHash();
+    return true;
+}
@@ -0,0 +1,39 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSTATS_H
+#define BITCOIN_COINSTATS_H
+
+#include "amount.h"
+#include "uint256.h"
+
+#include <stdint.h>
+
+class CCoinsViewDB;
+
+/** Number of txid ranges the UTXO set is split into; the ranges are hashed independently */
+static const int UTXO_STATS_RANGES = 16;
+
+struct CCoinsStats
+{
+    int nHeight;
+    uint256 hashBlock;
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    uint64_t nSerializedSize;
+    uint256 hashSerialized;
+    CAmount nTotalAmount;
+
+    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+};
+
+/**
+ * Calculate statistics about the unspent transaction output set in view.
+ * The database is read through a snapshot, so it may keep being written
+ * meanwhile, and the txid ranges are walked by up to nThreads threads.
+ * nHeight is left for the caller to fill in from hashBlock.
+ */
+bool GetUTXOStats(CCoinsViewDB* view, CCoinsStats& stats, int nThreads);
+
+#endif // BITCOIN_COINSTATS_H
@@ -183,3 +183,22 @@ uint64_t CTxOutCompressor::DecompressAmount(uint64_t x)
     }
     return n;
 }
+
+bool CTxCompressor::IsCompressible(const CTransaction &tx)
+{
+    // CScriptCompressor replaces overly long scripts instead of storing them
+    for (const CTxOut &txout : tx.vout) {
+        if (txout.scriptPubKey.size() > MAX_SCRIPT_SIZE)
+            return false;
+    }
+    return true;
+}
+
+bool CBlockCompressor::IsCompressible(const CBlock &block)
+{
+    for (const CTransactionRef &tx : block.vtx) {
+        if (!CTxCompressor::IsCompressible(*tx))
+            return false;
+    }
+    return true;
+}
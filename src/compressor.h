@@ -6,6 +6,7 @@
 #ifndef BITCOIN_COMPRESSOR_H
 #define BITCOIN_COMPRESSOR_H
 
+#include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "script/script.h"
 #include "serialize.h"
@@ -118,4 +119,105 @@ public:
     }
 };
 
+/** Compact serializer for transactions, used for blocks stored compressed.
+ *
+ *  Outputs go through CTxOutCompressor, and the fixed-size fields that are
+ *  mostly small (version, output index, sequence, lock time) are stored as
+ *  VARINTs. The output index is stored plus one and the sequence inverted, so
+ *  that the common 0xffffffff values take a single byte. Scripts longer than
+ *  MAX_SCRIPT_SIZE cannot be stored; see IsCompressible.
+ */
+class CTxCompressor
+{
+private:
+    CTransactionRef &tx;
+
+public:
+    CTxCompressor(CTransactionRef &txIn) : tx(txIn) { }
+
+    static bool IsCompressible(const CTransaction &tx);
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        uint32_t nVersion = tx->nVersion;
+        s << VARINT(nVersion);
+        unsigned char flags = tx->HasWitness() ? 1 : 0;
+        s << flags;
+        WriteCompactSize(s, tx->vin.size());
+        for (const CTxIn &txin : tx->vin) {
+            uint32_t n = txin.prevout.n + 1;
+            uint32_t nSequence = ~txin.nSequence;
+            s << txin.prevout.hash << VARINT(n) << *(const CScriptBase*)(&txin.scriptSig) << VARINT(nSequence);
+        }
+        WriteCompactSize(s, tx->vout.size());
+        for (const CTxOut &txout : tx->vout)
+            s << CTxOutCompressor(REF(txout));
+        if (flags & 1) {
+            for (const CTxIn &txin : tx->vin)
+                s << txin.scriptWitness.stack;
+        }
+        uint32_t nLockTime = tx->nLockTime;
+        s << VARINT(nLockTime);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        CMutableTransaction mtx;
+        uint32_t nVersion = 0;
+        s >> VARINT(nVersion);
+        mtx.nVersion = nVersion;
+        unsigned char flags = 0;
+        s >> flags;
+        if (flags & ~1)
+            throw std::ios_base::failure("Unknown transaction optional data");
+        mtx.vin.resize(ReadCompactSize(s));
+        for (CTxIn &txin : mtx.vin) {
+            uint32_t n = 0, nSequence = 0;
+            s >> txin.prevout.hash >> VARINT(n) >> *(CScriptBase*)(&txin.scriptSig) >> VARINT(nSequence);
+            txin.prevout.n = n - 1;
+            txin.nSequence = ~nSequence;
+        }
+        mtx.vout.resize(ReadCompactSize(s));
+        for (CTxOut &txout : mtx.vout)
+            s >> REF(CTxOutCompressor(txout));
+        if (flags & 1) {
+            for (CTxIn &txin : mtx.vin)
+                s >> txin.scriptWitness.stack;
+        }
+        s >> VARINT(mtx.nLockTime);
+        tx = MakeTransactionRef(std::move(mtx));
+    }
+};
+
+/** Compact serializer for blocks: the header as is, then every transaction through CTxCompressor */
+class CBlockCompressor
+{
+private:
+    CBlock &block;
+
+public:
+    CBlockCompressor(CBlock &blockIn) : block(blockIn) { }
+
+    static bool IsCompressible(const CBlock &block);
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << block.GetBlockHeader();
+        WriteCompactSize(s, block.vtx.size());
+        for (const CTransactionRef &tx : block.vtx)
+            s << CTxCompressor(REF(tx));
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        block.SetNull();
+        s >> *(CBlockHeader*)&block;
+        uint64_t nTx = ReadCompactSize(s);
+        for (uint64_t i = 0; i < nTx; i++) {
+            block.vtx.push_back(CTransactionRef());
+            s >> REF(CTxCompressor(block.vtx.back()));
+        }
+    }
+};
+
 #endif // BITCOIN_COMPRESSOR_H
@@ -6,6 +6,7 @@
 
 #include "util.h"
 #include "random.h"
+#include "utiltime.h"
 
 #include <boost/filesystem.hpp>
 
@@ -15,14 +16,17 @@
 #include <memenv.h>
 #include <stdint.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+static leveldb::Options GetOptions(size_t nCacheSize, const CDBProfile& profile)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    const size_t nBlockCacheSize = (uint64_t)nCacheSize * profile.nBlockCachePercent / 100;
+    options.block_cache = leveldb::NewLRUCache(nBlockCacheSize);
+    options.write_buffer_size = (nCacheSize - nBlockCacheSize) / 2; // up to two write buffers may be held in memory simultaneously
+    if (profile.nBloomBitsPerKey > 0)
+        options.filter_policy = leveldb::NewBloomFilterPolicy(profile.nBloomBitsPerKey);
+    options.compression = profile.fCompress ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.block_size = profile.nBlockSize;
+    options.max_open_files = profile.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -31,14 +35,14 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate, const CDBProfile& profile)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, profile);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -50,7 +54,8 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
             dbwrapper_private::HandleError(result);
         }
         TryCreateDirectory(path);
-        LogPrintf("Opening LevelDB in %s\n", path.string());
+        LogPrintf("Opening LevelDB in %s (max_open_files=%d, compression=%d, block_size=%u)\n", path.string(),
+                  options.max_open_files, options.compression == leveldb::kSnappyCompression, options.block_size);
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     dbwrapper_private::HandleError(status);
@@ -88,6 +93,15 @@ CDBWrapper::~CDBWrapper()
     options.env = NULL;
 }
 
+CDBSnapshot::CDBSnapshot(const CDBWrapper &parentIn) : parent(parentIn), psnapshot(parent.pdb->GetSnapshot())
+{
+}
+
+CDBSnapshot::~CDBSnapshot()
+{
+    parent.pdb->ReleaseSnapshot(psnapshot);
+}
+
 bool CDBWrapper::WriteBatch(CDBBatch& batch, bool fSync)
 {
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
@@ -122,6 +136,40 @@ bool CDBWrapper::IsEmpty()
     return !(it->Valid());
 }
 
+size_t CDBWrapper::EstimateSize() const
+{
+    // Keys are serialized with a leading type byte, so "" .. "\xff\xff" covers them all.
+    const std::string strEnd(2, '\xff');
+    const leveldb::Slice slBegin, slEnd(strEnd);
+    leveldb::Range range(slBegin, slEnd);
+    uint64_t size = 0;
+    pdb->GetApproximateSizes(&range, 1, &size);
+    return size;
+}
+
+bool CDBWrapper::Compact(int64_t nPauseMs, const std::function<bool()>& fnInterrupt)
+{
+    for (int nByte = 0; nByte < 256; ++nByte) {
+        if (fnInterrupt())
+            return false;
+        const std::string strBegin(1, (char)nByte);
+        const std::string strEnd(1, (char)(nByte + 1));
+        leveldb::Slice slBegin(strBegin), slEnd(strEnd);
+        // The last slice has no upper bound.
+        const leveldb::Slice* pEnd = nByte < 255 ? &slEnd : NULL;
+
+        uint64_t size = 0;
+        if (pEnd) {
+            leveldb::Range range(slBegin, slEnd);
+            pdb->GetApproximateSizes(&range, 1, &size);
+        }
+        pdb->CompactRange(&slBegin, pEnd);
+        if (size > 0 && nPauseMs > 0)
+            MilliSleep(nPauseMs);
+    }
+    return true;
+}
+
 CDBIterator::~CDBIterator() { delete piter; }
 bool CDBIterator::Valid() { return piter->Valid(); }
 void CDBIterator::SeekToFirst() { piter->SeekToFirst(); }
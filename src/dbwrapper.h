@@ -12,6 +12,8 @@
 #include "utilstrencodings.h"
 #include "version.h"
 
+#include <functional>
+
 #include <boost/filesystem/path.hpp>
 
 #include <leveldb/db.h>
@@ -28,6 +30,25 @@ public:
 
 class CDBWrapper;
 
+/** LevelDB tuning for a single database. The defaults reproduce the settings
+ * every database used before profiles existed.
+ */
+struct CDBProfile
+{
+    //! Number of table files LevelDB may keep open at once
+    int nMaxOpenFiles;
+    //! Bloom filter bits per key, 0 to disable the filter
+    int nBloomBitsPerKey;
+    //! Snappy-compress table blocks (stored uncompressed if LevelDB was built without Snappy)
+    bool fCompress;
+    //! Approximate size of uncompressed table blocks in bytes
+    size_t nBlockSize;
+    //! Share of the cache budget (in percent) used for the block cache; the rest is split over two write buffers
+    int nBlockCachePercent;
+
+    CDBProfile() : nMaxOpenFiles(64), nBloomBitsPerKey(10), fCompress(false), nBlockSize(4096), nBlockCachePercent(50) {}
+};
+
 /** These should be considered an implementation detail of the specific database.
  */
 namespace dbwrapper_private {
@@ -154,9 +175,30 @@ public:
 
 };
 
+/**
+ * The database as it was when the snapshot was taken. Reads and iterators
+ * given a snapshot all see the same state, whatever is written meanwhile.
+ */
+class CDBSnapshot
+{
+private:
+    const CDBWrapper &parent;
+    const leveldb::Snapshot *psnapshot;
+
+    CDBSnapshot(const CDBSnapshot&);
+    CDBSnapshot& operator=(const CDBSnapshot&);
+
+public:
+    explicit CDBSnapshot(const CDBWrapper &parentIn);
+    ~CDBSnapshot();
+
+    const leveldb::Snapshot *Get() const { return psnapshot; }
+};
+
 class CDBWrapper
 {
     friend const std::vector<unsigned char>& dbwrapper_private::GetObfuscateKey(const CDBWrapper &w);
+    friend class CDBSnapshot;
 private:
     //! custom environment this database is using (may be NULL in case of default environment)
     leveldb::Env* penv;
@@ -198,20 +240,24 @@ public:
      * @param[in] fWipe       If true, remove all existing data.
      * @param[in] obfuscate   If true, store data obfuscated via simple XOR. If false, XOR
      *                        with a zero'd byte array.
+     * @param[in] profile     LevelDB tuning for this database.
      */
-    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false, const CDBProfile& profile = CDBProfile());
     ~CDBWrapper();
 
     template <typename K, typename V>
-    bool Read(const K& key, V& value) const
+    bool Read(const K& key, V& value, const CDBSnapshot* psnapshot = NULL) const
     {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
         ssKey << key;
         leveldb::Slice slKey(ssKey.data(), ssKey.size());
 
+        leveldb::ReadOptions options = readoptions;
+        if (psnapshot)
+            options.snapshot = psnapshot->Get();
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = pdb->Get(options, slKey, &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -277,15 +323,47 @@ public:
         return WriteBatch(batch, true);
     }
 
-    CDBIterator *NewIterator()
+    CDBIterator *NewIterator(const CDBSnapshot* psnapshot = NULL)
     {
-        return new CDBIterator(*this, pdb->NewIterator(iteroptions));
+        leveldb::ReadOptions options = iteroptions;
+        if (psnapshot)
+            options.snapshot = psnapshot->Get();
+        return new CDBIterator(*this, pdb->NewIterator(options));
     }
 
     /**
      * Return true if the database managed by this class contains no entries.
      */
     bool IsEmpty();
+
+    template<typename K>
+    size_t EstimateSize(const K& key_begin, const K& key_end) const
+    {
+        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
+        ssKey1.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey2.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
+        ssKey1 << key_begin;
+        ssKey2 << key_end;
+        leveldb::Slice slKey1(ssKey1.data(), ssKey1.size());
+        leveldb::Slice slKey2(ssKey2.data(), ssKey2.size());
+        uint64_t size = 0;
+        leveldb::Range range(slKey1, slKey2);
+        pdb->GetApproximateSizes(&range, 1, &size);
+        return size;
+    }
+
+    /** Approximate on-disk size of the whole database in bytes */
+    size_t EstimateSize() const;
+
+    /**
+     * Compact the whole database, one slice of the key space (by first key
+     * byte) at a time. Sleeps nPauseMs after every slice that held data so a
+     * manual compaction leaves disk bandwidth to block validation.
+     *
+     * @param[in] fnInterrupt  Polled between slices; compaction stops early if it returns true.
+     * @return false if interrupted.
+     */
+    bool Compact(int64_t nPauseMs, const std::function<bool()>& fnInterrupt);
 };
 
 #endif // BITCOIN_DBWRAPPER_H
@@ -0,0 +1,382 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_EPOCHCACHE_H
+#define BITCOIN_EPOCHCACHE_H
+
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdint.h>
+
+/** namespace EpochCache provides a lock free, sharded set cache.
+ *
+ * Summary:
+ *
+ * 1) cache is a fixed size set of hashes that may be read, inserted into and
+ * erased from by any number of threads at once without a lock. Each slot is
+ * guarded by its own sequence counter (a "seqlock"), so readers never write
+ * to shared memory apart from the statistics counters.
+ *
+ * 2) Instead of cuckoo displacement, insert overwrites the oldest of eight
+ * candidate slots. Age is measured in epochs: every shard advances its epoch
+ * after a quarter of its capacity worth of inserts, and each slot remembers
+ * the epoch it was last written (or re-inserted) in.
+ *
+ * 3) stats exposes hit, miss, insert and eviction counters so that the cache
+ * size can be tuned from data.
+ */
+namespace EpochCache
+{
+/** stats is a snapshot of the counters of a cache. Counters are read with
+ * relaxed ordering, so a snapshot taken while other threads use the cache is
+ * only approximately consistent. */
+struct stats {
+    /** number of slots in the cache */
+    uint32_t capacity;
+    /** number of slots holding an entry which has not been erased */
+    uint32_t entries;
+    /** number of bytes used by the slots */
+    size_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    /** number of inserts which overwrote a live (non-erased) entry */
+    uint64_t evictions;
+};
+
+/** cache implements a set of fixed size elements with epoch based eviction.
+ *
+ *  All operations except setup() may be called concurrently from any number
+ *  of threads without external synchronization:
+ *      - contains(*, false)
+ *      - contains(*, true)
+ *      - insert()
+ *      - get_stats()
+ *
+ *  setup() and setup_bytes() must be called exactly once, before the cache
+ *  is shared between threads.
+ *
+ *  Lookups are wait free. An insert which races against another insert to the
+ *  same slot is dropped rather than retried; since this is a cache, the only
+ *  consequence is a later miss.
+ *
+ *  As with CuckooCache, erasing an element only marks it as the first
+ *  candidate for eviction, so
+ *
+ *  insert(x);
+ *  if (contains(x, true))
+ *      return contains(x, false);
+ *
+ *  executed on a single thread returns true until x is overwritten by a later
+ *  insert. This keeps re-orgs cheap.
+ *
+ * @tparam Element should be a trivially copyable type whose size is a
+ * multiple of 8 bytes, such as uint256.
+ * @tparam Hash should be a function/callable which takes a template parameter
+ * hash_select and an Element and extracts a hash from it. Should return
+ * high-entropy hashes for `Hash h; h<0>(e) ... h<7>(e)`.
+ */
+template <typename Element, typename Hash>
+class cache
+{
+private:
+    static_assert(sizeof(Element) % sizeof(uint64_t) == 0, "EpochCache elements must be a multiple of 8 bytes");
+    static const size_t WORDS = sizeof(Element) / sizeof(uint64_t);
+
+    /** Number of shards is 1 << SHARD_BITS. The shard is selected by the top
+     * bits of the first hash; slots within a shard by mapping the remaining
+     * bits of each hash onto [0, shard_size), see slot_for(). */
+    static const uint32_t SHARD_BITS = 4;
+    static const uint32_t SHARDS = 1 << SHARD_BITS;
+
+    /** Slot epoch values. EMPTY slots have never been written and are never
+     * matched. ERASED slots still match lookups but are evicted before any
+     * live entry. Live entries carry the epoch of their shard at insert time,
+     * starting from FIRST_EPOCH. */
+    static const uint32_t EMPTY = 0;
+    static const uint32_t ERASED = 1;
+    static const uint32_t FIRST_EPOCH = 2;
+
+    struct slot {
+        /** seq is odd while a writer owns the slot */
+        std::atomic<uint32_t> seq;
+        std::atomic<uint32_t> epoch;
+        std::atomic<uint64_t> words[WORDS];
+    };
+
+    struct shard {
+        std::unique_ptr<slot[]> table;
+        uint32_t shard_size;
+        /** number of inserts after which the shard epoch is advanced */
+        uint32_t epoch_size;
+        std::atomic<uint32_t> epoch;
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> misses;
+        std::atomic<uint64_t> inserts;
+        std::atomic<uint64_t> evictions;
+        /** keep the counters of neighbouring shards on separate cache lines */
+        char padding[64];
+    };
+
+    std::unique_ptr<shard[]> shards;
+
+    /** size stores the total number of slots over all shards */
+    uint32_t size;
+
+    /** hash_function is a const instance of the hash function. It cannot be
+     * static or initialized at call time as it may have internal state (such as
+     * a nonce).
+     */
+    const Hash hash_function;
+
+    inline std::array<uint32_t, 8> compute_hashes(const Element& e) const
+    {
+        return {{hash_function.template operator()<0>(e),
+                 hash_function.template operator()<1>(e),
+                 hash_function.template operator()<2>(e),
+                 hash_function.template operator()<3>(e),
+                 hash_function.template operator()<4>(e),
+                 hash_function.template operator()<5>(e),
+                 hash_function.template operator()<6>(e),
+                 hash_function.template operator()<7>(e)}};
+    }
+
+    inline shard& shard_for(const std::array<uint32_t, 8>& hashes) const
+    {
+        return shards[hashes[0] >> (32 - SHARD_BITS)];
+    }
+
+    /** slot_for maps a hash onto a slot of sh without a division, dropping
+     * the bits used to select the shard. */
+    static inline slot& slot_for(const shard& sh, uint32_t h)
+    {
+        return sh.table[((uint64_t)(h << SHARD_BITS) * sh.shard_size) >> 32];
+    }
+
+    /** read_slot copies the element stored in s into words.
+     *
+     * @returns false if s is empty or was written to while being read, in
+     * which case words must be ignored.
+     */
+    static inline bool read_slot(const slot& s, uint64_t (&words)[WORDS])
+    {
+        const uint32_t seq = s.seq.load(std::memory_order_acquire);
+        if (seq & 1)
+            return false;
+        if (s.epoch.load(std::memory_order_relaxed) == EMPTY)
+            return false;
+        for (size_t i = 0; i < WORDS; ++i)
+            words[i] = s.words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return s.seq.load(std::memory_order_relaxed) == seq;
+    }
+
+    /** find returns the slot holding e in sh, or nullptr if there is none. */
+    inline slot* find(shard& sh, const std::array<uint32_t, 8>& hashes, const uint64_t (&key)[WORDS]) const
+    {
+        uint64_t words[WORDS];
+        for (uint32_t h : hashes) {
+            slot& s = slot_for(sh, h);
+            if (read_slot(s, words) && std::memcmp(words, key, sizeof(key)) == 0)
+                return &s;
+        }
+        return nullptr;
+    }
+
+public:
+    /** You must always construct a cache with some elements via a subsequent
+     * call to setup or setup_bytes, otherwise operations may segfault.
+     */
+    cache() : shards(), size(), hash_function()
+    {
+    }
+
+    /** setup initializes the container to store no more than new_size
+     * elements. setup rounds down to a multiple of the number of shards, with
+     * at least two slots per shard.
+     *
+     * setup should only be called once.
+     *
+     * @param new_size the desired number of elements to store
+     * @returns the maximum number of elements storable
+     */
+    uint32_t setup(uint32_t new_size)
+    {
+        const uint32_t shard_size = std::max((uint32_t)2, new_size / SHARDS);
+        shards.reset(new shard[SHARDS]);
+        for (uint32_t n = 0; n < SHARDS; ++n) {
+            shard& sh = shards[n];
+            sh.table.reset(new slot[shard_size]);
+            for (uint32_t i = 0; i < shard_size; ++i) {
+                sh.table[i].seq.store(0, std::memory_order_relaxed);
+                sh.table[i].epoch.store(EMPTY, std::memory_order_relaxed);
+                for (size_t w = 0; w < WORDS; ++w)
+                    sh.table[i].words[w].store(0, std::memory_order_relaxed);
+            }
+            sh.shard_size = shard_size;
+            sh.epoch_size = std::max((uint32_t)1, shard_size / 4);
+            sh.epoch.store(FIRST_EPOCH, std::memory_order_relaxed);
+            sh.hits.store(0, std::memory_order_relaxed);
+            sh.misses.store(0, std::memory_order_relaxed);
+            sh.inserts.store(0, std::memory_order_relaxed);
+            sh.evictions.store(0, std::memory_order_relaxed);
+        }
+        size = shard_size * SHARDS;
+        std::atomic_thread_fence(std::memory_order_release);
+        return size;
+    }
+
+    /** setup_bytes is a convenience function which accounts for the per slot
+     * overhead (sequence and epoch counters) when deciding how many elements to
+     * store.
+     *
+     * @param bytes the approximate number of bytes to use for this data
+     * structure.
+     * @returns the maximum number of elements storable (see setup()
+     * documentation for more detail)
+     */
+    uint32_t setup_bytes(size_t bytes)
+    {
+        return setup(bytes / sizeof(slot));
+    }
+
+    /** insert stores e in the oldest of its eight candidate slots, preferring
+     * empty and erased slots. If e is already present it is only refreshed to
+     * the current epoch.
+     *
+     * Thus
+     *
+     * insert(x);
+     * return contains(x, false);
+     *
+     * is not guaranteed to return true: another thread may overwrite the slot
+     * in between, or win the race for it.
+     *
+     * @param e the element to insert
+     */
+    inline void insert(const Element& e)
+    {
+        uint64_t key[WORDS];
+        std::memcpy(key, &e, sizeof(key));
+        const std::array<uint32_t, 8> hashes = compute_hashes(e);
+        shard& sh = shard_for(hashes);
+        const uint32_t current = sh.epoch.load(std::memory_order_relaxed);
+
+        if (slot* s = find(sh, hashes, key)) {
+            s->epoch.store(current, std::memory_order_relaxed);
+            return;
+        }
+
+        slot* victim = nullptr;
+        uint32_t victim_epoch = 0;
+        for (uint32_t h : hashes) {
+            slot& s = slot_for(sh, h);
+            const uint32_t epoch = s.epoch.load(std::memory_order_relaxed);
+            if (victim == nullptr || epoch < victim_epoch) {
+                victim = &s;
+                victim_epoch = epoch;
+            }
+        }
+
+        // Claim the slot; give up if another writer holds or just took it.
+        uint32_t seq = victim->seq.load(std::memory_order_relaxed);
+        if ((seq & 1) || !victim->seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire, std::memory_order_relaxed))
+            return;
+        std::atomic_thread_fence(std::memory_order_release);
+        if (victim->epoch.load(std::memory_order_relaxed) >= FIRST_EPOCH)
+            sh.evictions.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < WORDS; ++i)
+            victim->words[i].store(key[i], std::memory_order_relaxed);
+        victim->epoch.store(current, std::memory_order_relaxed);
+        victim->seq.store(seq + 2, std::memory_order_release);
+
+        // Advance the epoch, saturating rather than wrapping back to EMPTY.
+        if ((sh.inserts.fetch_add(1, std::memory_order_relaxed) + 1) % sh.epoch_size == 0) {
+            uint32_t expected = current;
+            if (expected != std::numeric_limits<uint32_t>::max())
+                sh.epoch.compare_exchange_strong(expected, expected + 1, std::memory_order_relaxed);
+        }
+    }
+
+    /** contains checks whether e is present in any of its candidate slots.
+     *
+     * Erasing only demotes the slot (see class documentation). An erase that
+     * races with an insert to the same slot may demote the newly inserted
+     * element instead; this only makes that element the next to be evicted.
+     *
+     * @param e the element to check
+     * @param erase whether to mark the element, if found, for eviction
+     * @returns true if the element is found, false otherwise
+     */
+    inline bool contains(const Element& e, const bool erase) const
+    {
+        uint64_t key[WORDS];
+        std::memcpy(key, &e, sizeof(key));
+        const std::array<uint32_t, 8> hashes = compute_hashes(e);
+        shard& sh = shard_for(hashes);
+        if (slot* s = find(sh, hashes, key)) {
+            if (erase)
+                s->epoch.store(ERASED, std::memory_order_relaxed);
+            sh.hits.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        sh.misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    /** for_each calls f with every live (not erased) element. Elements
+     * inserted or erased by other threads meanwhile may or may not be
+     * visited. Like get_stats, this scans the whole table.
+     */
+    template <typename F>
+    void for_each(F f) const
+    {
+        if (!shards)
+            return;
+        const uint32_t shard_size = size / SHARDS;
+        uint64_t words[WORDS];
+        for (uint32_t n = 0; n < SHARDS; ++n) {
+            const shard& sh = shards[n];
+            for (uint32_t i = 0; i < shard_size; ++i) {
+                const slot& s = sh.table[i];
+                if (s.epoch.load(std::memory_order_relaxed) >= FIRST_EPOCH && read_slot(s, words)) {
+                    Element e;
+                    std::memcpy(&e, words, sizeof(e));
+                    f(e);
+                }
+            }
+        }
+    }
+
+    /** get_stats sums the counters of all shards. Counting the live entries
+     * scans the whole table, so this is meant for RPC and tests, not for hot
+     * paths.
+     */
+    stats get_stats() const
+    {
+        stats s = {};
+        if (!shards)
+            return s;
+        s.capacity = size;
+        s.bytes = (size_t)size * sizeof(slot);
+        const uint32_t shard_size = size / SHARDS;
+        for (uint32_t n = 0; n < SHARDS; ++n) {
+            const shard& sh = shards[n];
+            s.hits += sh.hits.load(std::memory_order_relaxed);
+            s.misses += sh.misses.load(std::memory_order_relaxed);
+            s.inserts += sh.inserts.load(std::memory_order_relaxed);
+            s.evictions += sh.evictions.load(std::memory_order_relaxed);
+            for (uint32_t i = 0; i < shard_size; ++i)
+                s.entries += sh.table[i].epoch.load(std::memory_order_relaxed) >= FIRST_EPOCH;
+        }
+        return s;
+    }
+};
+} // namespace EpochCache
+
+#endif // BITCOIN_EPOCHCACHE_H
@@ -12,6 +12,7 @@
 #include "acp.h"
 #include "addrman.h"
 #include "amount.h"
+#include "blockfile.h"
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -38,10 +39,12 @@
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "utilstrencodings.h"
 #include "validationinterface.h"
 #ifdef ENABLE_WALLET
 #include "wallet/wallet.h"
 #endif
+#include "warmstart.h"
 #include "warnings.h"
 #include <stdint.h>
 #include <stdio.h>
@@ -84,8 +87,11 @@ static CZMQNotificationInterface* pzmqNotificationInterface = NULL;
 // accessing block files don't count towards the fd_set size limit
 // anyway.
 #define MIN_CORE_FILEDESCRIPTORS 0
+#define MIN_DB_FILEDESCRIPTORS 0
 #else
 #define MIN_CORE_FILEDESCRIPTORS 150
+// The minimum LevelDB budgets and the cached block files
+#define MIN_DB_FILEDESCRIPTORS (DB_COUNT * DB_MIN_OPEN_FILES + (int)DEFAULT_BLOCKFILE_CACHE_SIZE)
 #endif
 
 /** Used to pass flags to the Bind() function */
@@ -165,7 +171,6 @@ public:
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
 static std::unique_ptr<ECCVerifyHandle> globalVerifyHandle;
 
@@ -229,6 +234,8 @@ void Shutdown()
         LOCK(cs_main);
         if (pcoinsTip != NULL) {
             FlushStateToDisk();
+            if (GetBoolArg("-warmstart", DEFAULT_WARMSTART))
+                DumpWarmStart();
         }
         delete pcoinsTip;
         pcoinsTip = NULL;
@@ -240,6 +247,8 @@ void Shutdown()
         pblocktree = NULL;
         delete acpdb;
         acpdb = NULL;
+        delete pblockfilterdb;
+        pblockfilterdb = NULL;
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -327,6 +336,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-?", _("Print this help message and exit"));
     strUsage += HelpMessageOpt("-version", _("Print version and exit"));
     strUsage += HelpMessageOpt("-alertnotify=<cmd>", _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)"));
+    strUsage += HelpMessageOpt("-blockcompression", strprintf(_("Store blocks in a compact encoding, and rewrite older block files in it in the background; older versions cannot read such block files (default: %u)"), DEFAULT_BLOCK_COMPRESSION));
     strUsage += HelpMessageOpt("-blocknotify=<cmd>", _("Execute command when the best block changes (%s in cmd is replaced by block hash)"));
     if (showDebug)
         strUsage += HelpMessageOpt("-blocksonly", strprintf(_("Whether to operate in a blocks only mode (default: %u)"), DEFAULT_BLOCKSONLY));
@@ -339,9 +349,15 @@ std::string HelpMessage(HelpMessageMode mode)
     }
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
     strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    if (showDebug) {
+        strUsage += HelpMessageOpt("-dbcompactpause=<n>", strprintf("Milliseconds to pause between key ranges during a compactdb call (default: %u)", DEFAULT_DB_COMPACT_PAUSE));
+        strUsage += HelpMessageOpt("-dbmaxopenfiles=<n>", strprintf("Total number of table files the databases may keep open, 0 = as many as the file descriptor limit allows, up to %u (default: %u)", DB_AUTO_OPEN_FILES, DEFAULT_DB_MAX_OPEN_FILES));
+    }
     if (showDebug)
         strUsage += HelpMessageOpt("-feefilter", strprintf("Tell other nodes to filter invs to us by our mempool min fee (default: %u)", DEFAULT_FEEFILTER));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file on startup"));
+    strUsage += HelpMessageOpt("-loadsnapshot=<file>", _("Start an empty chain state from a UTXO set snapshot written by dumptxoutset, instead of from the genesis block. "
+            "Blocks below the snapshot are neither downloaded nor validated. Requires -snapshothash and is incompatible with -txindex, -addrindex and -blockfilterindex"));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-maxmempool=<n>", strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE));
     strUsage += HelpMessageOpt("-mempoolexpiry=<n>", strprintf(_("Do not keep transactions in the mempool longer than <n> hours (default: %u)"), DEFAULT_MEMPOOL_EXPIRY));
@@ -356,11 +372,14 @@ std::string HelpMessage(HelpMessageMode mode)
             "(default: 0 = disable pruning blocks, 1 = allow manual pruning via RPC, >%u = automatically prune block files to stay under the specified target size in MiB)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex-chainstate", _("Rebuild chain state from the currently indexed blocks"));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild chain state and block index from the blk*.dat files on disk"));
+    strUsage += HelpMessageOpt("-snapshothash=<hash>", _("Hash the -loadsnapshot file must have, as reported by dumptxoutset on a node you trust"));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-sysperms", _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)"));
 #endif
     strUsage += HelpMessageOpt("-txindex", strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), DEFAULT_TXINDEX));
+    strUsage += HelpMessageOpt("-warmstart", strprintf(_("Save the recently used coins and the signature cache at shutdown, and reload them at the next startup (default: %u)"), DEFAULT_WARMSTART));
     strUsage += HelpMessageOpt("-addrindex", strprintf(_("Maintain a full address index, used by the searchrawtransactions rpc call (default: %u)"), true));
+    strUsage += HelpMessageOpt("-blockfilterindex", strprintf(_("Maintain an index of compact block filters (BIP 158), served to peers and over REST (default: %u)"), DEFAULT_BLOCKFILTERINDEX));
 
     strUsage += HelpMessageGroup(_("Connection options:"));
     strUsage += HelpMessageOpt("-addnode=<ip>", _("Add a node to connect to and attempt to keep the connection open"));
@@ -383,6 +402,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageOpt("-onlynet=<net>", _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)"));
     strUsage += HelpMessageOpt("-permitbaremultisig", strprintf(_("Relay non-P2SH multisig (default: %u)"), DEFAULT_PERMIT_BAREMULTISIG));
     strUsage += HelpMessageOpt("-peerbloomfilters", strprintf(_("Support filtering of blocks and transaction with bloom filters (default: %u)"), DEFAULT_PEERBLOOMFILTERS));
+    strUsage += HelpMessageOpt("-peerblockfilters", strprintf(_("Serve compact block filters to peers per BIP 157; requires -blockfilterindex (default: %u)"), DEFAULT_PEERBLOCKFILTERS));
     strUsage += HelpMessageOpt("-port=<port>", strprintf(_("Listen for connections on <port> (default: %u or testnet: %u)"), Params(CBaseChainParams::MAIN).GetDefaultPort(), Params(CBaseChainParams::TESTNET).GetDefaultPort()));
     strUsage += HelpMessageOpt("-proxy=<ip:port>", _("Connect through SOCKS5 proxy"));
     strUsage += HelpMessageOpt("-proxyrandomize", strprintf(_("Randomize credentials for every proxy connection. This enables Tor stream isolation (default: %u)"), DEFAULT_PROXYRANDOMIZE));
@@ -424,6 +444,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-checkblocks=<n>", strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), DEFAULT_CHECKBLOCKS));
         strUsage += HelpMessageOpt("-checklevel=<n>", strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), DEFAULT_CHECKLEVEL));
         strUsage += HelpMessageOpt("-checkblockindex", strprintf("Do a full consistency check for mapBlockIndex, setBlockIndexCandidates, chainActive and mapBlocksUnlinked occasionally. Also sets -checkmempool (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
+        strUsage += HelpMessageOpt("-checkblockreadpow", strprintf("Re-verify the proof of work of every block read from disk instead of only comparing its hash against the block index (default: %u)", DEFAULT_CHECKBLOCKREADPOW));
         strUsage += HelpMessageOpt("-checkmempool=<n>", strprintf("Run checks every <n> transactions (default: %u)", Params(CBaseChainParams::MAIN).DefaultConsistencyChecks()));
         strUsage += HelpMessageOpt("-checkpoints", strprintf("Disable expensive verification for known chain history (default: %u)", DEFAULT_CHECKPOINTS_ENABLED));
         strUsage += HelpMessageOpt("-disablesafemode", strprintf("Disable safemode, override a real safe mode event (default: %u)", DEFAULT_DISABLE_SAFEMODE));
@@ -453,7 +474,7 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-mocktime=<n>", "Replace actual time with <n> seconds since epoch (default: 0)");
         strUsage += HelpMessageOpt("-limitfreerelay=<n>", strprintf("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default: %u)", DEFAULT_LIMITFREERELAY));
         strUsage += HelpMessageOpt("-relaypriority", strprintf("Require high priority for relaying free or low-fee transactions (default: %u)", DEFAULT_RELAYPRIORITY));
-        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit size of signature cache to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
+        strUsage += HelpMessageOpt("-maxsigcachesize=<n>", strprintf("Limit sum of signature cache and script execution cache sizes to <n> MiB (default: %u)", DEFAULT_MAX_SIG_CACHE_SIZE));
         strUsage += HelpMessageOpt("-maxtipage=<n>", strprintf("Maximum tip age in seconds to consider node in initial block download (default: %u)", DEFAULT_MAX_TIP_AGE));
     }
     strUsage += HelpMessageOpt("-minrelaytxfee=<amt>", strprintf(_("Fees (in %s/kB) smaller than this are considered zero fee for relaying, mining and transaction creation (default: %s)"),
@@ -612,18 +633,13 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     CImportingNow imp;
 
     // -reindex
+    bool fReindexed = fReindex;
     if (fReindex) {
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(chainparams, file, &pos);
-            nFile++;
+        // Scan the block files on as many threads as script verification uses
+        if (!ReindexBlockFiles(chainparams, std::max(nScriptCheckThreads, 1))) {
+            // Keep the flag, so that the next start reindexes again
+            LogPrintf("Reindexing failed\n");
+            return;
         }
         pblocktree->WriteReindexing(false);
         fReindex = false;
@@ -658,11 +674,26 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     }
 
     // scan for better chains in the block chain database, that are not yet connected in the active best chain
+    int nHeightStart;
+    {
+        LOCK(cs_main);
+        nHeightStart = chainActive.Height();
+    }
+    int64_t nConnectStart = GetTimeMicros();
     CValidationState state;
     if (!ActivateBestChain(state, chainparams)) {
         LogPrintf("Failed to connect best block");
         StartShutdown();
     }
+    if (fReindexed) {
+        int nConnected;
+        {
+            LOCK(cs_main);
+            nConnected = chainActive.Height() - nHeightStart;
+        }
+        double nSeconds = std::max<int64_t>(GetTimeMicros() - nConnectStart, 1) * 0.000001;
+        LogPrintf("Reindex: connected %d blocks in %.2fs: %.1f blocks/s\n", nConnected, nSeconds, nConnected / nSeconds);
+    }
 
     if (GetBoolArg("-stopafterblockimport", DEFAULT_STOPAFTERBLOCKIMPORT)) {
         LogPrintf("Stopping after block import\n");
@@ -671,6 +702,10 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     } // End scope of CImportingNow
     LoadMempool();
     fDumpMempoolLater = !fRequestShutdown;
+
+    // New blocks are written compressed; bring the completed block files up to date
+    if (fCompressBlocks && !fRequestShutdown)
+        CompressBlockFiles(chainparams);
 }
 
 /** Sanity checks
@@ -793,6 +828,7 @@ ServiceFlags nRelevantServices = NODE_NETWORK;
 int nMaxConnections;
 int nUserMaxConnections;
 int nFD;
+int nDBOpenFiles;
 ServiceFlags nLocalServices = NODE_NETWORK;
 
 }
@@ -881,6 +917,15 @@ bool AppInitParameterInteraction()
             return InitError(_("Prune mode is incompatible with -txindex."));
     }
 
+    // a snapshot is only as trustworthy as the hash it is checked against
+    if (IsArgSet("-loadsnapshot")) {
+        const std::string strHash = GetArg("-snapshothash", "");
+        if (strHash.size() != 64 || !IsHex(strHash))
+            return InitError(_("-loadsnapshot requires -snapshothash, as reported by dumptxoutset."));
+        if (GetBoolArg("-txindex", DEFAULT_TXINDEX) || GetBoolArg("-addrindex", DEFAULT_ADDRINDEX) || GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX))
+            return InitError(_("-loadsnapshot is incompatible with -txindex, -addrindex and -blockfilterindex, which are built from the genesis block."));
+    }
+
     // Make sure enough file descriptors are available
     int nBind = std::max(
                 (mapMultiArgs.count("-bind") ? mapMultiArgs.at("-bind").size() : 0) +
@@ -888,12 +933,25 @@ bool AppInitParameterInteraction()
     nUserMaxConnections = GetArg("-maxconnections", DEFAULT_MAX_PEER_CONNECTIONS);
     nMaxConnections = std::max(nUserMaxConnections, 0);
 
+    // Every database always gets DB_MIN_OPEN_FILES, so reserve those along
+    // with the core file descriptors; ask for more so LevelDB does not keep
+    // reopening table files. Sockets are polled with select(), so the total
+    // must stay below FD_SETSIZE.
+    const int nCoreFD = MIN_CORE_FILEDESCRIPTORS + MIN_DB_FILEDESCRIPTORS;
+
     // Trim requested connection counts, to fit into system limitations
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS - MAX_ADDNODE_CONNECTIONS)), 0);
-    nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS + MAX_ADDNODE_CONNECTIONS);
-    if (nFD < MIN_CORE_FILEDESCRIPTORS)
+    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - nCoreFD - MAX_ADDNODE_CONNECTIONS)), 0);
+    int nDBOpenFilesWanted = GetArg("-dbmaxopenfiles", DEFAULT_DB_MAX_OPEN_FILES);
+    if (nDBOpenFilesWanted <= 0)
+        nDBOpenFilesWanted = DB_AUTO_OPEN_FILES;
+    const int nDBOpenFilesExtra = std::max(std::min(nDBOpenFilesWanted - DB_COUNT * DB_MIN_OPEN_FILES,
+                                                    (int)FD_SETSIZE - nBind - nCoreFD - MAX_ADDNODE_CONNECTIONS - nMaxConnections), 0);
+    nFD = RaiseFileDescriptorLimit(nMaxConnections + nCoreFD + MAX_ADDNODE_CONNECTIONS + nDBOpenFilesExtra);
+    if (nFD < nCoreFD)
         return InitError(_("Not enough file descriptors available."));
-    nMaxConnections = std::min(nFD - MIN_CORE_FILEDESCRIPTORS - MAX_ADDNODE_CONNECTIONS, nMaxConnections);
+    nMaxConnections = std::max(std::min(nFD - nCoreFD - MAX_ADDNODE_CONNECTIONS, nMaxConnections), 0);
+    // Connections take precedence; the databases get what is left over.
+    nDBOpenFiles = DB_COUNT * DB_MIN_OPEN_FILES + std::min(std::max(nFD - nCoreFD - MAX_ADDNODE_CONNECTIONS - nMaxConnections, 0), nDBOpenFilesExtra);
 
     if (nMaxConnections < nUserMaxConnections)
         InitWarning(strprintf(_("Reducing -maxconnections from %d to %d, because of system limitations."), nUserMaxConnections, nMaxConnections));
@@ -934,6 +992,8 @@ bool AppInitParameterInteraction()
     }
     fCheckBlockIndex = GetBoolArg("-checkblockindex", chainparams.DefaultConsistencyChecks());
     fCheckpointsEnabled = GetBoolArg("-checkpoints", DEFAULT_CHECKPOINTS_ENABLED);
+    fCheckBlockReadPoW = GetBoolArg("-checkblockreadpow", DEFAULT_CHECKBLOCKREADPOW);
+    fCompressBlocks = GetBoolArg("-blockcompression", DEFAULT_BLOCK_COMPRESSION);
 
     // mempool limits
     int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
@@ -1045,6 +1105,12 @@ bool AppInitParameterInteraction()
     if (GetBoolArg("-peerbloomfilters", DEFAULT_PEERBLOOMFILTERS))
         nLocalServices = ServiceFlags(nLocalServices | NODE_BLOOM);
 
+    if (GetBoolArg("-peerblockfilters", DEFAULT_PEERBLOCKFILTERS)) {
+        if (!GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX))
+            return InitError(_("Cannot set -peerblockfilters without -blockfilterindex."));
+        nLocalServices = ServiceFlags(nLocalServices | NODE_COMPACT_FILTERS);
+    }
+
     if (GetArg("-rpcserialversion", DEFAULT_RPC_SERIALIZE_VERSION) < 0)
         return InitError("rpcserialversion must be non-negative.");
 
@@ -1168,14 +1234,17 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Using data directory %s\n", GetDataDir().string());
     LogPrintf("Using config file %s\n", GetConfigFile(GetArg("-conf", BITCOIN_CONF_FILENAME)).string());
     LogPrintf("Using at most %i automatic connections (%i file descriptors available)\n", nMaxConnections, nFD);
+    LogPrintf("Using at most %i open files for databases\n", nDBOpenFiles);
 
     InitSignatureCache();
+    InitScriptExecutionCache();
 
     LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
     if (nScriptCheckThreads) {
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
     }
+    threadGroup.create_thread(&ThreadFlushWriter);
 
     // Start the lightweight task scheduler thread
     CScheduler::Function serviceLoop = boost::bind(&CScheduler::serviceQueue, &scheduler);
@@ -1424,10 +1493,35 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
                 delete pcoinscatcher;
                 delete pblocktree;
                 delete acpdb;
-
-                acpdb = new ACPDB(nBlockTreeDBCache, false, fReindex);
-                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
-                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState);
+                delete pblockfilterdb;
+                pblockfilterdb = NULL;
+
+                // Each database has DB_MIN_OPEN_FILES of its own; split the rest.
+                // Most lookups hit the chainstate; the acp database is tiny.
+                // The filter index, when enabled, takes its files from the block index's share.
+                const bool fBlockFilters = GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX);
+                const int nDBOpenFilesExtra = nDBOpenFiles - DB_COUNT * DB_MIN_OPEN_FILES;
+                acpdb = new ACPDB(nBlockTreeDBCache, false, fReindex, IndexDBProfile(DB_MIN_OPEN_FILES + nDBOpenFilesExtra / 8));
+                pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex, IndexDBProfile(DB_MIN_OPEN_FILES + nDBOpenFilesExtra * (fBlockFilters ? 2 : 3) / 8));
+                if (fBlockFilters)
+                    pblockfilterdb = new CBlockFilterDB(nBlockTreeDBCache, false, fReindex || fReindexChainState, IndexDBProfile(DB_MIN_OPEN_FILES + nDBOpenFilesExtra / 8));
+
+                // A snapshot load that was interrupted left part of its coins in the chainstate
+                bool fSnapshotLoading = false;
+                pblocktree->ReadSnapshotLoading(fSnapshotLoading);
+                if (fSnapshotLoading && !IsArgSet("-loadsnapshot") && !fReindexChainState) {
+                    strLoadError = _("Loading a UTXO snapshot was interrupted. Restart with the same -loadsnapshot, or with -reindex-chainstate to sync from the genesis block instead");
+                    break;
+                }
+                if (fSnapshotLoading)
+                    LogPrintf("Wiping the chain state left by an interrupted snapshot load\n");
+                pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex || fReindexChainState || fSnapshotLoading, ChainstateDBProfile(DB_MIN_OPEN_FILES + nDBOpenFilesExtra / 2));
+                if (fSnapshotLoading) {
+                    if (!pblocktree->EraseSnapshotBase() || !pblocktree->WriteSnapshotLoading(false)) {
+                        strLoadError = _("Error opening block database");
+                        break;
+                    }
+                }
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
                 pcoinsTip = new CCoinsViewCache(pcoinscatcher);
 
@@ -1460,6 +1554,12 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
+                // Filters are chained, so the index has to be built from the genesis block
+                if (fBlockFilterIndex != GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX)) {
+                    strLoadError = _("You need to rebuild the database using -reindex-chainstate to change -blockfilterindex");
+                    break;
+                }
+
                 // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
                 // in the past, but is now trying to run unpruned.
                 if (fHavePruned && !fPruneMode) {
@@ -1467,6 +1567,26 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
+                if (IsArgSet("-loadsnapshot") && !fReindex) {
+                    bool fEmpty;
+                    {
+                        LOCK(cs_main);
+                        fEmpty = chainActive.Height() <= 0;
+                    }
+                    if (fEmpty) {
+                        uiInterface.InitMessage(_("Loading UTXO snapshot..."));
+                        boost::filesystem::path pathSnapshot = GetArg("-loadsnapshot", "");
+                        if (!pathSnapshot.is_complete())
+                            pathSnapshot = GetDataDir() / pathSnapshot;
+                        if (!LoadSnapshot(chainparams, pathSnapshot, uint256S(GetArg("-snapshothash", "")))) {
+                            strLoadError = _("Unable to load the UTXO snapshot");
+                            break;
+                        }
+                    } else {
+                        LogPrintf("Ignoring -loadsnapshot, the chain state is not empty\n");
+                    }
+                }
+
                 if (!fReindex && chainActive.Tip() != NULL) {
                     uiInterface.InitMessage(_("Rewinding blocks..."));
                     if (!RewindBlockIndex(chainparams)) {
@@ -1570,6 +1690,15 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
         }
     }
 
+    // the blocks below a snapshot cannot be served either
+    {
+        LOCK(cs_main);
+        if (pindexSnapshot) {
+            LogPrintf("Unsetting NODE_NETWORK, the chain state was loaded from a snapshot\n");
+            nLocalServices = ServiceFlags(nLocalServices & ~NODE_NETWORK);
+        }
+    }
+
     if (chainparams.GetConsensus().vDeployments[Consensus::DEPLOYMENT_SEGWIT].nTimeout != 0) {
         // Only advertise witness capabilities if they have a reasonable start time.
         // This allows us to have the code merged without a defined softfork, by setting its
@@ -1598,6 +1727,13 @@ bool AppInitMain(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (IsArgSet("-blocknotify"))
         uiInterface.NotifyBlockTip.connect(BlockNotifyCallback);
 
+    // Before anything is validated, so that the restored signature cache
+    // entries are not mixed with ones computed meanwhile
+    if (GetBoolArg("-warmstart", DEFAULT_WARMSTART)) {
+        uiInterface.InitMessage(_("Loading warm start file..."));
+        LoadWarmStart();
+    }
+
     std::vector<boost::filesystem::path> vImportFiles;
     if (mapMultiArgs.count("-loadblock"))
     {
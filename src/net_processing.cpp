@@ -9,6 +9,7 @@
 #include "addrman.h"
 #include "arith_uint256.h"
 #include "blockencodings.h"
+#include "blockfilter.h"
 #include "chainparams.h"
 #include "consensus/validation.h"
 #include "hash.h"
@@ -24,6 +25,7 @@
 #include "primitives/transaction.h"
 #include "random.h"
 #include "tinyformat.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -32,6 +34,8 @@
 #include "validation.h"
 #include "validationinterface.h"
 
+#include <limits>
+
 #include <boost/thread.hpp>
 
 #if defined(NDEBUG)
@@ -64,6 +68,13 @@ static std::vector<std::pair<uint256, CTransactionRef>> vExtraTxnForCompact GUAR
 
 static const uint64_t RANDOMIZER_ID_ADDRESS_RELAY = 0x3cac0035b5866b90ULL; // SHA256("main address relay")[0:8]
 
+/** Maximum number of compact filters that may be requested with one getcfilters (BIP 157) */
+static const uint32_t MAX_GETCFILTERS_SIZE = 1000;
+/** Maximum number of filter hashes that may be requested with one getcfheaders (BIP 157) */
+static const uint32_t MAX_GETCFHEADERS_SIZE = 2000;
+/** Interval between the filter headers of a cfcheckpt message (BIP 157) */
+static const int CFCHECKPT_INTERVAL = 1000;
+
 // Internal stuff
 namespace {
     /** Number of nodes with fSyncStarted. */
@@ -1172,6 +1183,145 @@ inline void static SendBlockTransactions(const CBlock& block, const BlockTransac
     connman.PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCKTXN, resp));
 }
 
+/**
+ * Validate a compact filter request (BIP 157) and find its stop block in the
+ * active chain. Peers that ask for filters we do not serve, or for a range
+ * that is out of bounds, are disconnected.
+ */
+static bool PrepareBlockFilterRequest(CNode* pfrom, uint8_t nFilterType, uint32_t nStartHeight, const uint256& hashStop,
+                                      uint32_t nMaxHeightDiff, const CBlockIndex*& pindexStop)
+{
+    if (!(pfrom->GetLocalServices() & NODE_COMPACT_FILTERS) || !pblockfilterdb ||
+        nFilterType != (uint8_t)BlockFilterType::BASIC) {
+        LogPrint("net", "peer %d requested unsupported block filter type: %d\n", pfrom->id, nFilterType);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    LOCK(cs_main);
+    BlockMap::iterator it = mapBlockIndex.find(hashStop);
+    if (it == mapBlockIndex.end() || !chainActive.Contains(it->second)) {
+        LogPrint("net", "peer %d requested filters for unknown or stale block %s\n", pfrom->id, hashStop.ToString());
+        pfrom->fDisconnect = true;
+        return false;
+    }
+    pindexStop = it->second;
+
+    uint32_t nStopHeight = pindexStop->nHeight;
+    if (nStartHeight > nStopHeight || nStopHeight - nStartHeight >= nMaxHeightDiff) {
+        LogPrint("net", "peer %d sent invalid block filter range: start height %d, stop height %d\n",
+                 pfrom->id, nStartHeight, nStopHeight);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+    return true;
+}
+
+static void ProcessGetCFilters(CNode* pfrom, CDataStream& vRecv, CConnman& connman)
+{
+    uint8_t nFilterType;
+    uint32_t nStartHeight;
+    uint256 hashStop;
+    vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+    const CBlockIndex* pindexStop;
+    if (!PrepareBlockFilterRequest(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFILTERS_SIZE, pindexStop))
+        return;
+
+    std::vector<uint256> vHashes;
+    {
+        LOCK(cs_main);
+        for (const CBlockIndex* pindex = pindexStop; pindex && pindex->nHeight >= (int)nStartHeight; pindex = pindex->pprev)
+            vHashes.push_back(pindex->GetBlockHash());
+    }
+
+    // Each filter is a single lookup in the index
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    for (std::vector<uint256>::reverse_iterator it = vHashes.rbegin(); it != vHashes.rend(); ++it) {
+        BlockFilter filter;
+        if (!pblockfilterdb->ReadFilter(*it, filter)) {
+            LogPrint("net", "filter for block %s is not in the index\n", it->ToString());
+            return;
+        }
+        connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::CFILTER, filter));
+    }
+}
+
+static void ProcessGetCFHeaders(CNode* pfrom, CDataStream& vRecv, CConnman& connman)
+{
+    uint8_t nFilterType;
+    uint32_t nStartHeight;
+    uint256 hashStop;
+    vRecv >> nFilterType >> nStartHeight >> hashStop;
+
+    const CBlockIndex* pindexStop;
+    if (!PrepareBlockFilterRequest(pfrom, nFilterType, nStartHeight, hashStop, MAX_GETCFHEADERS_SIZE, pindexStop))
+        return;
+
+    std::vector<uint256> vHashes;
+    uint256 hashPrevBlock;
+    {
+        LOCK(cs_main);
+        const CBlockIndex* pindex = pindexStop;
+        for (; pindex && pindex->nHeight >= (int)nStartHeight; pindex = pindex->pprev)
+            vHashes.push_back(pindex->GetBlockHash());
+        if (pindex)
+            hashPrevBlock = pindex->GetBlockHash();
+    }
+
+    uint256 hashFilter, prevHeader;
+    if (!hashPrevBlock.IsNull() && !pblockfilterdb->ReadFilterHeader(hashPrevBlock, hashFilter, prevHeader)) {
+        LogPrint("net", "filter header for block %s is not in the index\n", hashPrevBlock.ToString());
+        return;
+    }
+
+    std::vector<uint256> vFilterHashes;
+    vFilterHashes.reserve(vHashes.size());
+    for (std::vector<uint256>::reverse_iterator it = vHashes.rbegin(); it != vHashes.rend(); ++it) {
+        uint256 header;
+        if (!pblockfilterdb->ReadFilterHeader(*it, hashFilter, header)) {
+            LogPrint("net", "filter header for block %s is not in the index\n", it->ToString());
+            return;
+        }
+        vFilterHashes.push_back(hashFilter);
+    }
+
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::CFHEADERS, nFilterType, hashStop, prevHeader, vFilterHashes));
+}
+
+static void ProcessGetCFCheckPt(CNode* pfrom, CDataStream& vRecv, CConnman& connman)
+{
+    uint8_t nFilterType;
+    uint256 hashStop;
+    vRecv >> nFilterType >> hashStop;
+
+    const CBlockIndex* pindexStop;
+    if (!PrepareBlockFilterRequest(pfrom, nFilterType, 0, hashStop, std::numeric_limits<uint32_t>::max(), pindexStop))
+        return;
+
+    std::vector<uint256> vHashes;
+    {
+        LOCK(cs_main);
+        for (int nHeight = CFCHECKPT_INTERVAL; nHeight <= pindexStop->nHeight; nHeight += CFCHECKPT_INTERVAL)
+            vHashes.push_back(pindexStop->GetAncestor(nHeight)->GetBlockHash());
+    }
+
+    std::vector<uint256> vHeaders;
+    vHeaders.reserve(vHashes.size());
+    BOOST_FOREACH(const uint256& hash, vHashes) {
+        uint256 hashFilter, header;
+        if (!pblockfilterdb->ReadFilterHeader(hash, hashFilter, header)) {
+            LogPrint("net", "filter header for block %s is not in the index\n", hash.ToString());
+            return;
+        }
+        vHeaders.push_back(header);
+    }
+
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    connman.PushMessage(pfrom, msgMaker.Make(NetMsgType::CFCHECKPT, nFilterType, hashStop, vHeaders));
+}
+
 bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman& connman, const std::atomic<bool>& interruptMsgProc)
 {
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
@@ -1716,6 +1866,24 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
     }
 
 
+    else if (strCommand == NetMsgType::GETCFILTERS)
+    {
+        ProcessGetCFilters(pfrom, vRecv, connman);
+    }
+
+
+    else if (strCommand == NetMsgType::GETCFHEADERS)
+    {
+        ProcessGetCFHeaders(pfrom, vRecv, connman);
+    }
+
+
+    else if (strCommand == NetMsgType::GETCFCHECKPT)
+    {
+        ProcessGetCFCheckPt(pfrom, vRecv, connman);
+    }
+
+
     else if (strCommand == NetMsgType::GETHEADERS)
     {
         CBlockLocator locator;
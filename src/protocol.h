@@ -240,6 +240,42 @@ extern const char *GETBLOCKTXN;
  * @since protocol version 70014 as described by BIP 152
  */
 extern const char *BLOCKTXN;
+/**
+ * getcfilters requests the compact filters of a range of blocks.
+ * Only available with service bit NODE_COMPACT_FILTERS as described by
+ * BIP 157 and BIP 158.
+ */
+extern const char *GETCFILTERS;
+/**
+ * cfilter is a response to a getcfilters request containing a single
+ * compact filter.
+ */
+extern const char *CFILTER;
+/**
+ * getcfheaders requests the filter hashes of a range of blocks, and the
+ * filter header of the block before them.
+ * Only available with service bit NODE_COMPACT_FILTERS as described by
+ * BIP 157 and BIP 158.
+ */
+extern const char *GETCFHEADERS;
+/**
+ * cfheaders is a response to a getcfheaders request containing a filter
+ * header and a vector of filter hashes for each subsequent block in the
+ * requested range.
+ */
+extern const char *CFHEADERS;
+/**
+ * getcfcheckpt requests the filter headers at every 1000th block up to a
+ * given block.
+ * Only available with service bit NODE_COMPACT_FILTERS as described by
+ * BIP 157 and BIP 158.
+ */
+extern const char *GETCFCHECKPT;
+/**
+ * cfcheckpt is a response to a getcfcheckpt request containing a vector of
+ * evenly spaced filter headers.
+ */
+extern const char *CFCHECKPT;
 extern const char *ACP;
 extern const char *CHECKPOINT;
 };
@@ -269,6 +305,9 @@ enum ServiceFlags : uint64_t {
     // NODE_XTHIN means the node supports Xtreme Thinblocks
     // If this is turned off then the node will not service nor make xthin requests
     NODE_XTHIN = (1 << 4),
+    // NODE_COMPACT_FILTERS means the node will serve basic compact block filters
+    // and their headers. See BIP 157 and BIP 158.
+    NODE_COMPACT_FILTERS = (1 << 6),
 
     // Bits 24-31 are reserved for temporary experiments. Just pick a bit that
     // isn't getting used, or one not being used much, and notify the
@@ -165,6 +165,13 @@ static int ecdsa_signature_parse_der_lax(const secp256k1_context* ctx, secp256k1
 }
 
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+    if (vchSig.size() == 0) {
+        return false;
+    }
+    return Verify(hash, &vchSig[0], vchSig.size());
+}
+
+bool CPubKey::Verify(const uint256 &hash, const unsigned char* pchSig, size_t nSigLen) const {
     if (!IsValid())
         return false;
     secp256k1_pubkey pubkey;
@@ -172,10 +179,10 @@ bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchS
     if (!secp256k1_ec_pubkey_parse(secp256k1_context_verify, &pubkey, &(*this)[0], size())) {
         return false;
     }
-    if (vchSig.size() == 0) {
+    if (nSigLen == 0) {
         return false;
     }
-    if (!ecdsa_signature_parse_der_lax(secp256k1_context_verify, &sig, &vchSig[0], vchSig.size())) {
+    if (!ecdsa_signature_parse_der_lax(secp256k1_context_verify, &sig, pchSig, nSigLen)) {
         return false;
     }
     /* libsecp256k1's ECDSA verification requires lower-S signatures, which have
@@ -273,8 +280,12 @@ bool CExtPubKey::Derive(CExtPubKey &out, unsigned int _nChild) const {
 }
 
 /* static */ bool CPubKey::CheckLowS(const std::vector<unsigned char>& vchSig) {
+    return CheckLowS(vchSig.data(), vchSig.size());
+}
+
+/* static */ bool CPubKey::CheckLowS(const unsigned char* pchSig, size_t nSigLen) {
     secp256k1_ecdsa_signature sig;
-    if (!ecdsa_signature_parse_der_lax(secp256k1_context_verify, &sig, &vchSig[0], vchSig.size())) {
+    if (!ecdsa_signature_parse_der_lax(secp256k1_context_verify, &sig, pchSig, nSigLen)) {
         return false;
     }
     return (!secp256k1_ecdsa_signature_normalize(secp256k1_context_verify, NULL, &sig));
@@ -8,13 +8,16 @@
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "coins.h"
+#include "coinstats.h"
 #include "consensus/validation.h"
 #include "validation.h"
 #include "policy/policy.h"
 #include "primitives/transaction.h"
 #include "rpc/server.h"
+#include "snapshot.h"
 #include "streams.h"
 #include "sync.h"
+#include "txdb.h"
 #include "txmempool.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -24,6 +27,7 @@
 
 #include <univalue.h>
 
+#include <boost/filesystem.hpp>
 #include <boost/thread/thread.hpp> // boost::thread::interrupt
 
 #include <mutex>
@@ -760,58 +764,71 @@ UniValue getblock(const JSONRPCRequest& request)
     return blockToJSON(block, pblockindex);
 }
 
-struct CCoinsStats
+/** DB is a CDBWrapper or a CCoinsViewDB */
+template <typename DB>
+static UniValue CompactDB(DB* pdb, int64_t nPauseMs)
 {
-    int nHeight;
-    uint256 hashBlock;
-    uint64_t nTransactions;
-    uint64_t nTransactionOutputs;
-    uint64_t nSerializedSize;
-    uint256 hashSerialized;
-    CAmount nTotalAmount;
-
-    CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
-};
+    UniValue obj(UniValue::VOBJ);
+    const int64_t nStart = GetTimeMillis();
+    obj.push_back(Pair("size_before", (uint64_t)pdb->EstimateSize()));
+    const bool fComplete = pdb->Compact(nPauseMs, [] { return !IsRPCRunning(); });
+    obj.push_back(Pair("size_after", (uint64_t)pdb->EstimateSize()));
+    obj.push_back(Pair("time", (GetTimeMillis() - nStart) / 1000.0));
+    obj.push_back(Pair("complete", fComplete));
+    return obj;
+}
 
-//! Calculate statistics about the unspent transaction output set
-static bool GetUTXOStats(CCoinsView *view, CCoinsStats &stats)
+UniValue compactdb(const JSONRPCRequest& request)
 {
-    std::unique_ptr<CCoinsViewCursor> pcursor(view->Cursor());
-
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = pcursor->GetBestBlock();
+    if (request.fHelp || request.params.size() > 1)
+        throw runtime_error(
+            "compactdb ( \"database\" )\n"
+            "\nCompacts the node's LevelDB databases one key range at a time, pausing -dbcompactpause\n"
+            "milliseconds between ranges. This can take several minutes; the node keeps validating blocks meanwhile.\n"
+            "\nArguments:\n"
+            "1. \"database\"    (string, optional, default=all) \"chainstate\", \"blockindex\", \"acp\" or \"all\"\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"name\": {             (json object) One entry per compacted database\n"
+            "    \"size_before\": n,   (numeric) Approximate size on disk in bytes before compacting\n"
+            "    \"size_after\": n,    (numeric) Approximate size on disk in bytes afterwards\n"
+            "    \"time\": n,          (numeric) Seconds spent\n"
+            "    \"complete\": b       (boolean) False if interrupted by shutdown\n"
+            "  }, ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("compactdb", "")
+            + HelpExampleCli("compactdb", "\"chainstate\"")
+            + HelpExampleRpc("compactdb", "\"chainstate\""));
+
+    const std::string strDB = request.params.size() > 0 ? request.params[0].get_str() : "all";
+    if (strDB != "all" && strDB != "chainstate" && strDB != "blockindex" && strDB != "acp")
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown database: " + strDB);
+
+    // The databases are only replaced during startup, before RPC is available,
+    // and deleted at shutdown after the RPC threads have been joined; LevelDB
+    // handles concurrent access itself, so cs_main is not held while compacting.
+    CCoinsViewDB* pcoins;
+    CBlockTreeDB* pindexdb;
+    ACPDB* pacp;
     {
         LOCK(cs_main);
-        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
+        pcoins = pcoinsdbview;
+        pindexdb = pblocktree;
+        pacp = acpdb;
     }
-    ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        uint256 key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && pcursor->GetValue(coins)) {
-            stats.nTransactions++;
-            ss << key;
-            for (unsigned int i=0; i<coins.vout.size(); i++) {
-                const CTxOut &out = coins.vout[i];
-                if (!out.IsNull()) {
-                    stats.nTransactionOutputs++;
-                    ss << VARINT(i+1);
-                    ss << out;
-                    nTotalAmount += out.nValue;
-                }
-            }
-            stats.nSerializedSize += 32 + pcursor->GetValueSize();
-            ss << VARINT(0);
-        } else {
-            return error("%s: unable to read value", __func__);
-        }
-        pcursor->Next();
-    }
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
-    return true;
+    if (!pcoins || !pindexdb || !pacp)
+        throw JSONRPCError(RPC_IN_WARMUP, "Databases are not loaded");
+
+    const int64_t nPauseMs = std::max(GetArg("-dbcompactpause", DEFAULT_DB_COMPACT_PAUSE), (int64_t)0);
+    UniValue ret(UniValue::VOBJ);
+    if (strDB == "all" || strDB == "chainstate")
+        ret.push_back(Pair("chainstate", CompactDB(pcoins, nPauseMs)));
+    if (strDB == "all" || strDB == "blockindex")
+        ret.push_back(Pair("blockindex", CompactDB(pindexdb, nPauseMs)));
+    if (strDB == "all" || strDB == "acp")
+        ret.push_back(Pair("acp", CompactDB(pacp, nPauseMs)));
+    return ret;
 }
 
 UniValue pruneblockchain(const JSONRPCRequest& request)
@@ -877,7 +894,7 @@ UniValue gettxoutsetinfo(const JSONRPCRequest& request)
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_serialized_2\": \"hash\", (string) The serialized hash\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
@@ -888,14 +905,21 @@ UniValue gettxoutsetinfo(const JSONRPCRequest& request)
     UniValue ret(UniValue::VOBJ);
 
     CCoinsStats stats;
+    // Once flushed, the database is read through a snapshot without cs_main
     FlushStateToDisk();
-    if (GetUTXOStats(pcoinsTip, stats)) {
+    if (GetUTXOStats(pcoinsdbview, stats, GetNumCores())) {
+        {
+            LOCK(cs_main);
+            BlockMap::const_iterator mi = mapBlockIndex.find(stats.hashBlock);
+            if (mi != mapBlockIndex.end())
+                stats.nHeight = mi->second->nHeight;
+        }
         ret.push_back(Pair("height", (int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
         ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        ret.push_back(Pair("hash_serialized_2", stats.hashSerialized.GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     } else {
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
@@ -903,6 +927,96 @@ UniValue gettxoutsetinfo(const JSONRPCRequest& request)
     return ret;
 }
 
+UniValue dumptxoutset(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrites the unspent transaction output set at the current tip to a file, which another\n"
+            "node can start from with -loadsnapshot instead of syncing from the genesis block.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"path\"    (string, required) The file to write, relative to the data directory unless absolute. It must not exist yet.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"xxxx\",        (string) The file written\n"
+            "  \"base_hash\": \"hex\",     (string) The block the snapshot was taken at\n"
+            "  \"base_height\": n,       (numeric) Its height\n"
+            "  \"transactions\": n,      (numeric) The number of transactions with unspent outputs written\n"
+            "  \"hash\": \"hex\"           (string) The hash to give -snapshothash when loading the snapshot\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    boost::filesystem::path path = request.params[0].get_str();
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+    const boost::filesystem::path pathTemp = path.string() + ".incomplete";
+
+    CAutoFile file(fopen(pathTemp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to open " + pathTemp.string() + " for writing");
+
+    CSnapshotMetadata meta;
+    uint256 hashCoins;
+    try {
+        std::unique_ptr<CCoinsViewCursor> pcursor;
+        {
+            // The cursor reads the database as it is once the flush is done, so
+            // that blocks can be connected again while the coins are written.
+            LOCK(cs_main);
+            FlushStateToDisk();
+            pcursor.reset(pcoinsdbview->Cursor());
+            const CBlockIndex* pindex = chainActive.Tip();
+            if (pcursor->GetBestBlock() != pindex->GetBlockHash())
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Coin database is not at the tip");
+            if (pindex->nHeight == 0)
+                throw JSONRPCError(RPC_MISC_ERROR, "Nothing to dump at the genesis block");
+            memcpy(meta.pchMessageStart, Params().MessageStart(), sizeof(meta.pchMessageStart));
+            meta.hashBlock = pindex->GetBlockHash();
+            meta.nHeight = pindex->nHeight;
+            meta.nTx = pindex->nTx;
+            meta.nChainTx = pindex->nChainTx;
+            file << meta;
+            for (int nHeight = 1; nHeight <= meta.nHeight; nHeight++)
+                file << pindex->GetAncestor(nHeight)->GetBlockHeader();
+        }
+
+        if (!WriteSnapshotCoins(pcursor.get(), file, meta.nCoins, hashCoins))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read UTXO set");
+        // Now that the number of records is known, fill it in
+        if (fseek(file.Get(), 0, SEEK_SET) != 0)
+            throw std::ios_base::failure("seek failed");
+        file << meta;
+        if (fflush(file.Get()) != 0)
+            throw std::ios_base::failure("flush failed");
+        FileCommit(file.Get());
+    } catch (const std::ios_base::failure& e) {
+        file.fclose();
+        boost::filesystem::remove(pathTemp);
+        throw JSONRPCError(RPC_MISC_ERROR, std::string("Unable to write snapshot: ") + e.what());
+    } catch (...) {
+        file.fclose();
+        boost::filesystem::remove(pathTemp);
+        throw;
+    }
+    file.fclose();
+    if (!RenameOver(pathTemp, path))
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to rename " + pathTemp.string());
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("path", path.string()));
+    ret.push_back(Pair("base_hash", meta.hashBlock.GetHex()));
+    ret.push_back(Pair("base_height", meta.nHeight));
+    ret.push_back(Pair("transactions", (int64_t)meta.nCoins));
+    ret.push_back(Pair("hash", meta.GetHash(hashCoins).GetHex()));
+    return ret;
+}
+
 UniValue gettxout(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() < 2 || request.params.size() > 3)
@@ -1089,6 +1203,10 @@ UniValue getblockchaininfo(const JSONRPCRequest& request)
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
             "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
             "  \"pruneheight\": xxxxxx,    (numeric) lowest-height complete block stored\n"
+            "  \"blockreads\": {            (object) checks done on blocks read from disk since startup\n"
+            "     \"hashchecked\": xx,      (numeric) blocks checked against their block index entry by hash\n"
+            "     \"powchecked\": xx        (numeric) blocks whose proof of work was re-verified (see -checkblockreadpow)\n"
+            "  },\n"
             "  \"softforks\": [            (array) status of softforks in progress\n"
             "     {\n"
             "        \"id\": \"xxxx\",        (string) name of softfork\n"
@@ -1138,6 +1256,11 @@ UniValue getblockchaininfo(const JSONRPCRequest& request)
     obj.push_back(Pair("softforks",             softforks));
     obj.push_back(Pair("bip9_softforks", bip9_softforks));
 
+    UniValue blockreads(UniValue::VOBJ);
+    blockreads.push_back(Pair("hashchecked", nBlockReadHashChecks.load()));
+    blockreads.push_back(Pair("powchecked", nBlockReadPoWChecks.load()));
+    obj.push_back(Pair("blockreads", blockreads));
+
     if (fPruneMode)
     {
         CBlockIndex *block = chainActive.Tip();
@@ -1418,6 +1541,7 @@ UniValue reconsiderblock(const JSONRPCRequest& request)
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         okSafe argNames
   //  --------------------- ------------------------  -----------------------  ------ ----------
+    { "blockchain",         "compactdb",              &compactdb,              true,  {"database"} },
     { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true,  {} },
     { "blockchain",         "getbestblockhash",       &getbestblockhash,       true,  {} },
     { "blockchain",         "getblockcount",          &getblockcount,          true,  {} },
@@ -1433,6 +1557,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getrawmempool",          &getrawmempool,          true,  {"verbose"} },
     { "blockchain",         "gettxout",               &gettxout,               true,  {"txid","n","include_mempool"} },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,  {} },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           true,  {"path"} },
     { "blockchain",         "pruneblockchain",        &pruneblockchain,        true,  {"height"} },
     { "blockchain",         "verifychain",            &verifychain,            true,  {"checklevel","nblocks"} },
 
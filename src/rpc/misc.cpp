@@ -10,6 +10,7 @@
 #include "net.h"
 #include "netbase.h"
 #include "rpc/server.h"
+#include "script/sigcache.h"
 #include "timedata.h"
 #include "util.h"
 #include "utilstrencodings.h"
@@ -496,6 +497,51 @@ UniValue getmemoryinfo(const JSONRPCRequest& request)
     return obj;
 }
 
+static UniValue RPCCacheInfo(const EpochCache::stats& stats)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("capacity", uint64_t(stats.capacity)));
+    obj.push_back(Pair("entries", uint64_t(stats.entries)));
+    obj.push_back(Pair("bytes", uint64_t(stats.bytes)));
+    obj.push_back(Pair("hits", stats.hits));
+    obj.push_back(Pair("misses", stats.misses));
+    obj.push_back(Pair("inserts", stats.inserts));
+    obj.push_back(Pair("evictions", stats.evictions));
+    return obj;
+}
+
+UniValue getsigcacheinfo(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns usage statistics of the signature cache and the script execution cache.\n"
+            "Both share the -maxsigcachesize budget; a high eviction count relative to inserts suggests raising it.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"signatures\": {           (json object) Signature cache\n"
+            "    \"capacity\": xxxxx,      (numeric) Number of entries the cache can hold\n"
+            "    \"entries\": xxxxx,       (numeric) Number of entries currently held and not erased\n"
+            "    \"bytes\": xxxxx,         (numeric) Memory used by the cache\n"
+            "    \"hits\": xxxxx,          (numeric) Number of lookups that found an entry\n"
+            "    \"misses\": xxxxx,        (numeric) Number of lookups that did not find an entry\n"
+            "    \"inserts\": xxxxx,       (numeric) Number of entries added\n"
+            "    \"evictions\": xxxxx,     (numeric) Number of entries overwritten before being erased\n"
+            "  },\n"
+            "  \"scripts\": {              (json object) Script execution cache, same fields as above\n"
+            "    ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getsigcacheinfo", "")
+            + HelpExampleRpc("getsigcacheinfo", "")
+        );
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("signatures", RPCCacheInfo(GetSignatureCacheStats())));
+    obj.push_back(Pair("scripts", RPCCacheInfo(GetScriptExecutionCacheStats())));
+    return obj;
+}
+
 UniValue echo(const JSONRPCRequest& request)
 {
     if (request.fHelp)
@@ -514,6 +560,7 @@ static const CRPCCommand commands[] =
   //  --------------------- ------------------------  -----------------------  ----------
     { "control",            "getinfo",                &getinfo,                true,  {} }, /* uses wallet if enabled */
     { "control",            "getmemoryinfo",          &getmemoryinfo,          true,  {} },
+    { "control",            "getsigcacheinfo",        &getsigcacheinfo,        true,  {} },
     { "util",               "validateaddress",        &validateaddress,        true,  {"address"} }, /* uses wallet if enabled */
     { "util",               "createmultisig",         &createmultisig,         true,  {"nrequired","keys"} },
     { "util",               "verifymessage",          &verifymessage,          true,  {"address","signature","message"} },
@@ -11,11 +11,12 @@
 #include "crypto/sha256.h"
 #include "pubkey.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 
 using namespace std;
 
-typedef vector<unsigned char> valtype;
+typedef CScriptStackElement valtype;
 
 namespace {
 
@@ -56,13 +57,19 @@ bool CastToBool(const valtype& vch)
  */
 #define stacktop(i)  (stack.at(stack.size()+(i)))
 #define altstacktop(i)  (altstack.at(altstack.size()+(i)))
-static inline void popstack(vector<valtype>& stack)
+static inline void popstack(CScriptStack& stack)
 {
     if (stack.empty())
         throw runtime_error("popstack(): stack empty");
     stack.pop_back();
 }
 
+/**
+ * Number of stack slots VerifyScript reserves up front, enough for the
+ * standard script templates so that evaluating them does not reallocate.
+ */
+static const size_t SCRIPT_STACK_RESERVE = 8;
+
 bool static IsCompressedOrUncompressedPubKey(const valtype &vchPubKey) {
     if (vchPubKey.size() < 33) {
         //  Non-canonical public key: too short
@@ -107,7 +114,7 @@ bool static IsCompressedPubKey(const valtype &vchPubKey) {
  *
  * This function is consensus-critical since BIP66.
  */
-bool static IsValidSignatureEncoding(const std::vector<unsigned char> &sig) {
+bool static IsValidSignatureEncoding(const valtype &sig) {
     // Format: 0x30 [total-length] 0x02 [R-length] [R] 0x02 [S-length] [S] [sighash]
     // * total-length: 1-byte length descriptor of everything that follows,
     //   excluding the sighash byte.
@@ -176,8 +183,8 @@ bool static IsLowDERSignature(const valtype &vchSig, ScriptError* serror) {
     if (!IsValidSignatureEncoding(vchSig)) {
         return set_error(serror, SCRIPT_ERR_SIG_DER);
     }
-    std::vector<unsigned char> vchSigCopy(vchSig.begin(), vchSig.begin() + vchSig.size() - 1);
-    if (!CPubKey::CheckLowS(vchSigCopy)) {
+    // The hash type byte is not part of the DER signature.
+    if (!CPubKey::CheckLowS(vchSig.data(), vchSig.size() - 1)) {
         return set_error(serror, SCRIPT_ERR_SIG_HIGH_S);
     }
     return true;
@@ -194,7 +201,7 @@ bool static IsDefinedHashtypeSignature(const valtype &vchSig) {
     return true;
 }
 
-bool CheckSignatureEncoding(const vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror) {
+bool CheckSignatureEncoding(const valtype &vchSig, unsigned int flags, ScriptError* serror) {
     // Empty signature. Not strictly DER encoded, but allowed to provide a
     // compact way to provide an invalid signature for use with CHECK(MULTI)SIG
     if (vchSig.size() == 0) {
@@ -211,6 +218,10 @@ bool CheckSignatureEncoding(const vector<unsigned char> &vchSig, unsigned int fl
     return true;
 }
 
+bool CheckSignatureEncoding(const vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror) {
+    return CheckSignatureEncoding(valtype(vchSig.begin(), vchSig.end()), flags, serror);
+}
+
 bool static CheckPubKeyEncoding(const valtype &vchPubKey, unsigned int flags, const SigVersion &sigversion, ScriptError* serror) {
     if ((flags & SCRIPT_VERIFY_STRICTENC) != 0 && !IsCompressedOrUncompressedPubKey(vchPubKey)) {
         return set_error(serror, SCRIPT_ERR_PUBKEYTYPE);
@@ -222,46 +233,67 @@ bool static CheckPubKeyEncoding(const valtype &vchPubKey, unsigned int flags, co
     return true;
 }
 
-bool static CheckMinimalPush(const valtype& data, opcodetype opcode) {
-    if (data.size() == 0) {
+bool static CheckMinimalPush(CScript::const_iterator pdataBegin, CScript::const_iterator pdataEnd, opcodetype opcode) {
+    const size_t nSize = pdataEnd - pdataBegin;
+    if (nSize == 0) {
         // Could have used OP_0.
         return opcode == OP_0;
-    } else if (data.size() == 1 && data[0] >= 1 && data[0] <= 16) {
+    } else if (nSize == 1 && pdataBegin[0] >= 1 && pdataBegin[0] <= 16) {
         // Could have used OP_1 .. OP_16.
-        return opcode == OP_1 + (data[0] - 1);
-    } else if (data.size() == 1 && data[0] == 0x81) {
+        return opcode == OP_1 + (pdataBegin[0] - 1);
+    } else if (nSize == 1 && pdataBegin[0] == 0x81) {
         // Could have used OP_1NEGATE.
         return opcode == OP_1NEGATE;
-    } else if (data.size() <= 75) {
+    } else if (nSize <= 75) {
         // Could have used a direct push (opcode indicating number of bytes pushed + those bytes).
-        return opcode == data.size();
-    } else if (data.size() <= 255) {
+        return opcode == nSize;
+    } else if (nSize <= 255) {
         // Could have used OP_PUSHDATA.
         return opcode == OP_PUSHDATA1;
-    } else if (data.size() <= 65535) {
+    } else if (nSize <= 65535) {
         // Could have used OP_PUSHDATA2.
         return opcode == OP_PUSHDATA2;
     }
     return true;
 }
 
-bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* serror)
+/**
+ * Remove pushes of vchSig from scriptCode, like scriptCode.FindAndDelete(CScript(vchSig)),
+ * but only build the pattern when scriptCode contains such a push at all. Standard
+ * scripts never do, so the common case neither copies the signature nor allocates.
+ */
+static void FindAndDeleteSignature(CScript& scriptCode, const valtype& vchSig)
+{
+    CScript::const_iterator pc = scriptCode.begin();
+    CScript::const_iterator pdataBegin = pc, pdataEnd = pc;
+    opcodetype opcode;
+    bool fFound = false;
+    while (!fFound && scriptCode.GetOp(pc, opcode, pdataBegin, pdataEnd)) {
+        fFound = opcode <= OP_PUSHDATA4 && (size_t)(pdataEnd - pdataBegin) == vchSig.size() &&
+                 std::equal(pdataBegin, pdataEnd, vchSig.begin());
+    }
+    if (fFound) {
+        scriptCode.FindAndDelete(CScript(vector<unsigned char>(vchSig.begin(), vchSig.end())));
+    }
+}
+
+bool EvalScript(CScriptStack& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* serror)
 {
     static const CScriptNum bnZero(0);
     static const CScriptNum bnOne(1);
     static const CScriptNum bnFalse(0);
     static const CScriptNum bnTrue(1);
-    static const valtype vchFalse(0);
-    static const valtype vchZero(0);
-    static const valtype vchTrue(1, 1);
+    static const valtype vchFalse;
+    static const valtype vchZero;
+    static const valtype vchTrue(1, (unsigned char)1);
 
     CScript::const_iterator pc = script.begin();
     CScript::const_iterator pend = script.end();
     CScript::const_iterator pbegincodehash = script.begin();
     opcodetype opcode;
-    valtype vchPushValue;
+    CScript::const_iterator pvchPushBegin = pc, pvchPushEnd = pc;
     vector<bool> vfExec;
-    vector<valtype> altstack;
+    CScriptStack altstack;
     set_error(serror, SCRIPT_ERR_UNKNOWN_ERROR);
     if (script.size() > MAX_SCRIPT_SIZE)
         return set_error(serror, SCRIPT_ERR_SCRIPT_SIZE);
@@ -277,9 +309,9 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
             //
             // Read instruction
             //
-            if (!script.GetOp(pc, opcode, vchPushValue))
+            if (!script.GetOp(pc, opcode, pvchPushBegin, pvchPushEnd))
                 return set_error(serror, SCRIPT_ERR_BAD_OPCODE);
-            if (vchPushValue.size() > MAX_SCRIPT_ELEMENT_SIZE)
+            if ((size_t)(pvchPushEnd - pvchPushBegin) > MAX_SCRIPT_ELEMENT_SIZE)
                 return set_error(serror, SCRIPT_ERR_PUSH_SIZE);
 
             // Note how OP_RESERVED does not count towards the opcode limit.
@@ -304,10 +336,10 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                 return set_error(serror, SCRIPT_ERR_DISABLED_OPCODE); // Disabled opcodes.
 
             if (fExec && 0 <= opcode && opcode <= OP_PUSHDATA4) {
-                if (fRequireMinimal && !CheckMinimalPush(vchPushValue, opcode)) {
+                if (fRequireMinimal && !CheckMinimalPush(pvchPushBegin, pvchPushEnd, opcode)) {
                     return set_error(serror, SCRIPT_ERR_MINIMALDATA);
                 }
-                stack.push_back(vchPushValue);
+                stack.emplace_back(pvchPushBegin, pvchPushEnd);
             } else if (fExec || (OP_IF <= opcode && opcode <= OP_ENDIF))
             switch (opcode)
             {
@@ -334,7 +366,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                 {
                     // ( -- value)
                     CScriptNum bn((int)opcode - (int)(OP_1 - 1));
-                    stack.push_back(bn.getvch());
+                    stack.emplace_back();
+                    bn.getvch(stack.back());
                     // The result of these opcodes should always be the minimal way to push the data
                     // they push, so no need for a CheckMinimalPush here.
                 }
@@ -603,7 +636,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                 {
                     // -- stacksize
                     CScriptNum bn(stack.size());
-                    stack.push_back(bn.getvch());
+                    stack.emplace_back();
+                    bn.getvch(stack.back());
                 }
                 break;
 
@@ -701,7 +735,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     if (stack.size() < 1)
                         return set_error(serror, SCRIPT_ERR_INVALID_STACK_OPERATION);
                     CScriptNum bn(stacktop(-1).size());
-                    stack.push_back(bn.getvch());
+                    stack.emplace_back();
+                    bn.getvch(stack.back());
                 }
                 break;
 
@@ -763,7 +798,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     default:            assert(!"invalid opcode"); break;
                     }
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.emplace_back();
+                    bn.getvch(stack.back());
                 }
                 break;
 
@@ -812,7 +848,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     }
                     popstack(stack);
                     popstack(stack);
-                    stack.push_back(bn.getvch());
+                    stack.emplace_back();
+                    bn.getvch(stack.back());
 
                     if (opcode == OP_NUMEQUALVERIFY)
                     {
@@ -854,7 +891,8 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     if (stack.size() < 1)
                         return set_error(serror, SCRIPT_ERR_INVALID_STACK_OPERATION);
                     valtype& vch = stacktop(-1);
-                    valtype vchHash((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
+                    valtype vchHash;
+                    vchHash.resize((opcode == OP_RIPEMD160 || opcode == OP_SHA1 || opcode == OP_HASH160) ? 20 : 32);
                     if (opcode == OP_RIPEMD160)
                         CRIPEMD160().Write(vch.data(), vch.size()).Finalize(vchHash.data());
                     else if (opcode == OP_SHA1)
@@ -892,7 +930,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
 
                     // Drop the signature in pre-segwit scripts but not segwit scripts
                     if (sigversion == SIGVERSION_BASE) {
-                        scriptCode.FindAndDelete(CScript(vchSig));
+                        FindAndDeleteSignature(scriptCode, vchSig);
                     }
 
                     if (!CheckSignatureEncoding(vchSig, flags, serror) || !CheckPubKeyEncoding(vchPubKey, flags, sigversion, serror)) {
@@ -956,7 +994,7 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
                     {
                         valtype& vchSig = stacktop(-isig-k);
                         if (sigversion == SIGVERSION_BASE) {
-                            scriptCode.FindAndDelete(CScript(vchSig));
+                            FindAndDeleteSignature(scriptCode, vchSig);
                         }
                     }
 
@@ -1045,8 +1083,47 @@ bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, un
     return set_success(serror);
 }
 
+bool EvalScript(vector<vector<unsigned char> >& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* serror)
+{
+    CScriptStack stackTmp;
+    stackTmp.reserve(stack.size());
+    for (const vector<unsigned char>& vch : stack) {
+        stackTmp.emplace_back(vch.begin(), vch.end());
+    }
+    bool fSuccess = EvalScript(stackTmp, script, flags, checker, sigversion, serror);
+    stack.clear();
+    stack.reserve(stackTmp.size());
+    for (const valtype& vch : stackTmp) {
+        stack.emplace_back(vch.begin(), vch.end());
+    }
+    return fSuccess;
+}
+
 namespace {
 
+/** Serialize scriptCode for a signature hash, skipping OP_CODESEPARATORs */
+template<typename S>
+void SerializeScriptCode(S &s, const CScript& scriptCode) {
+    CScript::const_iterator it = scriptCode.begin();
+    CScript::const_iterator itBegin = it;
+    opcodetype opcode;
+    unsigned int nCodeSeparators = 0;
+    while (scriptCode.GetOp(it, opcode)) {
+        if (opcode == OP_CODESEPARATOR)
+            nCodeSeparators++;
+    }
+    ::WriteCompactSize(s, scriptCode.size() - nCodeSeparators);
+    it = itBegin;
+    while (scriptCode.GetOp(it, opcode)) {
+        if (opcode == OP_CODESEPARATOR) {
+            s.write((char*)&itBegin[0], it-itBegin-1);
+            itBegin = it;
+        }
+    }
+    if (itBegin != scriptCode.end())
+        s.write((char*)&itBegin[0], it-itBegin);
+}
+
 /**
  * Wrapper that serializes like CTransaction, but with the modifications
  *  required for the signature hash done in-place
@@ -1067,29 +1144,6 @@ public:
         fHashSingle((nHashTypeIn & 0x1f) == SIGHASH_SINGLE),
         fHashNone((nHashTypeIn & 0x1f) == SIGHASH_NONE) {}
 
-    /** Serialize the passed scriptCode, skipping OP_CODESEPARATORs */
-    template<typename S>
-    void SerializeScriptCode(S &s) const {
-        CScript::const_iterator it = scriptCode.begin();
-        CScript::const_iterator itBegin = it;
-        opcodetype opcode;
-        unsigned int nCodeSeparators = 0;
-        while (scriptCode.GetOp(it, opcode)) {
-            if (opcode == OP_CODESEPARATOR)
-                nCodeSeparators++;
-        }
-        ::WriteCompactSize(s, scriptCode.size() - nCodeSeparators);
-        it = itBegin;
-        while (scriptCode.GetOp(it, opcode)) {
-            if (opcode == OP_CODESEPARATOR) {
-                s.write((char*)&itBegin[0], it-itBegin-1);
-                itBegin = it;
-            }
-        }
-        if (itBegin != scriptCode.end())
-            s.write((char*)&itBegin[0], it-itBegin);
-    }
-
     /** Serialize an input of txTo */
     template<typename S>
     void SerializeInput(S &s, unsigned int nInput) const {
@@ -1103,7 +1157,7 @@ public:
             // Blank out other inputs' signatures
             ::Serialize(s, CScriptBase());
         else
-            SerializeScriptCode(s);
+            SerializeScriptCode(s, scriptCode);
         // Serialize the nSequence
         if (nInput != nIn && (fHashSingle || fHashNone))
             // let the others update at will
@@ -1166,6 +1220,16 @@ uint256 GetOutputsHash(const CTransaction& txTo) {
     return ss.GetHash();
 }
 
+/** Serialized size of an outpoint */
+const size_t LEGACY_SIGHASH_PREVOUT_SIZE = 32 + 4;
+/** Serialized size of an input with its script blanked: outpoint, empty script, nSequence */
+const size_t LEGACY_SIGHASH_BLANK_INPUT_SIZE = LEGACY_SIGHASH_PREVOUT_SIZE + 1 + 4;
+
+/** Offset of input nInput within PrecomputedTransactionData::vchLegacyTemplate */
+size_t LegacyTemplateInputOffset(const CTransaction& txTo, size_t nInput) {
+    return sizeof(txTo.nVersion) + GetSizeOfCompactSize(txTo.vin.size()) + nInput * LEGACY_SIGHASH_BLANK_INPUT_SIZE;
+}
+
 } // anon namespace
 
 PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
@@ -1173,6 +1237,32 @@ PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
     hashPrevouts = GetPrevoutHash(txTo);
     hashSequence = GetSequenceHash(txTo);
     hashOutputs = GetOutputsHash(txTo);
+
+    unsigned int nLegacyInputs = 0;
+    for (const CTxIn& txin : txTo.vin) {
+        if (txin.scriptWitness.IsNull())
+            nLegacyInputs++;
+    }
+    if (nLegacyInputs < LEGACY_SIGHASH_MIN_INPUTS)
+        return;
+
+    // An input index past the end makes the serializer blank every input's
+    // script while still committing to all sequences and outputs.
+    const CScript scriptEmpty;
+    CTransactionSignatureSerializer txTmp(txTo, scriptEmpty, txTo.vin.size(), SIGHASH_ALL);
+    CVectorWriter writer(SER_GETHASH, 0, vchLegacyTemplate, 0);
+    writer << txTmp;
+    assert(vchLegacyTemplate.size() >= LegacyTemplateInputOffset(txTo, txTo.vin.size()));
+
+    CHashWriter ss(SER_GETHASH, 0);
+    vLegacyMidstates.reserve((txTo.vin.size() + LEGACY_SIGHASH_MIDSTATE_INTERVAL - 1) / LEGACY_SIGHASH_MIDSTATE_INTERVAL);
+    size_t nPos = 0;
+    for (size_t nInput = 0; nInput < txTo.vin.size(); nInput += LEGACY_SIGHASH_MIDSTATE_INTERVAL) {
+        size_t nOffset = LegacyTemplateInputOffset(txTo, nInput);
+        ss.write((const char*)&vchLegacyTemplate[nPos], nOffset - nPos);
+        nPos = nOffset;
+        vLegacyMidstates.push_back(ss);
+    }
 }
 
 uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const CAmount& amount, SigVersion sigversion, const PrecomputedTransactionData* cache)
@@ -1236,6 +1326,24 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
         }
     }
 
+    if (cache && !cache->vLegacyMidstates.empty() && !(nHashType & SIGHASH_ANYONECANPAY) &&
+        (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        // Resume from the last midstate before input nIn, hash the template up to
+        // its blanked script, splice in scriptCode and finish with the rest of the
+        // template. This is byte-for-byte what the serializer below produces.
+        const unsigned int nMidstate = nIn / LEGACY_SIGHASH_MIDSTATE_INTERVAL;
+        const size_t nResume = LegacyTemplateInputOffset(txTo, nMidstate * LEGACY_SIGHASH_MIDSTATE_INTERVAL);
+        const size_t nScript = LegacyTemplateInputOffset(txTo, nIn) + LEGACY_SIGHASH_PREVOUT_SIZE;
+        const std::vector<unsigned char>& vchTemplate = cache->vchLegacyTemplate;
+
+        CHashWriter ss(cache->vLegacyMidstates[nMidstate]);
+        ss.write((const char*)&vchTemplate[nResume], nScript - nResume);
+        SerializeScriptCode(ss, scriptCode);
+        ss.write((const char*)&vchTemplate[nScript + 1], vchTemplate.size() - nScript - 1);
+        ss << nHashType;
+        return ss.GetHash();
+    }
+
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
@@ -1245,19 +1353,19 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     return ss.GetHash();
 }
 
-bool TransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
+bool TransactionSignatureChecker::VerifySignature(const valtype& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    return pubkey.Verify(sighash, vchSig);
+    return pubkey.Verify(sighash, vchSig.data(), vchSig.size());
 }
 
-bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn, const vector<unsigned char>& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
+bool TransactionSignatureChecker::CheckSig(const valtype& vchSigIn, const valtype& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
 {
-    CPubKey pubkey(vchPubKey);
+    CPubKey pubkey(vchPubKey.data(), vchPubKey.data() + vchPubKey.size());
     if (!pubkey.IsValid())
         return false;
 
     // Hash type is one byte tacked on to the end of the signature
-    vector<unsigned char> vchSig(vchSigIn);
+    valtype vchSig(vchSigIn);
     if (vchSig.empty())
         return false;
     int nHashType = vchSig.back();
@@ -1353,9 +1461,18 @@ bool TransactionSignatureChecker::CheckSequence(const CScriptNum& nSequence) con
     return true;
 }
 
+/** Copy witness items [first, last) onto an interpreter stack. */
+static void PushWitnessStack(CScriptStack& stack, std::vector<std::vector<unsigned char> >::const_iterator first, std::vector<std::vector<unsigned char> >::const_iterator last)
+{
+    stack.reserve(stack.size() + (last - first));
+    for (; first != last; ++first) {
+        stack.emplace_back(first->begin(), first->end());
+    }
+}
+
 static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion, const std::vector<unsigned char>& program, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror)
 {
-    vector<vector<unsigned char> > stack;
+    CScriptStack stack;
     CScript scriptPubKey;
 
     if (witversion == 0) {
@@ -1365,7 +1482,7 @@ static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion,
                 return set_error(serror, SCRIPT_ERR_WITNESS_PROGRAM_WITNESS_EMPTY);
             }
             scriptPubKey = CScript(witness.stack.back().begin(), witness.stack.back().end());
-            stack = std::vector<std::vector<unsigned char> >(witness.stack.begin(), witness.stack.end() - 1);
+            PushWitnessStack(stack, witness.stack.begin(), witness.stack.end() - 1);
             uint256 hashScriptPubKey;
             CSHA256().Write(&scriptPubKey[0], scriptPubKey.size()).Finalize(hashScriptPubKey.begin());
             if (memcmp(hashScriptPubKey.begin(), &program[0], 32)) {
@@ -1377,7 +1494,7 @@ static bool VerifyWitnessProgram(const CScriptWitness& witness, int witversion,
                 return set_error(serror, SCRIPT_ERR_WITNESS_PROGRAM_MISMATCH); // 2 items in witness
             }
             scriptPubKey << OP_DUP << OP_HASH160 << program << OP_EQUALVERIFY << OP_CHECKSIG;
-            stack = witness.stack;
+            PushWitnessStack(stack, witness.stack.begin(), witness.stack.end());
         } else {
             return set_error(serror, SCRIPT_ERR_WITNESS_PROGRAM_WRONG_LENGTH);
         }
@@ -1420,7 +1537,8 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         return set_error(serror, SCRIPT_ERR_SIG_PUSHONLY);
     }
 
-    vector<vector<unsigned char> > stack, stackCopy;
+    CScriptStack stack, stackCopy;
+    stack.reserve(SCRIPT_STACK_RESERVE);
     if (!EvalScript(stack, scriptSig, flags, checker, SIGVERSION_BASE, serror))
         // serror is set
         return false;
@@ -1469,7 +1587,7 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         assert(!stack.empty());
 
         const valtype& pubKeySerialized = stack.back();
-        CScript pubKey2(pubKeySerialized.begin(), pubKeySerialized.end());
+        CScript pubKey2(pubKeySerialized.data(), pubKeySerialized.data() + pubKeySerialized.size());
         popstack(stack);
 
         if (!EvalScript(stack, pubKey2, flags, checker, SIGVERSION_BASE, serror))
@@ -1484,7 +1602,10 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
         if (flags & SCRIPT_VERIFY_WITNESS) {
             if (pubKey2.IsWitnessProgram(witnessversion, witnessprogram)) {
                 hadWitness = true;
-                if (scriptSig != CScript() << std::vector<unsigned char>(pubKey2.begin(), pubKey2.end())) {
+                // A witness program is at most 42 bytes, so that push is a
+                // direct one: <size> <redeemScript>.
+                if (scriptSig.size() != pubKey2.size() + 1 || scriptSig[0] != pubKey2.size() ||
+                    !std::equal(pubKey2.begin(), pubKey2.end(), scriptSig.begin() + 1)) {
                     // The scriptSig must be _exactly_ a single push of the redeemScript. Otherwise we
                     // reintroduce malleability.
                     return set_error(serror, SCRIPT_ERR_WITNESS_MALLEATED_P2SH);
@@ -7,6 +7,8 @@
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
 #include "script_error.h"
+#include "hash.h"
+#include "prevector.h"
 #include "primitives/transaction.h"
 
 #include <vector>
@@ -108,12 +110,38 @@ enum
     SCRIPT_VERIFY_WITNESS_PUBKEYTYPE = (1U << 15),
 };
 
+/**
+ * Element of the script interpreter's stack. Signatures, public keys and
+ * hashes fit in the inline buffer, so evaluating standard scripts does not
+ * allocate per stack element.
+ */
+typedef prevector<80, unsigned char> CScriptStackElement;
+typedef std::vector<CScriptStackElement> CScriptStack;
+
+bool CheckSignatureEncoding(const CScriptStackElement &vchSig, unsigned int flags, ScriptError* serror);
 bool CheckSignatureEncoding(const std::vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror);
 
+/** Minimum number of non-witness inputs for which the legacy sighash layout is built */
+static const unsigned int LEGACY_SIGHASH_MIN_INPUTS = 4;
+/** Number of inputs between two stored legacy sighash midstates */
+static const unsigned int LEGACY_SIGHASH_MIDSTATE_INTERVAL = 8;
+
 struct PrecomputedTransactionData
 {
     uint256 hashPrevouts, hashSequence, hashOutputs;
 
+    /**
+     * Layout for legacy (non-witness) signature hashes that commit to all
+     * inputs and outputs: the transaction serialized the way SignatureHash
+     * does, with every input script blanked, plus hashing midstates taken in
+     * front of every LEGACY_SIGHASH_MIDSTATE_INTERVAL'th input. SignatureHash
+     * resumes from the nearest midstate instead of re-serializing the whole
+     * transaction for each input. Left empty for transactions with fewer than
+     * LEGACY_SIGHASH_MIN_INPUTS non-witness inputs.
+     */
+    std::vector<unsigned char> vchLegacyTemplate;
+    std::vector<CHashWriter> vLegacyMidstates;
+
     PrecomputedTransactionData(const CTransaction& tx);
 };
 
@@ -128,7 +156,7 @@ uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsig
 class BaseSignatureChecker
 {
 public:
-    virtual bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
+    virtual bool CheckSig(const CScriptStackElement& scriptSig, const CScriptStackElement& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
     {
         return false;
     }
@@ -155,12 +183,12 @@ private:
     const PrecomputedTransactionData* txdata;
 
 protected:
-    virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
+    virtual bool VerifySignature(const CScriptStackElement& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
     TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn) : txTo(txToIn), nIn(nInIn), amount(amountIn), txdata(NULL) {}
     TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amountIn, const PrecomputedTransactionData& txdataIn) : txTo(txToIn), nIn(nInIn), amount(amountIn), txdata(&txdataIn) {}
-    bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const;
+    bool CheckSig(const CScriptStackElement& scriptSig, const CScriptStackElement& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const;
     bool CheckLockTime(const CScriptNum& nLockTime) const;
     bool CheckSequence(const CScriptNum& nSequence) const;
 };
@@ -174,6 +202,8 @@ public:
     MutableTransactionSignatureChecker(const CMutableTransaction* txToIn, unsigned int nInIn, const CAmount& amount) : TransactionSignatureChecker(&txTo, nInIn, amount), txTo(*txToIn) {}
 };
 
+bool EvalScript(CScriptStack& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* error = NULL);
+/** Convenience wrapper for callers that keep the stack as plain byte vectors; copies in and out. */
 bool EvalScript(std::vector<std::vector<unsigned char> >& stack, const CScript& script, unsigned int flags, const BaseSignatureChecker& checker, SigVersion sigversion, ScriptError* error = NULL);
 bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const CScriptWitness* witness, unsigned int flags, const BaseSignatureChecker& checker, ScriptError* serror = NULL);
 
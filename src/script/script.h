@@ -214,7 +214,8 @@ public:
 
     static const size_t nDefaultMaxNumSize = 4;
 
-    explicit CScriptNum(const std::vector<unsigned char>& vch, bool fRequireMinimal,
+    template<typename T>
+    explicit CScriptNum(const T& vch, bool fRequireMinimal,
                         const size_t nMaxNumSize = nDefaultMaxNumSize)
     {
         if (vch.size() > nMaxNumSize) {
@@ -316,12 +317,27 @@ public:
         return serialize(m_value);
     }
 
+    /** Serialize into an existing byte container, e.g. a script stack element. */
+    template<typename T>
+    void getvch(T& result) const
+    {
+        serialize(m_value, result);
+    }
+
     static std::vector<unsigned char> serialize(const int64_t& value)
     {
+        std::vector<unsigned char> result;
+        serialize(value, result);
+        return result;
+    }
+
+    template<typename T>
+    static void serialize(const int64_t& value, T& result)
+    {
+        result.clear();
         if(value == 0)
-            return std::vector<unsigned char>();
+            return;
 
-        std::vector<unsigned char> result;
         const bool neg = value < 0;
         uint64_t absvalue = neg ? -value : value;
 
@@ -345,12 +361,11 @@ public:
             result.push_back(neg ? 0x80 : 0);
         else if (neg)
             result.back() |= 0x80;
-
-        return result;
     }
 
 private:
-    static int64_t set_vch(const std::vector<unsigned char>& vch)
+    template<typename T>
+    static int64_t set_vch(const T& vch)
     {
       if (vch.empty())
           return 0;
@@ -501,9 +516,25 @@ public:
 
     bool GetOp2(const_iterator& pc, opcodetype& opcodeRet, std::vector<unsigned char>* pvchRet) const
     {
-        opcodeRet = OP_INVALIDOPCODE;
         if (pvchRet)
             pvchRet->clear();
+        const_iterator pdataBegin = pc, pdataEnd = pc;
+        if (!GetOp(pc, opcodeRet, pdataBegin, pdataEnd))
+            return false;
+        if (pvchRet)
+            pvchRet->assign(pdataBegin, pdataEnd);
+        return true;
+    }
+
+    /**
+     * Like GetOp, but instead of copying pushed data out of the script, return
+     * it as the range [pdataBegin, pdataEnd) into this script. The range is
+     * empty for non-push opcodes.
+     */
+    bool GetOp(const_iterator& pc, opcodetype& opcodeRet, const_iterator& pdataBegin, const_iterator& pdataEnd) const
+    {
+        opcodeRet = OP_INVALIDOPCODE;
+        pdataBegin = pdataEnd = pc;
         if (pc >= end())
             return false;
 
@@ -542,8 +573,8 @@ public:
             }
             if (end() - pc < 0 || (unsigned int)(end() - pc) < nSize)
                 return false;
-            if (pvchRet)
-                pvchRet->assign(pc, pc + nSize);
+            pdataBegin = pc;
+            pdataEnd = pc + nSize;
             pc += nSize;
         }
 
@@ -6,8 +6,10 @@
 #ifndef BITCOIN_SCRIPT_SIGCACHE_H
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
+#include "epochcache.h"
 #include "script/interpreter.h"
 
+#include <cstring>
 #include <vector>
 
 // DoS prevention: limit cache size to 32MB (over 1000000 entries on 64-bit
@@ -19,6 +21,27 @@ static const int64_t MAX_MAX_SIG_CACHE_SIZE = 16384;
 
 class CPubKey;
 
+/**
+ * We're hashing a nonce into the entries themselves, so we don't need extra
+ * blinding in the set hash computation.
+ *
+ * This may exhibit platform endian dependent behavior but because these are
+ * nonced hashes (random) and this state is only ever used locally it is safe.
+ * All that matters is local consistency.
+ */
+class SignatureCacheHasher
+{
+public:
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        static_assert(hash_select <8, "SignatureCacheHasher only has 8 hashes available.");
+        uint32_t u;
+        std::memcpy(&u, key.begin()+4*hash_select, 4);
+        return u;
+    }
+};
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
@@ -27,9 +50,22 @@ private:
 public:
     CachingTransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const CAmount& amount, bool storeIn, PrecomputedTransactionData& txdataIn) : TransactionSignatureChecker(txToIn, nInIn, amount, txdataIn), store(storeIn) {}
 
-    bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
+    bool VerifySignature(const CScriptStackElement& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
 void InitSignatureCache();
 
+/** Hit, miss and eviction counters of the signature cache */
+EpochCache::stats GetSignatureCacheStats();
+
+/** The live entries of the signature cache, and the nonce they were computed with */
+void DumpSignatureCache(uint256& nonce, std::vector<uint256>& vEntries);
+
+/**
+ * Restore entries saved by DumpSignatureCache. This replaces the nonce, so
+ * entries computed before no longer match: call it at startup, before the
+ * cache is shared between threads.
+ */
+void LoadSignatureCache(const uint256& nonce, const std::vector<uint256>& vEntries);
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
@@ -258,7 +258,7 @@ static vector<valtype> CombineMultisig(const CScript& scriptPubKey, const BaseSi
             if (sigs.count(pubkey))
                 continue; // Already got a sig for this pubkey
 
-            if (checker.CheckSig(sig, pubkey, scriptPubKey, sigversion))
+            if (checker.CheckSig(CScriptStackElement(sig.begin(), sig.end()), CScriptStackElement(pubkey.begin(), pubkey.end()), scriptPubKey, sigversion))
             {
                 sigs[pubkey] = sig;
                 break;
@@ -396,7 +396,7 @@ class DummySignatureChecker : public BaseSignatureChecker
 public:
     DummySignatureChecker() {}
 
-    bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
+    bool CheckSig(const CScriptStackElement& scriptSig, const CScriptStackElement& vchPubKey, const CScript& scriptCode, SigVersion sigversion) const
     {
         return true;
     }
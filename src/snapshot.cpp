@@ -0,0 +1,68 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "snapshot.h"
+
+#include "coins.h"
+#include "hash.h"
+#include "streams.h"
+#include "util.h"
+
+#include <boost/thread.hpp>
+
+/** Coins read from a snapshot are handed to the view this many transactions at a time */
+static const size_t SNAPSHOT_BATCH_SIZE = 50000;
+
+uint256 CSnapshotMetadata::GetHash(const uint256& hashCoins) const
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << *this << hashCoins;
+    return ss.GetHash();
+}
+
+bool WriteSnapshotCoins(CCoinsViewCursor* pcursor, CAutoFile& file, uint64_t& nCoins, uint256& hashCoins)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    nCoins = 0;
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        uint256 txid;
+        CCoins coins;
+        if (!pcursor->GetKey(txid) || !pcursor->GetValue(coins))
+            return error("%s: unable to read value", __func__);
+        ss << txid << coins;
+        file << txid << coins;
+        nCoins++;
+        pcursor->Next();
+    }
+    hashCoins = ss.GetHash();
+    return true;
+}
+
+bool ReadSnapshotCoins(CAutoFile& file, uint64_t nCoins, CCoinsView* view, uint256& hashCoins)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    CCoinsMap mapCoins;
+    for (uint64_t i = 0; i < nCoins; i++) {
+        boost::this_thread::interruption_point();
+        uint256 txid;
+        CCoins coins;
+        file >> txid >> coins;
+        if (coins.IsPruned())
+            return error("%s: snapshot contains spent transaction %s", __func__, txid.ToString());
+        ss << txid << coins;
+        if (view == NULL)
+            continue;
+        CCoinsCacheEntry& entry = mapCoins[txid];
+        entry.coins.swap(coins);
+        entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+        if (mapCoins.size() >= SNAPSHOT_BATCH_SIZE || i + 1 == nCoins) {
+            if (!view->BatchWrite(mapCoins, uint256()))
+                return error("%s: unable to write coins", __func__);
+            mapCoins.clear();
+        }
+    }
+    hashCoins = ss.GetHash();
+    return true;
+}
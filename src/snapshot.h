@@ -0,0 +1,79 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SNAPSHOT_H
+#define BITCOIN_SNAPSHOT_H
+
+#include "serialize.h"
+#include "uint256.h"
+
+#include <stdint.h>
+#include <string.h>
+
+class CAutoFile;
+class CCoinsView;
+class CCoinsViewCursor;
+
+/** Format of the snapshot files written by dumptxoutset */
+static const int SNAPSHOT_VERSION = 1;
+
+/**
+ * Start of a UTXO set snapshot file. It is followed by the headers of the
+ * blocks at heights 1 to nHeight, then by nCoins records of a txid and its
+ * unspent outputs, in database order.
+ */
+class CSnapshotMetadata
+{
+public:
+    unsigned char pchMessageStart[4]; //!< Network the snapshot was taken on
+    int nVersion;
+    uint256 hashBlock; //!< Block the snapshot was taken at
+    int nHeight;
+    unsigned int nTx;
+    uint64_t nChainTx;
+    uint64_t nCoins;
+
+    CSnapshotMetadata()
+    {
+        SetNull();
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(nVersion);
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(nTx);
+        READWRITE(nChainTx);
+        READWRITE(nCoins);
+    }
+
+    void SetNull()
+    {
+        memset(pchMessageStart, 0, sizeof(pchMessageStart));
+        nVersion = SNAPSHOT_VERSION;
+        hashBlock.SetNull();
+        nHeight = 0;
+        nTx = 0;
+        nChainTx = 0;
+        nCoins = 0;
+    }
+
+    /** What -snapshothash names: the metadata together with the hash of the coin records */
+    uint256 GetHash(const uint256& hashCoins) const;
+};
+
+/** Write a record for every transaction left to pcursor; nCoins and hashCoins describe the records written */
+bool WriteSnapshotCoins(CCoinsViewCursor* pcursor, CAutoFile& file, uint64_t& nCoins, uint256& hashCoins);
+
+/**
+ * Read nCoins records and hash them into hashCoins. Unless view is NULL, the
+ * coins are also written to it, in batches, without changing its best block.
+ */
+bool ReadSnapshotCoins(CAutoFile& file, uint64_t nCoins, CCoinsView* view, uint256& hashCoins);
+
+#endif // BITCOIN_SNAPSHOT_H
@@ -643,6 +643,16 @@ public:
         }
     }
 
+    // skip nSize bytes
+    void ignore(size_t nSize) {
+        char data[4096];
+        while (nSize > 0) {
+            size_t nNow = std::min<size_t>(nSize, sizeof(data));
+            read(data, nNow);
+            nSize -= nNow;
+        }
+    }
+
     // return the current reading position
     uint64_t GetPos() {
         return nReadPos;
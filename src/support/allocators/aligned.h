@@ -0,0 +1,50 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_ALIGNED_H
+#define BITCOIN_SUPPORT_ALLOCATORS_ALIGNED_H
+
+#include <cstddef>
+#include <new>
+#include <stdint.h>
+
+/**
+ * Allocator returning memory aligned to Alignment bytes (a power of two), for
+ * containers whose elements are accessed in cache line sized groups. The
+ * allocation is over-sized and the original pointer is kept just before the
+ * aligned block.
+ */
+template <typename T, size_t Alignment>
+struct aligned_allocator {
+    typedef T value_type;
+    template <typename U>
+    struct rebind {
+        typedef aligned_allocator<U, Alignment> other;
+    };
+
+    aligned_allocator() throw() {}
+    template <typename U>
+    aligned_allocator(const aligned_allocator<U, Alignment>&) throw() {}
+
+    T* allocate(std::size_t n)
+    {
+        char* base = static_cast<char*>(::operator new(n * sizeof(T) + sizeof(void*) + Alignment - 1));
+        uintptr_t aligned = (reinterpret_cast<uintptr_t>(base) + sizeof(void*) + Alignment - 1) & ~(uintptr_t)(Alignment - 1);
+        reinterpret_cast<void**>(aligned)[-1] = base;
+        return reinterpret_cast<T*>(aligned);
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (p != NULL)
+            ::operator delete(reinterpret_cast<void**>(p)[-1]);
+    }
+};
+
+template <typename T, typename U, size_t Alignment>
+bool operator==(const aligned_allocator<T, Alignment>&, const aligned_allocator<U, Alignment>&) { return true; }
+template <typename T, typename U, size_t Alignment>
+bool operator!=(const aligned_allocator<T, Alignment>&, const aligned_allocator<U, Alignment>&) { return false; }
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_ALIGNED_H
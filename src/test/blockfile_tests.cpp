@@ -0,0 +1,128 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+
+#include "clientversion.h"
+#include "random.h"
+#include "streams.h"
+#include "uint256.h"
+#include "util.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace {
+
+struct BlockFileSetup : public BasicTestingSetup {
+    boost::filesystem::path pathDir;
+
+    BlockFileSetup()
+    {
+        pathDir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+        boost::filesystem::create_directories(pathDir);
+    }
+
+    ~BlockFileSetup()
+    {
+        boost::filesystem::remove_all(pathDir);
+    }
+
+    boost::filesystem::path Path(int nFile) const
+    {
+        return pathDir / strprintf("blk%05u.dat", nFile);
+    }
+};
+
+void AppendToFile(const boost::filesystem::path& path, const std::vector<uint256>& vData)
+{
+    CAutoFile file(fopen(path.string().c_str(), "ab"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+    file << vData;
+}
+
+} // namespace
+
+BOOST_FIXTURE_TEST_SUITE(blockfile_tests, BlockFileSetup)
+
+BOOST_AUTO_TEST_CASE(blockfile_read)
+{
+    // Large enough to span several read-ahead chunks
+    std::vector<uint256> vData(5000);
+    for (size_t i = 0; i < vData.size(); i++)
+        vData[i] = GetRandHash();
+    AppendToFile(Path(0), vData);
+    const size_t nSize = GetSerializeSize(vData, SER_DISK, CLIENT_VERSION);
+
+    for (int fMap = 0; fMap <= 1; fMap++) {
+        std::shared_ptr<const CBlockFile> file = CBlockFile::Open(Path(0), fMap);
+        BOOST_REQUIRE(file);
+
+        std::vector<uint256> vRead;
+        CBlockFileReader reader(file, 0, SER_DISK, CLIENT_VERSION);
+        reader >> vRead;
+        BOOST_CHECK(vRead == vData);
+
+        // Skipping ahead and reading single elements
+        CBlockFileReader reader2(file, 0, SER_DISK, CLIENT_VERSION);
+        uint256 hash;
+        reader2.ignore(nSize - 32);
+        reader2 >> hash;
+        BOOST_CHECK(hash == vData.back());
+        BOOST_CHECK_THROW(reader2 >> hash, std::ios_base::failure);
+    }
+
+    // Data appended after the file was mapped is read past the mapping
+    std::shared_ptr<const CBlockFile> file = CBlockFile::Open(Path(0), true);
+    std::vector<uint256> vMore(3, GetRandHash());
+    AppendToFile(Path(0), vMore);
+    std::vector<uint256> vRead;
+    CBlockFileReader reader(file, nSize, SER_DISK, CLIENT_VERSION);
+    reader >> vRead;
+    BOOST_CHECK(vRead == vMore);
+
+    BOOST_CHECK(!CBlockFile::Open(Path(1), true));
+}
+
+BOOST_AUTO_TEST_CASE(blockfile_cache)
+{
+    std::vector<uint256> vData(1, GetRandHash());
+    for (int nFile = 0; nFile < 4; nFile++)
+        AppendToFile(Path(nFile), vData);
+
+    CBlockFileCache cache(3);
+    std::shared_ptr<const CBlockFile> file0 = cache.Get("blk", 0, Path(0), false);
+    BOOST_REQUIRE(file0);
+    BOOST_CHECK(cache.Get("blk", 0, Path(0), false) == file0);
+
+    // Once the file is complete it is opened again
+    std::shared_ptr<const CBlockFile> file0final = cache.Get("blk", 0, Path(0), true);
+    BOOST_CHECK(file0final != file0);
+    BOOST_CHECK(cache.Get("blk", 0, Path(0), true) == file0final);
+    BOOST_CHECK(cache.Get("blk", 0, Path(0), false) == file0final);
+
+    // Least recently used files are closed first
+    cache.Get("blk", 1, Path(1), true);
+    cache.Get("blk", 2, Path(2), true);
+    cache.Get("blk", 0, Path(0), true);
+    cache.Get("blk", 3, Path(3), true);
+    BOOST_CHECK_EQUAL(cache.Size(), 3U);
+    BOOST_CHECK(cache.Get("blk", 0, Path(0), true) == file0final);
+
+    // Evicted files stay usable by their readers
+    std::vector<uint256> vRead;
+    CBlockFileReader reader(file0, 0, SER_DISK, CLIENT_VERSION);
+    reader >> vRead;
+    BOOST_CHECK(vRead == vData);
+
+    cache.Erase(0);
+    BOOST_CHECK_EQUAL(cache.Size(), 2U);
+    BOOST_CHECK(cache.Get("blk", 0, Path(0), true) != file0final);
+    BOOST_CHECK(!cache.Get("blk", 4, Path(4), true));
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.Size(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
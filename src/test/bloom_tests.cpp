@@ -541,4 +541,44 @@ BOOST_AUTO_TEST_CASE(rolling_bloom)
     }
 }
 
+// The rolling filter is blocked; check that it keeps its false positive rate
+// when as full as it gets, and that hashes and their bytes are interchangeable.
+BOOST_AUTO_TEST_CASE(rolling_bloom_blocked)
+{
+    CRollingBloomFilter rb(10000, 0.001);
+    // Three generations of 5000 entries, the last one short of rolling over
+    for (int i = 0; i < 14999; i++) {
+        uint256 hash = GetRandHash();
+        if (i % 2) {
+            rb.insert(hash);
+            BOOST_CHECK(rb.contains(std::vector<unsigned char>(hash.begin(), hash.end())));
+        } else {
+            rb.insert(std::vector<unsigned char>(hash.begin(), hash.end()));
+            BOOST_CHECK(rb.contains(hash));
+        }
+    }
+
+    unsigned int nHits = 0;
+    for (int i = 0; i < 100000; i++) {
+        if (rb.contains(GetRandHash()))
+            ++nHits;
+    }
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~100 expected)");
+    BOOST_CHECK(nHits < 150);
+
+    // Blocking a filter with a low rate, like every peer's inventory filter,
+    // costs little memory over the unblocked 539kB
+    CRollingBloomFilter rbLow(50000, 0.000001);
+    BOOST_CHECK(rbLow.DynamicMemoryUsage() < 600000);
+    for (int i = 0; i < 74999; i++)
+        rbLow.insert(GetRandHash());
+    nHits = 0;
+    for (int i = 0; i < 1000000; i++) {
+        if (rbLow.contains(GetRandHash()))
+            ++nHits;
+    }
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~1 expected)");
+    BOOST_CHECK(nHits < 10);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -81,6 +81,12 @@ public:
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
             ret += it->second.coins.DynamicMemoryUsage();
         }
+        // A pending write is a copy, and counted as well
+        if (pcoinsWriting) {
+            ret += memusage::DynamicUsage(*pcoinsWriting);
+            for (CCoinsMap::const_iterator it = pcoinsWriting->begin(); it != pcoinsWriting->end(); it++)
+                ret += it->second.coins.DynamicMemoryUsage();
+        }
         BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
     }
 
@@ -121,6 +127,8 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
     std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
     stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
+    std::shared_ptr<const CCoinsMap> written; // Handed out by the bottom cache, not yet in base.
+    bool wrote_in_background = false;
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -170,16 +178,32 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
             }
         }
 
+        if (insecure_rand() % 100 == 0) {
+            // Every 100 iterations, start or finish writing the bottom cache the
+            // way the flush thread does, trimming it while the write is pending
+            if (written) {
+                CCoinsMap mapWritten(*written);
+                base.BatchWrite(mapWritten, uint256());
+                stack[0]->FinishWrite();
+                written.reset();
+                wrote_in_background = true;
+            } else if (stack.size() > 0) {
+                written = stack[0]->StartWrite();
+                stack[0]->Trim(insecure_rand() % (stack[0]->DynamicMemoryUsage() + 1));
+            }
+        }
         if (insecure_rand() % 100 == 0) {
             // Every 100 iterations, flush an intermediate cache
             if (stack.size() > 1 && insecure_rand() % 2 == 0) {
                 unsigned int flushIndex = insecure_rand() % (stack.size() - 1);
-                stack[flushIndex]->Flush();
+                // A cache being written in the background is not flushed as well
+                if (flushIndex > 0 || !written)
+                    stack[flushIndex]->Flush();
             }
         }
         if (insecure_rand() % 100 == 0) {
             // Every 100 iterations, change the cache stack.
-            if (stack.size() > 0 && insecure_rand() % 2 == 0) {
+            if (stack.size() > 0 && insecure_rand() % 2 == 0 && (stack.size() > 1 || !written)) {
                 //Remove the top cache
                 stack.back()->Flush();
                 delete stack.back();
@@ -215,6 +239,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(wrote_in_background);
 }
 
 typedef std::tuple<CTransaction,CTxUndo,CCoins> TxData;
@@ -873,4 +898,103 @@ BOOST_AUTO_TEST_CASE(ccoins_write)
                     CheckWriteCoins(parent_value, child_value, parent_value, parent_flags, child_flags, parent_flags);
 }
 
+BOOST_AUTO_TEST_CASE(ccoins_start_write)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    uint256 txid[4];
+    for (int i = 0; i < 4; i++) {
+        txid[i] = GetRandHash();
+        if (i == 3)
+            cache.Flush();
+        CCoinsModifier coins = cache.ModifyCoins(txid[i]);
+        coins->vout.resize(1);
+        coins->vout[0].nValue = i + 1;
+    }
+    // One modified entry, one spent after the base has it, and one spent
+    // before the base ever saw it
+    cache.ModifyCoins(txid[0])->vout[0].nValue = 10;
+    cache.ModifyCoins(txid[2])->Clear();
+    cache.ModifyCoins(txid[3])->Clear();
+
+    // Modified entries move out of the cache; spent ones the base never saw
+    // are dropped
+    const size_t nUsageBefore = cache.DynamicMemoryUsage();
+    std::shared_ptr<const CCoinsMap> written = cache.StartWrite();
+    BOOST_CHECK(cache.IsWriting());
+    BOOST_CHECK_EQUAL(written->size(), 2U);
+    BOOST_CHECK(written->count(txid[0]) && written->count(txid[2]));
+    BOOST_CHECK(!cache.HaveCoinsInCache(txid[0]));
+    BOOST_CHECK(cache.DynamicMemoryUsage() - cache.WritingMemoryUsage() < nUsageBefore);
+    BOOST_CHECK(!cache.HaveCoinsInCache(txid[2]));
+    BOOST_CHECK(!cache.HaveCoinsInCache(txid[3]));
+    cache.SelfTest();
+
+    // Until the write is done the base is stale, but lookups are not
+    cache.ModifyCoins(txid[1])->vout[0].nValue = 20;
+    cache.Trim(0);
+    BOOST_CHECK(!cache.HaveCoinsInCache(txid[0]));
+    BOOST_CHECK(cache.HaveCoinsInCache(txid[1]));
+    CCoins coins;
+    BOOST_CHECK(base.GetCoins(txid[0], coins) && coins.vout[0].nValue == 1);
+    BOOST_CHECK(cache.AccessCoins(txid[0])->vout[0].nValue == 10);
+    BOOST_CHECK(!cache.HaveCoins(txid[2]));
+    BOOST_CHECK(!cache.HaveCoins(txid[3]));
+
+    CCoinsMap mapWritten(*written);
+    base.BatchWrite(mapWritten, uint256());
+    const size_t nUsageWriting = cache.DynamicMemoryUsage();
+    // Written coins are cached again, unmodified, once the write is done
+    cache.Uncache(txid[0]);
+    BOOST_CHECK(!cache.HaveCoinsInCache(txid[0]));
+    cache.FinishWrite();
+    BOOST_CHECK(!cache.IsWriting());
+    BOOST_CHECK(cache.DynamicMemoryUsage() < nUsageWriting);
+    BOOST_CHECK(cache.HaveCoinsInCache(txid[0]) && cache.map().at(txid[0]).flags == 0);
+    BOOST_CHECK(base.GetCoins(txid[0], coins) && coins.vout[0].nValue == 10);
+    BOOST_CHECK(!base.GetCoins(txid[2], coins) || coins.IsPruned());
+    cache.SelfTest();
+}
+
+BOOST_AUTO_TEST_CASE(ccoins_trim)
+{
+    CCoinsViewTest base;
+    uint256 txid[3];
+    {
+        CCoinsViewCacheTest cache(&base);
+        for (int i = 0; i < 3; i++) {
+            txid[i] = GetRandHash();
+            CCoinsModifier coins = cache.ModifyCoins(txid[i]);
+            coins->vout.resize(1);
+            coins->vout[0].nValue = i + 1;
+        }
+        cache.Flush();
+    }
+
+    // Use the entries in three different epochs, the first one most recently
+    CCoinsViewCacheTest cache(&base);
+    CCoinsMap mapEmpty;
+    for (int i = 2; i >= 0; i--) {
+        BOOST_CHECK(cache.AccessCoins(txid[i]));
+        cache.BatchWrite(mapEmpty, uint256());
+    }
+    const size_t nUsage = cache.DynamicMemoryUsage();
+    cache.Trim(nUsage);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 3U);
+
+    // Evicting a little takes the least recently used entry
+    cache.Trim(nUsage - 1);
+    BOOST_CHECK(!cache.HaveCoinsInCache(txid[2]));
+    BOOST_CHECK(cache.HaveCoinsInCache(txid[1]));
+    BOOST_CHECK(cache.HaveCoinsInCache(txid[0]));
+    cache.SelfTest();
+
+    // Modified entries are never evicted
+    cache.ModifyCoins(txid[1])->vout[0].nValue = 5;
+    cache.Trim(0);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1U);
+    BOOST_CHECK(cache.HaveCoinsInCache(txid[1]));
+    cache.SelfTest();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,102 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinstats.h"
+
+#include "coins.h"
+#include "random.h"
+#include "txdb.h"
+#include "test/test_bitcoin.h"
+#include "test/test_random.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace {
+
+/** Write nCount random transactions to view, adding up what they hold in expected */
+void FillView(CCoinsViewDB& view, int nCount, const uint256& hashBlock, CCoinsStats& expected)
+{
+    CCoinsMap mapCoins;
+    for (int i = 0; i < nCount; i++) {
+        CCoinsCacheEntry& entry = mapCoins[GetRandHash()];
+        entry.coins.nVersion = 1;
+        entry.coins.fCoinBase = insecure_rand() % 2;
+        entry.coins.nHeight = insecure_rand() % 100000;
+        entry.coins.vout.resize(1 + insecure_rand() % 4);
+        for (unsigned int j = 0; j < entry.coins.vout.size(); j++) {
+            entry.coins.vout[j].nValue = insecure_rand() % 1000000;
+            entry.coins.vout[j].scriptPubKey.assign(1 + insecure_rand() % 40, (unsigned char)j);
+            expected.nTransactionOutputs++;
+            expected.nTotalAmount += entry.coins.vout[j].nValue;
+        }
+        entry.flags = CCoinsCacheEntry::DIRTY;
+        expected.nTransactions++;
+    }
+    BOOST_REQUIRE(view.BatchWrite(mapCoins, hashBlock));
+}
+
+} // namespace
+
+BOOST_FIXTURE_TEST_SUITE(coinstats_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(coinstats_parallel)
+{
+    CCoinsViewDB view(1 << 20, true);
+    const uint256 hashBlock = GetRandHash();
+    CCoinsStats expected;
+    FillView(view, 2000, hashBlock, expected);
+
+    // However the ranges are spread over threads, the results agree
+    CCoinsStats stats1, stats4, stats32;
+    BOOST_REQUIRE(GetUTXOStats(&view, stats1, 1));
+    BOOST_REQUIRE(GetUTXOStats(&view, stats4, 4));
+    BOOST_REQUIRE(GetUTXOStats(&view, stats32, 32));
+    BOOST_CHECK(stats1.hashBlock == hashBlock);
+    BOOST_CHECK_EQUAL(stats1.nTransactions, expected.nTransactions);
+    BOOST_CHECK_EQUAL(stats1.nTransactionOutputs, expected.nTransactionOutputs);
+    BOOST_CHECK_EQUAL(stats1.nTotalAmount, expected.nTotalAmount);
+    BOOST_CHECK(stats1.nSerializedSize > 32 * stats1.nTransactions);
+    BOOST_CHECK(stats1.hashSerialized == stats4.hashSerialized);
+    BOOST_CHECK(stats1.hashSerialized == stats32.hashSerialized);
+    BOOST_CHECK_EQUAL(stats1.nTransactions, stats4.nTransactions);
+    BOOST_CHECK_EQUAL(stats1.nSerializedSize, stats4.nSerializedSize);
+    BOOST_CHECK_EQUAL(stats1.nTotalAmount, stats32.nTotalAmount);
+
+    // Spending an output changes the hash and the totals
+    std::unique_ptr<CCoinsViewCursor> pcursor(view.Cursor());
+    uint256 txid;
+    CCoins coins;
+    BOOST_REQUIRE(pcursor->GetKey(txid) && pcursor->GetValue(coins));
+    pcursor.reset();
+    const CAmount nSpent = coins.vout[0].nValue;
+    coins.Spend(0);
+    CCoinsMap mapCoins;
+    mapCoins[txid].coins = coins;
+    mapCoins[txid].flags = CCoinsCacheEntry::DIRTY;
+    BOOST_REQUIRE(view.BatchWrite(mapCoins, hashBlock));
+    CCoinsStats stats2;
+    BOOST_REQUIRE(GetUTXOStats(&view, stats2, 4));
+    BOOST_CHECK(stats2.hashSerialized != stats1.hashSerialized);
+    BOOST_CHECK_EQUAL(stats2.nTotalAmount, stats1.nTotalAmount - nSpent);
+
+    // The best block is part of the hash
+    CCoinsMap mapEmpty;
+    BOOST_REQUIRE(view.BatchWrite(mapEmpty, GetRandHash()));
+    CCoinsStats stats3;
+    BOOST_REQUIRE(GetUTXOStats(&view, stats3, 4));
+    BOOST_CHECK(stats3.hashSerialized != stats2.hashSerialized);
+    BOOST_CHECK_EQUAL(stats3.nTotalAmount, stats2.nTotalAmount);
+}
+
+BOOST_AUTO_TEST_CASE(coinstats_empty)
+{
+    CCoinsViewDB view(1 << 20, true);
+    CCoinsStats stats;
+    BOOST_REQUIRE(GetUTXOStats(&view, stats, 4));
+    BOOST_CHECK(stats.hashBlock.IsNull());
+    BOOST_CHECK_EQUAL(stats.nTransactions, 0U);
+    BOOST_CHECK_EQUAL(stats.nTotalAmount, 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
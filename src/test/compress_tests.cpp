@@ -3,7 +3,13 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "compressor.h"
+#include "chain.h"
+#include "consensus/merkle.h"
+#include "key.h"
+#include "script/standard.h"
+#include "streams.h"
 #include "util.h"
+#include "version.h"
 #include "test/test_bitcoin.h"
 
 #include <stdint.h>
@@ -62,4 +68,87 @@ BOOST_AUTO_TEST_CASE(compress_amounts)
         BOOST_CHECK(TestDecode(i));
 }
 
+BOOST_AUTO_TEST_CASE(compress_block)
+{
+    CKey key;
+    key.MakeNewKey(false);
+    const CPubKey pubkey = key.GetPubKey();
+
+    CBlock block;
+    block.nVersion = 4;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = 1500000000;
+    block.nBits = 0x1d00ffff;
+    block.nNonce = 42;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << 1000 << OP_0;
+    coinbase.vout.push_back(CTxOut(50 * COIN, GetScriptForRawPubKey(pubkey)));
+    coinbase.vout.push_back(CTxOut(0, CScript() << OP_RETURN << std::vector<unsigned char>(36, 0xaa)));
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+
+    CMutableTransaction tx;
+    tx.nVersion = 2;
+    tx.vin.resize(2);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 3);
+    tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 0x30) << ToByteVector(pubkey);
+    tx.vin[1].prevout = COutPoint(GetRandHash(), 0);
+    tx.vin[1].nSequence = 0xfffffffd;
+    tx.vin[1].scriptWitness.stack.push_back(std::vector<unsigned char>(71, 0x30));
+    tx.vin[1].scriptWitness.stack.push_back(ToByteVector(pubkey));
+    tx.vout.push_back(CTxOut(12345678, GetScriptForDestination(pubkey.GetID())));
+    tx.vout.push_back(CTxOut(COIN, GetScriptForDestination(CScriptID(CScript() << OP_TRUE))));
+    tx.vout.push_back(CTxOut(1, CScript() << OP_2 << OP_ADD << OP_4 << OP_EQUAL));
+    tx.nLockTime = 123456;
+    block.vtx.push_back(MakeTransactionRef(tx));
+    block.hashMerkleRoot = BlockMerkleRoot(block);
+    BOOST_CHECK(CBlockCompressor::IsCompressible(block));
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << CBlockCompressor(block);
+    BOOST_CHECK(ss.size() < ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK_EQUAL(ss.size(), ::GetSerializeSize(CBlockCompressor(block), SER_DISK, CLIENT_VERSION));
+
+    // Decompressing gives back the same block, witnesses included
+    CBlock block2;
+    CBlockCompressor compressor(block2);
+    ss >> compressor;
+    BOOST_CHECK(ss.empty());
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+    BOOST_REQUIRE_EQUAL(block2.vtx.size(), block.vtx.size());
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(block2.vtx[i]->GetWitnessHash() == block.vtx[i]->GetWitnessHash());
+    BOOST_CHECK(BlockMerkleRoot(block2) == block.hashMerkleRoot);
+
+    // Overly long scripts cannot be stored compressed
+    std::vector<unsigned char> vLong(MAX_SCRIPT_SIZE + 1, OP_NOP);
+    tx.vout.push_back(CTxOut(0, CScript(vLong.begin(), vLong.end())));
+    block.vtx.push_back(MakeTransactionRef(tx));
+    BOOST_CHECK(!CBlockCompressor::IsCompressible(block));
+}
+
+BOOST_AUTO_TEST_CASE(blockfileinfo_flags)
+{
+    CBlockFileInfo info;
+    info.nBlocks = 3;
+    info.nFlags = BLOCKFILE_COMPRESSED;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << info;
+    CBlockFileInfo info2;
+    ss >> info2;
+    BOOST_CHECK_EQUAL(info2.nBlocks, 3U);
+    BOOST_CHECK_EQUAL(info2.nFlags, (unsigned int)BLOCKFILE_COMPRESSED);
+
+    // Entries written before the flags existed read as uncompressed
+    CDataStream ssOld(SER_DISK, CLIENT_VERSION);
+    ssOld << VARINT(info.nBlocks) << VARINT(info.nSize) << VARINT(info.nUndoSize) << VARINT(info.nHeightFirst)
+          << VARINT(info.nHeightLast) << VARINT(info.nTimeFirst) << VARINT(info.nTimeLast);
+    CBlockFileInfo info3;
+    info3.nFlags = BLOCKFILE_COMPRESSED;
+    ssOld >> info3;
+    BOOST_CHECK_EQUAL(info3.nBlocks, 3U);
+    BOOST_CHECK_EQUAL(info3.nFlags, 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
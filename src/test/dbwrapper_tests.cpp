@@ -122,6 +122,40 @@ BOOST_AUTO_TEST_CASE(dbwrapper_iterator)
     }
 }
 
+// Reads and iterators given a snapshot do not see later writes
+BOOST_AUTO_TEST_CASE(dbwrapper_snapshot)
+{
+    boost::filesystem::path ph = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    CDBWrapper dbw(ph, (1 << 20), true, false, true);
+
+    char key = 'j';
+    uint256 in = GetRandHash();
+    BOOST_CHECK(dbw.Write(key, in));
+    std::unique_ptr<CDBSnapshot> snapshot(new CDBSnapshot(dbw));
+
+    uint256 in2 = GetRandHash();
+    BOOST_CHECK(dbw.Write(key, in2));
+    char key2 = 'k';
+    BOOST_CHECK(dbw.Write(key2, in2));
+
+    uint256 res;
+    BOOST_CHECK(dbw.Read(key, res));
+    BOOST_CHECK(res == in2);
+    BOOST_CHECK(dbw.Read(key, res, snapshot.get()));
+    BOOST_CHECK(res == in);
+    BOOST_CHECK(!dbw.Read(key2, res, snapshot.get()));
+
+    std::unique_ptr<CDBIterator> it(dbw.NewIterator(snapshot.get()));
+    it->Seek(key);
+    char key_res;
+    BOOST_CHECK(it->GetKey(key_res));
+    BOOST_CHECK_EQUAL(key_res, key);
+    BOOST_CHECK(it->GetValue(res));
+    BOOST_CHECK(res == in);
+    it->Next();
+    BOOST_CHECK(!it->Valid());
+}
+
 // Test that we do not obfuscation if there is existing data.
 BOOST_AUTO_TEST_CASE(existing_data_no_obfuscate)
 {
@@ -318,6 +352,35 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
     }
 }
 
-
+BOOST_AUTO_TEST_CASE(dbwrapper_profile_compact)
+{
+    boost::filesystem::path ph = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    CDBProfile profile;
+    profile.nMaxOpenFiles = 100;
+    profile.nBloomBitsPerKey = 0;
+    profile.fCompress = true;
+    profile.nBlockSize = 16 * 1024;
+    profile.nBlockCachePercent = 75;
+    CDBWrapper dbw(ph, (1 << 20), false, false, true, profile);
+
+    for (int x = 0; x < 2000; ++x)
+        BOOST_CHECK(dbw.Write(std::make_pair('k', x), uint256S(strprintf("%x", x))));
+    for (int x = 0; x < 1000; ++x)
+        BOOST_CHECK(dbw.Erase(std::make_pair('k', x)));
+
+    // An interrupted compaction stops before touching any range.
+    BOOST_CHECK(!dbw.Compact(0, [] { return true; }));
+    BOOST_CHECK(dbw.Compact(0, [] { return false; }));
+    BOOST_CHECK(dbw.EstimateSize() > 0);
+    BOOST_CHECK(dbw.EstimateSize('k', 'l') > 0);
+    BOOST_CHECK_EQUAL(dbw.EstimateSize('a', 'b'), 0U);
+
+    for (int x = 0; x < 2000; ++x) {
+        uint256 res;
+        BOOST_CHECK_EQUAL(dbw.Read(std::make_pair('k', x), res), x >= 1000);
+        if (x >= 1000)
+            BOOST_CHECK(res == uint256S(strprintf("%x", x)));
+    }
+}
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,196 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#include <boost/test/unit_test.hpp>
+#include "epochcache.h"
+#include "test/test_bitcoin.h"
+#include "random.h"
+#include <set>
+#include <thread>
+
+/** Test Suite for EpochCache
+ *
+ *  All tests use insecure rand with deterministic seeds. As with the
+ *  CuckooCache tests, hit rate checks are regression tests and may need
+ *  updating when the eviction policy changes.
+ */
+BOOST_AUTO_TEST_SUITE(epochcache_tests);
+
+namespace {
+class uint256Hasher
+{
+public:
+    template <uint8_t hash_select>
+    uint32_t operator()(const uint256& key) const
+    {
+        static_assert(hash_select <8, "SignatureCacheHasher only has 8 hashes available.");
+        uint32_t u;
+        std::memcpy(&u, key.begin() + 4 * hash_select, 4);
+        return u;
+    }
+};
+
+typedef EpochCache::cache<uint256, uint256Hasher> Cache;
+
+std::vector<uint256> RandomHashes(FastRandomContext& rand, size_t n)
+{
+    std::vector<uint256> hashes(n);
+    for (uint256& hash : hashes) {
+        uint32_t* ptr = (uint32_t*)hash.begin();
+        for (uint8_t j = 0; j < 8; ++j)
+            *(ptr++) = rand.rand32();
+    }
+    return hashes;
+}
+}
+
+/* Test that no values not inserted into the cache are read out of it. */
+BOOST_AUTO_TEST_CASE(epochcache_no_fakes)
+{
+    FastRandomContext rand(true);
+    Cache cache;
+    cache.setup_bytes(1 << 20);
+    std::vector<uint256> hashes = RandomHashes(rand, 200000);
+    for (size_t i = 0; i < 100000; ++i)
+        cache.insert(hashes[i]);
+    for (size_t i = 100000; i < 200000; ++i)
+        BOOST_CHECK(!cache.contains(hashes[i], false));
+}
+
+BOOST_AUTO_TEST_CASE(epochcache_hit_rate_and_stats)
+{
+    FastRandomContext rand(true);
+    Cache cache;
+    const uint32_t capacity = cache.setup_bytes(4 << 20);
+    BOOST_CHECK_EQUAL(cache.get_stats().capacity, capacity);
+    BOOST_CHECK_EQUAL(cache.get_stats().entries, 0U);
+
+    // At half load nearly everything must still be present.
+    std::vector<uint256> hashes = RandomHashes(rand, capacity / 2);
+    for (const uint256& hash : hashes)
+        cache.insert(hash);
+    size_t hits = 0;
+    for (const uint256& hash : hashes)
+        hits += cache.contains(hash, false);
+    BOOST_CHECK(hits > hashes.size() * 99 / 100);
+
+    EpochCache::stats stats = cache.get_stats();
+    BOOST_CHECK_EQUAL(stats.hits, hits);
+    BOOST_CHECK_EQUAL(stats.misses, hashes.size() - hits);
+    BOOST_CHECK_EQUAL(stats.inserts, hashes.size());
+    BOOST_CHECK_EQUAL(stats.entries, stats.inserts - stats.evictions);
+
+    // Inserting an element that is already present does not use a new slot.
+    cache.insert(hashes.back());
+    BOOST_CHECK_EQUAL(cache.get_stats().inserts, stats.inserts);
+}
+
+/* Erased elements are still found until overwritten, and are overwritten
+ * before older elements which were not erased. */
+BOOST_AUTO_TEST_CASE(epochcache_erase_ok)
+{
+    FastRandomContext rand(true);
+    Cache cache;
+    const uint32_t capacity = cache.setup_bytes(4 << 20);
+    std::vector<uint256> hashes = RandomHashes(rand, capacity);
+
+    cache.insert(hashes[0]);
+    BOOST_CHECK(cache.contains(hashes[0], true));
+    BOOST_CHECK(cache.contains(hashes[0], false));
+    BOOST_CHECK_EQUAL(cache.get_stats().entries, 0U);
+
+    for (size_t i = 1; i < hashes.size() / 2; ++i)
+        cache.insert(hashes[i]);
+    for (size_t i = 0; i < hashes.size() / 4; ++i)
+        cache.contains(hashes[i], true);
+    for (size_t i = hashes.size() / 2; i < hashes.size(); ++i)
+        cache.insert(hashes[i]);
+
+    size_t count_erased = 0, count_stale = 0, count_fresh = 0;
+    for (size_t i = 0; i < hashes.size() / 4; ++i)
+        count_erased += cache.contains(hashes[i], false);
+    for (size_t i = hashes.size() / 4; i < hashes.size() / 2; ++i)
+        count_stale += cache.contains(hashes[i], false);
+    for (size_t i = hashes.size() / 2; i < hashes.size(); ++i)
+        count_fresh += cache.contains(hashes[i], false);
+
+    // Erased elements are only kept while there are empty slots to use
+    // instead, so they survive less often than stale ones.
+    BOOST_CHECK(count_fresh > (hashes.size() / 2) * 99 / 100);
+    BOOST_CHECK(count_stale > (hashes.size() / 4) * 9 / 10);
+    BOOST_CHECK(count_stale > count_erased);
+}
+
+/* for_each visits exactly the live elements, so they can be copied into a
+ * new cache. */
+BOOST_AUTO_TEST_CASE(epochcache_for_each)
+{
+    FastRandomContext rand(true);
+    Cache cache;
+    cache.setup_bytes(1 << 20);
+    std::vector<uint256> hashes = RandomHashes(rand, 1000);
+    for (const uint256& hash : hashes)
+        cache.insert(hash);
+    for (size_t i = 0; i < 100; ++i)
+        cache.contains(hashes[i], true);
+
+    std::set<uint256> visited;
+    cache.for_each([&visited](const uint256& hash) { visited.insert(hash); });
+    BOOST_CHECK_EQUAL(visited.size(), cache.get_stats().entries);
+    for (size_t i = 0; i < hashes.size(); ++i) {
+        const bool live = i >= 100 && cache.contains(hashes[i], false);
+        BOOST_CHECK_EQUAL(visited.count(hashes[i]), live ? 1U : 0U);
+    }
+
+    Cache copy;
+    copy.setup_bytes(1 << 20);
+    for (const uint256& hash : visited)
+        copy.insert(hash);
+    for (const uint256& hash : visited)
+        BOOST_CHECK(copy.contains(hash, false));
+}
+
+/* Concurrent inserts and lookups never produce false positives, and the
+ * counters add up once the threads are done. */
+BOOST_AUTO_TEST_CASE(epochcache_parallel)
+{
+    FastRandomContext rand(true);
+    Cache cache;
+    const uint32_t capacity = cache.setup_bytes(1 << 20);
+    std::vector<uint256> present = RandomHashes(rand, capacity / 8);
+    std::vector<uint256> absent = RandomHashes(rand, capacity / 8);
+    std::vector<uint256> inserted = RandomHashes(rand, capacity / 4);
+    for (const uint256& hash : present)
+        cache.insert(hash);
+
+    const int nThreads = 4;
+    std::atomic<size_t> false_positives(0);
+    std::atomic<size_t> lookups(0);
+    std::vector<std::thread> threads;
+    for (int x = 0; x < nThreads; ++x) {
+        threads.emplace_back([&, x] {
+            size_t n = 0, fp = 0;
+            for (size_t i = x; i < inserted.size(); i += nThreads) {
+                cache.insert(inserted[i]);
+                fp += cache.contains(absent[i % absent.size()], false);
+                cache.contains(present[i % present.size()], false);
+                n += 2;
+            }
+            false_positives += fp;
+            lookups += n;
+        });
+    }
+    for (std::thread& t : threads)
+        t.join();
+
+    BOOST_CHECK_EQUAL(false_positives.load(), 0U);
+    EpochCache::stats stats = cache.get_stats();
+    BOOST_CHECK_EQUAL(stats.hits + stats.misses, lookups.load());
+    BOOST_CHECK(stats.inserts <= present.size() + inserted.size());
+    size_t hits = 0;
+    for (const uint256& hash : inserted)
+        hits += cache.contains(hash, false);
+    BOOST_CHECK(hits > inserted.size() * 9 / 10);
+}
+
+BOOST_AUTO_TEST_SUITE_END();
@@ -1443,4 +1443,31 @@ BOOST_AUTO_TEST_CASE(script_FindAndDelete)
     BOOST_CHECK(s == expect);
 }
 
+BOOST_AUTO_TEST_CASE(script_GetOp_range)
+{
+    // The zero-copy GetOp overload must agree with the copying one, up to and
+    // including a trailing truncated push.
+    CScript s = CScript() << OP_0 << std::vector<unsigned char>(1, 0x81) << std::vector<unsigned char>(75, 1)
+                          << std::vector<unsigned char>(200, 2) << std::vector<unsigned char>(300, 3) << OP_CHECKSIG;
+    s += ScriptFromHex("4c05feed");
+
+    CScript::const_iterator pc = s.begin(), pcRange = s.begin();
+    CScript::const_iterator pdataBegin = pcRange, pdataEnd = pcRange;
+    opcodetype opcode, opcodeRange;
+    std::vector<unsigned char> data;
+    unsigned int nOps = 0;
+    while (true) {
+        bool fRet = s.GetOp(pc, opcode, data);
+        bool fRetRange = s.GetOp(pcRange, opcodeRange, pdataBegin, pdataEnd);
+        BOOST_CHECK_EQUAL(fRet, fRetRange);
+        BOOST_CHECK(pc == pcRange);
+        BOOST_CHECK_EQUAL(opcode, opcodeRange);
+        if (!fRet)
+            break;
+        BOOST_CHECK(data == std::vector<unsigned char>(pdataBegin, pdataEnd));
+        nOps++;
+    }
+    BOOST_CHECK_EQUAL(nOps, 6U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
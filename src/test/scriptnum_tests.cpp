@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "scriptnum10.h"
+#include "script/interpreter.h"
 #include "script/script.h"
 #include "test/test_bitcoin.h"
 
@@ -39,6 +40,13 @@ static void CheckCreateVch(const int64_t& num)
     CScriptNum10 bignum3(scriptnum2.getvch(), false);
     CScriptNum scriptnum3(bignum2.getvch(), false);
     BOOST_CHECK(verify(bignum3, scriptnum3));
+
+    // Round trip through an interpreter stack element.
+    CScriptStackElement elem;
+    scriptnum.getvch(elem);
+    BOOST_CHECK(std::vector<unsigned char>(elem.begin(), elem.end()) == scriptnum.getvch());
+    CScriptNum scriptnum4(elem, false, elem.size());
+    BOOST_CHECK(verify(bignum, scriptnum4));
 }
 
 static void CheckCreateInt(const int64_t& num)
@@ -166,6 +166,42 @@ BOOST_AUTO_TEST_CASE(sighash_test)
     #endif
 }
 
+// Goal: check that the precomputed legacy layout reproduces SignatureHash for
+// every input and hash type, across several midstate intervals
+BOOST_AUTO_TEST_CASE(sighash_legacy_precomputed)
+{
+    seed_insecure_rand(false);
+
+    for (int i = 0; i < 20; i++) {
+        CMutableTransaction txTo;
+        RandomTransaction(txTo, false);
+        unsigned int nInputs = LEGACY_SIGHASH_MIN_INPUTS + insecure_rand() % (4 * LEGACY_SIGHASH_MIDSTATE_INTERVAL);
+        while (txTo.vin.size() < nInputs) {
+            txTo.vin.push_back(txTo.vin.back());
+            txTo.vin.back().prevout.hash = GetRandHash();
+        }
+        txTo.vout.resize(nInputs);
+        const CTransaction tx(txTo);
+        PrecomputedTransactionData txdata(tx);
+        BOOST_CHECK(!txdata.vLegacyMidstates.empty());
+
+        for (unsigned int nIn = 0; nIn < tx.vin.size(); nIn++) {
+            CScript scriptCode;
+            RandomScript(scriptCode);
+            int nHashType = insecure_rand();
+            BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, nHashType, 0, SIGVERSION_BASE, &txdata) ==
+                        SignatureHash(scriptCode, tx, nIn, nHashType, 0, SIGVERSION_BASE));
+            BOOST_CHECK(SignatureHash(scriptCode, tx, nIn, SIGHASH_ALL, 0, SIGVERSION_BASE, &txdata) ==
+                        SignatureHashOld(scriptCode, tx, nIn, SIGHASH_ALL));
+        }
+    }
+
+    // Too few inputs to be worth building the layout.
+    CMutableTransaction txSmall;
+    txSmall.vin.resize(LEGACY_SIGHASH_MIN_INPUTS - 1);
+    BOOST_CHECK(PrecomputedTransactionData(txSmall).vLegacyMidstates.empty());
+}
+
 // Goal: check that SignatureHash generates correct hash
 BOOST_AUTO_TEST_CASE(sighash_from_data)
 {
@@ -143,4 +143,37 @@ BOOST_AUTO_TEST_CASE(findearliestatleast_test)
         BOOST_CHECK(vBlocksMain[r].GetAncestor(ret->nHeight) == ret);
     }
 }
+
+BOOST_AUTO_TEST_CASE(blockindexarena_test)
+{
+    CBlockIndexArena arena;
+    BOOST_CHECK_EQUAL(arena.Size(), 0U);
+
+    // Entries outlive the chunks that follow them, and start out like new ones
+    CBlockHeader header;
+    header.nTime = 1234;
+    header.nBits = 0x207fffff;
+    std::vector<CBlockIndex*> vIndex;
+    for (size_t i = 0; i < 3 * CBlockIndexArena::CHUNK_SIZE + 1; i++) {
+        CBlockIndex* pindex = (i % 2) ? arena.New(header) : arena.New();
+        BOOST_CHECK(pindex->pprev == NULL);
+        BOOST_CHECK_EQUAL(pindex->nTime, (i % 2) ? 1234U : 0U);
+        pindex->nHeight = i;
+        pindex->pprev = vIndex.empty() ? NULL : vIndex.back();
+        vIndex.push_back(pindex);
+    }
+    BOOST_CHECK_EQUAL(arena.Size(), 3 * CBlockIndexArena::CHUNK_SIZE + 1);
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        BOOST_CHECK_EQUAL(vIndex[i]->nHeight, (int)i);
+        BOOST_CHECK(vIndex[i]->pprev == (i ? vIndex[i - 1] : NULL));
+    }
+    // Entries of one chunk are contiguous
+    BOOST_CHECK(vIndex[1] == vIndex[0] + 1);
+
+    arena.Clear();
+    BOOST_CHECK_EQUAL(arena.Size(), 0U);
+    BOOST_CHECK_EQUAL(arena.New()->nHeight, 0);
+    BOOST_CHECK_EQUAL(arena.Size(), 1U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
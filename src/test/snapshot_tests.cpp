@@ -0,0 +1,157 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "snapshot.h"
+
+#include "clientversion.h"
+#include "coins.h"
+#include "random.h"
+#include "streams.h"
+#include "txdb.h"
+#include "util.h"
+#include "test/test_bitcoin.h"
+#include "test/test_random.h"
+
+#include <memory>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace {
+
+CCoins RandomCoins()
+{
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.fCoinBase = insecure_rand() % 2;
+    coins.nHeight = insecure_rand() % 100000;
+    coins.vout.resize(1 + insecure_rand() % 4);
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        coins.vout[i].nValue = insecure_rand() % 1000000;
+        coins.vout[i].scriptPubKey.assign(insecure_rand() % 40, (unsigned char)i);
+    }
+    return coins;
+}
+
+/** Fill view with nCount random transactions, returning them */
+std::map<uint256, CCoins> FillView(CCoinsView& view, int nCount, const uint256& hashBlock)
+{
+    std::map<uint256, CCoins> mapExpected;
+    CCoinsMap mapCoins;
+    for (int i = 0; i < nCount; i++) {
+        const uint256 txid = GetRandHash();
+        mapExpected[txid] = RandomCoins();
+        CCoinsCacheEntry& entry = mapCoins[txid];
+        entry.coins = mapExpected[txid];
+        entry.flags = CCoinsCacheEntry::DIRTY;
+    }
+    BOOST_REQUIRE(view.BatchWrite(mapCoins, hashBlock));
+    return mapExpected;
+}
+
+/** Write the coins of view to path as a snapshot at hashBlock */
+uint256 WriteSnapshot(const CCoinsView& view, const boost::filesystem::path& path, CSnapshotMetadata& meta)
+{
+    CAutoFile file(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+    file << meta;
+    std::unique_ptr<CCoinsViewCursor> pcursor(view.Cursor());
+    BOOST_CHECK(pcursor->GetBestBlock() == meta.hashBlock);
+    uint256 hashCoins;
+    BOOST_REQUIRE(WriteSnapshotCoins(pcursor.get(), file, meta.nCoins, hashCoins));
+    BOOST_REQUIRE(fseek(file.Get(), 0, SEEK_SET) == 0);
+    file << meta;
+    return hashCoins;
+}
+
+/** Read the coins of the snapshot in path into view, or only hash them if view is NULL */
+uint256 ReadSnapshot(const boost::filesystem::path& path, CCoinsView* view)
+{
+    CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+    CSnapshotMetadata meta;
+    file >> meta;
+    uint256 hashCoins;
+    BOOST_REQUIRE(ReadSnapshotCoins(file, meta.nCoins, view, hashCoins));
+    return hashCoins;
+}
+
+} // namespace
+
+BOOST_FIXTURE_TEST_SUITE(snapshot_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(snapshot_roundtrip)
+{
+    const boost::filesystem::path path = pathTemp / "snapshot.dat";
+    const uint256 hashBlock = GetRandHash();
+    CCoinsViewDB source(1 << 20, true);
+    const std::map<uint256, CCoins> mapExpected = FillView(source, 1000, hashBlock);
+
+    CSnapshotMetadata meta;
+    meta.hashBlock = hashBlock;
+    meta.nHeight = 100;
+    meta.nTx = 1;
+    meta.nChainTx = 150;
+    const uint256 hashCoins = WriteSnapshot(source, path, meta);
+    BOOST_CHECK_EQUAL(meta.nCoins, 1000U);
+
+    // Hashing alone and loading agree with what was written
+    BOOST_CHECK(ReadSnapshot(path, NULL) == hashCoins);
+    CCoinsViewDB dest(1 << 20, true);
+    BOOST_CHECK(ReadSnapshot(path, &dest) == hashCoins);
+    for (std::map<uint256, CCoins>::const_iterator it = mapExpected.begin(); it != mapExpected.end(); ++it) {
+        CCoins coins;
+        BOOST_REQUIRE(dest.GetCoins(it->first, coins));
+        BOOST_CHECK(coins == it->second);
+    }
+    // Loading the coins leaves the best block alone
+    BOOST_CHECK(dest.GetBestBlock().IsNull());
+
+    // The same coins are written the same way
+    const boost::filesystem::path path2 = pathTemp / "snapshot2.dat";
+    CCoinsMap mapEmpty;
+    dest.BatchWrite(mapEmpty, hashBlock);
+    BOOST_CHECK(WriteSnapshot(dest, path2, meta) == hashCoins);
+
+    // The snapshot hash covers the metadata as well as the coins
+    const uint256 hashSnapshot = meta.GetHash(hashCoins);
+    CSnapshotMetadata meta2 = meta;
+    meta2.nChainTx++;
+    BOOST_CHECK(meta2.GetHash(hashCoins) != hashSnapshot);
+
+    // Changing any coin changes the hash
+    {
+        FILE* f = fopen(path.string().c_str(), "r+b");
+        BOOST_REQUIRE(f);
+        BOOST_REQUIRE(fseek(f, ::GetSerializeSize(meta, SER_DISK, CLIENT_VERSION), SEEK_SET) == 0);
+        unsigned char ch = fgetc(f);
+        BOOST_REQUIRE(fseek(f, -1, SEEK_CUR) == 0);
+        fputc(ch ^ 1, f);
+        fclose(f);
+    }
+    BOOST_CHECK(ReadSnapshot(path, NULL) != hashCoins);
+
+    // A snapshot that ends early is rejected
+    boost::filesystem::resize_file(path2, boost::filesystem::file_size(path2) - 1);
+    CAutoFile file(fopen(path2.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    file >> meta2;
+    uint256 hashTruncated;
+    BOOST_CHECK_THROW(ReadSnapshotCoins(file, meta2.nCoins, NULL, hashTruncated), std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_empty)
+{
+    // A database without coins gives an empty snapshot
+    const boost::filesystem::path path = pathTemp / "empty.dat";
+    CCoinsViewDB source(1 << 20, true);
+    CSnapshotMetadata meta;
+    meta.hashBlock = GetRandHash();
+    CCoinsMap mapEmpty;
+    source.BatchWrite(mapEmpty, meta.hashBlock);
+    const uint256 hashCoins = WriteSnapshot(source, path, meta);
+    BOOST_CHECK_EQUAL(meta.nCoins, 0U);
+    BOOST_CHECK(ReadSnapshot(path, NULL) == hashCoins);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -84,4 +84,66 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+BOOST_FIXTURE_TEST_CASE(checkinputs_script_execution_cache, TestChain100Setup)
+{
+    // Check that CheckInputs consults the script execution cache before
+    // running or queueing script checks, and that cache entries only match
+    // the script verification flags they were validated under.
+
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 11*CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+
+    const CTransaction tx(spend);
+
+    LOCK(cs_main);
+    CCoinsViewCache coins(pcoinsTip);
+    PrecomputedTransactionData txdata(tx);
+    CValidationState state;
+    std::vector<CScriptCheck> checks;
+
+    // Nothing cached yet: one check is queued per input.
+    BOOST_CHECK(CheckInputs(tx, state, coins, true, SCRIPT_VERIFY_P2SH, true, true, txdata, &checks));
+    BOOST_CHECK_EQUAL(checks.size(), 1U);
+
+    // Queued checks are not cached, since CheckInputs can't know their result.
+    checks.clear();
+    BOOST_CHECK(CheckInputs(tx, state, coins, true, SCRIPT_VERIFY_P2SH, true, true, txdata, &checks));
+    BOOST_CHECK_EQUAL(checks.size(), 1U);
+
+    // Running the checks inline stores the result...
+    BOOST_CHECK(CheckInputs(tx, state, coins, true, SCRIPT_VERIFY_P2SH, true, true, txdata, NULL));
+    checks.clear();
+    BOOST_CHECK(CheckInputs(tx, state, coins, true, SCRIPT_VERIFY_P2SH, false, false, txdata, &checks));
+    BOOST_CHECK_EQUAL(checks.size(), 0U);
+
+    // ...but only for the flags it was validated under.
+    BOOST_CHECK(CheckInputs(tx, state, coins, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG, false, false, txdata, &checks));
+    BOOST_CHECK_EQUAL(checks.size(), 1U);
+
+    // An invalid signature must not be cached as valid.
+    CMutableTransaction badSpend(spend);
+    badSpend.vout[0].nValue = 10*CENT;
+    const CTransaction badTx(badSpend);
+    PrecomputedTransactionData badTxdata(badTx);
+    BOOST_CHECK(!CheckInputs(badTx, state, coins, true, SCRIPT_VERIFY_P2SH, true, true, badTxdata, NULL));
+    checks.clear();
+    BOOST_CHECK(CheckInputs(badTx, state, coins, true, SCRIPT_VERIFY_P2SH, false, false, badTxdata, &checks));
+    BOOST_CHECK_EQUAL(checks.size(), 1U);
+    BOOST_CHECK(!checks[0]());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
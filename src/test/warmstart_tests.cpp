@@ -0,0 +1,133 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "warmstart.h"
+
+#include "coins.h"
+#include "random.h"
+#include "script/sigcache.h"
+#include "sync.h"
+#include "util.h"
+#include "validation.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace {
+
+/** Add nCount coins to pcoinsTip and write them to the database */
+std::vector<uint256> AddCoins(int nCount)
+{
+    std::vector<uint256> vTxid;
+    CCoinsMap mapCoins;
+    for (int i = 0; i < nCount; i++) {
+        vTxid.push_back(GetRandHash());
+        CCoinsCacheEntry& entry = mapCoins[vTxid.back()];
+        entry.coins.nVersion = 1;
+        entry.coins.nHeight = 1;
+        entry.coins.vout.resize(1);
+        entry.coins.vout[0].nValue = 1000 + i;
+        entry.coins.vout[0].scriptPubKey.assign(25, (unsigned char)i);
+        entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+    }
+    LOCK(cs_main);
+    BOOST_REQUIRE(pcoinsTip->BatchWrite(mapCoins, pcoinsTip->GetBestBlock()));
+    FlushStateToDisk();
+    return vTxid;
+}
+
+/** Number of vTxid in the coins cache */
+size_t CountCached(const std::vector<uint256>& vTxid)
+{
+    LOCK(cs_main);
+    size_t nCached = 0;
+    for (const uint256& txid : vTxid)
+        nCached += pcoinsTip->HaveCoinsInCache(txid);
+    return nCached;
+}
+
+void EvictCoins()
+{
+    LOCK(cs_main);
+    pcoinsTip->Trim(0);
+}
+
+} // namespace
+
+BOOST_FIXTURE_TEST_SUITE(warmstart_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(warmstart_roundtrip)
+{
+    const boost::filesystem::path path = GetDataDir() / "warmstart.dat";
+    const std::vector<uint256> vTxid = AddCoins(100);
+    BOOST_CHECK_EQUAL(CountCached(vTxid), vTxid.size());
+
+    uint256 nonce;
+    std::vector<uint256> vSigCache;
+    DumpSignatureCache(nonce, vSigCache);
+
+    // Nothing to load until a file was written
+    BOOST_CHECK(!LoadWarmStart());
+    BOOST_REQUIRE(DumpWarmStart());
+    BOOST_CHECK(boost::filesystem::exists(path));
+    EvictCoins();
+    BOOST_CHECK_EQUAL(CountCached(vTxid), 0U);
+
+    // The coins come back, and the file is only used once
+    BOOST_CHECK(LoadWarmStart());
+    BOOST_CHECK_EQUAL(CountCached(vTxid), vTxid.size());
+    BOOST_CHECK(!boost::filesystem::exists(path));
+    BOOST_CHECK(!LoadWarmStart());
+
+    // The signature cache keeps its nonce, so its entries still match
+    uint256 nonce2;
+    std::vector<uint256> vSigCache2;
+    DumpSignatureCache(nonce2, vSigCache2);
+    BOOST_CHECK(nonce2 == nonce);
+    BOOST_CHECK(vSigCache2.size() >= vSigCache.size());
+}
+
+BOOST_AUTO_TEST_CASE(warmstart_moved_on)
+{
+    // Coins are not loaded once the chain state is at another block
+    const std::vector<uint256> vTxid = AddCoins(10);
+    BOOST_REQUIRE(DumpWarmStart());
+    EvictCoins();
+    uint256 hashBestBlock;
+    {
+        LOCK(cs_main);
+        hashBestBlock = pcoinsTip->GetBestBlock();
+        pcoinsTip->SetBestBlock(GetRandHash());
+    }
+    BOOST_CHECK(LoadWarmStart());
+    {
+        LOCK(cs_main);
+        pcoinsTip->SetBestBlock(hashBestBlock);
+    }
+    BOOST_CHECK_EQUAL(CountCached(vTxid), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(warmstart_corrupt)
+{
+    // A damaged file is removed without loading anything from it
+    const boost::filesystem::path path = GetDataDir() / "warmstart.dat";
+    const std::vector<uint256> vTxid = AddCoins(10);
+    BOOST_REQUIRE(DumpWarmStart());
+    EvictCoins();
+    {
+        FILE* f = fopen(path.string().c_str(), "r+b");
+        BOOST_REQUIRE(f);
+        BOOST_REQUIRE(fseek(f, 40, SEEK_SET) == 0);
+        unsigned char ch = fgetc(f);
+        BOOST_REQUIRE(fseek(f, -1, SEEK_CUR) == 0);
+        fputc(ch ^ 1, f);
+        fclose(f);
+    }
+    BOOST_CHECK(!LoadWarmStart());
+    BOOST_CHECK(!boost::filesystem::exists(path));
+    BOOST_CHECK_EQUAL(CountCached(vTxid), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,6 +5,7 @@
 
 #include "txdb.h"
 
+#include "blockfilter.h"
 #include "chainparams.h"
 #include "hash.h"
 #include "pow.h"
@@ -25,9 +26,30 @@ static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_BLOCK_INDEX_SIZE = 's';
 
+static const char DB_BLOCK_FILTER = 'f';
+static const char DB_BLOCK_FILTER_HEADER = 'h';
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+
+CDBProfile ChainstateDBProfile(int nMaxOpenFiles)
+{
+    CDBProfile profile;
+    profile.nMaxOpenFiles = std::max(nMaxOpenFiles, DB_MIN_OPEN_FILES);
+    return profile;
+}
+
+CDBProfile IndexDBProfile(int nMaxOpenFiles)
+{
+    CDBProfile profile;
+    profile.nMaxOpenFiles = std::max(nMaxOpenFiles, DB_MIN_OPEN_FILES);
+    profile.fCompress = true;
+    profile.nBlockSize = 16 * 1024;
+    profile.nBlockCachePercent = 75;
+    return profile;
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBProfile& profile) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true, profile)
 {
 }
 
@@ -47,10 +69,16 @@ uint256 CCoinsViewDB::GetBestBlock() const {
 }
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
+    bool fOk = WriteCoins(mapCoins, hashBlock);
+    mapCoins.clear();
+    return fOk;
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
             if (it->second.coins.IsPruned())
                 batch.Erase(std::make_pair(DB_COINS, it->first));
@@ -59,8 +87,6 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
@@ -69,7 +95,7 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBProfile& profile) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, false, profile) {
     if (!Read('S', salt)) {
         salt = GetRandHash();
         Write('S', salt);
@@ -104,7 +130,20 @@ CCoinsViewCursor *CCoinsViewDB::Cursor() const
        that restriction.  */
     i->pcursor->Seek(DB_COINS);
     // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    if (!i->pcursor->Valid() || !i->pcursor->GetKey(i->keyTmp))
+        i->keyTmp.first = 0; // The database holds no coins, or none after them
+    return i;
+}
+
+CCoinsViewCursor *CCoinsViewDB::Cursor(const CDBSnapshot &snapshot, const uint256 &hashStart) const
+{
+    uint256 hashBestChain;
+    if (!db.Read(DB_BEST_BLOCK, hashBestChain, &snapshot))
+        hashBestChain.SetNull();
+    CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper*>(&db)->NewIterator(&snapshot), hashBestChain);
+    i->pcursor->Seek(std::make_pair(DB_COINS, hashStart));
+    if (!i->pcursor->Valid() || !i->pcursor->GetKey(i->keyTmp))
+        i->keyTmp.first = 0;
     return i;
 }
 
@@ -140,18 +179,23 @@ void CCoinsViewDBCursor::Next()
         keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
 }
 
-bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
+bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo, uint64_t nBlockIndexSize) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it=fileInfo.begin(); it != fileInfo.end(); it++) {
         batch.Write(std::make_pair(DB_BLOCK_FILES, it->first), *it->second);
     }
     batch.Write(DB_LAST_BLOCK, nLastFile);
+    batch.Write(DB_BLOCK_INDEX_SIZE, nBlockIndexSize);
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
         batch.Write(std::make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
     }
     return WriteBatch(batch, true);
 }
 
+bool CBlockTreeDB::ReadBlockIndexSize(uint64_t &nBlockIndexSize) {
+    return Read(DB_BLOCK_INDEX_SIZE, nBlockIndexSize);
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(std::make_pair(DB_TXINDEX, txid), pos);
 }
@@ -167,6 +211,42 @@ bool CBlockTreeDB::WriteSyncCheckpoint(uint256 hashCheckpoint)
     return Write(std::string("hashSyncCheckpoint"), hashCheckpoint);
 }
 
+bool CBlockTreeDB::ReadSnapshotBase(uint256& hashBlock, uint64_t& nChainTx)
+{
+    std::pair<uint256, uint64_t> base;
+    if (!Read(std::string("snapshotbase"), base))
+        return false;
+    hashBlock = base.first;
+    nChainTx = base.second;
+    return true;
+}
+
+bool CBlockTreeDB::WriteSnapshotBase(const uint256& hashBlock, uint64_t nChainTx)
+{
+    return Write(std::string("snapshotbase"), std::make_pair(hashBlock, nChainTx), true);
+}
+
+bool CBlockTreeDB::EraseSnapshotBase()
+{
+    return Erase(std::string("snapshotbase"), true);
+}
+
+bool CBlockTreeDB::WriteSnapshotLoading(bool fLoading)
+{
+    // Synced both ways: the coins are written to another database, which
+    // must not get ahead of the marker
+    if (fLoading)
+        return Write(std::string("snapshotloading"), '1', true);
+    else
+        return Erase(std::string("snapshotloading"), true);
+}
+
+bool CBlockTreeDB::ReadSnapshotLoading(bool& fLoading)
+{
+    fLoading = Exists(std::string("snapshotloading"));
+    return true;
+}
+
 bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
@@ -174,16 +254,18 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+/** Address index entries are keyed by a salted hash of the address id */
+static uint64_t AddrIndexLookupId(const uint256 &salt, const uint160 &addrid) {
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << salt;
+    ss << addrid;
+    return UintToArith256(ss.GetHash()).GetLow64();
+}
+
 bool CBlockTreeDB::ReadAddrIndex(uint160 addrid, std::vector<CExtDiskTxPos> &list) {
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
-    uint64_t lookupid;
-    {
-        CHashWriter ss(SER_GETHASH, 0);
-        ss << salt;
-        ss << addrid;
-        lookupid = UintToArith256(ss.GetHash()).GetLow64();
-    }
+    uint64_t lookupid = AddrIndexLookupId(salt, addrid);
 
     pcursor->Seek(std::make_pair('a', lookupid));
 
@@ -203,10 +285,30 @@ bool CBlockTreeDB::AddAddrIndex(const std::vector<std::pair<uint160, CExtDiskTxP
     unsigned char foo[0];
     CDBBatch batch(*this);
     for (std::vector<std::pair<uint160, CExtDiskTxPos> >::const_iterator it=list.begin(); it!=list.end(); it++) {
-        CHashWriter ss(SER_GETHASH, 0);
-        ss << salt;
-        ss << it->first;
-        batch.Write(std::make_pair(std::make_pair('a', UintToArith256(ss.GetHash()).GetLow64()), it->second), FLATDATA(foo));
+        batch.Write(std::make_pair(std::make_pair('a', AddrIndexLookupId(salt, it->first)), it->second), FLATDATA(foo));
+    }
+    return WriteBatch(batch, true);
+}
+
+bool CBlockTreeDB::WriteBlockFileRewrite(int nFile, const CBlockFileInfo &fileinfo, const std::vector<const CBlockIndex*> &blockinfo,
+                                         const std::vector<std::pair<uint256, CDiskTxPos> > &vTxIndex,
+                                         const std::vector<std::pair<uint160, CExtDiskTxPos> > &vAddrIndexErase,
+                                         const std::vector<std::pair<uint160, CExtDiskTxPos> > &vAddrIndexAdd) {
+    unsigned char foo[0];
+    CDBBatch batch(*this);
+    batch.Write(std::make_pair(DB_BLOCK_FILES, nFile), fileinfo);
+    for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
+        batch.Write(std::make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
+    }
+    for (std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it=vTxIndex.begin(); it!=vTxIndex.end(); it++) {
+        batch.Write(std::make_pair(DB_TXINDEX, it->first), it->second);
+    }
+    // Erase before adding: an entry whose position did not change is in both lists
+    for (std::vector<std::pair<uint160, CExtDiskTxPos> >::const_iterator it=vAddrIndexErase.begin(); it!=vAddrIndexErase.end(); it++) {
+        batch.Erase(std::make_pair(std::make_pair('a', AddrIndexLookupId(salt, it->first)), it->second));
+    }
+    for (std::vector<std::pair<uint160, CExtDiskTxPos> >::const_iterator it=vAddrIndexAdd.begin(); it!=vAddrIndexAdd.end(); it++) {
+        batch.Write(std::make_pair(std::make_pair('a', AddrIndexLookupId(salt, it->first)), it->second), FLATDATA(foo));
     }
     return WriteBatch(batch, true);
 }
@@ -272,7 +374,7 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
     return true;
 }
 
-ACPDB::ACPDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "acp", nCacheSize, fMemory, fWipe) { }
+ACPDB::ACPDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBProfile& profile) : CDBWrapper(GetDataDir() / "acp", nCacheSize, fMemory, fWipe, false, profile) { }
 
 bool ACPDB::ReadACP(uint256& hashCheckpoint) {
     const std::string name = "checkpoint";
@@ -293,3 +395,25 @@ bool ACPDB::WriteACPPubKey(const std::string& strPubKey) {
     const std::string name = "checkpointPubkey";
     return Write(std::make_pair(DB_ACP, name), strPubKey);
 }
+
+CBlockFilterDB::CBlockFilterDB(size_t nCacheSize, bool fMemory, bool fWipe, const CDBProfile& profile) : CDBWrapper(GetDataDir() / "blocks" / "filter", nCacheSize, fMemory, fWipe, false, profile) { }
+
+bool CBlockFilterDB::WriteFilter(const BlockFilter& filter, const uint256& header) {
+    CDBBatch batch(*this);
+    batch.Write(std::make_pair(DB_BLOCK_FILTER, filter.GetBlockHash()), filter);
+    batch.Write(std::make_pair(DB_BLOCK_FILTER_HEADER, filter.GetBlockHash()), std::make_pair(filter.GetHash(), header));
+    return WriteBatch(batch);
+}
+
+bool CBlockFilterDB::ReadFilter(const uint256& hashBlock, BlockFilter& filter) {
+    return Read(std::make_pair(DB_BLOCK_FILTER, hashBlock), filter);
+}
+
+bool CBlockFilterDB::ReadFilterHeader(const uint256& hashBlock, uint256& hashFilter, uint256& header) {
+    std::pair<uint256, uint256> value;
+    if (!Read(std::make_pair(DB_BLOCK_FILTER_HEADER, hashBlock), value))
+        return false;
+    hashFilter = value.first;
+    header = value.second;
+    return true;
+}
@@ -17,6 +17,7 @@
 
 #include <boost/function.hpp>
 
+class BlockFilter;
 class CBlockIndex;
 class CCoinsViewDBCursor;
 class uint256;
@@ -42,6 +43,23 @@ static const int64_t nMaxBlockDBCache = 2;
 static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! -dbmaxopenfiles default: 0 derives the LevelDB open file budget from the file descriptor limit
+static const int DEFAULT_DB_MAX_OPEN_FILES = 0;
+//! Open files budget per database that is always available (reserved at startup on top of MIN_CORE_FILEDESCRIPTORS)
+static const int DB_MIN_OPEN_FILES = 64;
+//! Number of databases that get an open files budget: acp, block index, block filter index and chainstate
+static const int DB_COUNT = 4;
+//! Total open files requested for all databases when auto-tuning
+static const int DB_AUTO_OPEN_FILES = 2000;
+//! -dbcompactpause default (milliseconds slept between slices of a manual compaction)
+static const int64_t DEFAULT_DB_COMPACT_PAUSE = 100;
+
+/** Chainstate: random point lookups of small, already compact values. Gets
+ * the largest share of open files and no compression. */
+CDBProfile ChainstateDBProfile(int nMaxOpenFiles);
+/** Block index (including -txindex/-addrindex) and acp databases: larger,
+ * compressible records read in bulk at startup. */
+CDBProfile IndexDBProfile(int nMaxOpenFiles);
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -67,6 +85,10 @@ struct CDiskTxPos : public CDiskBlockPos
         nTxOffset = 0;
     }
 
+    friend bool operator==(const CDiskTxPos &a, const CDiskTxPos &b) {
+        return (a.nFile == b.nFile && a.nPos == b.nPos && a.nTxOffset == b.nTxOffset);
+    }
+
     friend bool operator<(const CDiskTxPos &a, const CDiskTxPos &b) {
         return (a.nFile < b.nFile || (
                (a.nFile == b.nFile) && (a.nPos < b.nPos || (
@@ -80,13 +102,25 @@ class CCoinsViewDB : public CCoinsView
 protected:
     CDBWrapper db;
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBProfile& profile = CDBProfile());
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! Like BatchWrite, but leaves mapCoins alone so others can keep reading it
+    bool WriteCoins(const CCoinsMap &mapCoins, const uint256 &hashBlock);
     CCoinsViewCursor *Cursor() const;
+
+    //! Take a snapshot of the database, for consistent reads while it keeps being written
+    CDBSnapshot *Snapshot() const { return new CDBSnapshot(db); }
+    //! Iterate over the coins in snapshot, starting at the first txid not below hashStart
+    CCoinsViewCursor *Cursor(const CDBSnapshot &snapshot, const uint256 &hashStart) const;
+
+    //! Approximate on-disk size of the coin database
+    size_t EstimateSize() const { return db.EstimateSize(); }
+    //! See CDBWrapper::Compact
+    bool Compact(int64_t nPauseMs, const std::function<bool()>& fnInterrupt) { return db.Compact(nPauseMs, fnInterrupt); }
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -115,13 +149,15 @@ private:
 class CBlockTreeDB : public CDBWrapper
 {
 public:
-    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBProfile& profile = CDBProfile());
 private:
     uint256 salt;
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
 public:
-    bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
+    bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo, uint64_t nBlockIndexSize);
+    //! Number of block index entries as of the last WriteBatchSync, to size the in-memory index before loading it
+    bool ReadBlockIndexSize(uint64_t &nBlockIndexSize);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
@@ -133,6 +169,11 @@ public:
 
     bool ReadAddrIndex(uint160 addrid, std::vector<CExtDiskTxPos> &list);
     bool AddAddrIndex(const std::vector<std::pair<uint160, CExtDiskTxPos> > &list);
+    /** Move the block, transaction and address index entries of a rewritten block file, in one synced batch */
+    bool WriteBlockFileRewrite(int nFile, const CBlockFileInfo &fileinfo, const std::vector<const CBlockIndex*> &blockinfo,
+                               const std::vector<std::pair<uint256, CDiskTxPos> > &vTxIndex,
+                               const std::vector<std::pair<uint160, CExtDiskTxPos> > &vAddrIndexErase,
+                               const std::vector<std::pair<uint160, CExtDiskTxPos> > &vAddrIndexAdd);
 
     bool ReadACP(uint256& hashCheckpoint);
     bool WriteACP(uint256 hashCheckpoint);
@@ -143,6 +184,14 @@ public:
     bool ReadSyncCheckpoint(uint256& hashCheckpoint);
     bool WriteSyncCheckpoint(uint256 hashCheckpoint);
 
+    /** The block a UTXO snapshot was loaded at, and its nChainTx, which the block index cannot work out */
+    bool ReadSnapshotBase(uint256& hashBlock, uint64_t& nChainTx);
+    bool WriteSnapshotBase(const uint256& hashBlock, uint64_t nChainTx);
+    bool EraseSnapshotBase();
+    /** Set while a snapshot's coins are written; a chainstate left with it set is incomplete */
+    bool WriteSnapshotLoading(bool fLoading);
+    bool ReadSnapshotLoading(bool& fLoading);
+
     bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
 };
 
@@ -189,7 +238,7 @@ struct CExtDiskTxPos : public CDiskTxPos
 class ACPDB : public CDBWrapper
 {
 public:
-    ACPDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ACPDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBProfile& profile = CDBProfile());
 private:
     ACPDB(const ACPDB&);
     void operator=(const ACPDB&);
@@ -200,4 +249,19 @@ public:
     bool WriteACPPubKey(const std::string& strPubKey);
 };
 
+/** Access to the compact block filter index (blocks/filter/), keyed by block hash */
+class CBlockFilterDB : public CDBWrapper
+{
+public:
+    CBlockFilterDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CDBProfile& profile = CDBProfile());
+private:
+    CBlockFilterDB(const CBlockFilterDB&);
+    void operator=(const CBlockFilterDB&);
+public:
+    //! Store a filter together with its hash and its header
+    bool WriteFilter(const BlockFilter& filter, const uint256& header);
+    bool ReadFilter(const uint256& hashBlock, BlockFilter& filter);
+    bool ReadFilterHeader(const uint256& hashBlock, uint256& hashFilter, uint256& header);
+};
+
 #endif // BITCOIN_TXDB_H
@@ -613,6 +613,17 @@ bool RenameOver(boost::filesystem::path src, boost::filesystem::path dest)
 #endif /* WIN32 */
 }
 
+void DirectoryCommit(const boost::filesystem::path& dirname)
+{
+#ifndef WIN32
+    FILE* file = fopen(dirname.string().c_str(), "r");
+    if (file) {
+        fsync(fileno(file));
+        fclose(file);
+    }
+#endif
+}
+
 /**
  * Ignores exceptions thrown by Boost's create_directory if the requested directory exists.
  * Specifically handles case where path p exists, but it wasn't possible for the user to
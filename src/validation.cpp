@@ -8,12 +8,17 @@
 #include "acp.h"
 #include "arith_uint256.h"
 #include "base58.h"
+#include "blockfile.h"
+#include "blockfilter.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "compressor.h"
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
+#include "epochcache.h"
 #include "hash.h"
 #include "init.h"
 #include "policy/fees.h"
@@ -25,6 +30,7 @@
 #include "script/script.h"
 #include "script/sigcache.h"
 #include "script/standard.h"
+#include "snapshot.h"
 #include "timedata.h"
 #include "tinyformat.h"
 #include "txdb.h"
@@ -59,6 +65,8 @@
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
+/** Owns the entries of mapBlockIndex */
+static CBlockIndexArena blockIndexArena;
 CChain chainActive;
 CBlockIndex *pindexBestKnownBlock = NULL;
 CBlockIndex *pindexBestHeader = NULL;
@@ -69,12 +77,17 @@ std::atomic_bool fImporting(false);
 bool fReindex = false;
 bool fTxIndex = false;
 bool fAddrIndex = false;
+bool fBlockFilterIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
 bool fRequireStandard = true;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = DEFAULT_CHECKPOINTS_ENABLED;
+bool fCheckBlockReadPoW = DEFAULT_CHECKBLOCKREADPOW;
+bool fCompressBlocks = DEFAULT_BLOCK_COMPRESSION;
+std::atomic<uint64_t> nBlockReadHashChecks(0);
+std::atomic<uint64_t> nBlockReadPoWChecks(0);
 size_t nCoinCacheUsage = 5000 * 300;
 uint64_t nPruneTarget = 0;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
@@ -86,6 +99,7 @@ CAmount maxTxFee = DEFAULT_TRANSACTION_MAXFEE;
 CTxMemPool mempool(::minRelayTxFee);
 
 static void CheckBlockIndex(const Consensus::Params& consensusParams);
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consensus::Params& chainparams);
 
 /** Constant stuff for coinbase transactions we create: */
 CScript COINBASE_FLAGS;
@@ -132,6 +146,10 @@ namespace {
     CCriticalSection cs_LastBlockFile;
     std::vector<CBlockFileInfo> vinfoBlockFile;
     int nLastBlockFile = 0;
+    /** Block and undo files open for reading; the ones before nLastBlockFile are mapped */
+    CBlockFileCache blockFileCache;
+    /** Highest block whose data PrefetchBlocks has asked the OS to read in */
+    const CBlockIndex* pindexPrefetched = NULL;
     /** Global flag to indicate we should check to see if there are
      *  block/undo files that should be deleted.  Set on startup
      *  or if we allocate more file space when we're in prune mode
@@ -155,6 +173,9 @@ namespace {
 
     /** Dirty block file entries. */
     std::set<int> setDirtyFileInfo;
+
+    /** Bytes appended to the blk and rev files since they were last committed. */
+    uint64_t nDirtyBlockFileSize = 0;
 } // anon namespace
 
 /* Use this class to start tracking transactions that are removed from the
@@ -209,8 +230,11 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewDB *pcoinsdbview = NULL;
+CBlockIndex *pindexSnapshot = NULL;
 CBlockTreeDB *pblocktree = NULL;
 ACPDB *acpdb = NULL;
+CBlockFilterDB *pblockfilterdb = NULL;
 
 enum FlushStateMode {
     FLUSH_STATE_NONE,
@@ -952,21 +976,27 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, txdata)) {
+        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false, txdata)) {
             // SCRIPT_VERIFY_CLEANSTACK requires SCRIPT_VERIFY_WITNESS, so we
             // need to turn both off, and compare against just turning off CLEANSTACK
             // to see if the failure is specifically due to witness validation.
             CValidationState stateDummy; // Want reported failures to be from first CheckInputs
-            if (!tx.HasWitness() && CheckInputs(tx, stateDummy, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, txdata) &&
-                !CheckInputs(tx, stateDummy, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, txdata)) {
+            if (!tx.HasWitness() && CheckInputs(tx, stateDummy, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, false, txdata) &&
+                !CheckInputs(tx, stateDummy, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, false, txdata)) {
                 // Only the witness is missing, so the transaction itself may be fine.
                 state.SetCorruptionPossible();
             }
             return false; // state filled in by CheckInputs
         }
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
+        // Check again against the current block tip's script verification
+        // flags to cache our script execution flags. This is, of course,
+        // useless if the next block has different script flags from the
+        // previous one, but because the cache tracks script flags for us it
+        // will auto-invalidate and we'll just have a few blocks of extra
+        // misses on soft-fork activation.
+        //
+        // This is also useful in case of bugs in the standard flags that cause
         // transactions to pass as valid when they're actually invalid. For
         // instance the STRICTENC flag was incorrectly allowing certain
         // CHECKSIG NOT scripts to pass, even though they were invalid.
@@ -974,10 +1004,21 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
+        unsigned int currentBlockScriptVerifyFlags = GetBlockScriptFlags(chainActive.Tip(), Params().GetConsensus());
+        if (!CheckInputs(tx, state, view, true, currentBlockScriptVerifyFlags, true, true, txdata))
         {
-            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
-                __func__, hash.ToString(), FormatStateMessage(state));
+            // If we're using promiscuousmempoolflags, we may hit this normally.
+            // Check if the current block has some flags that scriptVerifyFlags
+            // does not before printing an ominous warning.
+            if (!(~scriptVerifyFlags & currentBlockScriptVerifyFlags)) {
+                return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against latest-block but not STANDARD flags %s, %s",
+                    __func__, hash.ToString(), FormatStateMessage(state));
+            }
+            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, false, txdata)) {
+                return error("%s: ConnectInputs failed against MANDATORY but not STANDARD flags due to promiscuous mempool %s, %s",
+                    __func__, hash.ToString(), FormatStateMessage(state));
+            }
+            LogPrintf("Warning: -promiscuousmempoolflags set to not include currently enforced soft forks, this may break mining or otherwise cause instability!\n");
         }
 
         // Remove conflicting transactions from the mempool
@@ -1038,16 +1079,47 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), plTxnReplaced, fOverrideMempoolLimit, nAbsurdFee);
 }
 
-bool ReadTransaction(CTransactionRef tx, const CDiskTxPos &pos, uint256 &hashBlock) {
-    CAutoFile file(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    CBlockHeader header;
+/** Open a block or undo file for reading through the cache of open files */
+static std::shared_ptr<const CBlockFile> OpenDiskFileForRead(const CDiskBlockPos &pos, const char *prefix)
+{
+    if (pos.IsNull())
+        return std::shared_ptr<const CBlockFile>();
+    bool fFinalized;
+    {
+        LOCK(cs_LastBlockFile);
+        fFinalized = (int)pos.nFile < nLastBlockFile;
+    }
+    return blockFileCache.Get(prefix, pos.nFile, GetBlockPosFilename(pos, prefix), fFinalized);
+}
+
+/** Read the transaction at pos, and the header of the block it is in */
+static bool ReadTxFromDisk(const CDiskTxPos &pos, CBlockHeader &header, CTransactionRef &tx)
+{
+    if (pos.nPos < 4)
+        return error("%s: invalid position %s", __func__, pos.ToString());
+    // Start at the size field of the block record, which tells how the block is stored
+    CBlockFileReader file(OpenDiskFileForRead(pos, "blk"), pos.nPos - 4, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return error("%s: OpenBlockFile failed", __func__);
     try {
+        unsigned int nSize;
+        file >> nSize;
         file >> header;
-        fseek(file.Get(), pos.nTxOffset, SEEK_CUR);
-        file >> tx;
-    } catch (std::exception &e) {
-        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+        file.ignore(pos.nTxOffset);
+        if (nSize & BLOCK_RECORD_COMPRESSED)
+            file >> REF(CTxCompressor(tx));
+        else
+            file >> tx;
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
     }
+    return true;
+}
+
+bool ReadTransaction(CTransactionRef &tx, const CDiskTxPos &pos, uint256 &hashBlock) {
+    CBlockHeader header;
+    if (!ReadTxFromDisk(pos, header, tx))
+        return false;
     hashBlock = header.GetHash();
     return true;
 }
@@ -1092,17 +1164,9 @@ bool GetTransaction(const uint256 &hash, CTransactionRef &txOut, const Consensus
     if (fTxIndex) {
         CDiskTxPos postx;
         if (pblocktree->ReadTxIndex(hash, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-            if (file.IsNull())
-                return error("%s: OpenBlockFile failed", __func__);
             CBlockHeader header;
-            try {
-                file >> header;
-                fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                file >> txOut;
-            } catch (const std::exception& e) {
-                return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-            }
+            if (!ReadTxFromDisk(postx, header, txOut))
+                return false;
             hashBlock = header.GetHash();
             if (txOut->GetHash() != hash)
                 return error("%s: txid mismatch", __func__);
@@ -1148,58 +1212,133 @@ bool GetTransaction(const uint256 &hash, CTransactionRef &txOut, const Consensus
 // CBlock and CBlockIndex
 //
 
-bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+/** Size of a block as stored in a block file record */
+static unsigned int GetBlockRecordSize(const CBlock& block, bool fCompress)
 {
-    // Open history file to append
-    CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
-    if (fileout.IsNull())
-        return error("WriteBlockToDisk: OpenBlockFile failed");
+    if (fCompress)
+        return ::GetSerializeSize(CBlockCompressor(REF(block)), SER_DISK, CLIENT_VERSION);
+    return ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+}
 
+/**
+ * Append a block record (message start, size, block) to fileout, storing the
+ * block with CBlockCompressor if fCompress. nPos is set to where the block starts.
+ */
+static bool WriteBlockRecord(CAutoFile& fileout, const CBlock& block, unsigned int& nPos, const CMessageHeader::MessageStartChars& messageStart, bool fCompress)
+{
     // Write index header
-    unsigned int nSize = GetSerializeSize(fileout, block);
+    unsigned int nSize = GetBlockRecordSize(block, fCompress);
+    if (fCompress)
+        nSize |= BLOCK_RECORD_COMPRESSED;
     fileout << FLATDATA(messageStart) << nSize;
 
     // Write block
     long fileOutPos = ftell(fileout.Get());
     if (fileOutPos < 0)
         return error("WriteBlockToDisk: ftell failed");
-    pos.nPos = (unsigned int)fileOutPos;
-    fileout << block;
+    nPos = (unsigned int)fileOutPos;
+    if (fCompress)
+        fileout << CBlockCompressor(REF(block));
+    else
+        fileout << block;
 
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart, bool fCompress)
+{
+    // Open history file to append
+    CAutoFile fileout(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("WriteBlockToDisk: OpenBlockFile failed");
+
+    return WriteBlockRecord(fileout, block, pos.nPos, messageStart, fCompress);
+}
+
+/** Read the size field of the block file record holding the block at pos */
+static bool ReadBlockRecordSize(const CDiskBlockPos& pos, unsigned int& nSize)
+{
+    std::shared_ptr<const CBlockFile> file = OpenDiskFileForRead(pos, "blk");
+    unsigned char buf[4];
+    if (!file || pos.nPos < sizeof(buf) || file->Read(pos.nPos - sizeof(buf), buf, sizeof(buf)) != sizeof(buf))
+        return false;
+    nSize = ReadLE32(buf);
+    return true;
+}
+
+/** Read the block stored at nPos in file, in either record format; throws on failure */
+static void ReadBlockRecord(const std::shared_ptr<const CBlockFile>& file, unsigned int nPos, CBlock& block)
+{
+    if (nPos < 4)
+        throw std::ios_base::failure("invalid block position");
+    CBlockFileReader filein(file, nPos - 4, SER_DISK, CLIENT_VERSION);
+    unsigned int nSize;
+    filein >> nSize;
+    if (nSize & BLOCK_RECORD_COMPRESSED) {
+        CBlockCompressor compressor(block);
+        filein >> compressor;
+    } else {
+        filein >> block;
+    }
+}
+
+static bool ReadBlockFromDiskUnchecked(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
     // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
+    std::shared_ptr<const CBlockFile> file = OpenDiskFileForRead(pos, "blk");
+    if (!file)
         return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
 
     // Read block
     try {
-        filein >> block;
+        ReadBlockRecord(file, pos.nPos, block);
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
     }
 
-    // Check the header
+    return true;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+{
+    if (!ReadBlockFromDiskUnchecked(block, pos))
+        return false;
+
+    // Without an index entry to compare against, the header has to carry its own proof of work
     if (!CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
         return error("ReadBlockFromDisk: Errors in block header at %s", pos.ToString());
+    nBlockReadPoWChecks++;
 
     return true;
 }
 
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), consensusParams))
+    return ReadBlockFromDisk(block, pindex->GetBlockPos(), pindex->GetBlockHash(), consensusParams);
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const uint256& hashBlock, const Consensus::Params& consensusParams)
+{
+    if (!ReadBlockFromDiskUnchecked(block, pos))
         return false;
-    if (block.GetHash() != pindex->GetBlockHash())
+
+    // The proof of work of the block was verified when its header was accepted, and the
+    // block hash commits to the whole header, so a matching SHA-256 hash is enough to
+    // catch a corrupt or misplaced block without recomputing scrypt on every read.
+    if (block.GetHash() != hashBlock)
         return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
-                pindex->ToString(), pindex->GetBlockPos().ToString());
+                hashBlock.ToString(), pos.ToString());
+    nBlockReadHashChecks++;
+
+    if (fCheckBlockReadPoW) {
+        if (!CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
+            return error("ReadBlockFromDisk: Errors in block header at %s", pos.ToString());
+        nBlockReadPoWChecks++;
+    }
+
     return true;
 }
 
@@ -1454,7 +1593,24 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
 }
 }// namespace Consensus
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
+static EpochCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
+static uint256 scriptExecutionCacheNonce(GetRandHash());
+
+void InitScriptExecutionCache() {
+    // nMaxCacheSize is unsigned. If -maxsigcachesize is set to zero,
+    // setup_bytes creates the minimum possible cache (2 elements).
+    size_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) / 2), MAX_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
+    size_t nElems = scriptExecutionCache.setup_bytes(nMaxCacheSize);
+    LogPrintf("Using %zu MiB out of %zu/2 requested for script execution cache, able to store %zu elements\n",
+            scriptExecutionCache.get_stats().bytes >>20, (nMaxCacheSize*2)>>20, nElems);
+}
+
+EpochCache::stats GetScriptExecutionCacheStats()
+{
+    return scriptExecutionCache.get_stats();
+}
+
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
     {
@@ -1474,13 +1630,27 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // Of course, if an assumed valid block is invalid due to false scriptSigs
         // this optimization would allow an invalid chain to be accepted.
         if (fScriptChecks) {
+            // First check if script executions have been cached with the same
+            // flags. Note that this assumes that the inputs provided are
+            // correct (ie that the transaction hash which is in tx's prevouts
+            // properly commits to the scriptPubKey in the inputs view of that
+            // transaction).
+            uint256 hashCacheEntry;
+            // We only use the first 19 bytes of nonce to avoid a second SHA
+            // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
+            static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
+            CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+            if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
+                return true;
+            }
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
                 assert(coins);
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
+                CScriptCheck check(*coins, tx, i, flags, cacheSigStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1493,7 +1663,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
                         CScriptCheck check2(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheSigStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -1507,6 +1677,12 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                     return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            if (cacheFullScriptStore && !pvChecks) {
+                // We executed all of the provided scripts, and were told to
+                // cache the result. Do so now.
+                scriptExecutionCache.insert(hashCacheEntry);
+            }
         }
     }
 
@@ -1517,27 +1693,25 @@ namespace {
 
 bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint256& hashBlock, const CMessageHeader::MessageStartChars& messageStart)
 {
+    // Serialize the whole record once, so it can be hashed and written in one go
+    CDataStream ssUndo(SER_DISK, CLIENT_VERSION);
+    ssUndo << FLATDATA(messageStart) << (unsigned int)0 << blockundo;
+    const unsigned int nHeaderSize = sizeof(CMessageHeader::MessageStartChars) + sizeof(unsigned int);
+    const unsigned int nSize = ssUndo.size() - nHeaderSize;
+    WriteLE32((unsigned char*)&ssUndo[sizeof(CMessageHeader::MessageStartChars)], nSize);
+
+    // calculate & append checksum
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    hasher << hashBlock;
+    hasher.write(&ssUndo[nHeaderSize], nSize);
+    ssUndo << hasher.GetHash();
+
     // Open history file to append
     CAutoFile fileout(OpenUndoFile(pos), SER_DISK, CLIENT_VERSION);
     if (fileout.IsNull())
         return error("%s: OpenUndoFile failed", __func__);
-
-    // Write index header
-    unsigned int nSize = GetSerializeSize(fileout, blockundo);
-    fileout << FLATDATA(messageStart) << nSize;
-
-    // Write undo data
-    long fileOutPos = ftell(fileout.Get());
-    if (fileOutPos < 0)
-        return error("%s: ftell failed", __func__);
-    pos.nPos = (unsigned int)fileOutPos;
-    fileout << blockundo;
-
-    // calculate & write checksum
-    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
-    hasher << hashBlock;
-    hasher << blockundo;
-    fileout << hasher.GetHash();
+    fileout.write(ssUndo.data(), ssUndo.size());
+    pos.nPos += nHeaderSize;
 
     return true;
 }
@@ -1545,7 +1719,7 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
     // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+    CBlockFileReader filein(OpenDiskFileForRead(pos, "rev"), pos.nPos, SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
         return error("%s: OpenUndoFile failed", __func__);
 
@@ -1690,7 +1864,8 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
     return fClean;
 }
 
-void static FlushBlockFile(bool fFinalize = false)
+/** Trim the preallocated space off the files of the block file being left; they are committed with the next flush */
+void static FinalizeBlockFile()
 {
     LOCK(cs_LastBlockFile);
 
@@ -1698,21 +1873,34 @@ void static FlushBlockFile(bool fFinalize = false)
 
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
-        FileCommit(fileOld);
+        TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
         fclose(fileOld);
     }
 
     fileOld = OpenUndoFile(posOld);
     if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nUndoSize);
-        FileCommit(fileOld);
+        TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nUndoSize);
         fclose(fileOld);
     }
 }
 
+/** Make sure the blk and rev data of file nFile is on disk */
+void static CommitBlockFile(int nFile, bool fBlocks, bool fUndo)
+{
+    CDiskBlockPos pos(nFile, 0);
+    FILE *file = fBlocks ? OpenBlockFile(pos) : NULL;
+    if (file) {
+        FileCommit(file);
+        fclose(file);
+    }
+
+    file = fUndo ? OpenUndoFile(pos) : NULL;
+    if (file) {
+        FileCommit(file);
+        fclose(file);
+    }
+}
+
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
@@ -1802,6 +1990,50 @@ void static BuildAddrIndex(const CScript &script, const CExtDiskTxPos &pos, std:
     }
 }
 
+/** Build the basic filter of a connected block and store it, its header chained to the previous block's */
+static bool WriteBlockFilter(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex)
+{
+    if (!pblockfilterdb)
+        return false;
+    uint256 hashPrevFilter, prevHeader;
+    if (pindex->pprev && !pblockfilterdb->ReadFilterHeader(pindex->pprev->GetBlockHash(), hashPrevFilter, prevHeader))
+        return error("%s: no filter header for block %s", __func__, pindex->pprev->GetBlockHash().ToString());
+    BlockFilter filter(BlockFilterType::BASIC, block, blockundo);
+    return pblockfilterdb->WriteFilter(filter, filter.ComputeHeader(prevHeader));
+}
+
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consensus::Params& consensusparams) {
+    AssertLockHeld(cs_main);
+
+    // BIP16 didn't become active until Oct 1 2012
+    int64_t nBIP16SwitchTime = 1349049600;
+    bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
+
+    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
+
+    // Start enforcing the DERSIG (BIP66) rule
+    if (pindex->nHeight >= consensusparams.BIP66Height) {
+        flags |= SCRIPT_VERIFY_DERSIG;
+    }
+
+    // Start enforcing CHECKLOCKTIMEVERIFY (BIP65) rule
+    if (pindex->nHeight >= consensusparams.BIP65Height) {
+        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    }
+
+    // Start enforcing BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    if (VersionBitsState(pindex->pprev, consensusparams, Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
+        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+    }
+
+    // Start enforcing WITNESS rules using versionbits logic.
+    if (IsWitnessEnabled(pindex->pprev, consensusparams)) {
+        flags |= SCRIPT_VERIFY_WITNESS;
+        flags |= SCRIPT_VERIFY_NULLDUMMY;
+    }
+
+    return flags;
+}
 
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
                   CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
@@ -1821,8 +2053,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Special case for the genesis block, skipping connection of its transactions
     // (its coinbase is unspendable)
     if (block.GetHash() == chainparams.GetConsensus().hashGenesisBlock) {
-        if (!fJustCheck)
+        if (!fJustCheck) {
+            if (fBlockFilterIndex && !WriteBlockFilter(block, CBlockUndo(), pindex))
+                return AbortNode(state, "Failed to write block filter index");
             view.SetBestBlock(pindex->GetBlockHash());
+        }
         return true;
     }
 
@@ -1866,34 +2101,14 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    // BIP16 didn't become active until Oct 1 2012
-    int64_t nBIP16SwitchTime = 1349049600;
-    bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
-
-    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
-
-    // Start enforcing the DERSIG (BIP66) rule
-    if (pindex->nHeight >= chainparams.GetConsensus().BIP66Height) {
-        flags |= SCRIPT_VERIFY_DERSIG;
-    }
-
-    // Start enforcing CHECKLOCKTIMEVERIFY (BIP65) rule
-    if (pindex->nHeight >= chainparams.GetConsensus().BIP65Height) {
-        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-    }
-
-    // Start enforcing BIP68 (sequence locks) and BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    // Start enforcing BIP68 (sequence locks) using versionbits logic.
     int nLockTimeFlags = 0;
     if (VersionBitsState(pindex->pprev, chainparams.GetConsensus(), Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
-        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
         nLockTimeFlags |= LOCKTIME_VERIFY_SEQUENCE;
     }
 
-    // Start enforcing WITNESS rules using versionbits logic.
-    if (IsWitnessEnabled(pindex->pprev, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_WITNESS;
-        flags |= SCRIPT_VERIFY_NULLDUMMY;
-    }
+    // Get the script flags for this block
+    unsigned int flags = GetBlockScriptFlags(pindex, chainparams.GetConsensus());
 
     int64_t nTime2 = GetTimeMicros(); nTimeForks += nTime2 - nTime1;
     LogPrint("bench", "    - Fork checks: %.2fms [%.2fs]\n", 0.001 * (nTime2 - nTime1), nTimeForks * 0.000001);
@@ -1960,7 +2175,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, fCacheResults, txdata[i], nScriptCheckThreads ? &vChecks : NULL))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
             control.Add(vChecks);
@@ -1986,7 +2201,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
         UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
 
-        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        // Offsets are into the block as stored, so that a transaction can be read on its own
+        if (pindex->nStatus & BLOCK_COMPRESSED)
+            pos.nTxOffset += ::GetSerializeSize(CTxCompressor(REF(block.vtx[i])), SER_DISK, CLIENT_VERSION);
+        else
+            pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
     int64_t nTime3 = GetTimeMicros(); nTimeConnect += nTime3 - nTime2;
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime3 - nTime2), 0.001 * (nTime3 - nTime2) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime3 - nTime2) / (nInputs-1), nTimeConnect * 0.000001);
@@ -2031,6 +2250,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (fAddrIndex)
         if (!pblocktree->AddAddrIndex(vPosAddrid))
             return AbortNode(state, "Failed to write address index");
+    if (fBlockFilterIndex && !WriteBlockFilter(block, blockundo, pindex))
+        return AbortNode(state, "Failed to write block filter index");
 
 
     // add this block to the view's block chain
@@ -2051,6 +2272,144 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     return true;
 }
 
+namespace {
+
+/** Block file commits, block index updates and, on a full flush, coins that go to disk together */
+struct CFlushBatch {
+    std::vector<std::pair<int, CBlockFileInfo> > vFiles;
+    int nLastFile;
+    std::vector<CBlockIndex> vBlocks; //!< Copies, so the entries can change while the batch is written
+    uint64_t nBlockIndexSize;
+    std::shared_ptr<const CCoinsMap> pcoins; //!< From pcoinsTip->StartWrite, or NULL
+    uint256 hashCoinsBlock;
+
+    CFlushBatch() : nLastFile(0), nBlockIndexSize(0) {}
+};
+
+/** Commit the block files, then write the block index entries that refer to them, then sync the filters and write the coins */
+bool WriteFlushBatch(const CFlushBatch& batch)
+{
+    try {
+        BOOST_FOREACH(const PAIRTYPE(int, CBlockFileInfo)& file, batch.vFiles)
+            CommitBlockFile(file.first, file.second.nSize > 0, file.second.nUndoSize > 0);
+
+        std::vector<std::pair<int, const CBlockFileInfo*> > vFiles;
+        vFiles.reserve(batch.vFiles.size());
+        BOOST_FOREACH(const PAIRTYPE(int, CBlockFileInfo)& file, batch.vFiles)
+            vFiles.push_back(std::make_pair(file.first, &file.second));
+        std::vector<const CBlockIndex*> vBlocks;
+        vBlocks.reserve(batch.vBlocks.size());
+        BOOST_FOREACH(const CBlockIndex& index, batch.vBlocks)
+            vBlocks.push_back(&index);
+        if (!pblocktree->WriteBatchSync(vFiles, batch.nLastFile, vBlocks, batch.nBlockIndexSize))
+            return AbortNode("Failed to write to block index database");
+
+        // Filters are written unsynced as blocks connect; the coins must not
+        // get ahead of them, or a crash leaves connected blocks without one
+        if (batch.pcoins && pblockfilterdb && !pblockfilterdb->Sync())
+            return AbortNode("Failed to sync the block filter database");
+        if (batch.pcoins && !pcoinsdbview->WriteCoins(*batch.pcoins, batch.hashCoinsBlock))
+            return AbortNode("Failed to write to coin database");
+    } catch (const std::runtime_error& e) {
+        return AbortNode(std::string("System error while flushing: ") + e.what());
+    }
+    return true;
+}
+
+/**
+ * Writes flush batches on a background thread, so that block connection
+ * goes on while the block files, block index and coins are written. One
+ * batch can wait while another is written; queueing a third waits for the
+ * first to finish, which bounds how far the disk lags behind. Without the
+ * thread, batches are written right away.
+ */
+class CFlushWriter
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::unique_ptr<CFlushBatch> pending;
+    bool fWriting;
+    bool fRunning;
+    bool fFailed;
+
+public:
+    CFlushWriter() : fWriting(false), fRunning(false), fFailed(false) {}
+
+    /** Queue a batch for writing; false if a write has failed */
+    bool Submit(std::unique_ptr<CFlushBatch> batch)
+    {
+        // Callers hold cs_main and have taken the dirty entries; they must not be lost
+        boost::this_thread::disable_interruption di;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (fRunning && pending)
+                cond.wait(lock);
+            if (fRunning) {
+                pending = std::move(batch);
+                cond.notify_all();
+                return !fFailed;
+            }
+        }
+        return WriteFlushBatch(*batch);
+    }
+
+    /** Whether every batch queued so far is on disk */
+    bool IsIdle()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return !pending && !fWriting;
+    }
+
+    /** Wait until every batch queued so far is on disk; false if a write has failed */
+    bool Wait()
+    {
+        boost::this_thread::disable_interruption di;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (fRunning && (pending || fWriting))
+            cond.wait(lock);
+        return !fFailed;
+    }
+
+    void Thread()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fRunning = true;
+        try {
+            while (true) {
+                while (!pending)
+                    cond.wait(lock);
+                std::unique_ptr<CFlushBatch> batch = std::move(pending);
+                fWriting = true;
+                cond.notify_all();
+                lock.unlock();
+                bool fOk = WriteFlushBatch(*batch);
+                // Let go of the coins before reporting that the write is done
+                batch.reset();
+                lock.lock();
+                fWriting = false;
+                if (!fOk)
+                    fFailed = true;
+                cond.notify_all();
+            }
+        } catch (const boost::thread_interrupted&) {
+            // Only ever interrupted while idle; later batches are written by their callers
+            fRunning = false;
+            cond.notify_all();
+            throw;
+        }
+    }
+};
+
+CFlushWriter flushWriter;
+
+} // anon namespace
+
+void ThreadFlushWriter() {
+    RenameThread("bitcoin-flush");
+    flushWriter.Thread();
+}
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed depending on the mode we're called with
@@ -2094,7 +2453,10 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode, int n
         nLastSetChain = nNow;
     }
     int64_t nMempoolSizeMax = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
-    int64_t cacheSize = pcoinsTip->DynamicMemoryUsage() * DB_PEAK_USAGE_FACTOR;
+    // The peak usage factor already leaves room for a write in flight, which
+    // holds the modified entries moved out of the cache; counting it as well
+    // would have the next block wait for it after every full flush.
+    int64_t cacheSize = (pcoinsTip->DynamicMemoryUsage() - pcoinsTip->WritingMemoryUsage()) * DB_PEAK_USAGE_FACTOR;
     int64_t nTotalSpace = nCoinCacheUsage + std::max<int64_t>(nMempoolSizeMax - nMempoolUsage, 0);
     // The cache is large and we're within 10% and 200 MiB or 50% and 50MiB of the limit, but we have time now (not in the middle of a block processing).
     bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize > std::min(std::max(nTotalSpace / 2, nTotalSpace - MIN_BLOCK_COINSDB_USAGE * 1024 * 1024),
@@ -2105,51 +2467,69 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode, int n
     bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
     // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
     bool fPeriodicFlush = mode == FLUSH_STATE_PERIODIC && nNow > nLastFlush + (int64_t)DATABASE_FLUSH_INTERVAL * 1000000;
+    // Enough block and undo data has piled up to commit it, along with the block index, in the background.
+    bool fDirtyWrite = mode == FLUSH_STATE_PERIODIC && nDirtyBlockFileSize > MAX_BLOCKFILE_DIRTY_SIZE;
     // Combine all conditions that result in a full cache flush.
     bool fDoFullFlush = (mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical || fPeriodicFlush || fFlushForPrune;
     // Write blocks and block index to disk.
-    if (fDoFullFlush || fPeriodicWrite) {
+    if (fDoFullFlush || fPeriodicWrite || fDirtyWrite) {
         // Depend on nMinDiskSpace to ensure we can write block index
         if (!CheckDiskSpace(0))
             return state.Error("out of disk space");
-        // First make sure all block and undo data is flushed to disk.
-        FlushBlockFile();
-        // Then update all block file information (which may refer to block and undo files).
-        {
-            std::vector<std::pair<int, const CBlockFileInfo*> > vFiles;
-            vFiles.reserve(setDirtyFileInfo.size());
-            for (std::set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end(); ) {
-                vFiles.push_back(std::make_pair(*it, &vinfoBlockFile[*it]));
-                setDirtyFileInfo.erase(it++);
-            }
-            std::vector<const CBlockIndex*> vBlocks;
-            vBlocks.reserve(setDirtyBlockIndex.size());
-            for (std::set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end(); ) {
-                vBlocks.push_back(*it);
-                setDirtyBlockIndex.erase(it++);
-            }
-            if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks)) {
-                return AbortNode(state, "Failed to write to block index database");
-            }
-        }
-        // Finally remove any pruned files
-        if (fFlushForPrune)
-            UnlinkPrunedFiles(setFilesToPrune);
-        nLastWrite = nNow;
-    }
-    // Flush best chain related state. This can only be done if the blocks / block index write was also done.
-    if (fDoFullFlush) {
         // Typical CCoins structures on disk are around 128 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (fDoFullFlush && !CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
-        // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
-            return AbortNode(state, "Failed to write to coin database");
-        nLastFlush = nNow;
+        // Commit the block and undo data, then the block file information and
+        // block index entries that refer to it, in the background.
+        std::unique_ptr<CFlushBatch> batch(new CFlushBatch());
+        batch->vFiles.reserve(setDirtyFileInfo.size());
+        for (std::set<int>::iterator it = setDirtyFileInfo.begin(); it != setDirtyFileInfo.end(); ) {
+            batch->vFiles.push_back(std::make_pair(*it, vinfoBlockFile[*it]));
+            setDirtyFileInfo.erase(it++);
+        }
+        batch->nLastFile = nLastBlockFile;
+        batch->nBlockIndexSize = mapBlockIndex.size();
+        batch->vBlocks.reserve(setDirtyBlockIndex.size());
+        for (std::set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end(); ) {
+            batch->vBlocks.push_back(**it);
+            setDirtyBlockIndex.erase(it++);
+        }
+        nDirtyBlockFileSize = 0;
+        if (fDoFullFlush) {
+            // Only one write of the coins can be in flight at a time.
+            if (pcoinsTip->IsWriting()) {
+                if (!flushWriter.Wait())
+                    return state.Error("Failed to write to coin database");
+                pcoinsTip->FinishWrite();
+            }
+            // Write the modified coins after the block index entries they
+            // may refer to, and keep the recently used ones cached.
+            batch->hashCoinsBlock = pcoinsTip->GetBestBlock();
+            batch->pcoins = pcoinsTip->StartWrite();
+            pcoinsTip->Trim(nTotalSpace * COINS_CACHE_KEEP_PERCENT / 100 / DB_PEAK_USAGE_FACTOR);
+            nLastFlush = nNow;
+        }
+        if (!flushWriter.Submit(std::move(batch)))
+            return state.Error("Failed to write to block index database");
+        nLastWrite = nNow;
+    }
+    // Pruning needs the block index on disk, and callers that flush always
+    // expect everything to be there when we return.
+    if (fFlushForPrune || mode == FLUSH_STATE_ALWAYS) {
+        if (!flushWriter.Wait())
+            return state.Error("Failed to write to block index database");
+        // Remove any pruned files
+        if (fFlushForPrune)
+            UnlinkPrunedFiles(setFilesToPrune);
+    }
+    // Once the coins are in the database, they are cached as unmodified ones.
+    if (pcoinsTip->IsWriting() && flushWriter.IsIdle()) {
+        pcoinsTip->FinishWrite();
+        pcoinsTip->Trim(nTotalSpace * COINS_CACHE_KEEP_PERCENT / 100 / DB_PEAK_USAGE_FACTOR);
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
         // Update best block in wallet (so we can detect restored wallets).
@@ -2436,6 +2816,37 @@ static void PruneBlockIndexCandidates() {
  * Try to make some progress towards making pindexMostWork the active block.
  * pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
  */
+/**
+ * Ask the OS to start reading the blocks about to be connected (highest first
+ * in vpindex), so that ConnectTip finds them in the page cache. Blocks up to
+ * the last one hinted on the same chain are skipped.
+ */
+static void PrefetchBlocks(const std::vector<CBlockIndex*>& vpindex)
+{
+    AssertLockHeld(cs_main);
+
+    std::vector<CBlockIndex*>::const_reverse_iterator it = vpindex.rbegin();
+    if (pindexPrefetched != NULL) {
+        while (it != vpindex.rend() && (*it)->nHeight <= pindexPrefetched->nHeight && pindexPrefetched->GetAncestor((*it)->nHeight) == *it)
+            ++it;
+    }
+    for (; it != vpindex.rend(); ++it) {
+        const CBlockIndex* pindex = *it;
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            continue;
+        const CDiskBlockPos pos = pindex->GetBlockPos();
+        // Blocks are mostly stored in chain order, so the next block bounds the size of this one
+        size_t nSize = MAX_BLOCK_BASE_SIZE;
+        std::vector<CBlockIndex*>::const_reverse_iterator itNext = it + 1;
+        if (itNext != vpindex.rend() && (*itNext)->nFile == pindex->nFile && (*itNext)->nDataPos > pos.nPos)
+            nSize = std::min<size_t>((*itNext)->nDataPos - pos.nPos, MAX_BLOCK_SERIALIZED_SIZE);
+        std::shared_ptr<const CBlockFile> file = OpenDiskFileForRead(pos, "blk");
+        if (file)
+            file->Prefetch(pos.nPos, nSize);
+        pindexPrefetched = pindex;
+    }
+}
+
 static bool ActivateBestChainStep(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, bool& fInvalidFound, ConnectTrace& connectTrace)
 {
     AssertLockHeld(cs_main);
@@ -2466,6 +2877,7 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
             pindexIter = pindexIter->pprev;
         }
         nHeight = nTargetHeight;
+        PrefetchBlocks(vpindexToConnect);
 
         // Connect new blocks.
         BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
@@ -2730,8 +3142,7 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.New(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -2805,7 +3216,7 @@ bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBl
     return true;
 }
 
-bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAddSize, unsigned int nHeight, uint64_t nTime, bool fKnown = false)
+bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAddSize, unsigned int nHeight, uint64_t nTime, bool fKnown = false, bool fCompressed = false)
 {
     LOCK(cs_LastBlockFile);
 
@@ -2829,10 +3240,17 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
         if (!fKnown) {
             LogPrintf("Leaving block file %i: %s\n", nLastBlockFile, vinfoBlockFile[nLastBlockFile].ToString());
         }
-        FlushBlockFile(!fKnown);
+        if (!fKnown)
+            FinalizeBlockFile();
+        setDirtyFileInfo.insert(nLastBlockFile);
         nLastBlockFile = nFile;
     }
 
+    // A file stays marked compressed only as long as every block added to it is
+    if (vinfoBlockFile[nFile].nBlocks == 0 && fCompressed)
+        vinfoBlockFile[nFile].nFlags |= BLOCKFILE_COMPRESSED;
+    else if (!fCompressed)
+        vinfoBlockFile[nFile].nFlags &= ~BLOCKFILE_COMPRESSED;
     vinfoBlockFile[nFile].AddBlock(nHeight, nTime);
     if (fKnown)
         vinfoBlockFile[nFile].nSize = std::max(pos.nPos + nAddSize, vinfoBlockFile[nFile].nSize);
@@ -2840,6 +3258,7 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
         vinfoBlockFile[nFile].nSize += nAddSize;
 
     if (!fKnown) {
+        nDirtyBlockFileSize += nAddSize;
         unsigned int nOldChunks = (pos.nPos + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         unsigned int nNewChunks = (vinfoBlockFile[nFile].nSize + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         if (nNewChunks > nOldChunks) {
@@ -2871,6 +3290,7 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
     unsigned int nNewSize;
     pos.nPos = vinfoBlockFile[nFile].nUndoSize;
     nNewSize = vinfoBlockFile[nFile].nUndoSize += nAddSize;
+    nDirtyBlockFileSize += nAddSize;
     setDirtyFileInfo.insert(nFile);
 
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
@@ -3152,7 +3572,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, const Co
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fCheckPOW = true)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -3172,7 +3592,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus()))
+        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), fCheckPOW))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         // Get prev block index
@@ -3236,7 +3656,8 @@ static bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidation
     CBlockIndex *pindexDummy = NULL;
     CBlockIndex *&pindex = ppindex ? *ppindex : pindexDummy;
 
-    if (!AcceptBlockHeader(block, state, chainparams, &pindex))
+    // A block that passed CheckBlock already had its proof of work checked
+    if (!AcceptBlockHeader(block, state, chainparams, &pindex, !block.fChecked))
         return false;
 
     // Try to process all requested blocks that we don't have, but only
@@ -3284,15 +3705,29 @@ static bool AcceptBlock(const std::shared_ptr<const CBlock>& pblock, CValidation
 
     // Write block to history file
     try {
-        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        unsigned int nBlockSize;
+        bool fCompressed;
         CDiskBlockPos blockPos;
-        if (dbp != NULL)
+        if (dbp != NULL) {
+            // Already on disk, in whichever format it was written in
             blockPos = *dbp;
-        if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, block.GetBlockTime(), dbp != NULL))
+            if (!ReadBlockRecordSize(blockPos, nBlockSize))
+                return error("AcceptBlock(): can't read block record at %s", blockPos.ToString());
+            fCompressed = (nBlockSize & BLOCK_RECORD_COMPRESSED) != 0;
+            nBlockSize &= ~BLOCK_RECORD_COMPRESSED;
+        } else {
+            fCompressed = fCompressBlocks && CBlockCompressor::IsCompressible(block);
+            nBlockSize = GetBlockRecordSize(block, fCompressed);
+        }
+        if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, block.GetBlockTime(), dbp != NULL, fCompressed))
             return error("AcceptBlock(): FindBlockPos failed");
         if (dbp == NULL)
-            if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart()))
+            if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart(), fCompressed))
                 AbortNode(state, "Failed to write block");
+        if (fCompressed)
+            pindex->nStatus |= BLOCK_COMPRESSED;
+        else
+            pindex->nStatus &= ~BLOCK_COMPRESSED;
         if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
             return error("AcceptBlock(): ReceivedBlockTransactions failed");
     } catch (const std::runtime_error& e) {
@@ -3420,6 +3855,7 @@ void UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
 {
     for (std::set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        blockFileCache.Erase(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -3555,40 +3991,91 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     if (hash.IsNull())
         return NULL;
 
-    // Return existing
-    BlockMap::iterator mi = mapBlockIndex.find(hash);
-    if (mi != mapBlockIndex.end())
-        return (*mi).second;
+    // Return existing, or create new, with a single lookup
+    std::pair<BlockMap::iterator, bool> ret = mapBlockIndex.insert(std::make_pair(hash, (CBlockIndex*)NULL));
+    if (!ret.second)
+        return ret.first->second;
 
-    // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw std::runtime_error(std::string(__func__) + ": new CBlockIndex failed");
-    mi = mapBlockIndex.insert(std::make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
+    CBlockIndex* pindexNew = blockIndexArena.New();
+    ret.first->second = pindexNew;
+    pindexNew->phashBlock = &ret.first->first;
 
     return pindexNew;
 }
 
+/**
+ * Finish or drop a rewrite of block file nFile by CompressBlockFile that was
+ * interrupted. The index entries of all its blocks move in one batch, so the
+ * new file is the current one exactly when every block is found in it.
+ */
+static bool RecoverBlockFileRewrite(int nFile)
+{
+    const boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk");
+    const boost::filesystem::path pathNew = path.string() + ".new";
+    if (!boost::filesystem::exists(pathNew))
+        return true;
+
+    std::shared_ptr<const CBlockFile> file = CBlockFile::Open(pathNew, false);
+    bool fCurrent = (bool)file;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex) {
+        const CBlockIndex* pindex = item.second;
+        if (!fCurrent)
+            break;
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nFile != nFile)
+            continue;
+        CBlock block;
+        try {
+            ReadBlockRecord(file, pindex->nDataPos, block);
+            fCurrent = block.GetHash() == pindex->GetBlockHash();
+        } catch (const std::exception&) {
+            fCurrent = false;
+        }
+    }
+    file.reset();
+
+    if (fCurrent) {
+        LogPrintf("%s: finishing the rewrite of %s\n", __func__, path.string());
+        if (!RenameOver(pathNew, path))
+            return error("%s: failed to replace %s", __func__, path.string());
+    } else {
+        LogPrintf("%s: dropping the unfinished rewrite of %s\n", __func__, path.string());
+        boost::filesystem::remove(pathNew);
+    }
+    return true;
+}
+
 bool static LoadBlockIndexDB(const CChainParams& chainparams)
 {
+    // Size the index up front rather than rehashing it while loading
+    uint64_t nBlockIndexSize = 0;
+    if (pblocktree->ReadBlockIndexSize(nBlockIndexSize))
+        mapBlockIndex.reserve(nBlockIndexSize);
     if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
         return false;
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
-    std::vector<std::pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
+    // A chainstate loaded from a snapshot starts counting transactions at its base
+    uint256 hashSnapshotBase;
+    uint64_t nSnapshotChainTx = 0;
+    if (pblocktree->ReadSnapshotBase(hashSnapshotBase, nSnapshotChainTx))
+        LogPrintf("%s: chainstate was loaded from a snapshot at %s\n", __func__, hashSnapshotBase.ToString());
+
+    // Calculate nChainWork, in height order. Heights are dense, so the
+    // entries are bucketed by height rather than sorted.
+    int nMaxHeight = 0;
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        nMaxHeight = std::max(nMaxHeight, item.second->nHeight);
+    std::vector<size_t> vHeightStart(nMaxHeight + 2, 0);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vHeightStart[item.second->nHeight + 1]++;
+    for (int nHeight = 1; nHeight <= nMaxHeight + 1; nHeight++)
+        vHeightStart[nHeight] += vHeightStart[nHeight - 1];
+    std::vector<CBlockIndex*> vSortedByHeight(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight[vHeightStart[item.second->nHeight]++] = item.second;
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(std::make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
         pindex->nTimeMax = (pindex->pprev ? std::max(pindex->pprev->nTimeMax, pindex->nTime) : pindex->nTime);
         // We can link the chain of blocks for which we've received transactions at some point.
@@ -3597,6 +4084,10 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+                } else if (pindex->GetBlockHash() == hashSnapshotBase) {
+                    // The chain below a snapshot's base was never connected here
+                    pindex->nChainTx = nSnapshotChainTx;
+                    pindexSnapshot = pindex;
                 } else {
                     pindex->nChainTx = 0;
                     mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
@@ -3660,6 +4151,8 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     }
     for (std::set<int>::iterator it = setBlkDataFiles.begin(); it != setBlkDataFiles.end(); it++)
     {
+        if (!RecoverBlockFileRewrite(*it))
+            return false;
         CDiskBlockPos pos(*it, 0);
         if (CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION).IsNull()) {
             return false;
@@ -3682,6 +4175,8 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
 
     pblocktree->ReadFlag("addrindex", fAddrIndex);
     LogPrintf("LoadBlockIndexDB(): address index %s\n", fAddrIndex ? "enabled" : "disabled");
+    pblocktree->ReadFlag("blockfilterindex", fBlockFilterIndex);
+    LogPrintf("LoadBlockIndexDB(): block filter index %s\n", fBlockFilterIndex ? "enabled" : "disabled");
 
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
@@ -3742,9 +4237,9 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
         uiInterface.ShowProgress(_("Verifying blocks..."), percentageDone);
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
-        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
-            // If pruning, only go back as far as we have data.
-            LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
+        if ((fPruneMode || pindexSnapshot) && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // If pruning, or below a snapshot's base, only go back as far as we have data.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (%s, no data)\n", pindex->nHeight, fPruneMode ? "pruning" : "snapshot");
             break;
         }
         CBlock block;
@@ -3807,7 +4302,8 @@ bool RewindBlockIndex(const CChainParams& params)
 {
     LOCK(cs_main);
 
-    int nHeight = 1;
+    // Blocks up to a snapshot's base were never validated here, with or without witnesses
+    int nHeight = pindexSnapshot ? pindexSnapshot->nHeight + 1 : 1;
     while (nHeight <= chainActive.Height()) {
         if (IsWitnessEnabled(chainActive[nHeight - 1], params.GetConsensus()) && !(chainActive[nHeight]->nStatus & BLOCK_OPT_WITNESS)) {
             break;
@@ -3893,14 +4389,19 @@ bool RewindBlockIndex(const CChainParams& params)
 void UnloadBlockIndex()
 {
     LOCK(cs_main);
+    // Batches being written refer to the entries about to be freed
+    flushWriter.Wait();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
+    pindexSnapshot = NULL;
     mempool.clear();
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
     nLastBlockFile = 0;
+    blockFileCache.Clear();
+    pindexPrefetched = NULL;
     nBlockSequenceId = 1;
     setDirtyBlockIndex.clear();
     setDirtyFileInfo.clear();
@@ -3909,10 +4410,8 @@ void UnloadBlockIndex()
         warningcache[b].clear();
     }
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
-    }
     mapBlockIndex.clear();
+    blockIndexArena.Clear();
     fHavePruned = false;
 }
 
@@ -3924,6 +4423,110 @@ bool LoadBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
+/** Read a snapshot's metadata and check that it was taken on this network */
+static bool ReadSnapshotMetadata(const CChainParams& chainparams, CAutoFile& file, CSnapshotMetadata& meta)
+{
+    file >> meta;
+    if (memcmp(meta.pchMessageStart, chainparams.MessageStart(), sizeof(meta.pchMessageStart)) != 0)
+        return error("%s: snapshot was taken on a different network", __func__);
+    if (meta.nVersion != SNAPSHOT_VERSION)
+        return error("%s: unknown snapshot version %d", __func__, meta.nVersion);
+    if (meta.nHeight <= 0 || meta.nTx == 0 || meta.nChainTx < (uint64_t)meta.nHeight)
+        return error("%s: invalid snapshot base", __func__);
+    return true;
+}
+
+bool LoadSnapshot(const CChainParams& chainparams, const boost::filesystem::path& path, const uint256& hashExpected)
+{
+    CValidationState state;
+    {
+        LOCK(cs_main);
+        if (chainActive.Height() > 0)
+            return error("%s: a snapshot can only be loaded into an empty chainstate", __func__);
+    }
+    // Connect the genesis block, so that the snapshot's headers extend the active chain as usual
+    if (!ActivateBestChain(state, chainparams))
+        return error("%s: unable to connect the genesis block: %s", __func__, FormatStateMessage(state));
+
+    LOCK(cs_main);
+    if (chainActive.Height() != 0)
+        return error("%s: a snapshot can only be loaded into an empty chainstate", __func__);
+    CSnapshotMetadata meta;
+
+    try {
+        // Check the whole file before anything of it is written
+        {
+            CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+            if (file.IsNull())
+                return error("%s: unable to open %s", __func__, path.string());
+            if (!ReadSnapshotMetadata(chainparams, file, meta))
+                return false;
+            file.ignore((size_t)meta.nHeight * ::GetSerializeSize(CBlockHeader(), SER_DISK, CLIENT_VERSION));
+            uint256 hashCoins;
+            if (!ReadSnapshotCoins(file, meta.nCoins, NULL, hashCoins))
+                return false;
+            if (meta.GetHash(hashCoins) != hashExpected)
+                return error("%s: snapshot hash %s does not match -snapshothash", __func__, meta.GetHash(hashCoins).ToString());
+        }
+        LogPrintf("%s: loading %u transactions at height %d from %s\n", __func__, meta.nCoins, meta.nHeight, path.string());
+
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull() || !ReadSnapshotMetadata(chainparams, file, meta))
+            return error("%s: unable to reopen %s", __func__, path.string());
+
+        // The headers get the usual checks, proof of work included
+        std::vector<CBlockHeader> vHeaders;
+        for (int nHeight = 1; nHeight <= meta.nHeight; nHeight++) {
+            vHeaders.push_back(CBlockHeader());
+            file >> vHeaders.back();
+            if (vHeaders.size() == MAX_HEADERS_RESULTS || nHeight == meta.nHeight) {
+                if (!ProcessNewBlockHeaders(vHeaders, state, chainparams))
+                    return error("%s: invalid header in snapshot: %s", __func__, FormatStateMessage(state));
+                vHeaders.clear();
+            }
+        }
+        BlockMap::iterator mi = mapBlockIndex.find(meta.hashBlock);
+        if (mi == mapBlockIndex.end() || mi->second->nHeight != meta.nHeight)
+            return error("%s: snapshot headers do not lead to its base %s", __func__, meta.hashBlock.ToString());
+        CBlockIndex* pindex = mi->second;
+
+        // Write the coins without a best block, so that an interrupted load
+        // leaves the chainstate at the genesis block. The marker makes the
+        // next start wipe those coins instead of running on them.
+        if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+            return false;
+        if (!pblocktree->WriteSnapshotLoading(true))
+            return AbortNode("Failed to write snapshot marker");
+        uint256 hashCoins;
+        if (!ReadSnapshotCoins(file, meta.nCoins, pcoinsdbview, hashCoins))
+            return false;
+        if (meta.GetHash(hashCoins) != hashExpected)
+            return error("%s: snapshot changed while it was loaded", __func__);
+
+        pindex->nTx = meta.nTx;
+        pindex->nChainTx = meta.nChainTx;
+        pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
+        setDirtyBlockIndex.insert(pindex);
+        if (!pblocktree->WriteSnapshotBase(pindex->GetBlockHash(), pindex->nChainTx))
+            return AbortNode("Failed to write snapshot base");
+        pindexSnapshot = pindex;
+
+        pcoinsTip->SetBestBlock(pindex->GetBlockHash());
+        chainActive.SetTip(pindex);
+        setBlockIndexCandidates.insert(pindex);
+        PruneBlockIndexCandidates();
+        if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+            return false;
+        if (!pblocktree->WriteSnapshotLoading(false))
+            return AbortNode("Failed to clear snapshot marker");
+    } catch (const std::exception& e) {
+        return error("%s: unable to read snapshot: %s", __func__, e.what());
+    }
+
+    LogPrintf("%s: chainstate loaded at %s height=%d\n", __func__, chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height());
+    return true;
+}
+
 bool InitBlockIndex(const CChainParams& chainparams)
 {
     LOCK(cs_main);
@@ -3937,6 +4540,8 @@ bool InitBlockIndex(const CChainParams& chainparams)
     pblocktree->WriteFlag("txindex", fTxIndex);
     fAddrIndex = GetBoolArg("-addrindex", DEFAULT_ADDRINDEX);
     pblocktree->WriteFlag("addrindex", fAddrIndex);
+    fBlockFilterIndex = GetBoolArg("-blockfilterindex", DEFAULT_BLOCKFILTERINDEX);
+    pblocktree->WriteFlag("blockfilterindex", fBlockFilterIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3944,14 +4549,17 @@ bool InitBlockIndex(const CChainParams& chainparams)
         try {
             CBlock &block = const_cast<CBlock&>(chainparams.GenesisBlock());
             // Start new block file
-            unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+            const bool fCompressed = fCompressBlocks && CBlockCompressor::IsCompressible(block);
+            unsigned int nBlockSize = GetBlockRecordSize(block, fCompressed);
             CDiskBlockPos blockPos;
             CValidationState state;
-            if (!FindBlockPos(state, blockPos, nBlockSize+8, 0, block.GetBlockTime()))
+            if (!FindBlockPos(state, blockPos, nBlockSize+8, 0, block.GetBlockTime(), false, fCompressed))
                 return error("LoadBlockIndex(): FindBlockPos failed");
-            if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart()))
+            if (!WriteBlockToDisk(block, blockPos, chainparams.MessageStart(), fCompressed))
                 return error("LoadBlockIndex(): writing genesis block to disk failed");
             CBlockIndex *pindex = AddToBlockIndex(block);
+            if (fCompressed)
+                pindex->nStatus |= BLOCK_COMPRESSED;
             if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
                 return error("LoadBlockIndex(): genesis block not accepted");
             if (!WriteSyncCheckpoint(block.GetHash()))
@@ -3969,121 +4577,541 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
+/** Map of disk positions for blocks with unknown parent (only used for reindex) */
+static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+
+/**
+ * Hand a block read from a block file to AcceptBlock, or set it aside until its
+ * parent is known, and then process any set-aside children it has.
+ * Returns false if importing has to stop.
+ */
+static bool ImportBlock(const CChainParams& chainparams, const std::shared_ptr<CBlock>& pblock, CDiskBlockPos *dbp, int& nLoaded)
+{
+    const CBlock& block = *pblock;
+
+    // detect out of order blocks, and store them for later
+    uint256 hash = block.GetHash();
+    if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                block.hashPrevBlock.ToString());
+        if (dbp)
+            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+        return true;
+    }
+
+    // process in case the block isn't known yet
+    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+        LOCK(cs_main);
+        CValidationState state;
+        if (AcceptBlock(pblock, state, chainparams, NULL, true, dbp, NULL))
+            nLoaded++;
+        if (state.IsError())
+            return false;
+    } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+        LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+    }
+
+    // Activate the genesis block so normal node progress can continue
+    if (hash == chainparams.GetConsensus().hashGenesisBlock) {
+        CValidationState state;
+        if (!ActivateBestChain(state, chainparams)) {
+            return false;
+        }
+    }
+
+    NotifyHeaderTip();
+
+    // Recursively process earlier encountered successors of this block
+    std::deque<uint256> queue;
+    queue.push_back(hash);
+    while (!queue.empty()) {
+        uint256 head = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+        while (range.first != range.second) {
+            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+            std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
+            if (ReadBlockFromDisk(*pblockrecursive, it->second, chainparams.GetConsensus()))
+            {
+                LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
+                        head.ToString());
+                LOCK(cs_main);
+                CValidationState dummy;
+                if (AcceptBlock(pblockrecursive, dummy, chainparams, NULL, true, &it->second, NULL))
+                {
+                    nLoaded++;
+                    queue.push_back(pblockrecursive->GetHash());
+                }
+            }
+            range.first++;
+            mapBlocksUnknownParent.erase(it);
+            NotifyHeaderTip();
+        }
+    }
+    return true;
+}
+
+/**
+ * Scan a block file for blocks, calling fn(pblock, nBlockPos, nSize) on each
+ * one; fn returns false to stop the scan.
+ */
+template <typename Callback>
+static void ScanBlockFile(const CChainParams& chainparams, FILE* fileIn, Callback fn)
+{
+    // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+    CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
+    uint64_t nRewind = blkdat.GetPos();
+    while (!blkdat.eof()) {
+        boost::this_thread::interruption_point();
+
+        blkdat.SetPos(nRewind);
+        nRewind++; // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        bool fCompressed = false;
+        try {
+            // locate a header
+            unsigned char buf[CMessageHeader::MESSAGE_START_SIZE];
+            blkdat.FindByte(chainparams.MessageStart()[0]);
+            nRewind = blkdat.GetPos()+1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            fCompressed = (nSize & BLOCK_RECORD_COMPRESSED) != 0;
+            nSize &= ~BLOCK_RECORD_COMPRESSED;
+            if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+                continue;
+        } catch (const std::exception&) {
+            // no valid block header found; don't complain
+            break;
+        }
+        try {
+            // read block
+            uint64_t nBlockPos = blkdat.GetPos();
+            blkdat.SetLimit(nBlockPos + nSize);
+            blkdat.SetPos(nBlockPos);
+            std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+            if (fCompressed) {
+                CBlockCompressor compressor(*pblock);
+                blkdat >> compressor;
+            } else {
+                blkdat >> *pblock;
+            }
+            nRewind = blkdat.GetPos();
+            if (!fn(pblock, nBlockPos, nSize))
+                break;
+        } catch (const std::exception& e) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+        }
+    }
+}
+
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp)
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
+        ScanBlockFile(chainparams, fileIn, [&](const std::shared_ptr<CBlock>& pblock, uint64_t nBlockPos, unsigned int nSize) {
+            if (dbp)
+                dbp->nPos = nBlockPos;
+            return ImportBlock(chainparams, pblock, dbp, nLoaded);
+        });
+    } catch (const std::runtime_error& e) {
+        AbortNode(std::string("System error: ") + e.what());
+    }
+    if (nLoaded > 0)
+        LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    return nLoaded > 0;
+}
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[CMessageHeader::MESSAGE_START_SIZE];
-                blkdat.FindByte(chainparams.MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, chainparams.MessageStart(), CMessageHeader::MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
-                break;
+namespace {
+
+/** Bytes of scanned blocks the -reindex workers may keep queued ahead of the importer */
+static const size_t REINDEX_QUEUE_SIZE = 64 * 1024 * 1024;
+
+/**
+ * The -reindex pipeline. Worker threads scan the block files in parallel,
+ * deserializing every block and running the context-free checks (proof of
+ * work, merkle root) on it. The importing thread takes the checked blocks in
+ * file order and adds them to the block index, so that the scrypt hashing no
+ * longer runs on a single core. Workers stay at most a bounded number of
+ * bytes ahead of the importer.
+ */
+class CReindexPipeline
+{
+private:
+    struct CScannedBlock {
+        std::shared_ptr<CBlock> pblock;
+        CDiskBlockPos pos;
+        unsigned int nSize;
+    };
+
+    const CChainParams& chainparams;
+    const size_t nMaxQueuedBytes;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::map<int, std::deque<CScannedBlock> > mapQueued;
+    std::set<int> setFilesScanned;
+    size_t nQueuedBytes;
+    int nNextScanFile;
+    int nImportFile;
+    int nEndFile; //!< First block file that does not exist
+    bool fStop;
+
+    std::atomic<uint64_t> nScannedBlocks;
+    std::atomic<uint64_t> nScannedBytes;
+
+    bool Queue(int nFile, CScannedBlock&& block)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        // The importer never waits on a full queue for the file it is importing
+        while (!fStop && nQueuedBytes >= nMaxQueuedBytes && !(nFile == nImportFile && mapQueued[nFile].empty()))
+            cond.wait(lock);
+        if (fStop)
+            return false;
+        nQueuedBytes += block.nSize;
+        mapQueued[nFile].push_back(std::move(block));
+        cond.notify_all();
+        return true;
+    }
+
+    void ThreadScan()
+    {
+        RenameThread("bitcoin-reindex");
+        const Consensus::Params& consensusParams = chainparams.GetConsensus();
+        while (true) {
+            int nFile;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                if (fStop || nNextScanFile >= nEndFile)
+                    return;
+                nFile = nNextScanFile++;
             }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
-                CBlock& block = *pblock;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    LOCK(cs_main);
-                    CValidationState state;
-                    if (AcceptBlock(pblock, state, chainparams, NULL, true, dbp, NULL))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
+            CDiskBlockPos pos(nFile, 0);
+            FILE* file = NULL;
+            if (boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
+                file = OpenBlockFile(pos, true);
+            if (file == NULL) {
+                // No block files left to reindex (or an error, logged in OpenBlockFile)
+                boost::unique_lock<boost::mutex> lock(mutex);
+                nEndFile = std::min(nEndFile, nFile);
+                cond.notify_all();
+                return;
+            }
 
-                // Activate the genesis block so normal node progress can continue
-                if (hash == chainparams.GetConsensus().hashGenesisBlock) {
+            try {
+                ScanBlockFile(chainparams, file, [&](const std::shared_ptr<CBlock>& pblock, uint64_t nBlockPos, unsigned int nSize) {
+                    // Sets pblock->fChecked, so the importer does not hash the header again
                     CValidationState state;
-                    if (!ActivateBestChain(state, chainparams)) {
+                    CheckBlock(*pblock, state, consensusParams);
+                    nScannedBlocks++;
+                    nScannedBytes += nSize;
+                    CScannedBlock block = {pblock, CDiskBlockPos(nFile, nBlockPos), nSize};
+                    return Queue(nFile, std::move(block));
+                });
+            } catch (const std::exception& e) {
+                LogPrintf("%s: error scanning blk%05u.dat: %s\n", __func__, nFile, e.what());
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            setFilesScanned.insert(nFile);
+            cond.notify_all();
+        }
+    }
+
+    /** Wait for the next block of nImportFile; false once that file is done */
+    bool Next(CScannedBlock& block)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            std::map<int, std::deque<CScannedBlock> >::iterator it = mapQueued.find(nImportFile);
+            if (it != mapQueued.end() && !it->second.empty()) {
+                block = std::move(it->second.front());
+                it->second.pop_front();
+                nQueuedBytes -= block.nSize;
+                cond.notify_all();
+                return true;
+            }
+            if (setFilesScanned.count(nImportFile) || nImportFile >= nEndFile) {
+                if (it != mapQueued.end())
+                    mapQueued.erase(it);
+                return false;
+            }
+            cond.wait(lock);
+        }
+    }
+
+    void Stop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fStop = true;
+        cond.notify_all();
+    }
+
+public:
+    CReindexPipeline(const CChainParams& chainparamsIn, size_t nMaxQueuedBytesIn)
+        : chainparams(chainparamsIn), nMaxQueuedBytes(nMaxQueuedBytesIn), nQueuedBytes(0), nNextScanFile(0),
+          nImportFile(0), nEndFile(std::numeric_limits<int>::max()), fStop(false), nScannedBlocks(0), nScannedBytes(0) {}
+
+    /** False if importing a block hit a database or disk error */
+    bool Run(int nThreads)
+    {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&CReindexPipeline::ThreadScan, this));
+
+        int64_t nStart = GetTimeMicros();
+        int64_t nImportTime = 0;
+        int nLoaded = 0;
+        bool fContinue = true;
+        try {
+            while (fContinue) {
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    if (nImportFile >= nEndFile)
                         break;
-                    }
                 }
-
-                NotifyHeaderTip();
-
-                // Recursively process earlier encountered successors of this block
-                std::deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        std::shared_ptr<CBlock> pblockrecursive = std::make_shared<CBlock>();
-                        if (ReadBlockFromDisk(*pblockrecursive, it->second, chainparams.GetConsensus()))
-                        {
-                            LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, pblockrecursive->GetHash().ToString(),
-                                    head.ToString());
-                            LOCK(cs_main);
-                            CValidationState dummy;
-                            if (AcceptBlock(pblockrecursive, dummy, chainparams, NULL, true, &it->second, NULL))
-                            {
-                                nLoaded++;
-                                queue.push_back(pblockrecursive->GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                        NotifyHeaderTip();
+                LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nImportFile);
+                CScannedBlock block;
+                while (fContinue && Next(block)) {
+                    boost::this_thread::interruption_point();
+                    int64_t nTimeStart = GetTimeMicros();
+                    try {
+                        fContinue = ImportBlock(chainparams, block.pblock, &block.pos, nLoaded);
+                    } catch (const std::exception& e) {
+                        LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
                     }
+                    nImportTime += GetTimeMicros() - nTimeStart;
                 }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+                boost::unique_lock<boost::mutex> lock(mutex);
+                nImportFile++;
+                cond.notify_all();
             }
+        } catch (...) {
+            Stop();
+            threadGroup.interrupt_all();
+            threadGroup.join_all();
+            throw;
         }
-    } catch (const std::runtime_error& e) {
-        AbortNode(std::string("System error: ") + e.what());
+        Stop();
+        threadGroup.join_all();
+
+        const double nSeconds = std::max<int64_t>(GetTimeMicros() - nStart, 1) * 0.000001;
+        LogPrintf("Reindex: scanned %u blocks (%.1f MB) in %.2fs with %d threads: %.1f blocks/s, %.1f MB/s\n",
+            nScannedBlocks.load(), nScannedBytes.load() * 0.000001, nSeconds, nThreads,
+            nScannedBlocks.load() / nSeconds, nScannedBytes.load() * 0.000001 / nSeconds);
+        LogPrintf("Reindex: indexed %d blocks in %.2fs: %.1f blocks/s\n",
+            nLoaded, nImportTime * 0.000001, nLoaded / std::max(nImportTime * 0.000001, 0.000001));
+        return fContinue;
+    }
+};
+
+} // namespace
+
+bool ReindexBlockFiles(const CChainParams& chainparams, int nThreads)
+{
+    CReindexPipeline pipeline(chainparams, REINDEX_QUEUE_SIZE);
+    return pipeline.Run(std::max(nThreads, 1));
+}
+
+namespace {
+
+/** A block moved to a new position by CompressBlockFile */
+struct CMovedBlock {
+    CBlockIndex* pindex;
+    CDiskBlockPos posOld;
+    unsigned int nStatusOld;
+    unsigned int nUndoPos;
+    unsigned int nPosNew;
+    bool fCompressedNew;
+
+    bool operator<(const CMovedBlock& other) const { return posOld.nPos < other.posOld.nPos; }
+};
+
+/** The transaction and address index entries ConnectBlock writes for a block stored at pos */
+void GetBlockIndexEntries(const CBlock& block, const CBlockUndo* pundo, const CDiskBlockPos& pos, bool fCompressed, int nHeight,
+                          std::vector<std::pair<uint256, CDiskTxPos> >& vPosTxid, std::vector<std::pair<uint160, CExtDiskTxPos> >& vPosAddrid)
+{
+    CExtDiskTxPos txpos(CDiskTxPos(pos, GetSizeOfCompactSize(block.vtx.size())), nHeight);
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = *block.vtx[i];
+        if (fTxIndex)
+            vPosTxid.push_back(std::make_pair(tx.GetHash(), txpos));
+        if (fAddrIndex && pundo != NULL) {
+            if (!tx.IsCoinBase()) {
+                BOOST_FOREACH(const CTxInUndo& prevout, pundo->vtxundo[i - 1].vprevout)
+                    BuildAddrIndex(prevout.txout.scriptPubKey, txpos, vPosAddrid);
+            }
+            BOOST_FOREACH(const CTxOut& txout, tx.vout)
+                BuildAddrIndex(txout.scriptPubKey, txpos, vPosAddrid);
+        }
+        if (fCompressed)
+            txpos.nTxOffset += ::GetSerializeSize(CTxCompressor(REF(block.vtx[i])), SER_DISK, CLIENT_VERSION);
+        else
+            txpos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+    }
+}
+
+/**
+ * Rewrite block file nFile with its blocks compressed. The new file is written
+ * next to the old one as blk?????.dat.new. Then the block, transaction and
+ * address index entries of its blocks move to their new positions in a single
+ * database batch, and the new file replaces the old one. If the node stops in
+ * between, RecoverBlockFileRewrite finishes or drops the rewrite on startup.
+ * Returns false if the file was left as it was.
+ */
+bool CompressBlockFile(const CChainParams& chainparams, int nFile, const std::vector<CBlockIndex*>& vpindex)
+{
+    std::vector<CMovedBlock> vBlocks;
+    {
+        LOCK(cs_main);
+        BOOST_FOREACH(CBlockIndex* pindex, vpindex) {
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nFile != nFile)
+                continue;
+            CMovedBlock moved = {pindex, pindex->GetBlockPos(), pindex->nStatus, pindex->nUndoPos, 0, false};
+            vBlocks.push_back(moved);
+        }
+    }
+    std::sort(vBlocks.begin(), vBlocks.end());
+
+    const boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk");
+    const boost::filesystem::path pathNew = path.string() + ".new";
+    std::vector<std::pair<uint256, CDiskTxPos> > vPosTxidOld, vPosTxidNew;
+    std::vector<std::pair<uint160, CExtDiskTxPos> > vPosAddridOld, vPosAddridNew;
+    unsigned int nSizeNew;
+    {
+        CAutoFile fileout(fopen(pathNew.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (fileout.IsNull())
+            return error("%s: can't create %s", __func__, pathNew.string());
+
+        BOOST_FOREACH(CMovedBlock& moved, vBlocks) {
+            boost::this_thread::interruption_point();
+
+            CBlock block;
+            if (!ReadBlockFromDiskUnchecked(block, moved.posOld) || block.GetHash() != moved.pindex->GetBlockHash())
+                return error("%s: can't read block %s", __func__, moved.pindex->GetBlockHash().ToString());
+            moved.fCompressedNew = CBlockCompressor::IsCompressible(block);
+            if (!WriteBlockRecord(fileout, block, moved.nPosNew, chainparams.MessageStart(), moved.fCompressedNew))
+                return error("%s: can't write %s", __func__, pathNew.string());
+
+            // Address index entries exist for the blocks that were connected, which left undo data
+            CBlockUndo undo;
+            const bool fHaveUndo = fAddrIndex && (moved.nStatusOld & BLOCK_HAVE_UNDO);
+            if (fHaveUndo) {
+                if (!UndoReadFromDisk(undo, CDiskBlockPos(nFile, moved.nUndoPos), moved.pindex->pprev->GetBlockHash()) ||
+                    undo.vtxundo.size() + 1 != block.vtx.size())
+                    return error("%s: can't read undo data of block %s", __func__, moved.pindex->GetBlockHash().ToString());
+            }
+            if (fTxIndex || fAddrIndex) {
+                GetBlockIndexEntries(block, fHaveUndo ? &undo : NULL, moved.posOld, moved.nStatusOld & BLOCK_COMPRESSED,
+                                     moved.pindex->nHeight, vPosTxidOld, vPosAddridOld);
+                GetBlockIndexEntries(block, fHaveUndo ? &undo : NULL, CDiskBlockPos(nFile, moved.nPosNew), moved.fCompressedNew,
+                                     moved.pindex->nHeight, vPosTxidNew, vPosAddridNew);
+            }
+        }
+
+        long nPosEnd = ftell(fileout.Get());
+        if (nPosEnd < 0)
+            return error("%s: can't write %s", __func__, pathNew.string());
+        FileCommit(fileout.Get());
+        nSizeNew = nPosEnd;
+    }
+
+    // Only move the transaction index entries that point at these blocks; a
+    // duplicate transaction may have been indexed in a later block
+    std::vector<std::pair<uint256, CDiskTxPos> > vPosTxid;
+    for (size_t i = 0; i < vPosTxidOld.size(); i++) {
+        CDiskTxPos postx;
+        if (pblocktree->ReadTxIndex(vPosTxidOld[i].first, postx) && postx == vPosTxidOld[i].second)
+            vPosTxid.push_back(vPosTxidNew[i]);
+    }
+
+    LOCK(cs_main);
+    // A batch still being written may hold the old positions of these blocks
+    if (!flushWriter.Wait()) {
+        boost::filesystem::remove(pathNew);
+        return false;
+    }
+    // Give up if any of the blocks changed meanwhile, e.g. by being pruned or connected
+    BOOST_FOREACH(const CMovedBlock& moved, vBlocks) {
+        if (moved.pindex->nStatus != moved.nStatusOld || !(moved.pindex->GetBlockPos() == moved.posOld)) {
+            boost::filesystem::remove(pathNew);
+            return false;
+        }
+    }
+
+    std::vector<const CBlockIndex*> vBlockIndex;
+    BOOST_FOREACH(const CMovedBlock& moved, vBlocks) {
+        moved.pindex->nDataPos = moved.nPosNew;
+        if (moved.fCompressedNew)
+            moved.pindex->nStatus |= BLOCK_COMPRESSED;
+        else
+            moved.pindex->nStatus &= ~BLOCK_COMPRESSED;
+        vBlockIndex.push_back(moved.pindex);
+    }
+    CBlockFileInfo info;
+    {
+        LOCK(cs_LastBlockFile);
+        vinfoBlockFile[nFile].nSize = nSizeNew;
+        vinfoBlockFile[nFile].nFlags |= BLOCKFILE_COMPRESSED;
+        info = vinfoBlockFile[nFile];
+    }
+    if (!pblocktree->WriteBlockFileRewrite(nFile, info, vBlockIndex, vPosTxid, vPosAddridOld, vPosAddridNew))
+        return AbortNode("Failed to write block index of a compressed block file");
+    if (!RenameOver(pathNew, path))
+        return AbortNode(strprintf("Failed to replace %s", path.string()));
+    blockFileCache.Erase(nFile);
+    return true;
+}
+
+} // namespace
+
+void CompressBlockFiles(const CChainParams& chainparams)
+{
+    // The blocks of every completed file that was not written compressed
+    std::map<int, std::vector<CBlockIndex*> > mapFiles;
+    {
+        LOCK(cs_main);
+        std::set<int> setFiles;
+        {
+            LOCK(cs_LastBlockFile);
+            for (int nFile = 0; nFile < nLastBlockFile; nFile++) {
+                if (vinfoBlockFile[nFile].nBlocks > 0 && !(vinfoBlockFile[nFile].nFlags & BLOCKFILE_COMPRESSED))
+                    setFiles.insert(nFile);
+            }
+        }
+        if (setFiles.empty())
+            return;
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex) {
+            CBlockIndex* pindex = item.second;
+            if ((pindex->nStatus & BLOCK_HAVE_DATA) && setFiles.count(pindex->nFile))
+                mapFiles[pindex->nFile].push_back(pindex);
+        }
+    }
+
+    for (std::map<int, std::vector<CBlockIndex*> >::const_iterator it = mapFiles.begin(); it != mapFiles.end(); it++) {
+        unsigned int nSizeOld;
+        {
+            LOCK(cs_LastBlockFile);
+            nSizeOld = vinfoBlockFile[it->first].nSize;
+        }
+        int64_t nStart = GetTimeMillis();
+        if (!CompressBlockFile(chainparams, it->first, it->second)) {
+            LogPrintf("Block file blk%05u.dat left uncompressed\n", it->first);
+            continue;
+        }
+        unsigned int nSizeNew;
+        {
+            LOCK(cs_LastBlockFile);
+            nSizeNew = vinfoBlockFile[it->first].nSize;
+        }
+        LogPrintf("Compressed block file blk%05u.dat from %u to %u bytes in %dms\n", it->first, nSizeOld, nSizeNew, GetTimeMillis() - nStart);
     }
-    if (nLoaded > 0)
-        LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
-    return nLoaded > 0;
 }
 
 void static CheckBlockIndex(const Consensus::Params& consensusParams)
@@ -4102,6 +5130,11 @@ void static CheckBlockIndex(const Consensus::Params& consensusParams)
         return;
     }
 
+    // The checks below expect every block in the active chain to have been
+    // connected here, which is not the case below a snapshot's base.
+    if (pindexSnapshot)
+        return;
+
     // Build forward-pointing map of the entire block tree.
     std::multimap<CBlockIndex*,CBlockIndex*> forward;
     for (BlockMap::iterator it = mapBlockIndex.begin(); it != mapBlockIndex.end(); it++) {
@@ -4272,7 +5305,7 @@ void static CheckBlockIndex(const Consensus::Params& consensusParams)
 
 std::string CBlockFileInfo::ToString() const
 {
-    return strprintf("CBlockFileInfo(blocks=%u, size=%u, heights=%u...%u, time=%s...%s)", nBlocks, nSize, nHeightFirst, nHeightLast, DateTimeStrFormat("%Y-%m-%d", nTimeFirst), DateTimeStrFormat("%Y-%m-%d", nTimeLast));
+    return strprintf("CBlockFileInfo(blocks=%u, size=%u, heights=%u...%u, time=%s...%s%s)", nBlocks, nSize, nHeightFirst, nHeightLast, DateTimeStrFormat("%Y-%m-%d", nTimeFirst), DateTimeStrFormat("%Y-%m-%d", nTimeLast), (nFlags & BLOCKFILE_COMPRESSED) ? ", compressed" : "");
 }
 
 CBlockFileInfo* GetBlockFileInfo(size_t n)
@@ -4431,9 +5464,7 @@ public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        blockIndexArena.Clear();
     }
 } instance_of_cmaincleanup;
@@ -13,6 +13,7 @@
 #include "amount.h"
 #include "chain.h"
 #include "coins.h"
+#include "epochcache.h"
 #include "protocol.h" // For CMessageHeader::MessageStartChars
 #include "script/script_error.h"
 #include "script/standard.h"
@@ -35,6 +36,7 @@
 #include <boost/filesystem/path.hpp>
 
 class ACPDB;
+class CBlockFilterDB;
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
@@ -78,6 +80,8 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Set in the size field of a blk?????.dat record whose block is stored with CBlockCompressor */
+static const unsigned int BLOCK_RECORD_COMPRESSED = 0x80000000;
 
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
@@ -104,6 +108,10 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
+/** Block and undo data (in bytes) written since the last commit after which the block files and index are committed in the background. */
+static const uint64_t MAX_BLOCKFILE_DIRTY_SIZE = 64 * 1024 * 1024;
+/** Share of the coins cache budget kept, evicting least recently used entries, after the cache is written; below the point at which it is written again. */
+static const int COINS_CACHE_KEEP_PERCENT = 40;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 /** Average delay between local address broadcasts in seconds. */
@@ -134,8 +142,15 @@ static const int64_t MAX_FEE_ESTIMATION_TIP_AGE = 3 * 60 * 60;
 /** Default for -permitbaremultisig */
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
+/** Default for -checkblockreadpow, re-verifying the proof of work of blocks read from disk */
+static const bool DEFAULT_CHECKBLOCKREADPOW = false;
+/** Default for -blockcompression, storing blocks in the compact CBlockCompressor encoding */
+static const bool DEFAULT_BLOCK_COMPRESSION = false;
 static const bool DEFAULT_TXINDEX = true;
 static const bool DEFAULT_ADDRINDEX = true;
+static const bool DEFAULT_BLOCKFILTERINDEX = false;
+/** Default for -peerblockfilters, serving compact block filters to peers (BIP 157) */
+static const bool DEFAULT_PEERBLOCKFILTERS = false;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 
 /** Default for -mempoolreplacement */
@@ -172,10 +187,17 @@ extern bool fReindex;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
 extern bool fAddrIndex;
+extern bool fBlockFilterIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
+extern bool fCheckBlockReadPoW;
+extern bool fCompressBlocks;
+/** Blocks read from disk that were checked against their block index entry by hash */
+extern std::atomic<uint64_t> nBlockReadHashChecks;
+/** Blocks read from disk whose (scrypt) proof of work was verified */
+extern std::atomic<uint64_t> nBlockReadPoWChecks;
 extern size_t nCoinCacheUsage;
 /** A fee rate smaller than this is considered zero fee (for relaying, mining and transaction creation) */
 extern CFeeRate minRelayTxFee;
@@ -258,14 +280,30 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Rebuild the block index from the block files (-reindex), scanning them on nThreads threads; false on a database or disk error */
+bool ReindexBlockFiles(const CChainParams& chainparams, int nThreads);
+/** Rewrite the completed block files that were written uncompressed, one file at a time */
+void CompressBlockFiles(const CChainParams& chainparams);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex(const CChainParams& chainparams);
 /** Load the block tree and coins database from disk */
 bool LoadBlockIndex(const CChainParams& chainparams);
+/**
+ * Replace a chainstate holding only the genesis block with the UTXO snapshot
+ * in path, which must hash to hashExpected. The blocks below the snapshot's
+ * base are then assumed valid and never downloaded.
+ */
+bool LoadSnapshot(const CChainParams& chainparams, const boost::filesystem::path& path, const uint256& hashExpected);
 /** Unload database information */
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run the thread that writes block index updates in the background */
+void ThreadFlushWriter();
+/** Initializes the script-execution cache */
+void InitScriptExecutionCache();
+/** Hit, miss and eviction counters of the script-execution cache */
+EpochCache::stats GetScriptExecutionCacheStats();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -369,10 +407,12 @@ int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& i
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
- * instead of being performed inline.
+ * instead of being performed inline. Transactions whose scripts already passed under the same
+ * flags are looked up in the script execution cache and skip script checks entirely; if
+ * cacheFullScriptStore is set and all checks ran inline, a successful result is added to it.
  */
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
-                 unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks = NULL);
+                 unsigned int flags, bool cacheSigStore, bool cacheFullScriptStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks = NULL);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -472,10 +512,12 @@ public:
 
 
 /** Functions for disk access for blocks */
-bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
+bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart, bool fCompress = false);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
-bool ReadTransaction(CTransactionRef tx, const CDiskTxPos &pos, uint256 &hashBlock);
+/** Read the block hashBlock from pos, as taken from its index entry under cs_main, for reading without holding the lock */
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const uint256& hashBlock, const Consensus::Params& consensusParams);
+bool ReadTransaction(CTransactionRef &tx, const CDiskTxPos &pos, uint256 &hashBlock);
 bool FindTransactionsByDestination(const CTxDestination &dest, std::set<CExtDiskTxPos> &setpos);
 
 /** Functions for validating blocks and updating the block tree */
@@ -543,10 +585,19 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coin database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
+/** Block the chainstate was loaded from a UTXO snapshot at, or NULL (protected by cs_main) */
+extern CBlockIndex *pindexSnapshot;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 extern ACPDB *acpdb;
 
+/** Global variable that points to the compact block filter index, NULL unless -blockfilterindex */
+extern CBlockFilterDB *pblockfilterdb;
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
@@ -206,6 +206,13 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
     return true;
 }
 
+void CCryptoKeyStore::EraseKey(const CKeyID &address)
+{
+    LOCK(cs_KeyStore);
+    mapKeys.erase(address);
+    mapCryptedKeys.erase(address);
+}
+
 bool CCryptoKeyStore::AddKeyPubKey(const CKey& key, const CPubKey &pubkey)
 {
     {
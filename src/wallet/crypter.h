@@ -134,6 +134,9 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
+    //! Forget a plain or encrypted key, e.g. one whose database write was dropped
+    void EraseKey(const CKeyID &address);
+
 public:
     CCryptoKeyStore() : fUseCrypto(false), fDecryptionThoroughlyChecked(false)
     {
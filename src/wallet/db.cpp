@@ -50,6 +50,7 @@ void CDBEnv::Reset()
     dbenv = new DbEnv(DB_CXX_NO_EXCEPTIONS);
     fDbEnvInit = false;
     fMockDb = false;
+    fLogBackend = false;
 }
 
 CDBEnv::CDBEnv() : dbenv(NULL)
@@ -59,6 +60,9 @@ CDBEnv::CDBEnv() : dbenv(NULL)
 
 CDBEnv::~CDBEnv()
 {
+    for (map<string, CWalletLog*>::iterator it = mapLogs.begin(); it != mapLogs.end(); ++it)
+        delete it->second;
+    mapLogs.clear();
     EnvShutdown();
     delete dbenv;
     dbenv = NULL;
@@ -111,6 +115,7 @@ bool CDBEnv::Open(const boost::filesystem::path& pathIn)
 
     fDbEnvInit = true;
     fMockDb = false;
+    fLogBackend = GetArg("-walletbackend", DEFAULT_WALLET_BACKEND) == "log";
     return true;
 }
 
@@ -151,6 +156,16 @@ CDBEnv::VerifyResult CDBEnv::Verify(const std::string& strFile, bool (*recoverFu
     LOCK(cs_db);
     assert(mapFileUseCount.count(strFile) == 0);
 
+    if (fLogBackend) {
+        CWalletLog log(boost::filesystem::path(strPath) / GetFileName(strFile));
+        if (log.Open())
+            return VERIFY_OK;
+        log.Close();
+        if (recoverFunc == NULL)
+            return RECOVER_FAIL;
+        return (SalvageLog(strFile) ? RECOVER_OK : RECOVER_FAIL);
+    }
+
     Db db(dbenv, 0);
     int result = db.verify(strFile.c_str(), NULL, NULL, 0);
     if (result == 0)
@@ -228,9 +243,110 @@ bool CDBEnv::Salvage(const std::string& strFile, bool fAggressive, std::vector<C
     return (result == 0);
 }
 
+bool CDBEnv::SalvageLog(const std::string& strFile)
+{
+    LOCK(cs_db);
+    assert(mapFileUseCount.count(strFile) == 0);
+
+    boost::filesystem::path pathLog = boost::filesystem::path(strPath) / GetFileName(strFile);
+    if (!boost::filesystem::exists(pathLog))
+        return true;
+    boost::filesystem::path pathBackup = boost::filesystem::path(strPath) / strprintf("%s.%d.bak", GetFileName(strFile), GetTime());
+    try {
+        boost::filesystem::copy_file(pathLog, pathBackup);
+    } catch (const boost::filesystem::filesystem_error& e) {
+        return error("CDBEnv::SalvageLog: Can't back up %s: %s", pathLog.string(), e.what());
+    }
+    LogPrintf("CDBEnv::SalvageLog: Salvaging %s, original saved as %s\n", pathLog.string(), pathBackup.string());
+
+    CWalletLog log(pathLog);
+    return log.Open(true);
+}
+
+bool CDBEnv::MigrateToLog(const std::string& strFile, const boost::filesystem::path& pathLog)
+{
+    LogPrintf("CDBEnv::MigrateToLog: Copying %s to %s...\n", strFile, pathLog.string());
+    Db db(dbenv, 0);
+    int ret = db.open(NULL, strFile.c_str(), "main", DB_BTREE, DB_RDONLY, 0);
+    if (ret != 0)
+        return error("CDBEnv::MigrateToLog: Error %d opening %s", ret, strFile);
+
+    CWalletLog::Batch batch;
+    Dbc* pcursor = NULL;
+    if (db.cursor(NULL, &pcursor, 0) == 0) {
+        while (true) {
+            Dbt datKey, datValue;
+            datKey.set_flags(DB_DBT_MALLOC);
+            datValue.set_flags(DB_DBT_MALLOC);
+            if (pcursor->get(&datKey, &datValue, DB_NEXT) != 0)
+                break;
+            const unsigned char* pkey = (const unsigned char*)datKey.get_data();
+            const char* pvalue = (const char*)datValue.get_data();
+            batch[CWalletLog::Key(pkey, pkey + datKey.get_size())] = make_pair(false, CWalletLog::Value(pvalue, pvalue + datValue.get_size()));
+            memset(datKey.get_data(), 0, datKey.get_size());
+            memset(datValue.get_data(), 0, datValue.get_size());
+            free(datKey.get_data());
+            free(datValue.get_data());
+        }
+        pcursor->close();
+    }
+    db.close(0);
+
+    // Build the log next to its final name so that an interrupted
+    // migration is simply started over.
+    boost::filesystem::path pathTmp = pathLog.string() + ".migrate";
+    boost::filesystem::remove(pathTmp);
+    bool fSuccess;
+    {
+        CWalletLog log(pathTmp);
+        fSuccess = log.Open() && log.Commit(batch) && log.Sync();
+    }
+    if (fSuccess)
+        fSuccess = RenameOver(pathTmp, pathLog);
+    if (!fSuccess)
+        return error("CDBEnv::MigrateToLog: Failed to write %s", pathLog.string());
+    LogPrintf("CDBEnv::MigrateToLog: Copied %u records, %s is left unchanged\n", batch.size(), strFile);
+    return true;
+}
+
+CWalletLog* CDBEnv::OpenLog(const std::string& strFile)
+{
+    AssertLockHeld(cs_db);
+    map<string, CWalletLog*>::iterator it = mapLogs.find(strFile);
+    if (it != mapLogs.end())
+        return it->second;
+
+    boost::filesystem::path pathLog = boost::filesystem::path(strPath) / GetFileName(strFile);
+    if (!boost::filesystem::exists(pathLog) && boost::filesystem::exists(boost::filesystem::path(strPath) / strFile)) {
+        if (!MigrateToLog(strFile, pathLog))
+            return NULL;
+    }
+    CWalletLog* plog = new CWalletLog(pathLog);
+    if (!plog->Open()) {
+        delete plog;
+        return NULL;
+    }
+    mapLogs[strFile] = plog;
+    return plog;
+}
+
+/** Make everything written to a record log durable, and compact it if it has grown too sparse */
+static void SyncLog(CWalletLog* plog)
+{
+    plog->Sync();
+    if (plog->NeedsCompaction())
+        plog->Compact();
+}
 
 void CDBEnv::CheckpointLSN(const std::string& strFile)
 {
+    if (fLogBackend) {
+        LOCK(cs_db);
+        map<string, CWalletLog*>::iterator it = mapLogs.find(strFile);
+        if (it != mapLogs.end())
+            SyncLog(it->second);
+        return;
+    }
     dbenv->txn_checkpoint(0, 0, 0);
     if (fMockDb)
         return;
@@ -238,7 +354,7 @@ void CDBEnv::CheckpointLSN(const std::string& strFile)
 }
 
 
-CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), activeTxn(NULL)
+CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnCloseIn) : pdb(NULL), plog(NULL), activeTxn(NULL), fLogTxn(false)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -256,6 +372,21 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
         if (!bitdb.Open(GetDataDir()))
             throw runtime_error("CDB: Failed to open database environment.");
 
+        if (bitdb.IsLogBackend()) {
+            plog = bitdb.OpenLog(strFilename);
+            if (!plog)
+                throw runtime_error(strprintf("CDB: Can't open wallet log for %s", strFilename));
+            strFile = strFilename;
+            ++bitdb.mapFileUseCount[strFile];
+            if (fCreate && !Exists(string("version"))) {
+                bool fTmp = fReadOnly;
+                fReadOnly = false;
+                WriteVersion(CLIENT_VERSION);
+                fReadOnly = fTmp;
+            }
+            return;
+        }
+
         strFile = strFilename;
         ++bitdb.mapFileUseCount[strFile];
         pdb = bitdb.mapDb[strFile];
@@ -299,7 +430,8 @@ CDB::CDB(const std::string& strFilename, const char* pszMode, bool fFlushOnClose
 
 void CDB::Flush()
 {
-    if (activeTxn)
+    // Record logs are synced by CDBEnv as a group
+    if (activeTxn || plog)
         return;
 
     // Flush database activity from memory pool to disk log
@@ -312,6 +444,14 @@ void CDB::Flush()
 
 void CDB::Close()
 {
+    if (plog) {
+        logTxn.clear();
+        fLogTxn = false;
+        plog = NULL;
+        LOCK(bitdb.cs_db);
+        --bitdb.mapFileUseCount[strFile];
+        return;
+    }
     if (!pdb)
         return;
     if (activeTxn)
@@ -351,12 +491,105 @@ bool CDBEnv::RemoveDb(const string& strFile)
     return (rc == 0);
 }
 
+bool CDB::ReadLog(const CDataStream& ssKey, CWalletLog::Value& value)
+{
+    CWalletLog::Key key(ssKey.begin(), ssKey.end());
+    if (fLogTxn) {
+        CWalletLog::Batch::const_iterator it = logTxn.find(key);
+        if (it != logTxn.end()) {
+            if (it->second.first)
+                return false;
+            value = it->second.second;
+            return true;
+        }
+    }
+    return plog->Read(key, value);
+}
+
+bool CDB::ExistsLog(const CDataStream& ssKey)
+{
+    CWalletLog::Key key(ssKey.begin(), ssKey.end());
+    if (fLogTxn) {
+        CWalletLog::Batch::const_iterator it = logTxn.find(key);
+        if (it != logTxn.end())
+            return !it->second.first;
+    }
+    return plog->Exists(key);
+}
+
+bool CDB::WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    if (fReadOnly)
+        assert(!"Write called on database in read-only mode");
+    if (!fOverwrite && ExistsLog(ssKey))
+        return false;
+
+    CWalletLog::Key key(ssKey.begin(), ssKey.end());
+    CWalletLog::Value value(ssValue.begin(), ssValue.end());
+    if (fLogTxn) {
+        logTxn[key] = make_pair(false, value);
+        return true;
+    }
+    CWalletLog::Batch batch;
+    batch[key] = make_pair(false, value);
+    return plog->Commit(batch);
+}
+
+bool CDB::EraseLog(const CDataStream& ssKey)
+{
+    if (fReadOnly)
+        assert(!"Erase called on database in read-only mode");
+
+    CWalletLog::Key key(ssKey.begin(), ssKey.end());
+    if (fLogTxn) {
+        logTxn[key] = make_pair(true, CWalletLog::Value());
+        return true;
+    }
+    CWalletLog::Batch batch;
+    batch[key] = make_pair(true, CWalletLog::Value());
+    return plog->Commit(batch);
+}
+
+int CDB::ReadAtLogCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, bool setRange)
+{
+    bool fInclusive = setRange || !pcursor->fStarted;
+    if (setRange)
+        pcursor->keyLast.assign(ssKey.begin(), ssKey.end());
+    CWalletLog::Value value;
+    if (!plog->Next(pcursor->keyLast, value, fInclusive))
+        return DB_NOTFOUND;
+    pcursor->fStarted = true;
+
+    // Convert to streams
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write((const char*)pcursor->keyLast.data(), pcursor->keyLast.size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write(value.data(), value.size());
+    return 0;
+}
+
 bool CDB::Rewrite(const string& strFile, const char* pszSkip)
 {
     while (true) {
         {
             LOCK(bitdb.cs_db);
             if (!bitdb.mapFileUseCount.count(strFile) || bitdb.mapFileUseCount[strFile] == 0) {
+                if (bitdb.IsLogBackend()) {
+                    // A record log is rewritten by compacting it
+                    LogPrintf("CDB::Rewrite: Compacting %s...\n", strFile);
+                    CWalletLog* plog = bitdb.OpenLog(strFile);
+                    if (!plog)
+                        return false;
+                    {
+                        CDB db(strFile, "r+");
+                        db.WriteVersion(CLIENT_VERSION);
+                    }
+                    bitdb.mapFileUseCount.erase(strFile);
+                    return plog->Compact(pszSkip);
+                }
+
                 // Flush log data to the dat file
                 bitdb.CloseDb(strFile);
                 bitdb.CheckpointLSN(strFile);
@@ -380,17 +613,17 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess) {
                             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
                             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
                             int ret1 = db.ReadAtCursor(pcursor, ssKey, ssValue);
                             if (ret1 == DB_NOTFOUND) {
-                                pcursor->close();
+                                delete pcursor;
                                 break;
                             } else if (ret1 != 0) {
-                                pcursor->close();
+                                delete pcursor;
                                 fSuccess = false;
                                 break;
                             }
@@ -449,7 +682,9 @@ void CDBEnv::Flush(bool fShutdown)
             string strFile = (*mi).first;
             int nRefCount = (*mi).second;
             LogPrint("db", "CDBEnv::Flush: Flushing %s (refcount = %d)...\n", strFile, nRefCount);
-            if (nRefCount == 0) {
+            if (nRefCount == 0 && fLogBackend) {
+                mapFileUseCount.erase(mi++);
+            } else if (nRefCount == 0) {
                 // Move log data to the dat file
                 CloseDb(strFile);
                 LogPrint("db", "CDBEnv::Flush: %s checkpoint\n", strFile);
@@ -462,10 +697,15 @@ void CDBEnv::Flush(bool fShutdown)
             } else
                 mi++;
         }
+        for (map<string, CWalletLog*>::iterator it = mapLogs.begin(); it != mapLogs.end(); ++it)
+            SyncLog(it->second);
         LogPrint("db", "CDBEnv::Flush: Flush(%s)%s took %15dms\n", fShutdown ? "true" : "false", fDbEnvInit ? "" : " database not started", GetTimeMillis() - nStart);
         if (fShutdown) {
             char** listp;
             if (mapFileUseCount.empty()) {
+                for (map<string, CWalletLog*>::iterator it = mapLogs.begin(); it != mapLogs.end(); ++it)
+                    delete it->second;
+                mapLogs.clear();
                 dbenv->log_archive(&listp, DB_ARCH_REMOVE);
                 Close();
                 if (!fMockDb)
@@ -12,6 +12,7 @@
 #include "sync.h"
 #include "version.h"
 #include "uint256.h"
+#include "wallet/walletlog.h"
 
 #include <map>
 #include <string>
@@ -23,23 +24,27 @@
 
 static const unsigned int DEFAULT_WALLET_DBLOGSIZE = 100;
 static const bool DEFAULT_WALLET_PRIVDB = true;
+static const char* const DEFAULT_WALLET_BACKEND = "bdb";
 
 class CDBEnv
 {
 private:
     bool fDbEnvInit;
     bool fMockDb;
+    bool fLogBackend;
     // Don't change into boost::filesystem::path, as that can result in
     // shutdown problems/crashes caused by a static initialized internal pointer.
     std::string strPath;
 
     void EnvShutdown();
+    bool MigrateToLog(const std::string& strFile, const boost::filesystem::path& pathLog);
 
 public:
     mutable CCriticalSection cs_db;
     DbEnv *dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    std::map<std::string, CWalletLog*> mapLogs;
 
     CDBEnv();
     ~CDBEnv();
@@ -47,6 +52,10 @@ public:
 
     void MakeMock();
     bool IsMock() { return fMockDb; }
+    /** Whether wallet files are stored as record logs instead of Berkeley databases (-walletbackend=log) */
+    bool IsLogBackend() const { return fLogBackend; }
+    /** Name of the file in the data directory that holds the records of wallet file strFile */
+    std::string GetFileName(const std::string& strFile) const { return fLogBackend ? strFile + ".log" : strFile; }
 
     /**
      * Verify that database file strFile is OK. If it is not,
@@ -67,6 +76,11 @@ public:
      */
     typedef std::pair<std::vector<unsigned char>, std::vector<unsigned char> > KeyValPair;
     bool Salvage(const std::string& strFile, bool fAggressive, std::vector<KeyValPair>& vResult);
+    /**
+     * Salvage a record log by dropping its corrupt batches, after saving a
+     * copy of the original.
+     */
+    bool SalvageLog(const std::string& strFile);
 
     bool Open(const boost::filesystem::path& path);
     void Close();
@@ -75,6 +89,12 @@ public:
 
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
+    /**
+     * Get the loaded record log of strFile, opening (and, the first time,
+     * migrating an existing Berkeley database into) it if needed.
+     * Requires cs_db.
+     */
+    CWalletLog* OpenLog(const std::string& strFile);
 
     DbTxn* TxnBegin(int flags = DB_TXN_WRITE_NOSYNC)
     {
@@ -88,14 +108,38 @@ public:
 
 extern CDBEnv bitdb;
 
+/** Cursor over the records of a CDB, in key order */
+class CDBCursor
+{
+public:
+    Dbc* pdbc;
+    //! For record logs, the last key returned
+    CWalletLog::Key keyLast;
+    bool fStarted;
+
+    explicit CDBCursor(Dbc* pdbcIn) : pdbc(pdbcIn), fStarted(false) {}
+    ~CDBCursor()
+    {
+        if (pdbc)
+            pdbc->close();
+    }
 
-/** RAII class that provides access to a Berkeley database */
+private:
+    CDBCursor(const CDBCursor&);
+    void operator=(const CDBCursor&);
+};
+
+/** RAII class that provides access to a Berkeley database or wallet record log */
 class CDB
 {
 protected:
     Db* pdb;
+    CWalletLog* plog;
     std::string strFile;
     DbTxn* activeTxn;
+    //! Writes of the active transaction on a record log, applied by TxnCommit()
+    CWalletLog::Batch logTxn;
+    bool fLogTxn;
     bool fReadOnly;
     bool fFlushOnClose;
 
@@ -110,17 +154,36 @@ private:
     CDB(const CDB&);
     void operator=(const CDB&);
 
+    bool ReadLog(const CDataStream& ssKey, CWalletLog::Value& value);
+    bool WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool EraseLog(const CDataStream& ssKey);
+    bool ExistsLog(const CDataStream& ssKey);
+    int ReadAtLogCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, bool setRange);
+
 protected:
     template <typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (plog) {
+            CWalletLog::Value vchValue;
+            if (!ReadLog(ssKey, vchValue))
+                return false;
+            try {
+                CDataStream ssValue(vchValue.begin(), vchValue.end(), SER_DISK, CLIENT_VERSION);
+                ssValue >> value;
+            } catch (const std::exception&) {
+                return false;
+            }
+            return true;
+        }
         Dbt datKey(ssKey.data(), ssKey.size());
 
         // Read
@@ -148,7 +211,7 @@ protected:
     template <typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite = true)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -157,12 +220,15 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(ssKey.data(), ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+
+        if (plog)
+            return WriteLog(ssKey, ssValue, fOverwrite);
+        Dbt datKey(ssKey.data(), ssKey.size());
         Dbt datValue(ssValue.data(), ssValue.size());
 
         // Write
@@ -177,7 +243,7 @@ protected:
     template <typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -186,6 +252,8 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (plog)
+            return EraseLog(ssKey);
         Dbt datKey(ssKey.data(), ssKey.size());
 
         // Erase
@@ -199,13 +267,15 @@ protected:
     template <typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !plog)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (plog)
+            return ExistsLog(ssKey);
         Dbt datKey(ssKey.data(), ssKey.size());
 
         // Exists
@@ -216,19 +286,24 @@ protected:
         return (ret == 0);
     }
 
-    Dbc* GetCursor()
+    CDBCursor* GetCursor()
     {
+        if (plog)
+            return new CDBCursor(NULL);
         if (!pdb)
             return NULL;
         Dbc* pcursor = NULL;
         int ret = pdb->cursor(NULL, &pcursor, 0);
         if (ret != 0)
             return NULL;
-        return pcursor;
+        return new CDBCursor(pcursor);
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, bool setRange = false)
+    int ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, bool setRange = false)
     {
+        if (plog)
+            return ReadAtLogCursor(pcursor, ssKey, ssValue, setRange);
+
         // Read at cursor
         Dbt datKey;
         unsigned int fFlags = DB_NEXT;
@@ -240,7 +315,7 @@ protected:
         Dbt datValue;
         datKey.set_flags(DB_DBT_MALLOC);
         datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
+        int ret = pcursor->pdbc->get(&datKey, &datValue, fFlags);
         if (ret != 0)
             return ret;
         else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
@@ -265,6 +340,12 @@ protected:
 public:
     bool TxnBegin()
     {
+        if (plog) {
+            if (fLogTxn)
+                return false;
+            fLogTxn = true;
+            return true;
+        }
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = bitdb.TxnBegin();
@@ -276,6 +357,14 @@ public:
 
     bool TxnCommit()
     {
+        if (plog) {
+            if (!fLogTxn)
+                return false;
+            bool ret = plog->Commit(logTxn);
+            logTxn.clear();
+            fLogTxn = false;
+            return ret;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->commit(0);
@@ -285,6 +374,13 @@ public:
 
     bool TxnAbort()
     {
+        if (plog) {
+            if (!fLogTxn)
+                return false;
+            logTxn.clear();
+            fLogTxn = false;
+            return true;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
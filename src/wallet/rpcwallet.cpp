@@ -57,6 +57,33 @@ void EnsureWalletIsUnlocked()
         throw JSONRPCError(RPC_WALLET_UNLOCK_NEEDED, "Error: Please enter the wallet passphrase with walletpassphrase first.");
 }
 
+void EnsureWalletIsNotScanning()
+{
+    if (pwalletMain->IsScanning())
+        throw JSONRPCError(RPC_WALLET_ERROR, "Error: Wallet is currently rescanning. Abort the rescan with abortrescan or wait for it to finish.");
+}
+
+void EnsureRescanHasBlockData(const CBlockIndex* pindexStart)
+{
+    if (fPruneMode)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Rescan is disabled in pruned mode");
+    // Blocks up to the base of a UTXO snapshot have no data, like pruned ones
+    LOCK(cs_main);
+    if (pindexSnapshot && (!pindexStart || pindexStart->nHeight <= pindexSnapshot->nHeight))
+        throw JSONRPCError(RPC_WALLET_ERROR, strprintf("Rescan is disabled up to block %d, where the chain state was loaded from a UTXO snapshot", pindexSnapshot->nHeight));
+}
+
+CBlockIndex* RescanWallet(CBlockIndex* pindexStart, bool fUpdate, CBlockIndex* pindexStop)
+{
+    // EnsureWalletIsNotScanning() is only an early check; a rescan started
+    // since then makes ScanForWalletTransactions return without scanning.
+    bool fAlreadyScanning = false;
+    CBlockIndex* pindexScanned = pwalletMain->ScanForWalletTransactions(pindexStart, fUpdate, pindexStop, &fAlreadyScanning);
+    if (fAlreadyScanning)
+        throw JSONRPCError(RPC_WALLET_ERROR, "Error: Wallet is currently rescanning. Abort the rescan with abortrescan or wait for it to finish.");
+    return pindexScanned;
+}
+
 void WalletTxToJSON(const CWalletTx& wtx, UniValue& entry)
 {
     int confirms = wtx.GetDepthInMainChain();
@@ -132,7 +159,7 @@ UniValue getnewaddress(const JSONRPCRequest& request)
         strAccount = AccountFromValue(request.params[0]);
 
     if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
+        pwalletMain->RequestKeyPoolTopUp();
 
     // Generate a new key that is added to wallet
     CPubKey newKey;
@@ -208,7 +235,7 @@ UniValue getrawchangeaddress(const JSONRPCRequest& request)
     LOCK2(cs_main, pwalletMain->cs_wallet);
 
     if (!pwalletMain->IsLocked())
-        pwalletMain->TopUpKeyPool();
+        pwalletMain->RequestKeyPoolTopUp();
 
     CReserveKey reservekey(pwalletMain);
     CPubKey vchPubKey;
@@ -1162,35 +1189,39 @@ UniValue ListReceived(const UniValue& params, bool fByAccounts)
         if(params[2].get_bool())
             filter = filter | ISMINE_WATCH_ONLY;
 
-    // Tally
+    // Tally, only over the transactions paying to address book entries
     map<CBitcoinAddress, tallyitem> mapTally;
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+    BOOST_FOREACH(const PAIRTYPE(CTxDestination, CAddressBookData)& entry, pwalletMain->mapAddressBook)
     {
-        const CWalletTx& wtx = (*it).second;
-
-        if (wtx.IsCoinBase() || !CheckFinalTx(*wtx.tx))
-            continue;
-
-        int nDepth = wtx.GetDepthInMainChain();
-        if (nDepth < nMinDepth)
+        const CTxDestination& dest = entry.first;
+        isminefilter mine = IsMine(*pwalletMain, dest);
+        if(!(mine & filter))
             continue;
 
-        BOOST_FOREACH(const CTxOut& txout, wtx.tx->vout)
+        BOOST_FOREACH(const CWalletTx* pwtx, pwalletMain->GetTxsByDestination(dest))
         {
-            CTxDestination address;
-            if (!ExtractDestination(txout.scriptPubKey, address))
+            const CWalletTx& wtx = *pwtx;
+
+            if (wtx.IsCoinBase() || !CheckFinalTx(*wtx.tx))
                 continue;
 
-            isminefilter mine = IsMine(*pwalletMain, address);
-            if(!(mine & filter))
+            int nDepth = wtx.GetDepthInMainChain();
+            if (nDepth < nMinDepth)
                 continue;
 
-            tallyitem& item = mapTally[address];
-            item.nAmount += txout.nValue;
-            item.nConf = min(item.nConf, nDepth);
-            item.txids.push_back(wtx.GetHash());
-            if (mine & ISMINE_WATCH_ONLY)
-                item.fIsWatchonly = true;
+            BOOST_FOREACH(const CTxOut& txout, wtx.tx->vout)
+            {
+                CTxDestination address;
+                if (!ExtractDestination(txout.scriptPubKey, address) || !(address == dest))
+                    continue;
+
+                tallyitem& item = mapTally[address];
+                item.nAmount += txout.nValue;
+                item.nConf = min(item.nConf, nDepth);
+                item.txids.push_back(wtx.GetHash());
+                if (mine & ISMINE_WATCH_ONLY)
+                    item.fIsWatchonly = true;
+            }
         }
     }
 
@@ -1532,14 +1563,34 @@ UniValue listtransactions(const JSONRPCRequest& request)
     UniValue ret(UniValue::VARR);
 
     const CWallet::TxItems & txOrdered = pwalletMain->wtxOrdered;
+    const bool fAllAccounts = (strAccount == string("*"));
 
-    // iterate backwards until we have nCount items to return:
+    // iterate backwards until we have nCount items to return; entries that
+    // fall entirely before nFrom are only counted, not built:
     for (CWallet::TxItems::const_reverse_iterator it = txOrdered.rbegin(); it != txOrdered.rend(); ++it)
     {
         CWalletTx *const pwtx = (*it).second.first;
+        CAccountingEntry *const pacentry = (*it).second.second;
+        if (fAllAccounts && nFrom > 0 && ret.empty())
+        {
+            size_t nEntries = 0;
+            if (pwtx != 0)
+            {
+                size_t nSent, nReceived;
+                pwtx->GetAmountsCount(nSent, nReceived, filter);
+                nEntries = nSent + (pwtx->GetDepthInMainChain() >= 0 ? nReceived : 0);
+            }
+            if (pacentry != 0)
+                nEntries++;
+            if ((int)nEntries <= nFrom)
+            {
+                nFrom -= nEntries;
+                continue;
+            }
+        }
+
         if (pwtx != 0)
             ListTransactions(*pwtx, strAccount, 0, true, ret, filter);
-        CAccountingEntry *const pacentry = (*it).second.second;
         if (pacentry != 0)
             AcentryToJSON(*pacentry, strAccount, ret);
 
@@ -1738,12 +1789,22 @@ UniValue listsinceblock(const JSONRPCRequest& request)
 
     UniValue transactions(UniValue::VARR);
 
-    for (map<uint256, CWalletTx>::iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); it++)
+    if (pindex)
     {
-        CWalletTx tx = (*it).second;
-
-        if (depth == -1 || tx.GetDepthInMainChain() < depth)
-            ListTransactions(tx, "*", 0, true, transactions, filter);
+        // Only look at the transactions the wallet has seen since pindex,
+        // listed by hash as a walk over mapWallet would
+        std::vector<const CWalletTx*> vTxs = pwalletMain->GetTxsSinceHeight(pindex->nHeight);
+        std::sort(vTxs.begin(), vTxs.end(), [](const CWalletTx* a, const CWalletTx* b) { return a->GetHash() < b->GetHash(); });
+        BOOST_FOREACH(const CWalletTx* pwtx, vTxs)
+        {
+            if (pwtx->GetDepthInMainChain() < depth)
+                ListTransactions(*pwtx, "*", 0, true, transactions, filter);
+        }
+    }
+    else
+    {
+        for (map<uint256, CWalletTx>::const_iterator it = pwalletMain->mapWallet.begin(); it != pwalletMain->mapWallet.end(); ++it)
+            ListTransactions((*it).second, "*", 0, true, transactions, filter);
     }
 
     CBlockIndex *pblockLast = chainActive[chainActive.Height() + 1 - target_confirms];
@@ -2984,6 +3045,98 @@ UniValue bumpfee(const JSONRPCRequest& request)
     return result;
 }
 
+UniValue rescanblockchain(const JSONRPCRequest& request)
+{
+    if (!EnsureWalletIsAvailable(request.fHelp))
+        return NullUniValue;
+
+    if (request.fHelp || request.params.size() > 2)
+        throw runtime_error(
+            "rescanblockchain ( start_height stop_height )\n"
+            "\nRescan the local block chain for wallet related transactions.\n"
+            "Without start_height, a rescan that was aborted or interrupted by a shutdown is resumed,\n"
+            "or the whole chain is scanned if there is none.\n"
+            "\nArguments:\n"
+            "1. start_height    (numeric, optional) block height where the rescan should start\n"
+            "2. stop_height     (numeric, optional) the last block height that should be scanned\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"start_height\"     (numeric) The block height where the rescan started\n"
+            "  \"stop_height\"      (numeric) The height of the last rescanned block\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("rescanblockchain", "")
+            + HelpExampleCli("rescanblockchain", "100000 120000")
+            + HelpExampleRpc("rescanblockchain", "100000, 120000")
+        );
+
+    EnsureWalletIsNotScanning();
+
+    CBlockIndex *pindexStart = NULL, *pindexStop = NULL;
+    {
+        LOCK(cs_main);
+        if (request.params.size() > 0 && !request.params[0].isNull()) {
+            int nHeight = request.params[0].get_int();
+            if (nHeight < 0 || nHeight > chainActive.Height())
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid start_height");
+            pindexStart = chainActive[nHeight];
+        } else {
+            pindexStart = pwalletMain->GetRescanResumePoint();
+            if (!pindexStart)
+                pindexStart = chainActive.Genesis();
+        }
+
+        if (request.params.size() > 1 && !request.params[1].isNull()) {
+            int nHeight = request.params[1].get_int();
+            if (nHeight < 0 || nHeight > chainActive.Height())
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid stop_height");
+            if (nHeight < pindexStart->nHeight)
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "stop_height must be greater than start_height");
+            pindexStop = chainActive[nHeight];
+        }
+        EnsureRescanHasBlockData(pindexStart);
+    }
+
+    CBlockIndex *pindexScanned = RescanWallet(pindexStart, true, pindexStop);
+    if (pwalletMain->IsAbortingRescan())
+        throw JSONRPCError(RPC_MISC_ERROR, "Rescan aborted. Call rescanblockchain without start_height to resume it.");
+    if (!pindexScanned)
+        throw JSONRPCError(RPC_MISC_ERROR, "Rescan failed. Potentially corrupted data files.");
+    pwalletMain->ReacceptWalletTransactions();
+
+    UniValue response(UniValue::VOBJ);
+    response.push_back(Pair("start_height", pindexStart->nHeight));
+    {
+        LOCK(cs_main);
+        response.push_back(Pair("stop_height", pindexStop ? pindexStop->nHeight : chainActive.Height()));
+    }
+    return response;
+}
+
+UniValue abortrescan(const JSONRPCRequest& request)
+{
+    if (!EnsureWalletIsAvailable(request.fHelp))
+        return NullUniValue;
+
+    if (request.fHelp || request.params.size() != 0)
+        throw runtime_error(
+            "abortrescan\n"
+            "\nStops the wallet rescan started by an import call or rescanblockchain.\n"
+            "The first block that was not scanned is remembered; rescanblockchain without start_height,\n"
+            "or the next start of the node, resumes the rescan from there.\n"
+            "\nResult:\n"
+            "true|false    (boolean) Whether a running rescan was asked to stop\n"
+            "\nExamples:\n"
+            + HelpExampleCli("abortrescan", "")
+            + HelpExampleRpc("abortrescan", "")
+        );
+
+    if (!pwalletMain->IsScanning() || pwalletMain->IsAbortingRescan())
+        return false;
+    pwalletMain->AbortRescan();
+    return true;
+}
+
 extern UniValue dumpprivkey(const JSONRPCRequest& request); // in rpcdump.cpp
 extern UniValue importprivkey(const JSONRPCRequest& request);
 extern UniValue importaddress(const JSONRPCRequest& request);
@@ -3000,6 +3153,7 @@ static const CRPCCommand commands[] =
     { "rawtransactions",    "fundrawtransaction",       &fundrawtransaction,       false,  {"hexstring","options"} },
     { "hidden",             "resendwallettransactions", &resendwallettransactions, true,   {} },
     { "wallet",             "abandontransaction",       &abandontransaction,       false,  {"txid"} },
+    { "wallet",             "abortrescan",              &abortrescan,              true,   {} },
     { "wallet",             "addmultisigaddress",       &addmultisigaddress,       true,   {"nrequired","keys","account"} },
     { "wallet",             "addwitnessaddress",        &addwitnessaddress,        true,   {"address"} },
     { "wallet",             "backupwallet",             &backupwallet,             true,   {"destination"} },
@@ -3035,6 +3189,7 @@ static const CRPCCommand commands[] =
     { "wallet",             "listunspent",              &listunspent,              false,  {"minconf","maxconf","addresses","include_unsafe"} },
     { "wallet",             "lockunspent",              &lockunspent,              true,   {"unlock","transactions"} },
     { "wallet",             "move",                     &movecmd,                  false,  {"fromaccount","toaccount","amount","minconf","comment"} },
+    { "wallet",             "rescanblockchain",         &rescanblockchain,         true,   {"start_height","stop_height"} },
     { "wallet",             "sendfrom",                 &sendfrom,                 false,  {"fromaccount","toaddress","amount","minconf","comment","comment_to"} },
     { "wallet",             "sendmany",                 &sendmany,                 false,  {"fromaccount","amounts","minconf","comment","subtractfeefrom"} },
     { "wallet",             "sendtoaddress",            &sendtoaddress,            false,  {"address","amount","comment","comment_to","subtractfeefromamount"} },
@@ -363,6 +363,38 @@ BOOST_AUTO_TEST_CASE(ApproximateBestSubset)
     empty_wallet();
 }
 
+// An exact match is found whenever one exists, also among many coins of
+// equal value.
+BOOST_AUTO_TEST_CASE(coin_selection_bnb)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    empty_wallet();
+    for (int i = 0; i < 200; i++)
+        add_coin(7 * CENT);
+    add_coin(3 * CENT);
+    add_coin(2 * CENT);
+    add_coin(1000 * COIN);
+
+    // 10 * 7 + 3 + 2 cents; no subset of the 7 cent coins comes close
+    for (int i = 0; i < RUN_TESTS; i++) {
+        BOOST_CHECK(wallet.SelectCoinsMinConf(75 * CENT, 1, 6, 0, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 75 * CENT);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 12U);
+    }
+
+    // The same selection works from coins sorted once for several tiers
+    const CSelectableCoins coins(vCoins);
+    BOOST_CHECK(!wallet.SelectCoinsMinConf(75 * CENT, 1, 200, 0, coins, setCoinsRet, nValueRet));
+    BOOST_CHECK(wallet.SelectCoinsMinConf(75 * CENT, 1, 6, 0, coins, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 75 * CENT);
+
+    empty_wallet();
+}
+
 BOOST_FIXTURE_TEST_CASE(rescan, TestChain100Setup)
 {
     LOCK(cs_main);
@@ -430,6 +462,125 @@ BOOST_FIXTURE_TEST_CASE(rescan, TestChain100Setup)
     }
 }
 
+// Verify that a rescan stops at pindexStop, gives the same result with several
+// reading threads, and that the prefilter lets through outputs to keys and to
+// watch-only scripts.
+BOOST_FIXTURE_TEST_CASE(rescan_range_and_filter, TestChain100Setup)
+{
+    LOCK(cs_main);
+    ForceSetArg("-rescanthreads", "3");
+
+    CBlockIndex* const pindexStop = chainActive[chainActive.Height() / 2];
+    {
+        CWallet wallet;
+        LOCK(wallet.cs_wallet);
+        wallet.AddKeyPubKey(coinbaseKey, coinbaseKey.GetPubKey());
+        BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chainActive.Genesis(), false, pindexStop), chainActive.Genesis());
+        BOOST_CHECK_EQUAL(wallet.mapWallet.size(), (size_t)pindexStop->nHeight);
+        BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chainActive.Next(pindexStop)), chainActive.Next(pindexStop));
+        BOOST_CHECK_EQUAL(wallet.mapWallet.size(), (size_t)chainActive.Height());
+        BOOST_CHECK(!wallet.IsScanning());
+    }
+
+    ForceSetArg("-rescanthreads", "1");
+    {
+        CWallet wallet;
+        LOCK(wallet.cs_wallet);
+        wallet.AddWatchOnly(CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG, 1);
+        BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chainActive.Genesis()), chainActive.Genesis());
+        BOOST_CHECK_EQUAL(wallet.mapWallet.size(), (size_t)chainActive.Height());
+    }
+    ForceSetArg("-rescanthreads", "0");
+}
+
+// Verify that a rescan finds a transaction spending an output that only became
+// the wallet's earlier in the same block.
+BOOST_FIXTURE_TEST_CASE(rescan_same_block_spend, TestChain100Setup)
+{
+    LOCK(cs_main);
+
+    CKey key;
+    key.MakeNewKey(true);
+    const CScript scriptCoinbase = GetScriptForRawPubKey(coinbaseKey.GetPubKey());
+    const CScript scriptKey = GetScriptForRawPubKey(key.GetPubKey());
+
+    CMutableTransaction txReceive;
+    txReceive.nVersion = 1;
+    txReceive.vin.resize(1);
+    txReceive.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    txReceive.vout.resize(1);
+    txReceive.vout[0].nValue = 11 * CENT;
+    txReceive.vout[0].scriptPubKey = scriptKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptCoinbase, txReceive, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    txReceive.vin[0].scriptSig << vchSig;
+
+    CMutableTransaction txSpend;
+    txSpend.nVersion = 1;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(txReceive.GetHash(), 0);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 10 * CENT;
+    txSpend.vout[0].scriptPubKey = scriptCoinbase;
+    vchSig.clear();
+    hash = SignatureHash(scriptKey, txSpend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    txSpend.vin[0].scriptSig << vchSig;
+
+    CreateAndProcessBlock({txReceive, txSpend}, scriptCoinbase);
+    BOOST_CHECK(chainActive.Tip()->nTx == 3);
+
+    CWallet wallet;
+    LOCK(wallet.cs_wallet);
+    wallet.AddKeyPubKey(key, key.GetPubKey());
+    BOOST_CHECK_EQUAL(wallet.ScanForWalletTransactions(chainActive.Tip()), chainActive.Tip());
+    BOOST_CHECK(wallet.GetWalletTx(txReceive.GetHash()));
+    BOOST_CHECK(wallet.GetWalletTx(txSpend.GetHash()));
+    BOOST_CHECK(!wallet.IsScanning());
+}
+
+// Verify the cached balances and the unspent index follow new wallet
+// transactions and tip changes, and agree with AvailableCoins.
+BOOST_FIXTURE_TEST_CASE(balance_cache, TestChain100Setup)
+{
+    LOCK(cs_main);
+    CWallet wallet;
+    LOCK(wallet.cs_wallet);
+    wallet.AddKeyPubKey(coinbaseKey, coinbaseKey.GetPubKey());
+    wallet.ScanForWalletTransactions(chainActive.Genesis());
+
+    const CAmount nTotal = wallet.GetBalance() + wallet.GetImmatureBalance();
+    BOOST_CHECK(nTotal > 0);
+    // Served from the cache the second time around.
+    BOOST_CHECK_EQUAL(wallet.GetBalance() + wallet.GetImmatureBalance(), nTotal);
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), 0);
+    BOOST_CHECK_EQUAL(wallet.GetWatchOnlyBalance(), 0);
+
+    std::vector<COutput> vAvailable;
+    wallet.AvailableCoins(vAvailable);
+    CAmount nAvailable = 0;
+    for (const COutput& out : vAvailable)
+        nAvailable += out.tx->tx->vout[out.i].nValue;
+    BOOST_CHECK_EQUAL(nAvailable, wallet.GetBalance());
+
+    CBlock block = CreateAndProcessBlock({}, GetScriptForRawPubKey(coinbaseKey.GetPubKey()));
+    wallet.ScanForWalletTransactions(chainActive.Tip());
+    BOOST_CHECK_EQUAL(wallet.GetBalance() + wallet.GetImmatureBalance(), nTotal + block.vtx[0]->GetValueOut());
+
+    wallet.AvailableCoins(vAvailable);
+    nAvailable = 0;
+    for (const COutput& out : vAvailable)
+        nAvailable += out.tx->tx->vout[out.i].nValue;
+    BOOST_CHECK_EQUAL(nAvailable, wallet.GetBalance());
+
+    // A full rebuild (as after an import) gives the same answer.
+    wallet.MarkDirty();
+    BOOST_CHECK_EQUAL(wallet.GetBalance() + wallet.GetImmatureBalance(), nTotal + block.vtx[0]->GetValueOut());
+}
+
 // Verify importwallet RPC starts rescan at earliest block with timestamp
 // greater or equal than key birthday. Previously there was a bug where
 // importwallet RPC would start the scan at the latest block with timestamp less
@@ -490,4 +641,198 @@ BOOST_FIXTURE_TEST_CASE(importwallet_rescan, TestChain100Setup)
     ::pwalletMain = pwalletMainBackup;
 }
 
+// Verify that keys and watch-only scripts added in a batch are all kept, and
+// that batches do not nest.
+BOOST_AUTO_TEST_CASE(import_batch)
+{
+    CWallet wallet;
+    LOCK(wallet.cs_wallet);
+    BOOST_CHECK(!wallet.CommitBatch());
+    BOOST_CHECK(wallet.BeginBatch());
+    BOOST_CHECK(!wallet.BeginBatch());
+
+    std::vector<CPubKey> vPubKeys;
+    for (int i = 0; i < 50; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        vPubKeys.push_back(key.GetPubKey());
+        BOOST_CHECK(wallet.AddKeyPubKey(key, key.GetPubKey()));
+        CKey watched;
+        watched.MakeNewKey(true);
+        BOOST_CHECK(wallet.AddWatchOnly(GetScriptForRawPubKey(watched.GetPubKey()), 1));
+        wallet.MarkDirty();
+    }
+    BOOST_CHECK(wallet.CommitBatch());
+    BOOST_CHECK(!wallet.CommitBatch());
+
+    for (const CPubKey& pubkey : vPubKeys)
+        BOOST_CHECK(wallet.HaveKey(pubkey.GetID()));
+    BOOST_CHECK(wallet.HaveWatchOnly());
+}
+
+// Verify that a batch scope left by an exception aborts its batch, and that a
+// scope opened inside a running batch leaves it to its owner.
+BOOST_AUTO_TEST_CASE(import_batch_scope)
+{
+    CWallet wallet;
+    LOCK(wallet.cs_wallet);
+    CKey key;
+    key.MakeNewKey(true);
+    const CScript script = GetScriptForDestination(key.GetPubKey().GetID());
+    try {
+        CWalletBatchScope batch(wallet);
+        BOOST_CHECK(batch.IsActive());
+        BOOST_CHECK(wallet.AddKeyPubKey(key, key.GetPubKey()));
+        BOOST_CHECK(wallet.AddCScript(script));
+        throw std::runtime_error("import failed");
+    } catch (const std::runtime_error&) {
+    }
+    BOOST_CHECK(!wallet.CommitBatch());
+    // What the aborted batch added is gone, so a retry adds it again
+    BOOST_CHECK(!wallet.HaveKey(key.GetPubKey().GetID()));
+    BOOST_CHECK(!wallet.HaveCScript(CScriptID(script)));
+
+    BOOST_CHECK(wallet.BeginBatch());
+    {
+        CWalletBatchScope batch(wallet);
+        BOOST_CHECK(!batch.IsActive());
+        BOOST_CHECK(batch.Commit());
+    }
+    BOOST_CHECK(wallet.CommitBatch());
+
+    {
+        CWalletBatchScope batch(wallet);
+        BOOST_CHECK(batch.Commit());
+    }
+    BOOST_CHECK(!wallet.CommitBatch());
+}
+
+// Keys for the keypool are derived in parallel and added in batches; the pool
+// must end up at its target size with consecutive HD keypaths.
+BOOST_AUTO_TEST_CASE(keypool_topup_batch)
+{
+    CWallet wallet("wallet_keypool_test.dat");
+    bool fFirstRun;
+    BOOST_CHECK_EQUAL(wallet.LoadWallet(fFirstRun), DB_LOAD_OK);
+    LOCK(wallet.cs_wallet);
+    BOOST_CHECK(wallet.SetHDMasterKey(wallet.GenerateNewHDMasterKey()));
+    const unsigned int nKeys = KEYPOOL_TOPUP_BATCH + 100;
+    BOOST_CHECK(wallet.TopUpKeyPool(nKeys));
+    BOOST_CHECK_EQUAL(wallet.GetKeyPoolSize(), nKeys + 1);
+    BOOST_CHECK_EQUAL(wallet.GetHDChain().nExternalChainCounter, nKeys + 1);
+
+    std::set<std::string> setKeypaths;
+    for (const auto& entry : wallet.mapKeyMetadata) {
+        BOOST_CHECK(entry.second.hdMasterKeyID == wallet.GetHDChain().masterKeyID);
+        if (entry.second.hdKeypath != "m")
+            setKeypaths.insert(entry.second.hdKeypath);
+    }
+    BOOST_CHECK_EQUAL(setKeypaths.size(), nKeys + 1);
+    BOOST_CHECK(setKeypaths.count("m/0'/0'/0'"));
+    BOOST_CHECK(setKeypaths.count(strprintf("m/0'/0'/%u'", nKeys)));
+
+    // Keys handed out are replaced on the next top up
+    CPubKey pubkey;
+    BOOST_CHECK(wallet.GetKeyFromPool(pubkey));
+    BOOST_CHECK(wallet.HaveKey(pubkey.GetID()));
+    BOOST_CHECK(wallet.TopUpKeyPool(nKeys));
+    BOOST_CHECK_EQUAL(wallet.GetKeyPoolSize(), nKeys + 1);
+}
+
+// Transaction records are parsed in parallel batches while a wallet is
+// loaded; all of them must be loaded with their metadata intact.
+BOOST_AUTO_TEST_CASE(load_wallet_parallel)
+{
+    const std::string strFile = "wallet_load_test.dat";
+    const size_t nTxs = WALLET_LOAD_TX_BATCH + 1000;
+    std::map<uint256, int64_t> mapOrderPos;
+    {
+        CWalletDB walletdb(strFile, "cr+");
+        for (size_t i = 0; i < nTxs; i++) {
+            CMutableTransaction mtx;
+            mtx.vin.resize(1);
+            mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+            mtx.vout.resize(1);
+            mtx.vout[0].nValue = i + 1;
+            CWalletTx wtx(NULL, MakeTransactionRef(std::move(mtx)));
+            wtx.nOrderPos = i;
+            mapOrderPos[wtx.GetHash()] = i;
+            BOOST_CHECK(walletdb.WriteTx(wtx));
+        }
+    }
+
+    CWallet wallet(strFile);
+    bool fFirstRun;
+    BOOST_CHECK_EQUAL(wallet.LoadWallet(fFirstRun), DB_LOAD_OK);
+    LOCK(wallet.cs_wallet);
+    BOOST_CHECK_EQUAL(wallet.mapWallet.size(), nTxs);
+    BOOST_CHECK_EQUAL(wallet.wtxOrdered.size(), nTxs);
+    for (const auto& entry : mapOrderPos) {
+        auto it = wallet.mapWallet.find(entry.first);
+        BOOST_CHECK(it != wallet.mapWallet.end() && it->second.nOrderPos == entry.second);
+    }
+}
+
+// The listing indexes file transactions by confirmation height and by the
+// destinations they pay to, and follow changes to the transactions.
+BOOST_AUTO_TEST_CASE(listing_indexes)
+{
+    CWallet wallet("wallet_listing_test.dat");
+    bool fFirstRun;
+    BOOST_CHECK_EQUAL(wallet.LoadWallet(fFirstRun), DB_LOAD_OK);
+    LOCK2(cs_main, wallet.cs_wallet);
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(wallet.AddKeyPubKey(key, key.GetPubKey()));
+    const CTxDestination destMine = key.GetPubKey().GetID();
+    CKey other;
+    other.MakeNewKey(true);
+    const CTxDestination destOther = other.GetPubKey().GetID();
+
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 10; i++) {
+        CMutableTransaction mtx;
+        mtx.vin.resize(1);
+        mtx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        mtx.vout.resize(1);
+        mtx.vout[0].nValue = i + 1;
+        mtx.vout[0].scriptPubKey = GetScriptForDestination(i % 2 ? destMine : destOther);
+        CWalletTx wtx(&wallet, MakeTransactionRef(std::move(mtx)));
+        if (i < 4) {
+            wtx.hashBlock = chainActive.Genesis()->GetBlockHash();
+            wtx.nIndex = 0;
+        }
+        BOOST_CHECK(wallet.AddToWallet(wtx));
+        vHashes.push_back(wtx.GetHash());
+    }
+
+    BOOST_CHECK_EQUAL(wallet.GetTxsSinceHeight(-1).size(), 10U);
+    BOOST_CHECK_EQUAL(wallet.GetTxsSinceHeight(0).size(), 6U);
+    BOOST_CHECK_EQUAL(wallet.GetTxsByDestination(destMine).size(), 5U);
+    BOOST_CHECK_EQUAL(wallet.GetTxsByDestination(destOther).size(), 5U);
+
+    // A transaction that leaves its block moves back to the unconfirmed ones
+    CWalletTx& wtx = wallet.mapWallet[vHashes[1]];
+    wtx.hashBlock = uint256();
+    wtx.nIndex = -1;
+    wtx.MarkDirty();
+    BOOST_CHECK_EQUAL(wallet.GetTxsSinceHeight(0).size(), 7U);
+
+    // The same after a full rebuild
+    wallet.MarkDirty();
+    BOOST_CHECK_EQUAL(wallet.GetTxsSinceHeight(0).size(), 7U);
+    BOOST_CHECK_EQUAL(wallet.GetTxsByDestination(destMine).size(), 5U);
+
+    // Counts of listed entries, cached per address book generation
+    size_t nSent, nReceived;
+    wtx.GetAmountsCount(nSent, nReceived, ISMINE_SPENDABLE);
+    BOOST_CHECK_EQUAL(nSent, 0U);
+    BOOST_CHECK_EQUAL(nReceived, 1U);
+    wallet.mapWallet[vHashes[0]].GetAmountsCount(nSent, nReceived, ISMINE_SPENDABLE);
+    BOOST_CHECK_EQUAL(nReceived, 0U);
+    const uint64_t nGeneration = wallet.GetAddressBookGeneration();
+    wallet.SetAddressBook(destMine, "mine", "receive");
+    BOOST_CHECK(wallet.GetAddressBookGeneration() != nGeneration);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
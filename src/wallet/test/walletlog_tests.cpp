@@ -0,0 +1,211 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/walletlog.h"
+
+#include "test/test_bitcoin.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(walletlog_tests, BasicTestingSetup)
+
+static CWalletLog::Key MakeKey(const std::string& str)
+{
+    return CWalletLog::Key(str.begin(), str.end());
+}
+
+static CWalletLog::Value MakeValue(const std::string& str)
+{
+    return CWalletLog::Value(str.begin(), str.end());
+}
+
+static std::string ReadString(const CWalletLog& log, const std::string& key)
+{
+    CWalletLog::Value value;
+    if (!log.Read(MakeKey(key), value))
+        return "";
+    return std::string(value.begin(), value.end());
+}
+
+static void Put(CWalletLog::Batch& batch, const std::string& key, const std::string& value)
+{
+    batch[MakeKey(key)] = std::make_pair(false, MakeValue(value));
+}
+
+static void Del(CWalletLog::Batch& batch, const std::string& key)
+{
+    batch[MakeKey(key)] = std::make_pair(true, CWalletLog::Value());
+}
+
+struct WalletLogSetup : public BasicTestingSetup {
+    boost::filesystem::path path;
+
+    WalletLogSetup()
+    {
+        path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    }
+    ~WalletLogSetup()
+    {
+        boost::filesystem::remove(path);
+    }
+};
+
+BOOST_FIXTURE_TEST_CASE(walletlog_replay, WalletLogSetup)
+{
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        CWalletLog::Batch batch;
+        Put(batch, "b", "2");
+        Put(batch, "a", "1");
+        Put(batch, "c", "3");
+        BOOST_CHECK(log.Commit(batch));
+        batch.clear();
+        Put(batch, "a", "one");
+        Del(batch, "c");
+        BOOST_CHECK(log.Commit(batch));
+        BOOST_CHECK_EQUAL(ReadString(log, "a"), "one");
+        BOOST_CHECK(!log.Exists(MakeKey("c")));
+        BOOST_CHECK(log.Sync());
+    }
+
+    CWalletLog log(path);
+    BOOST_CHECK(log.Open());
+    BOOST_CHECK_EQUAL(log.GetRecordCount(), 2U);
+    BOOST_CHECK_EQUAL(ReadString(log, "a"), "one");
+    BOOST_CHECK_EQUAL(ReadString(log, "b"), "2");
+    BOOST_CHECK(!log.Exists(MakeKey("c")));
+
+    // Cursor order is byte order of the keys
+    CWalletLog::Key key;
+    CWalletLog::Value value;
+    BOOST_CHECK(log.Next(key, value, true));
+    BOOST_CHECK(key == MakeKey("a"));
+    BOOST_CHECK(log.Next(key, value, false));
+    BOOST_CHECK(key == MakeKey("b"));
+    BOOST_CHECK(!log.Next(key, value, false));
+}
+
+BOOST_FIXTURE_TEST_CASE(walletlog_torn_and_corrupt, WalletLogSetup)
+{
+    uint64_t nIntactSize;
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        CWalletLog::Batch batch;
+        Put(batch, "first", "1");
+        BOOST_CHECK(log.Commit(batch));
+        batch.clear();
+        Put(batch, "second", "2");
+        BOOST_CHECK(log.Commit(batch));
+        nIntactSize = log.GetFileSize();
+        batch.clear();
+        Put(batch, "third", "3");
+        BOOST_CHECK(log.Commit(batch));
+    }
+
+    // Cut the last batch short, as if the write had been interrupted
+    boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 3);
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        BOOST_CHECK_EQUAL(log.GetFileSize(), nIntactSize);
+        BOOST_CHECK_EQUAL(ReadString(log, "second"), "2");
+        BOOST_CHECK(!log.Exists(MakeKey("third")));
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nIntactSize);
+
+    // Damage the first batch: opening fails, salvaging keeps the second
+    {
+        boost::filesystem::fstream stream(path, std::ios::in | std::ios::out | std::ios::binary);
+        stream.seekp(30);
+        stream.put('x');
+    }
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(!log.Open());
+    }
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open(true));
+        BOOST_CHECK(!log.Exists(MakeKey("first")));
+        BOOST_CHECK_EQUAL(ReadString(log, "second"), "2");
+    }
+    CWalletLog log(path);
+    BOOST_CHECK(log.Open());
+    BOOST_CHECK_EQUAL(log.GetRecordCount(), 1U);
+}
+
+// Only data that reaches the end of the file passes for an interrupted write
+BOOST_FIXTURE_TEST_CASE(walletlog_tail, WalletLogSetup)
+{
+    uint64_t nIntactSize;
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        CWalletLog::Batch batch;
+        Put(batch, "first", "1");
+        BOOST_CHECK(log.Commit(batch));
+        nIntactSize = log.GetFileSize();
+    }
+
+    // Space the file was extended by, but that was never written
+    boost::filesystem::resize_file(path, nIntactSize + 64);
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(log.Open());
+        BOOST_CHECK_EQUAL(log.GetFileSize(), nIntactSize);
+        BOOST_CHECK_EQUAL(ReadString(log, "first"), "1");
+    }
+
+    // Data that does not look like the start of a batch is damage
+    {
+        boost::filesystem::ofstream stream(path, std::ios::out | std::ios::binary | std::ios::app);
+        stream << std::string(64, 'x');
+    }
+    {
+        CWalletLog log(path);
+        BOOST_CHECK(!log.Open());
+    }
+    CWalletLog log(path);
+    BOOST_CHECK(log.Open(true));
+    BOOST_CHECK_EQUAL(ReadString(log, "first"), "1");
+    BOOST_CHECK_EQUAL(log.GetFileSize(), nIntactSize);
+}
+
+BOOST_FIXTURE_TEST_CASE(walletlog_compact, WalletLogSetup)
+{
+    CWalletLog log(path);
+    BOOST_CHECK(log.Open());
+    for (int i = 0; i < 200; i++) {
+        CWalletLog::Batch batch;
+        for (int j = 0; j < 50; j++)
+            Put(batch, strprintf("key%02d", j), strprintf("%0200d", i));
+        Put(batch, "pkey", "secret");
+        BOOST_CHECK(log.Commit(batch));
+    }
+    BOOST_CHECK(log.NeedsCompaction());
+    uint64_t nSizeBefore = log.GetFileSize();
+
+    BOOST_CHECK(log.Compact("pkey"));
+    BOOST_CHECK(log.GetFileSize() < nSizeBefore / 100);
+    BOOST_CHECK(!log.NeedsCompaction());
+    BOOST_CHECK(!log.Exists(MakeKey("pkey")));
+    BOOST_CHECK_EQUAL(log.GetRecordCount(), 50U);
+
+    // Writes after compaction append to the new file
+    CWalletLog::Batch batch;
+    Put(batch, "key00", "new");
+    BOOST_CHECK(log.Commit(batch));
+    log.Close();
+    BOOST_CHECK(log.Open());
+    BOOST_CHECK_EQUAL(log.GetRecordCount(), 50U);
+    BOOST_CHECK_EQUAL(ReadString(log, "key00"), "new");
+    BOOST_CHECK_EQUAL(ReadString(log, "key49"), strprintf("%0200d", 199));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -11,6 +11,10 @@
 #include "wallet/coincontrol.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "init.h"
 #include "key.h"
 #include "keystore.h"
 #include "validation.h"
@@ -27,6 +31,8 @@
 #include "utilmoneystr.h"
 
 #include <assert.h>
+#include <thread>
+#include <unordered_set>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
@@ -64,12 +70,11 @@ const uint256 CMerkleTx::ABANDON_HASH(uint256S("00000000000000000000000000000000
  * @{
  */
 
-struct CompareValueOnly
+struct CompareValueDescending
 {
-    bool operator()(const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t1,
-                    const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t2) const
+    bool operator()(const CSelectableCoins::Coin& c1, const CSelectableCoins::Coin& c2) const
     {
-        return t1.first < t2.first;
+        return c1.nValue > c2.nValue;
     }
 };
 
@@ -78,6 +83,35 @@ std::string COutput::ToString() const
     return strprintf("COutput(%s, %d, %d) [%s]", tx->GetHash().ToString(), i, nDepth, FormatMoney(tx->tx->vout[i].nValue));
 }
 
+CSelectableCoins::CSelectableCoins(const std::vector<COutput>& vAvailableCoins)
+{
+    vCoins.reserve(vAvailableCoins.size());
+    BOOST_FOREACH(const COutput& output, vAvailableCoins)
+    {
+        if (!output.fSpendable)
+            continue;
+        Coin coin;
+        coin.nValue = output.tx->tx->vout[output.i].nValue;
+        coin.coin = std::make_pair(output.tx, (unsigned int)output.i);
+        coin.nDepth = output.nDepth;
+        coin.fFromMe = output.tx->IsFromMe(ISMINE_ALL);
+        vCoins.push_back(coin);
+    }
+    // Shuffle first, so that the stable sort leaves coins of equal value in random order
+    FastRandomContext insecure_rand;
+    for (size_t i = vCoins.size(); i > 1; i--)
+        std::swap(vCoins[i - 1], vCoins[insecure_rand.rand32() % i]);
+    std::stable_sort(vCoins.begin(), vCoins.end(), CompareValueDescending());
+}
+
+CSelectableCoins::CSelectableCoins(const CSelectableCoins& other, const std::set<std::pair<const CWalletTx*, unsigned int> >& setExclude)
+{
+    vCoins.reserve(other.vCoins.size());
+    BOOST_FOREACH(const Coin& coin, other.vCoins)
+        if (!setExclude.count(coin.coin))
+            vCoins.push_back(coin);
+}
+
 const CWalletTx* CWallet::GetWalletTx(const uint256& hash) const
 {
     LOCK(cs_wallet);
@@ -90,44 +124,53 @@ const CWalletTx* CWallet::GetWalletTx(const uint256& hash) const
 CPubKey CWallet::GenerateNewKey()
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
-    bool fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+    std::vector<CPubKey> vPubKeys = GenerateNewKeys(1);
+    if (vPubKeys.empty())
+        throw std::runtime_error(std::string(__func__) + ": AddKey failed");
+    return vPubKeys[0];
+}
 
-    CKey secret;
+std::vector<CPubKey> CWallet::GenerateNewKeys(unsigned int nKeys, bool fAddToKeyPool)
+{
+    std::vector<CPubKey> vAdded;
+    while (vAdded.size() < nKeys) {
+        CNewKeyContext context;
+        {
+            LOCK(cs_wallet);
+            if (IsLocked())
+                break;
+            PrepareNewKeys(context);
+        }
 
-    // Create new metadata
-    int64_t nCreationTime = GetTime();
-    CKeyMetadata metadata(nCreationTime);
+        std::vector<CKey> vKeys;
+        std::vector<CPubKey> vPubKeys;
+        DeriveNewKeys(context, nKeys - vAdded.size(), vKeys, vPubKeys);
 
-    // use HD key derivation if HD was enabled during wallet creation
-    if (IsHDEnabled()) {
-        DeriveNewChildKey(metadata, secret);
-    } else {
-        secret.MakeNewKey(fCompressed);
+        {
+            LOCK(cs_wallet);
+            if (IsLocked())
+                break;
+            AddNewKeys(context, vKeys, vPubKeys, fAddToKeyPool, vAdded);
+        }
     }
-
-    // Compressed public keys were introduced in version 0.6.0
-    if (fCompressed)
-        SetMinVersion(FEATURE_COMPRPUBKEY);
-
-    CPubKey pubkey = secret.GetPubKey();
-    assert(secret.VerifyPubKey(pubkey));
-
-    mapKeyMetadata[pubkey.GetID()] = metadata;
-    UpdateTimeFirstKey(nCreationTime);
-
-    if (!AddKeyPubKey(secret, pubkey))
-        throw std::runtime_error(std::string(__func__) + ": AddKey failed");
-    return pubkey;
+    return vAdded;
 }
 
-void CWallet::DeriveNewChildKey(CKeyMetadata& metadata, CKey& secret)
+void CWallet::PrepareNewKeys(CNewKeyContext& context)
 {
+    AssertLockHeld(cs_wallet);
+    context.fCompressed = CanSupportFeature(FEATURE_COMPRPUBKEY); // default to compressed public keys if we want 0.6.0 wallets
+    context.nCreationTime = GetTime();
+
+    // use HD key derivation if HD was enabled during wallet creation
+    context.fHD = IsHDEnabled();
+    if (!context.fHD)
+        return;
+
     // for now we use a fixed keypath scheme of m/0'/0'/k
     CKey key;                      //master key seed (256bit)
     CExtKey masterKey;             //hd master key
     CExtKey accountKey;            //key at m/0'
-    CExtKey externalChainChildKey; //key at m/0'/0'
-    CExtKey childKey;              //key at m/0'/0'/<n>'
 
     // try to get the master key
     if (!GetKey(hdChain.masterKeyID, key))
@@ -140,31 +183,110 @@ void CWallet::DeriveNewChildKey(CKeyMetadata& metadata, CKey& secret)
     masterKey.Derive(accountKey, BIP32_HARDENED_KEY_LIMIT);
 
     // derive m/0'/0'
-    accountKey.Derive(externalChainChildKey, BIP32_HARDENED_KEY_LIMIT);
-
-    // derive child key at next index, skip keys already known to the wallet
-    do {
-        // always derive hardened keys
-        // childIndex | BIP32_HARDENED_KEY_LIMIT = derive childIndex in hardened child-index-range
-        // example: 1 | BIP32_HARDENED_KEY_LIMIT == 0x80000001 == 2147483649
-        externalChainChildKey.Derive(childKey, hdChain.nExternalChainCounter | BIP32_HARDENED_KEY_LIMIT);
-        metadata.hdKeypath = "m/0'/0'/" + std::to_string(hdChain.nExternalChainCounter) + "'";
-        metadata.hdMasterKeyID = hdChain.masterKeyID;
-        // increment childkey index
-        hdChain.nExternalChainCounter++;
-    } while (HaveKey(childKey.key.GetPubKey().GetID()));
-    secret = childKey.key;
-
-    // update the chain model in the database
-    if (!CWalletDB(strWalletFile).WriteHDChain(hdChain))
-        throw std::runtime_error(std::string(__func__) + ": Writing HD chain model failed");
+    accountKey.Derive(context.chainKey, BIP32_HARDENED_KEY_LIMIT);
+    context.masterKeyID = hdChain.masterKeyID;
+    context.nChildIndex = hdChain.nExternalChainCounter;
+}
+
+void CWallet::DeriveNewKeys(const CNewKeyContext& context, unsigned int nKeys, std::vector<CKey>& vKeys, std::vector<CPubKey>& vPubKeys)
+{
+    vKeys.assign(nKeys, CKey());
+    vPubKeys.assign(nKeys, CPubKey());
+    std::atomic<unsigned int> nNext(0);
+    auto worker = [&]() {
+        unsigned int i;
+        while ((i = nNext++) < nKeys) {
+            if (context.fHD) {
+                // always derive hardened keys
+                // childIndex | BIP32_HARDENED_KEY_LIMIT = derive childIndex in hardened child-index-range
+                // example: 1 | BIP32_HARDENED_KEY_LIMIT == 0x80000001 == 2147483649
+                CExtKey childKey;
+                context.chainKey.Derive(childKey, (context.nChildIndex + i) | BIP32_HARDENED_KEY_LIMIT);
+                vKeys[i] = childKey.key;
+            } else {
+                vKeys[i].MakeNewKey(context.fCompressed);
+            }
+            vPubKeys[i] = vKeys[i].GetPubKey();
+            assert(vKeys[i].VerifyPubKey(vPubKeys[i]));
+        }
+    };
+    // Deriving a key is cheap next to starting a thread; only spread out larger batches
+    int nThreads = std::min(std::min(GetNumCores(), MAX_KEY_DERIVATION_THREADS), (int)(nKeys / 16));
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nThreads; ++i)
+        threads.emplace_back(worker);
+    worker();
+    BOOST_FOREACH(std::thread& thread, threads)
+        thread.join();
+}
+
+void CWallet::AddNewKeys(const CNewKeyContext& context, const std::vector<CKey>& vKeys, const std::vector<CPubKey>& vPubKeys, bool fAddToKeyPool, std::vector<CPubKey>& vAdded)
+{
+    AssertLockHeld(cs_wallet);
+    // Someone else derived keys from the HD chain meanwhile; derive again
+    if (context.fHD != IsHDEnabled() || (context.fHD && (hdChain.masterKeyID != context.masterKeyID || hdChain.nExternalChainCounter != context.nChildIndex)))
+        return;
+
+    // Compressed public keys were introduced in version 0.6.0
+    if (context.fCompressed)
+        SetMinVersion(FEATURE_COMPRPUBKEY);
+
+    CWalletBatchScope batch(*this);
+    CWalletDB walletdbLocal(pwalletdbBatch ? std::string() : strWalletFile);
+    CWalletDB& walletdb = pwalletdbBatch ? *pwalletdbBatch : walletdbLocal;
+    std::vector<int64_t> vPoolAdded;
+    try {
+        for (size_t i = 0; i < vKeys.size(); i++) {
+            CKeyMetadata metadata(context.nCreationTime);
+            if (context.fHD) {
+                // skip keys already known to the wallet
+                metadata.hdKeypath = "m/0'/0'/" + std::to_string(hdChain.nExternalChainCounter) + "'";
+                metadata.hdMasterKeyID = hdChain.masterKeyID;
+                hdChain.nExternalChainCounter++;
+                if (HaveKey(vPubKeys[i].GetID()))
+                    continue;
+            }
+
+            mapKeyMetadata[vPubKeys[i].GetID()] = metadata;
+            UpdateTimeFirstKey(context.nCreationTime);
+            if (!AddKeyPubKey(vKeys[i], vPubKeys[i]))
+                throw std::runtime_error(std::string(__func__) + ": AddKey failed");
+
+            if (fAddToKeyPool) {
+                int64_t nEnd = 1;
+                if (!setKeyPool.empty())
+                    nEnd = *(--setKeyPool.end()) + 1;
+                if (!walletdb.WritePool(nEnd, CKeyPool(vPubKeys[i])))
+                    throw std::runtime_error(std::string(__func__) + ": writing generated key failed");
+                setKeyPool.insert(nEnd);
+                vPoolAdded.push_back(nEnd);
+            }
+            vAdded.push_back(vPubKeys[i]);
+        }
+
+        // update the chain model in the database
+        if (context.fHD && !walletdb.WriteHDChain(hdChain))
+            throw std::runtime_error(std::string(__func__) + ": Writing HD chain model failed");
+    } catch (...) {
+        // The batch is aborted on the way out; don't hand out pool entries it never wrote
+        if (batch.IsActive()) {
+            BOOST_FOREACH(int64_t nIndex, vPoolAdded)
+                setKeyPool.erase(nIndex);
+        }
+        throw;
+    }
+    if (!batch.Commit())
+        throw std::runtime_error(std::string(__func__) + ": writing generated keys failed");
 }
 
 bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
+    const bool fNew = !HaveKey(pubkey.GetID());
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    if (fInBatch && fNew)
+        vBatchKeys.push_back(pubkey.GetID());
 
     // check if we need to remove from watch-only
     CScript script;
@@ -178,6 +300,10 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
+        if (pwalletdbBatch)
+            return pwalletdbBatch->WriteKey(pubkey,
+                                            secret.GetPrivKey(),
+                                            mapKeyMetadata[pubkey.GetID()]);
         return CWalletDB(strWalletFile).WriteKey(pubkey,
                                                  secret.GetPrivKey(),
                                                  mapKeyMetadata[pubkey.GetID()]);
@@ -198,6 +324,10 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
             return pwalletdbEncryption->WriteCryptedKey(vchPubKey,
                                                         vchCryptedSecret,
                                                         mapKeyMetadata[vchPubKey.GetID()]);
+        else if (pwalletdbBatch)
+            return pwalletdbBatch->WriteCryptedKey(vchPubKey,
+                                                   vchCryptedSecret,
+                                                   mapKeyMetadata[vchPubKey.GetID()]);
         else
             return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey,
                                                             vchCryptedSecret,
@@ -233,10 +363,15 @@ void CWallet::UpdateTimeFirstKey(int64_t nCreateTime)
 
 bool CWallet::AddCScript(const CScript& redeemScript)
 {
+    const bool fNew = !HaveCScript(CScriptID(redeemScript));
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    if (fInBatch && fNew)
+        vBatchScripts.push_back(CScriptID(redeemScript));
     if (!fFileBacked)
         return true;
+    if (pwalletdbBatch)
+        return pwalletdbBatch->WriteCScript(Hash160(redeemScript), redeemScript);
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
@@ -258,13 +393,18 @@ bool CWallet::LoadCScript(const CScript& redeemScript)
 
 bool CWallet::AddWatchOnly(const CScript& dest)
 {
+    const bool fNew = !HaveWatchOnly(dest);
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    if (fInBatch && fNew)
+        vBatchWatchOnlyAdded.push_back(dest);
     const CKeyMetadata& meta = mapKeyMetadata[CScriptID(dest)];
     UpdateTimeFirstKey(meta.nCreateTime);
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
         return true;
+    if (pwalletdbBatch)
+        return pwalletdbBatch->WriteWatchOnly(dest, meta);
     return CWalletDB(strWalletFile).WriteWatchOnly(dest, meta);
 }
 
@@ -279,11 +419,14 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
         return false;
+    if (fInBatch)
+        vBatchWatchOnlyRemoved.push_back(dest);
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
-    if (fFileBacked)
-        if (!CWalletDB(strWalletFile).EraseWatchOnly(dest))
+    if (fFileBacked) {
+        if (pwalletdbBatch ? !pwalletdbBatch->EraseWatchOnly(dest) : !CWalletDB(strWalletFile).EraseWatchOnly(dest))
             return false;
+    }
 
     return true;
 }
@@ -476,11 +619,14 @@ bool CWallet::Verify()
     if (GetBoolArg("-salvagewallet", false))
     {
         // Recover readable keypairs:
-        if (!CWalletDB::Recover(bitdb, walletFile, true))
+        if (bitdb.IsLogBackend() ? !bitdb.SalvageLog(walletFile) : !CWalletDB::Recover(bitdb, walletFile, true))
             return false;
     }
-    
-    if (boost::filesystem::exists(GetDataDir() / walletFile))
+
+    if (!bitdb.IsLogBackend() && boost::filesystem::exists(GetDataDir() / (walletFile + ".log")))
+        InitWarning(strprintf(_("%s exists: changes made with -walletbackend=log are not in %s"), walletFile + ".log", walletFile));
+
+    if (boost::filesystem::exists(GetDataDir() / bitdb.GetFileName(walletFile)))
     {
         CDBEnv::VerifyResult r = bitdb.Verify(walletFile, CWalletDB::Recover);
         if (r == CDBEnv::RECOVER_OK)
@@ -844,11 +990,110 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        // Imports call this for every entry; once at the end of the batch is enough
+        if (fInBatch) {
+            fBatchMarkDirty = true;
+            return;
+        }
+        // Ownership of outputs may have changed (e.g. after an import), so
+        // rebuild the unspent index from scratch instead of queueing every tx.
+        fUnspentTxsStale = true;
+        setDirtyTxs.clear();
+        fTxIndexesStale = true;
+        setIndexDirtyTxs.clear();
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
     }
 }
 
+bool CWallet::BeginBatch()
+{
+    AssertLockHeld(cs_wallet);
+    if (fInBatch)
+        return false;
+    if (fFileBacked) {
+        pwalletdbBatch = new CWalletDB(strWalletFile);
+        if (!pwalletdbBatch->TxnBegin()) {
+            delete pwalletdbBatch;
+            pwalletdbBatch = NULL;
+            return false;
+        }
+    }
+    fInBatch = true;
+    fBatchMarkDirty = false;
+    hdChainBatch = hdChain;
+    return true;
+}
+
+bool CWallet::CommitBatch()
+{
+    AssertLockHeld(cs_wallet);
+    if (!fInBatch)
+        return false;
+    bool fResult = true;
+    if (pwalletdbBatch) {
+        fResult = pwalletdbBatch->TxnCommit();
+        delete pwalletdbBatch;
+        pwalletdbBatch = NULL;
+    }
+    fInBatch = false;
+    ClearBatchUndo();
+    if (fBatchMarkDirty)
+        MarkDirty();
+    return fResult;
+}
+
+void CWallet::AbortBatch()
+{
+    AssertLockHeld(cs_wallet);
+    if (!fInBatch)
+        return;
+    if (pwalletdbBatch) {
+        pwalletdbBatch->TxnAbort();
+        delete pwalletdbBatch;
+        pwalletdbBatch = NULL;
+    }
+    fInBatch = false;
+
+    // Nothing of the batch reached the database; if it stayed in memory, a
+    // retry would take it as present and never write it.
+    BOOST_FOREACH(const CKeyID& keyid, vBatchKeys)
+        EraseKey(keyid);
+    {
+        LOCK(cs_KeyStore);
+        BOOST_FOREACH(const CScriptID& scriptid, vBatchScripts)
+            mapScripts.erase(scriptid);
+    }
+    BOOST_FOREACH(const CScript& dest, vBatchWatchOnlyAdded)
+        CCryptoKeyStore::RemoveWatchOnly(dest);
+    BOOST_FOREACH(const CScript& dest, vBatchWatchOnlyRemoved)
+        CCryptoKeyStore::AddWatchOnly(dest);
+    if (!vBatchWatchOnlyAdded.empty() || !vBatchWatchOnlyRemoved.empty())
+        NotifyWatchonlyChanged(HaveWatchOnly());
+    hdChain = hdChainBatch;
+    ClearBatchUndo();
+    if (fBatchMarkDirty)
+        MarkDirty();
+}
+
+void CWallet::ClearBatchUndo()
+{
+    vBatchKeys.clear();
+    vBatchScripts.clear();
+    vBatchWatchOnlyAdded.clear();
+    vBatchWatchOnlyRemoved.clear();
+}
+
+void CWallet::MarkTxDirty(const uint256& hash) const
+{
+    LOCK(cs_wallet);
+    ++nTxGeneration;
+    if (!fUnspentTxsStale)
+        setDirtyTxs.insert(hash);
+    if (!fTxIndexesStale)
+        setIndexDirtyTxs.insert(hash);
+}
+
 bool CWallet::MarkReplaced(const uint256& originalHash, const uint256& newHash)
 {
     LOCK(cs_wallet);
@@ -1006,6 +1251,8 @@ bool CWallet::LoadToWallet(const CWalletTx& wtxIn)
     wtx.BindWallet(this);
     wtxOrdered.insert(make_pair(wtx.nOrderPos, TxPair(&wtx, (CAccountingEntry*)0)));
     AddToSpends(hash);
+    fUnspentTxsStale = true;
+    fTxIndexesStale = true;
     BOOST_FOREACH(const CTxIn& txin, wtx.tx->vin) {
         if (mapWallet.count(txin.prevout.hash)) {
             CWalletTx& prevtx = mapWallet[txin.prevout.hash];
@@ -1506,6 +1753,29 @@ void CWalletTx::GetAmounts(list<COutputEntry>& listReceived,
 
 }
 
+void CWalletTx::GetAmountsCount(size_t& nSent, size_t& nReceived, const isminefilter& filter) const
+{
+    const int nSlot = filter == ISMINE_SPENDABLE ? 0 : (filter == ISMINE_ALL ? 1 : -1);
+    if (nSlot >= 0 && nAmountsCountGeneration[nSlot] == pwallet->GetAddressBookGeneration()) {
+        nSent = nAmountsCountCached[nSlot][0];
+        nReceived = nAmountsCountCached[nSlot][1];
+        return;
+    }
+
+    CAmount nFee;
+    string strSentAccount;
+    list<COutputEntry> listReceived;
+    list<COutputEntry> listSent;
+    GetAmounts(listReceived, listSent, nFee, strSentAccount, filter);
+    nSent = listSent.size();
+    nReceived = listReceived.size();
+    if (nSlot >= 0) {
+        nAmountsCountCached[nSlot][0] = nSent;
+        nAmountsCountCached[nSlot][1] = nReceived;
+        nAmountsCountGeneration[nSlot] = pwallet->GetAddressBookGeneration();
+    }
+}
+
 void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
                                   CAmount& nSent, CAmount& nFee, const isminefilter& filter) const
 {
@@ -1542,21 +1812,237 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
 }
 
 /**
- * Scan the block chain (starting in pindexStart) for transactions
- * from or to us. If fUpdate is true, found transactions that already
- * exist in the wallet will be updated.
+ * Conservative prefilter for rescans. A transaction can only involve the
+ * wallet if it already is a wallet transaction, if it spends an output of
+ * one, or if one of its outputs pays to a key, script or watch-only script we
+ * know. Outputs are matched on the data pushes of their scriptPubKey (key IDs,
+ * script IDs, public keys and witness script hashes), which covers every
+ * template IsMine understands: there may be false positives, but no false
+ * negatives. Output matching only reads the filter and is done on the block
+ * reading threads; the transaction set grows as matches are added to the
+ * wallet and is only used by the scanning thread.
+ */
+class CRescanFilter
+{
+private:
+    struct ShortIdHasher
+    {
+        size_t operator()(const uint160& id) const { return ReadLE64(id.begin()); }
+    };
+
+    std::unordered_set<uint160, ShortIdHasher> setIds;
+    std::unordered_set<uint256, SaltedTxidHasher> setWitnessScriptHashes;
+    std::set<CScript> setScripts;
+    std::unordered_set<uint256, SaltedTxidHasher> setTxids;
+
+public:
+    void AddKeyId(const CKeyID& keyid) { setIds.insert(keyid); }
+
+    void AddScript(const CScript& script)
+    {
+        setIds.insert(CScriptID(script));
+        uint256 hash;
+        CSHA256().Write(script.data(), script.size()).Finalize(hash.begin());
+        setWitnessScriptHashes.insert(hash);
+    }
+
+    void AddWatchOnly(const CScript& script)
+    {
+        setScripts.insert(script);
+        CScript::const_iterator pc = script.begin();
+        opcodetype opcode;
+        std::vector<unsigned char> vch;
+        while (pc < script.end() && script.GetOp(pc, opcode, vch)) {
+            if (vch.size() == 20)
+                setIds.insert(uint160(vch));
+            else if (vch.size() == 33 || vch.size() == 65)
+                setIds.insert(Hash160(vch));
+        }
+    }
+
+    void AddTxid(const uint256& hash) { setTxids.insert(hash); }
+
+    bool MatchesOutputs(const CTransaction& tx) const
+    {
+        std::vector<unsigned char> vch;
+        BOOST_FOREACH(const CTxOut& txout, tx.vout) {
+            const CScript& script = txout.scriptPubKey;
+            if (setScripts.count(script))
+                return true;
+            CScript::const_iterator pc = script.begin();
+            opcodetype opcode;
+            while (pc < script.end() && script.GetOp(pc, opcode, vch)) {
+                if (vch.size() == 20 && setIds.count(uint160(vch)))
+                    return true;
+                if ((vch.size() == 33 || vch.size() == 65) && setIds.count(Hash160(vch)))
+                    return true;
+                if (vch.size() == 32 && setWitnessScriptHashes.count(uint256(vch)))
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    bool MatchesTxOrInputs(const CTransaction& tx) const
+    {
+        if (setTxids.count(tx.GetHash()))
+            return true;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (setTxids.count(txin.prevout.hash))
+                return true;
+        return false;
+    }
+};
+
+void CWallet::GetRescanFilter(CRescanFilter& filter) const
+{
+    AssertLockHeld(cs_wallet);
+
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    BOOST_FOREACH(const CKeyID& keyid, setKeys)
+        filter.AddKeyId(keyid);
+    {
+        LOCK(cs_KeyStore);
+        for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+            filter.AddScript(it->second);
+        BOOST_FOREACH(const CScript& script, setWatchOnly)
+            filter.AddWatchOnly(script);
+    }
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        filter.AddTxid(it->first);
+}
+
+namespace {
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    //! Where the block was stored when the batch was taken under cs_main, if it had data
+    CDiskBlockPos pos;
+    bool fHaveData;
+    CBlock block;
+    bool fRead;
+    //! per transaction: whether an output matched the filter
+    std::vector<bool> vMatch;
+
+    explicit CRescanBlock(CBlockIndex* pindexIn) : pindex(pindexIn), fHaveData(false), fRead(false) {}
+};
+
+/**
+ * Read and prefilter a batch of blocks on nThreads threads (including the
+ * calling one). The workers don't take cs_main, so they only read from the
+ * positions taken with the batch; a block moved or pruned meanwhile fails to
+ * read and is left to the caller.
+ */
+void ReadRescanBatch(std::vector<CRescanBlock>& vBlocks, const CRescanFilter& filter, int nThreads)
+{
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    std::atomic<size_t> nNext(0);
+    auto worker = [&]() {
+        size_t i;
+        while ((i = nNext++) < vBlocks.size()) {
+            CRescanBlock& entry = vBlocks[i];
+            if (!entry.fHaveData)
+                continue;
+            entry.fRead = ReadBlockFromDisk(entry.block, entry.pos, entry.pindex->GetBlockHash(), consensusParams);
+            if (!entry.fRead)
+                continue;
+            entry.vMatch.resize(entry.block.vtx.size());
+            for (size_t posInBlock = 0; posInBlock < entry.block.vtx.size(); ++posInBlock)
+                entry.vMatch[posInBlock] = filter.MatchesOutputs(*entry.block.vtx[posInBlock]);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nThreads && (size_t)i < vBlocks.size(); ++i)
+        threads.emplace_back(worker);
+    worker();
+    BOOST_FOREACH(std::thread& thread, threads)
+        thread.join();
+}
+}
+
+CBlockIndex* CWallet::GetRescanResumePoint() const
+{
+    AssertLockHeld(cs_main);
+    CBlockLocator locator;
+    if (!fFileBacked || !CWalletDB(strWalletFile).ReadRescanResume(locator) || locator.IsNull())
+        return NULL;
+    return FindForkInGlobalIndex(chainActive, locator);
+}
+
+void CWallet::UpdateRescanResumePoint(const CBlockIndex* pindexScanStart, const CBlockIndex* pindexUnscanned, bool fReachedTip)
+{
+    AssertLockHeld(cs_main);
+    if (!fFileBacked)
+        return;
+
+    const CBlockIndex* pindexResume = GetRescanResumePoint();
+    // An older gap is still unscanned; resuming from there covers this scan too.
+    if (pindexResume && pindexResume->nHeight < pindexScanStart->nHeight)
+        return;
+
+    CWalletDB walletdb(strWalletFile);
+    if (pindexUnscanned)
+        walletdb.WriteRescanResume(chainActive.GetLocator(pindexUnscanned));
+    else if (pindexResume && fReachedTip)
+        walletdb.EraseRescanResume();
+}
+
+namespace {
+/** Clears the scanning flag however ScanForWalletTransactions is left */
+class CScanningWalletGuard
+{
+    std::atomic<bool>& fScanning;
+public:
+    explicit CScanningWalletGuard(std::atomic<bool>& fScanningIn) : fScanning(fScanningIn) {}
+    ~CScanningWalletGuard() { fScanning = false; }
+};
+}
+
+/**
+ * Scan the block chain (starting in pindexStart, up to and including
+ * pindexStop if given) for transactions from or to us. If fUpdate is true,
+ * found transactions that already exist in the wallet will be updated.
+ *
+ * Blocks are read and prefiltered in batches on -rescanthreads threads.
+ * cs_main and cs_wallet are only held to walk the chain and to add matching
+ * transactions, so the node keeps running during long rescans. A reorg while
+ * the locks are released continues the scan at the fork point.
+ *
+ * The scan stops early on AbortRescan() or shutdown; the first block that was
+ * not scanned is then stored so that the next rescan can resume there. The
+ * same happens for a block that has data but cannot be read.
  *
  * Returns pointer to the first block in the last contiguous range that was
- * successfully scanned.
+ * successfully scanned, or NULL if a block with data could not be read.
  *
  */
-CBlockIndex* CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
-{
+CBlockIndex* CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate, CBlockIndex* pindexStop, bool* pfAlreadyScanning)
+{
+    if (pfAlreadyScanning)
+        *pfAlreadyScanning = false;
+    if (fScanningWallet.exchange(true)) {
+        LogPrintf("%s: a rescan is already in progress\n", __func__);
+        if (pfAlreadyScanning)
+            *pfAlreadyScanning = true;
+        return NULL;
+    }
+    CScanningWalletGuard scanningGuard(fScanningWallet);
+    fAbortRescan = false;
+
     CBlockIndex* ret = nullptr;
     int64_t nNow = GetTime();
     const CChainParams& chainParams = Params();
 
+    int nThreads = GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS);
+    if (nThreads <= 0)
+        nThreads = GetNumCores();
+    nThreads = std::max(1, std::min(nThreads, MAX_RESCAN_THREADS));
+    const size_t nBatchSize = 16 * nThreads;
+
+    CRescanFilter filter;
     CBlockIndex* pindex = pindexStart;
+    double dProgressStart, dProgressTip;
     {
         LOCK2(cs_main, cs_wallet);
 
@@ -1565,33 +2051,117 @@ CBlockIndex* CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool f
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
+        GetRescanFilter(filter);
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = GuessVerificationProgress(chainParams.TxData(), pindex);
-        double dProgressTip = GuessVerificationProgress(chainParams.TxData(), chainActive.Tip());
-        while (pindex)
+        dProgressStart = GuessVerificationProgress(chainParams.TxData(), pindex);
+        dProgressTip = GuessVerificationProgress(chainParams.TxData(), chainActive.Tip());
+    }
+    const CBlockIndex* pindexFirst = pindex;
+
+    std::vector<CRescanBlock> vBlocks;
+    CBlockIndex* pindexLast = NULL; // last block whose transactions were applied
+    CBlockIndex* pindexFailed = NULL; // first block that has data but could not be read
+    bool fReachedStop = false;
+    while (pindex && !fReachedStop && !fAbortRescan && !ShutdownRequested())
+    {
+        vBlocks.clear();
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((GuessVerificationProgress(chainParams.TxData(), pindex) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            LOCK(cs_main);
+            if (!chainActive.Contains(pindex)) {
+                // Reorganized while the lock was released: continue after the fork
+                pindex = chainActive.Next(chainActive.FindFork(pindex));
+                if (!pindex)
+                    break;
+            }
+            for (CBlockIndex* pindexBatch = pindex; pindexBatch && vBlocks.size() < nBatchSize; pindexBatch = chainActive.Next(pindexBatch)) {
+                // Block files may be rewritten or pruned once cs_main is released
+                vBlocks.push_back(CRescanBlock(pindexBatch));
+                vBlocks.back().fHaveData = pindexBatch->nStatus & BLOCK_HAVE_DATA;
+                if (vBlocks.back().fHaveData)
+                    vBlocks.back().pos = pindexBatch->GetBlockPos();
+                if (pindexBatch == pindexStop || (pindexStop && pindexBatch->nHeight >= pindexStop->nHeight))
+                    break;
+            }
+        }
+        if (vBlocks.empty())
+            break;
+
+        ReadRescanBatch(vBlocks, filter, nThreads);
+
+        for (size_t i = 0; i < vBlocks.size() && !fAbortRescan; ++i) {
+            CRescanBlock& entry = vBlocks[i];
+            CBlockIndex* pindexBlock = entry.pindex;
+            if (pindexBlock->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((GuessVerificationProgress(chainParams.TxData(), pindexBlock) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+
+            if (entry.fHaveData && !entry.fRead) {
+                // The block may have moved since the batch was taken; read it
+                // again where the index has it now.
+                LOCK(cs_main);
+                if (pindexBlock->nStatus & BLOCK_HAVE_DATA) {
+                    entry.fRead = ReadBlockFromDisk(entry.block, pindexBlock, chainParams.GetConsensus());
+                    if (entry.fRead) {
+                        entry.vMatch.resize(entry.block.vtx.size());
+                        for (size_t posInBlock = 0; posInBlock < entry.block.vtx.size(); ++posInBlock)
+                            entry.vMatch[posInBlock] = filter.MatchesOutputs(*entry.block.vtx[posInBlock]);
+                    }
+                }
+                if (!entry.fRead) {
+                    LogPrintf("%s: Failed to read block %s at height %d, it was not scanned\n", __func__, pindexBlock->GetBlockHash().ToString(), pindexBlock->nHeight);
+                    if (!pindexFailed)
+                        pindexFailed = pindexBlock;
+                }
+            }
 
-            CBlock block;
-            if (ReadBlockFromDisk(block, pindex, Params().GetConsensus())) {
-                for (size_t posInBlock = 0; posInBlock < block.vtx.size(); ++posInBlock) {
-                    AddToWalletIfInvolvingMe(*block.vtx[posInBlock], pindex, posInBlock, fUpdate);
+            if (entry.fRead) {
+                // Only take the locks for blocks with a candidate. Once one is
+                // found, the rest of the block is matched in order, so that a
+                // spend of an output added earlier in the same block is seen.
+                size_t posFirst = 0;
+                while (posFirst < entry.block.vtx.size() && !entry.vMatch[posFirst] && !filter.MatchesTxOrInputs(*entry.block.vtx[posFirst]))
+                    ++posFirst;
+                if (posFirst < entry.block.vtx.size()) {
+                    LOCK2(cs_main, cs_wallet);
+                    if (!chainActive.Contains(pindexBlock))
+                        break;
+                    for (size_t posInBlock = posFirst; posInBlock < entry.block.vtx.size(); ++posInBlock) {
+                        const CTransaction& tx = *entry.block.vtx[posInBlock];
+                        if ((entry.vMatch[posInBlock] || filter.MatchesTxOrInputs(tx)) && AddToWalletIfInvolvingMe(tx, pindexBlock, posInBlock, fUpdate))
+                            filter.AddTxid(tx.GetHash());
+                    }
                 }
-                if (!ret) {
-                    ret = pindex;
+                if (!ret && !pindexFailed) {
+                    ret = pindexBlock;
                 }
             } else {
                 ret = nullptr;
             }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, GuessVerificationProgress(chainParams.TxData(), pindex));
-            }
+            pindexLast = pindexBlock;
+            fReachedStop = pindexBlock == pindexStop;
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+
+        {
+            LOCK(cs_main);
+            if (pindexLast)
+                pindex = chainActive.Contains(pindexLast) ? chainActive.Next(pindexLast) : pindexLast;
+            if (pindexStop && pindex && pindex->nHeight > pindexStop->nHeight)
+                fReachedStop = true;
+        }
+        if (pindex && GetTime() >= nNow + 60) {
+            nNow = GetTime();
+            LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, GuessVerificationProgress(chainParams.TxData(), pindex));
+        }
+    }
+
+    if (pindexFirst) {
+        LOCK(cs_main);
+        const bool fInterrupted = pindex && !fReachedStop && (fAbortRescan || ShutdownRequested());
+        if (fInterrupted)
+            LogPrintf("Rescan interrupted at block %d\n", pindex->nHeight);
+        // The next rescan resumes at the first block that could not be read
+        UpdateRescanResumePoint(pindexFirst, pindexFailed ? pindexFailed : fInterrupted ? pindex : NULL, !pindexFailed && !fInterrupted && !pindexStop);
     }
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     return ret;
 }
 
@@ -1726,6 +2296,22 @@ CAmount CWalletTx::GetCredit(const isminefilter& filter) const
     return credit;
 }
 
+void CWalletTx::MarkDirty()
+{
+    fCreditCached = false;
+    fAvailableCreditCached = false;
+    fImmatureCreditCached = false;
+    fWatchDebitCached = false;
+    fWatchCreditCached = false;
+    fAvailableWatchCreditCached = false;
+    fImmatureWatchCreditCached = false;
+    fDebitCached = false;
+    fChangeCached = false;
+    nAmountsCountGeneration[0] = nAmountsCountGeneration[1] = 0;
+    if (pwallet)
+        pwallet->MarkTxDirty(GetHash());
+}
+
 CAmount CWalletTx::GetImmatureCredit(bool fUseCache) const
 {
     if (IsCoinBase() && GetBlocksToMaturity() > 0 && IsInMainChain())
@@ -1929,94 +2515,208 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime, CConnman* connman
  */
 
 
-CAmount CWallet::GetBalance() const
+void CWallet::UpdateUnspentTxs() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    // A transaction belongs in the index while any output that is ours is
+    // not spent by a non-conflicted wallet transaction.
+    auto fHasUnspent = [this](const CWalletTx& wtx) {
+        for (unsigned int i = 0; i < wtx.tx->vout.size(); i++)
+            if (IsMine(wtx.tx->vout[i]) != ISMINE_NO && !IsSpent(wtx.GetHash(), i))
+                return true;
+        return false;
+    };
+
+    if (fUnspentTxsStale) {
+        setUnspentTxs.clear();
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+            if (fHasUnspent(it->second))
+                setUnspentTxs.insert(setUnspentTxs.end(), it->first);
+        fUnspentTxsStale = false;
+        setDirtyTxs.clear();
+        return;
     }
 
-    return nTotal;
+    BOOST_FOREACH(const uint256& hash, setDirtyTxs) {
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end() && fHasUnspent(it->second))
+            setUnspentTxs.insert(hash);
+        else
+            setUnspentTxs.erase(hash);
+    }
+    setDirtyTxs.clear();
 }
 
-CAmount CWallet::GetUnconfirmedBalance() const
+void CWallet::UpdateTxIndexes() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    auto nTxHeight = [](const CWalletTx& wtx) {
+        if (wtx.hashUnset() || wtx.nIndex == -1)
+            return -1;
+        BlockMap::const_iterator mi = mapBlockIndex.find(wtx.hashBlock);
+        if (mi == mapBlockIndex.end() || !chainActive.Contains(mi->second))
+            return -1;
+        return mi->second->nHeight;
+    };
+    // Destinations are only ever added: outputs do not change, and a
+    // transaction that left mapWallet is skipped at lookup.
+    auto addTx = [this, &nTxHeight](const uint256& hash, const CWalletTx& wtx, bool fNew) {
+        const int nHeight = nTxHeight(wtx);
+        if (!fNew) {
+            std::map<uint256, int>::iterator mi = mapTxHeight.find(hash);
+            if (mi != mapTxHeight.end()) {
+                if (mi->second == nHeight)
+                    return;
+                setTxByHeight.erase(std::make_pair(mi->second, hash));
+            }
+        }
+        mapTxHeight[hash] = nHeight;
+        setTxByHeight.insert(std::make_pair(nHeight, hash));
+        BOOST_FOREACH(const CTxOut& txout, wtx.tx->vout) {
+            CTxDestination dest;
+            if (ExtractDestination(txout.scriptPubKey, dest))
+                mapTxByDestination[dest].insert(hash);
+        }
+    };
+
+    if (fTxIndexesStale) {
+        setTxByHeight.clear();
+        mapTxHeight.clear();
+        mapTxByDestination.clear();
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableCredit();
+            addTx(it->first, it->second, true);
+        fTxIndexesStale = false;
+        setIndexDirtyTxs.clear();
+        return;
+    }
+
+    BOOST_FOREACH(const uint256& hash, setIndexDirtyTxs) {
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end()) {
+            addTx(hash, it->second, false);
+        } else {
+            std::map<uint256, int>::iterator mi = mapTxHeight.find(hash);
+            if (mi != mapTxHeight.end()) {
+                setTxByHeight.erase(std::make_pair(mi->second, hash));
+                mapTxHeight.erase(mi);
+            }
         }
     }
-    return nTotal;
+    setIndexDirtyTxs.clear();
 }
 
-CAmount CWallet::GetImmatureBalance() const
+std::vector<const CWalletTx*> CWallet::GetTxsSinceHeight(int nHeight) const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
+    UpdateTxIndexes();
+
+    std::vector<const CWalletTx*> vResult;
+    auto addRange = [this, &vResult](std::set<std::pair<int, uint256> >::const_iterator it,
+                                     std::set<std::pair<int, uint256> >::const_iterator end) {
+        for (; it != end; ++it) {
+            map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(it->second);
+            if (mi != mapWallet.end())
+                vResult.push_back(&mi->second);
         }
+    };
+    addRange(setTxByHeight.begin(), setTxByHeight.lower_bound(std::make_pair(0, uint256())));
+    addRange(setTxByHeight.lower_bound(std::make_pair(std::max(nHeight + 1, 0), uint256())), setTxByHeight.end());
+    return vResult;
+}
+
+std::vector<const CWalletTx*> CWallet::GetTxsByDestination(const CTxDestination& dest) const
+{
+    UpdateTxIndexes();
+
+    std::vector<const CWalletTx*> vResult;
+    std::map<CTxDestination, std::set<uint256> >::const_iterator it = mapTxByDestination.find(dest);
+    if (it == mapTxByDestination.end())
+        return vResult;
+    BOOST_FOREACH(const uint256& hash, it->second) {
+        map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+        if (mi != mapWallet.end())
+            vResult.push_back(&mi->second);
     }
-    return nTotal;
+    return vResult;
 }
 
-CAmount CWallet::GetWatchOnlyBalance() const
+const CWallet::CBalances& CWallet::GetBalances() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    const unsigned int nMempoolUpdated = mempool.GetTransactionsUpdated();
+    if (fBalancesCached && nBalancesTxGeneration == nTxGeneration &&
+        pBalancesTip == chainActive.Tip() && nBalancesMempoolUpdated == nMempoolUpdated)
+        return cachedBalances;
+
+    UpdateUnspentTxs();
+
+    CBalances balances = {};
+    BOOST_FOREACH(const uint256& hash, setUnspentTxs) {
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it == mapWallet.end())
+            continue;
+        const CWalletTx* pcoin = &it->second;
+        const bool fTrusted = pcoin->IsTrusted();
+        if (fTrusted) {
+            balances.nTrusted += pcoin->GetAvailableCredit();
+            balances.nWatchTrusted += pcoin->GetAvailableWatchOnlyCredit();
+        } else if (pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool()) {
+            balances.nUntrusted += pcoin->GetAvailableCredit();
+            balances.nWatchUntrusted += pcoin->GetAvailableWatchOnlyCredit();
         }
+        balances.nImmature += pcoin->GetImmatureCredit();
+        balances.nWatchImmature += pcoin->GetImmatureWatchOnlyCredit();
     }
 
-    return nTotal;
+    // Computing the balances may have refreshed per-transaction caches, but
+    // not changed any wallet transaction.
+    cachedBalances = balances;
+    fBalancesCached = true;
+    nBalancesTxGeneration = nTxGeneration;
+    pBalancesTip = chainActive.Tip();
+    nBalancesMempoolUpdated = nMempoolUpdated;
+    return cachedBalances;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nTrusted;
+}
+
+CAmount CWallet::GetUnconfirmedBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUntrusted;
+}
+
+CAmount CWallet::GetImmatureBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmature;
+}
+
+CAmount CWallet::GetWatchOnlyBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchTrusted;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchUntrusted;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchImmature;
 }
 
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fIncludeZeroValue) const
@@ -2025,9 +2725,12 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateUnspentTxs();
+        BOOST_FOREACH(const uint256& wtxid, setUnspentTxs)
         {
-            const uint256& wtxid = it->first;
+            map<uint256, CWalletTx>::const_iterator it = mapWallet.find(wtxid);
+            if (it == mapWallet.end())
+                continue;
             const CWalletTx* pcoin = &(*it).second;
 
             if (!CheckFinalTx(*pcoin))
@@ -2093,7 +2796,7 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
     }
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+static void ApproximateBestSubset(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
                                   vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
 {
     vector<char> vfIncluded;
@@ -2102,6 +2805,8 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     nBest = nTotalLower;
 
     FastRandomContext insecure_rand;
+    uint32_t nRandBits = 0;
+    int nRandBitsLeft = 0;
 
     for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
     {
@@ -2117,8 +2822,20 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
                 //needed to prevent degenerate behavior and it is important
                 //that the rng is fast. We do not use a constant random sequence,
                 //because there may be some privacy improvement by making
-                //the selection random.
-                if (nPass == 0 ? insecure_rand.rand32()&1 : !vfIncluded[i])
+                //the selection random. Each random word is used for 32 coins.
+                bool fInclude;
+                if (nPass == 0) {
+                    if (nRandBitsLeft == 0) {
+                        nRandBits = insecure_rand.rand32();
+                        nRandBitsLeft = 32;
+                    }
+                    fInclude = nRandBits & 1;
+                    nRandBits >>= 1;
+                    nRandBitsLeft--;
+                } else {
+                    fInclude = !vfIncluded[i];
+                }
+                if (fInclude)
                 {
                     nTotal += vValue[i].first;
                     vfIncluded[i] = true;
@@ -2139,7 +2856,74 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     }
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMine, const int nConfTheirs, const uint64_t nMaxAncestors, vector<COutput> vCoins,
+/**
+ * Depth-first search for a subset of vValue (sorted by descending value)
+ * summing to exactly nTargetValue, so that no change output is needed.
+ * Coins that would overshoot the target are skipped in one step, branches
+ * that cannot reach the target any more are cut, and of coins with equal
+ * value only the first ones are tried, as leaving out one and including
+ * another gives the same sum. Gives up after MAX_BNB_TRIES steps.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTargetValue,
+                           vector<char>& vfBest)
+{
+    const size_t nCoins = vValue.size();
+    // vRemaining[i] is the sum of all coins from i on
+    vector<CAmount> vRemaining(nCoins + 1, 0);
+    for (size_t i = nCoins; i > 0; i--)
+        vRemaining[i - 1] = vRemaining[i] + vValue[i - 1].first;
+
+    vector<char> vfIncluded(nCoins, false);
+    CAmount nTotal = 0;
+    size_t i = 0;
+    for (unsigned int nTries = 0; nTries < MAX_BNB_TRIES; nTries++)
+    {
+        if (nTotal == nTargetValue) {
+            vfBest = vfIncluded;
+            return true;
+        }
+
+        if (nTotal + vRemaining[i] < nTargetValue) {
+            // Backtrack: leave out the last coin included so far
+            while (i > 0 && !vfIncluded[i - 1])
+                i--;
+            if (i == 0)
+                return false;
+            i--;
+            vfIncluded[i] = false;
+            nTotal -= vValue[i].first;
+            i++;
+            continue;
+        }
+
+        if (nTotal + vValue[i].first > nTargetValue) {
+            // Move on to the largest coin that still fits
+            CAmount nMissing = nTargetValue - nTotal;
+            i = std::partition_point(vValue.begin() + i, vValue.end(),
+                    [nMissing](const pair<CAmount, pair<const CWalletTx*,unsigned int> >& coin) { return coin.first > nMissing; }) - vValue.begin();
+            continue;
+        }
+
+        if (i > 0 && !vfIncluded[i - 1] && vValue[i].first == vValue[i - 1].first) {
+            // An equal coin was left out; including this one is a duplicate branch
+            i++;
+            continue;
+        }
+
+        vfIncluded[i] = true;
+        nTotal += vValue[i].first;
+        i++;
+    }
+    return false;
+}
+
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMine, const int nConfTheirs, const uint64_t nMaxAncestors, const vector<COutput>& vCoins,
+                                 set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+{
+    return SelectCoinsMinConf(nTargetValue, nConfMine, nConfTheirs, nMaxAncestors, CSelectableCoins(vCoins), setCoinsRet, nValueRet);
+}
+
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMine, const int nConfTheirs, const uint64_t nMaxAncestors, const CSelectableCoins& coins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
 {
     setCoinsRet.clear();
@@ -2152,25 +2936,20 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMin
     vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
     CAmount nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    BOOST_FOREACH(const COutput &output, vCoins)
+    // Coins are visited by descending value, so vValue ends up sorted the
+    // same way, and the last larger coin seen is the lowest one
+    BOOST_FOREACH(const CSelectableCoins::Coin& output, coins.vCoins)
     {
-        if (!output.fSpendable)
+        if (output.nDepth < (output.fFromMe ? nConfMine : nConfTheirs))
             continue;
 
-        const CWalletTx *pcoin = output.tx;
-
-        if (output.nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
+        // Only unconfirmed transactions can be in the mempool
+        if (output.nDepth == 0 && !mempool.TransactionWithinChainLimit(output.coin.first->GetHash(), nMaxAncestors))
             continue;
 
-        if (!mempool.TransactionWithinChainLimit(pcoin->GetHash(), nMaxAncestors))
-            continue;
-
-        int i = output.i;
-        CAmount n = pcoin->tx->vout[i].nValue;
+        CAmount n = output.nValue;
 
-        pair<CAmount,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
+        pair<CAmount,pair<const CWalletTx*,unsigned int> > coin = make_pair(n, output.coin);
 
         if (n == nTargetValue)
         {
@@ -2208,15 +2987,18 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMin
         return true;
     }
 
-    // Solve subset sum by stochastic approximation
-    std::sort(vValue.begin(), vValue.end(), CompareValueOnly());
-    std::reverse(vValue.begin(), vValue.end());
     vector<char> vfBest;
     CAmount nBest;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + MIN_CHANGE)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + MIN_CHANGE, vfBest, nBest);
+    // An exact match needs no change and beats any larger coin; otherwise
+    // solve subset sum by stochastic approximation
+    if (SelectCoinsBnB(vValue, nTargetValue, vfBest)) {
+        nBest = nTargetValue;
+    } else {
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest);
+        if (nBest != nTargetValue && nTotalLower >= nTargetValue + MIN_CHANGE)
+            ApproximateBestSubset(vValue, nTotalLower, nTargetValue + MIN_CHANGE, vfBest, nBest);
+    }
 
     // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
     //                                   or the next bigger coin is closer), return the bigger coin
@@ -2244,19 +3026,15 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const int nConfMin
     return true;
 }
 
-bool CWallet::SelectCoins(const vector<COutput>& vAvailableCoins, const CAmount& nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl) const
+bool CWallet::SelectCoins(const CSelectableCoins& availableCoins, const CAmount& nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl) const
 {
-    vector<COutput> vCoins(vAvailableCoins);
-
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs)
     {
-        BOOST_FOREACH(const COutput& out, vCoins)
+        BOOST_FOREACH(const CSelectableCoins::Coin& out, availableCoins.vCoins)
         {
-            if (!out.fSpendable)
-                 continue;
-            nValueRet += out.tx->tx->vout[out.i].nValue;
-            setCoinsRet.insert(make_pair(out.tx, out.i));
+            nValueRet += out.nValue;
+            setCoinsRet.insert(out.coin);
         }
         return (nValueRet >= nTargetValue);
     }
@@ -2283,14 +3061,11 @@ bool CWallet::SelectCoins(const vector<COutput>& vAvailableCoins, const CAmount&
             return false; // TODO: Allow non-wallet inputs
     }
 
-    // remove preset inputs from vCoins
-    for (vector<COutput>::iterator it = vCoins.begin(); it != vCoins.end() && coinControl && coinControl->HasSelected();)
-    {
-        if (setPresetCoins.count(make_pair(it->tx, it->i)))
-            it = vCoins.erase(it);
-        else
-            ++it;
-    }
+    // remove preset inputs from the coins to select from
+    std::unique_ptr<CSelectableCoins> pcoinsWithoutPreset;
+    if (!setPresetCoins.empty())
+        pcoinsWithoutPreset.reset(new CSelectableCoins(availableCoins, setPresetCoins));
+    const CSelectableCoins& vCoins = pcoinsWithoutPreset ? *pcoinsWithoutPreset : availableCoins;
 
     size_t nMaxChainLength = std::min(GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT), GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT));
     bool fRejectLongChains = GetBoolArg("-walletrejectlongchains", DEFAULT_WALLET_REJECT_LONG_CHAINS);
@@ -2435,6 +3210,8 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wt
         {
             std::vector<COutput> vAvailableCoins;
             AvailableCoins(vAvailableCoins, true, coinControl);
+            // Sorted once, and reused for every fee iteration below
+            const CSelectableCoins availableCoins(vAvailableCoins);
 
             nFeeRet = 0;
             // Start with no fee and loop until there is enough fee
@@ -2485,7 +3262,7 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend, CWalletTx& wt
                 // Choose coins to use
                 CAmount nValueIn = 0;
                 setCoins.clear();
-                if (!SelectCoins(vAvailableCoins, nValueToSelect, setCoins, nValueIn, coinControl))
+                if (!SelectCoins(availableCoins, nValueToSelect, setCoins, nValueIn, coinControl))
                 {
                     strFailReason = _("Insufficient funds");
                     return false;
@@ -2924,6 +3701,8 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
         LOCK(cs_wallet); // mapAddressBook
         std::map<CTxDestination, CAddressBookData>::iterator mi = mapAddressBook.find(address);
         fUpdated = mi != mapAddressBook.end();
+        if (!fUpdated)
+            ++nAddressBookGeneration;
         mapAddressBook[address].name = strName;
         if (!strPurpose.empty()) /* update purpose only if requested */
             mapAddressBook[address].purpose = strPurpose;
@@ -2932,9 +3711,12 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
                              strPurpose, (fUpdated ? CT_UPDATED : CT_NEW) );
     if (!fFileBacked)
         return false;
-    if (!strPurpose.empty() && !CWalletDB(strWalletFile).WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
-        return false;
-    return CWalletDB(strWalletFile).WriteName(CBitcoinAddress(address).ToString(), strName);
+    CWalletDB* pwalletdb = pwalletdbBatch ? pwalletdbBatch : new CWalletDB(strWalletFile);
+    bool fResult = (strPurpose.empty() || pwalletdb->WritePurpose(CBitcoinAddress(address).ToString(), strPurpose)) &&
+                   pwalletdb->WriteName(CBitcoinAddress(address).ToString(), strName);
+    if (!pwalletdbBatch)
+        delete pwalletdb;
+    return fResult;
 }
 
 bool CWallet::DelAddressBook(const CTxDestination& address)
@@ -2951,7 +3733,8 @@ bool CWallet::DelAddressBook(const CTxDestination& address)
                 CWalletDB(strWalletFile).EraseDestData(strAddress, item.first);
             }
         }
-        mapAddressBook.erase(address);
+        if (mapAddressBook.erase(address))
+            ++nAddressBookGeneration;
     }
 
     NotifyAddressBookChanged(this, address, "", ::IsMine(*this, address) != ISMINE_NO, "", CT_DELETED);
@@ -2990,12 +3773,7 @@ bool CWallet::NewKeyPool()
             return false;
 
         int64_t nKeys = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t)0);
-        for (int i = 0; i < nKeys; i++)
-        {
-            int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
-            setKeyPool.insert(nIndex);
-        }
+        GenerateNewKeys(nKeys, true);
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
     return true;
@@ -3003,33 +3781,70 @@ bool CWallet::NewKeyPool()
 
 bool CWallet::TopUpKeyPool(unsigned int kpSize)
 {
-    {
-        LOCK(cs_wallet);
+    // Top up key pool
+    unsigned int nTargetSize;
+    if (kpSize > 0)
+        nTargetSize = kpSize;
+    else
+        nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
 
-        if (IsLocked())
+    // Keys are generated in batches, each written in one transaction;
+    // cs_wallet is only held while adding them, unless the caller holds it.
+    unsigned int nKeys = 0;
+    while (true)
+    {
+        {
+            LOCK(cs_wallet);
+            // The pool may change as soon as the lock is released
+            if (nKeys > 0)
+                LogPrintf("keypool added %u keys, size=%u\n", nKeys, setKeyPool.size());
+            if (IsLocked())
+                return false;
+            if (setKeyPool.size() >= nTargetSize + 1)
+                break;
+            nKeys = std::min<size_t>(nTargetSize + 1 - setKeyPool.size(), KEYPOOL_TOPUP_BATCH);
+        }
+        if (GenerateNewKeys(nKeys, true).size() < nKeys)
             return false;
+    }
+    return true;
+}
 
-        CWalletDB walletdb(strWalletFile);
+void CWallet::RequestKeyPoolTopUp()
+{
+    if (!fKeyPoolRefillThread) {
+        TopUpKeyPool();
+        return;
+    }
 
-        // Top up key pool
-        unsigned int nTargetSize;
-        if (kpSize > 0)
-            nTargetSize = kpSize;
-        else
-            nTargetSize = max(GetArg("-keypool", DEFAULT_KEYPOOL_SIZE), (int64_t) 0);
+    {
+        boost::lock_guard<boost::mutex> lock(csKeyPoolRefill);
+        fKeyPoolRefillRequested = true;
+    }
+    condKeyPoolRefill.notify_one();
+
+    LOCK(cs_wallet);
+    if (setKeyPool.empty())
+        TopUpKeyPool(1);
+}
 
-        while (setKeyPool.size() < (nTargetSize + 1))
+void CWallet::KeyPoolRefillThread()
+{
+    RenameThread("bitcoin-keypool");
+    while (true)
+    {
         {
-            int64_t nEnd = 1;
-            if (!setKeyPool.empty())
-                nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
-                throw runtime_error(std::string(__func__) + ": writing generated key failed");
-            setKeyPool.insert(nEnd);
-            LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
+            boost::unique_lock<boost::mutex> lock(csKeyPoolRefill);
+            while (!fKeyPoolRefillRequested)
+                condKeyPoolRefill.wait(lock);
+            fKeyPoolRefillRequested = false;
+        }
+        try {
+            TopUpKeyPool();
+        } catch (const std::exception& e) {
+            PrintExceptionContinue(&e, "KeyPoolRefillThread()");
         }
     }
-    return true;
 }
 
 void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
@@ -3040,7 +3855,7 @@ void CWallet::ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool)
         LOCK(cs_wallet);
 
         if (!IsLocked())
-            TopUpKeyPool();
+            RequestKeyPoolTopUp();
 
         // Get the oldest key
         if(setKeyPool.empty())
@@ -3548,6 +4363,7 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     strUsage += HelpMessageOpt("-paytxfee=<amt>", strprintf(_("Fee (in %s/kB) to add to transactions you send (default: %s)"),
                                                             CURRENCY_UNIT, FormatMoney(payTxFee.GetFeePerK())));
     strUsage += HelpMessageOpt("-rescan", _("Rescan the block chain for missing wallet transactions on startup"));
+    strUsage += HelpMessageOpt("-rescanthreads=<n>", strprintf(_("Number of threads reading blocks during a rescan (0 = one per core, up to %d, default: %d)"), MAX_RESCAN_THREADS, DEFAULT_RESCAN_THREADS));
     strUsage += HelpMessageOpt("-salvagewallet", _("Attempt to recover private keys from a corrupt wallet on startup"));
     if (showDebug)
         strUsage += HelpMessageOpt("-sendfreetransactions", strprintf(_("Send transactions as zero-fee transactions if possible (default: %u)"), DEFAULT_SEND_FREE_TRANSACTIONS));
@@ -3556,6 +4372,7 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     strUsage += HelpMessageOpt("-usehd", _("Use hierarchical deterministic key generation (HD) after BIP32. Only has effect during wallet creation/first start") + " " + strprintf(_("(default: %u)"), DEFAULT_USE_HD_WALLET));
     strUsage += HelpMessageOpt("-walletrbf", strprintf(_("Send transactions with full-RBF opt-in enabled (default: %u)"), DEFAULT_WALLET_RBF));
     strUsage += HelpMessageOpt("-upgradewallet", _("Upgrade wallet to latest format on startup"));
+    strUsage += HelpMessageOpt("-walletbackend=<backend>", _("Store the wallet in a Berkeley database (bdb) or an append-only record log (log); an existing wallet database is copied into the log the first time it is used") + " " + strprintf(_("(default: %s)"), DEFAULT_WALLET_BACKEND));
     strUsage += HelpMessageOpt("-wallet=<file>", _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), DEFAULT_WALLET_DAT));
     strUsage += HelpMessageOpt("-walletbroadcast", _("Make the wallet broadcast transactions") + " " + strprintf(_("(default: %u)"), DEFAULT_WALLETBROADCAST));
     strUsage += HelpMessageOpt("-walletnotify=<cmd>", _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)"));
@@ -3567,6 +4384,7 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
         strUsage += HelpMessageGroup(_("Wallet debugging/testing options:"));
 
         strUsage += HelpMessageOpt("-dblogsize=<n>", strprintf("Flush wallet database activity from memory to disk log every <n> megabytes (default: %u)", DEFAULT_WALLET_DBLOGSIZE));
+        strUsage += HelpMessageOpt("-keypoolbackground", strprintf("Refill the keypool on a background thread instead of when keys are requested (default: %u)", DEFAULT_KEYPOOL_BACKGROUND));
         strUsage += HelpMessageOpt("-flushwallet", strprintf("Run a thread to flush wallet periodically (default: %u)", DEFAULT_FLUSHWALLET));
         strUsage += HelpMessageOpt("-privdb", strprintf("Sets the DB_PRIVATE flag in the wallet db environment (default: %u)", DEFAULT_WALLET_PRIVDB));
         strUsage += HelpMessageOpt("-walletrejectlongchains", strprintf(_("Wallet will not create transactions that violate mempool chain limits (default: %u)"), DEFAULT_WALLET_REJECT_LONG_CHAINS));
@@ -3693,20 +4511,32 @@ CWallet* CWallet::CreateWalletFromFile(const std::string walletFile)
             pindexRescan = FindForkInGlobalIndex(chainActive, locator);
         else
             pindexRescan = chainActive.Genesis();
+
+        // Pick up a rescan that was aborted or interrupted by a shutdown
+        LOCK(cs_main);
+        CBlockIndex* pindexResume = walletInstance->GetRescanResumePoint();
+        if (pindexResume && pindexRescan && pindexResume->nHeight < pindexRescan->nHeight) {
+            LogPrintf("Resuming interrupted rescan at block %d\n", pindexResume->nHeight);
+            pindexRescan = pindexResume;
+        }
     }
     if (chainActive.Tip() && chainActive.Tip() != pindexRescan)
     {
         //We can't rescan beyond non-pruned blocks, stop and throw an error
         //this might happen if a user uses a old wallet within a pruned node
         // or if he ran -disablewallet for a longer time, then decided to re-enable
-        if (fPruneMode)
+        // Blocks up to the base of a UTXO snapshot have no data either
+        if (fPruneMode || pindexSnapshot)
         {
             CBlockIndex *block = chainActive.Tip();
             while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA) && block->pprev->nTx > 0 && pindexRescan != block)
                 block = block->pprev;
 
             if (pindexRescan != block) {
-                InitError(_("Prune: last wallet synchronisation goes beyond pruned data. You need to -reindex (download the whole blockchain again in case of pruned node)"));
+                if (fPruneMode)
+                    InitError(_("Prune: last wallet synchronisation goes beyond pruned data. You need to -reindex (download the whole blockchain again in case of pruned node)"));
+                else
+                    InitError(_("Last wallet synchronisation goes beyond the UTXO snapshot the chain state was loaded from, which has no block data. You need to -reindex (download the whole blockchain)"));
                 return NULL;
             }
         }
@@ -3787,6 +4617,11 @@ void CWallet::postInitProcess(boost::thread_group& threadGroup)
     if (!CWallet::fFlushThreadRunning.exchange(true)) {
         threadGroup.create_thread(ThreadFlushWalletDB);
     }
+
+    // Run a thread to refill the keypool off the request path
+    if (GetBoolArg("-keypoolbackground", DEFAULT_KEYPOOL_BACKGROUND) && !fKeyPoolRefillThread.exchange(true)) {
+        threadGroup.create_thread(boost::bind(&CWallet::KeyPoolRefillThread, this));
+    }
 }
 
 bool CWallet::ParameterInteraction()
@@ -3872,6 +4707,10 @@ bool CWallet::ParameterInteraction()
     fSendFreeTransactions = GetBoolArg("-sendfreetransactions", DEFAULT_SEND_FREE_TRANSACTIONS);
     fWalletRbf = GetBoolArg("-walletrbf", DEFAULT_WALLET_RBF);
 
+    std::string strBackend = GetArg("-walletbackend", DEFAULT_WALLET_BACKEND);
+    if (strBackend != "bdb" && strBackend != "log")
+        return InitError(strprintf(_("Unknown wallet backend requested: -walletbackend=%s"), strBackend));
+
     if (fSendFreeTransactions && GetArg("-limitfreerelay", DEFAULT_LIMITFREERELAY) <= 0)
         return InitError("Creation of free transactions with their relay disabled is not supported.");
 
@@ -3894,10 +4733,11 @@ bool CWallet::BackupWallet(const std::string& strDest)
                 bitdb.mapFileUseCount.erase(strWalletFile);
 
                 // Copy wallet file
-                boost::filesystem::path pathSrc = GetDataDir() / strWalletFile;
+                std::string strFileName = bitdb.GetFileName(strWalletFile);
+                boost::filesystem::path pathSrc = GetDataDir() / strFileName;
                 boost::filesystem::path pathDest(strDest);
                 if (boost::filesystem::is_directory(pathDest))
-                    pathDest /= strWalletFile;
+                    pathDest /= strFileName;
 
                 try {
 #if BOOST_VERSION >= 104000
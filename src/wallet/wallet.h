@@ -43,6 +43,12 @@ extern bool fSendFreeTransactions;
 extern bool fWalletRbf;
 
 static const unsigned int DEFAULT_KEYPOOL_SIZE = 100;
+//! -keypoolbackground default
+static const bool DEFAULT_KEYPOOL_BACKGROUND = true;
+//! Maximum number of keys generated and written in one keypool top-up transaction
+static const unsigned int KEYPOOL_TOPUP_BATCH = 1000;
+//! Maximum number of threads deriving new keys
+static const int MAX_KEY_DERIVATION_THREADS = 8;
 //! -paytxfee default
 static const CAmount DEFAULT_TRANSACTION_FEE = 0;
 //! -fallbackfee default
@@ -55,6 +61,8 @@ static const CAmount WALLET_INCREMENTAL_RELAY_FEE = 5000;
 static const CAmount MIN_CHANGE = CENT;
 //! final minimum change amount after paying for fees
 static const CAmount MIN_FINAL_CHANGE = MIN_CHANGE/2;
+//! Maximum number of branches the exact-match coin selection search visits
+static const unsigned int MAX_BNB_TRIES = 100000;
 //! Default for -spendzeroconfchange
 static const bool DEFAULT_SPEND_ZEROCONF_CHANGE = true;
 //! Default for -sendfreetransactions
@@ -71,6 +79,10 @@ static const bool DEFAULT_WALLETBROADCAST = true;
 static const bool DEFAULT_DISABLE_WALLET = false;
 //! if set, all keys will be derived by using BIP32
 static const bool DEFAULT_USE_HD_WALLET = true;
+//! -rescanthreads default (0 = one per core)
+static const int DEFAULT_RESCAN_THREADS = 0;
+//! Maximum number of threads reading blocks during a rescan
+static const int MAX_RESCAN_THREADS = 16;
 
 extern const char * DEFAULT_WALLET_DAT;
 
@@ -78,6 +90,7 @@ class CBlockIndex;
 class CCoinControl;
 class COutput;
 class CReserveKey;
+class CRescanFilter;
 class CScript;
 class CTxMemPool;
 class CWalletTx;
@@ -289,6 +302,10 @@ public:
     mutable CAmount nImmatureWatchCreditCached;
     mutable CAmount nAvailableWatchCreditCached;
     mutable CAmount nChangeCached;
+    //! Sizes of the sent and received lists of GetAmounts() for ISMINE_SPENDABLE
+    //! and ISMINE_ALL, valid while the address book generation matches (0: not cached)
+    mutable size_t nAmountsCountCached[2][2];
+    mutable uint64_t nAmountsCountGeneration[2];
 
     CWalletTx()
     {
@@ -328,6 +345,7 @@ public:
         nAvailableWatchCreditCached = 0;
         nImmatureWatchCreditCached = 0;
         nChangeCached = 0;
+        nAmountsCountGeneration[0] = nAmountsCountGeneration[1] = 0;
         nOrderPos = -1;
     }
 
@@ -375,19 +393,8 @@ public:
         mapValue.erase("timesmart");
     }
 
-    //! make sure balances are recalculated
-    void MarkDirty()
-    {
-        fCreditCached = false;
-        fAvailableCreditCached = false;
-        fImmatureCreditCached = false;
-        fWatchDebitCached = false;
-        fWatchCreditCached = false;
-        fAvailableWatchCreditCached = false;
-        fImmatureWatchCreditCached = false;
-        fDebitCached = false;
-        fChangeCached = false;
-    }
+    //! make sure balances are recalculated, here and in the wallet-wide balance cache
+    void MarkDirty();
 
     void BindWallet(CWallet *pwalletIn)
     {
@@ -406,6 +413,12 @@ public:
 
     void GetAmounts(std::list<COutputEntry>& listReceived,
                     std::list<COutputEntry>& listSent, CAmount& nFee, std::string& strSentAccount, const isminefilter& filter) const;
+    /**
+     * Number of entries GetAmounts() returns in listSent and listReceived;
+     * cached for the filters the listing RPCs use, so that they can skip
+     * transactions without building their entries
+     */
+    void GetAmountsCount(size_t& nSent, size_t& nReceived, const isminefilter& filter) const;
 
     void GetAccountAmounts(const std::string& strAccount, CAmount& nReceived,
                            CAmount& nSent, CAmount& nFee, const isminefilter& filter) const;
@@ -449,6 +462,29 @@ public:
     std::string ToString() const;
 };
 
+/**
+ * Spendable coins sorted by descending value (coins of equal value in random
+ * order). Built once per transaction, so that each eligibility tier tried by
+ * SelectCoins() filters it instead of copying, shuffling and sorting the
+ * available coins again.
+ */
+class CSelectableCoins
+{
+public:
+    struct Coin
+    {
+        CAmount nValue;
+        std::pair<const CWalletTx*, unsigned int> coin;
+        int nDepth;
+        bool fFromMe;
+    };
+
+    std::vector<Coin> vCoins;
+
+    explicit CSelectableCoins(const std::vector<COutput>& vAvailableCoins);
+    //! Copy of other without the given coins
+    CSelectableCoins(const CSelectableCoins& other, const std::set<std::pair<const CWalletTx*, unsigned int> >& setExclude);
+};
 
 
 
@@ -576,10 +612,22 @@ private:
      * all coins from coinControl are selected; Never select unconfirmed coins
      * if they are not ours
      */
-    bool SelectCoins(const std::vector<COutput>& vAvailableCoins, const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL) const;
+    bool SelectCoins(const CSelectableCoins& availableCoins, const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL) const;
 
     CWalletDB *pwalletdbEncryption;
 
+    //! Open transaction that key, script, watch-only and address book writes go through; see BeginBatch()
+    CWalletDB *pwalletdbBatch;
+    bool fInBatch;
+    bool fBatchMarkDirty;
+    //! What the open batch changed in memory, for AbortBatch() to undo
+    std::vector<CKeyID> vBatchKeys;
+    std::vector<CScriptID> vBatchScripts;
+    std::vector<CScript> vBatchWatchOnlyAdded;
+    std::vector<CScript> vBatchWatchOnlyRemoved;
+    CHDChain hdChainBatch;
+    void ClearBatchUndo();
+
     //! the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -590,6 +638,36 @@ private:
     int64_t nLastResend;
     bool fBroadcastTransactions;
 
+    std::atomic<bool> fAbortRescan;
+    std::atomic<bool> fScanningWallet;
+
+    //! State of the background keypool refill thread; see RequestKeyPoolTopUp()
+    std::atomic<bool> fKeyPoolRefillThread;
+    boost::mutex csKeyPoolRefill;
+    boost::condition_variable condKeyPoolRefill;
+    bool fKeyPoolRefillRequested;
+
+    //! What is needed to derive new keys without holding cs_wallet
+    struct CNewKeyContext
+    {
+        bool fHD;
+        bool fCompressed;
+        int64_t nCreationTime;
+        CKeyID masterKeyID;
+        //! HD chain key at m/0'/0' and the index of its next child
+        CExtKey chainKey;
+        uint32_t nChildIndex;
+    };
+    void PrepareNewKeys(CNewKeyContext& context);
+    static void DeriveNewKeys(const CNewKeyContext& context, unsigned int nKeys, std::vector<CKey>& vKeys, std::vector<CPubKey>& vPubKeys);
+    void AddNewKeys(const CNewKeyContext& context, const std::vector<CKey>& vKeys, const std::vector<CPubKey>& vPubKeys, bool fAddToKeyPool, std::vector<CPubKey>& vAdded);
+    void KeyPoolRefillThread();
+
+    //! Fill a rescan prefilter from the keys, scripts and transactions of this wallet
+    void GetRescanFilter(CRescanFilter& filter) const;
+    //! Record where an interrupted rescan has to continue, or clear that point once it is covered
+    void UpdateRescanResumePoint(const CBlockIndex* pindexScanStart, const CBlockIndex* pindexUnscanned, bool fReachedTip);
+
     /**
      * Used to keep track of spent outpoints, and
      * detect and report conflicts (double-spends or
@@ -605,6 +683,75 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Index of wallet transactions that may still have unspent outputs of
+     * ours. Balances and AvailableCoins only visit these instead of all of
+     * mapWallet, so their cost is proportional to the unspent set.
+     *
+     * Membership is maintained lazily: CWalletTx::MarkDirty, which is called
+     * on a transaction and on the parents of every transaction whose
+     * conflicted/abandoned state changes, queues it in setDirtyTxs, and the
+     * next query re-classifies the queued transactions. The index may contain
+     * fully spent transactions (they contribute nothing), but never misses one
+     * with an unspent output.
+     */
+    mutable std::set<uint256> setUnspentTxs;
+    mutable std::set<uint256> setDirtyTxs;
+    //! setUnspentTxs has to be rebuilt from all of mapWallet (after loading or MarkDirty())
+    mutable bool fUnspentTxsStale;
+
+    //! Bumped whenever a wallet transaction changes; part of the balance cache key
+    mutable uint64_t nTxGeneration;
+
+    /** All balances, computed in one pass over setUnspentTxs */
+    struct CBalances
+    {
+        CAmount nTrusted;
+        CAmount nUntrusted;
+        CAmount nImmature;
+        CAmount nWatchTrusted;
+        CAmount nWatchUntrusted;
+        CAmount nWatchImmature;
+    };
+    /**
+     * Balances only change with the wallet, the chain tip and the mempool, so
+     * they are cached until one of those changes. Repeated balance queries
+     * between blocks are O(1).
+     */
+    mutable CBalances cachedBalances;
+    mutable bool fBalancesCached;
+    mutable uint64_t nBalancesTxGeneration;
+    mutable const CBlockIndex* pBalancesTip;
+    mutable unsigned int nBalancesMempoolUpdated;
+
+    /**
+     * Secondary indexes for the listing RPCs, so that their cost follows the
+     * size of the result rather than of the wallet; wtxOrdered already is the
+     * index by order position. They are maintained lazily like setUnspentTxs,
+     * from their own queue of changed transactions.
+     *
+     * setTxByHeight files every transaction under the height of the block
+     * that confirms it in the active chain, or under -1 while it is
+     * unconfirmed, conflicted or in a disconnected block (all transactions of
+     * a disconnected block pass through SyncTransaction, which queues them).
+     * mapTxByDestination lists the transactions paying to each destination.
+     */
+    mutable std::set<std::pair<int, uint256> > setTxByHeight;
+    mutable std::map<uint256, int> mapTxHeight;
+    mutable std::map<CTxDestination, std::set<uint256> > mapTxByDestination;
+    mutable std::set<uint256> setIndexDirtyTxs;
+    mutable bool fTxIndexesStale;
+
+    //! Bumped when an address book entry is added or removed, as that changes what counts as change
+    uint64_t nAddressBookGeneration;
+
+    //! Bring setUnspentTxs up to date. Requires cs_main and cs_wallet.
+    void UpdateUnspentTxs() const;
+    //! Bring the listing indexes up to date. Requires cs_main and cs_wallet.
+    void UpdateTxIndexes() const;
+    //! Return the (possibly cached) balances. Requires cs_main and cs_wallet.
+    const CBalances& GetBalances() const;
+
     /* the HD chain data model (external chain counters) */
     CHDChain hdChain;
 
@@ -672,6 +819,8 @@ public:
     {
         delete pwalletdbEncryption;
         pwalletdbEncryption = NULL;
+        delete pwalletdbBatch;
+        pwalletdbBatch = NULL;
     }
 
     void SetNull()
@@ -681,11 +830,26 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbBatch = NULL;
+        fInBatch = false;
+        fBatchMarkDirty = false;
         nOrderPosNext = 0;
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
+        fAbortRescan = false;
+        fScanningWallet = false;
+        fKeyPoolRefillThread = false;
+        fKeyPoolRefillRequested = false;
+        fUnspentTxsStale = true;
+        fTxIndexesStale = true;
+        nAddressBookGeneration = 1;
+        nTxGeneration = 0;
+        fBalancesCached = false;
+        nBalancesTxGeneration = 0;
+        pBalancesTip = NULL;
+        nBalancesMempoolUpdated = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -720,7 +884,13 @@ public:
      * completion the coin set and corresponding actual target value is
      * assembled
      */
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, uint64_t nMaxAncestors, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, uint64_t nMaxAncestors, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    /**
+     * Select from coins eligible for the given tier; an exact match is
+     * searched for by branch and bound before falling back to the
+     * stochastic approximation
+     */
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, uint64_t nMaxAncestors, const CSelectableCoins& coins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -735,7 +905,13 @@ public:
      * Generate a new key
      */
     CPubKey GenerateNewKey();
-    void DeriveNewChildKey(CKeyMetadata& metadata, CKey& secret);
+    /**
+     * Generate nKeys new keys, optionally adding them to the keypool. Keys
+     * are derived on several threads without holding cs_wallet (unless the
+     * caller holds it), then added and written in a single transaction.
+     * Returns fewer keys only if the wallet got locked meanwhile.
+     */
+    std::vector<CPubKey> GenerateNewKeys(unsigned int nKeys, bool fAddToKeyPool = false);
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey) override;
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
@@ -784,11 +960,44 @@ public:
     bool GetAccountPubkey(CPubKey &pubKey, std::string strAccount, bool bForceNew = false);
 
     void MarkDirty();
+    /**
+     * Group the database writes of many key, script, watch-only and address
+     * book changes into one transaction, like EncryptWallet does, instead of
+     * one transaction per record. MarkDirty() is deferred to CommitBatch().
+     * Both require cs_wallet, which has to be held for the whole batch.
+     */
+    bool BeginBatch();
+    bool CommitBatch();
+    /**
+     * Drop the database writes of the open batch, and undo the keys, scripts,
+     * watch-only changes and HD chain counter it made in memory, so that a
+     * retry writes them again; see CWalletBatchScope.
+     */
+    void AbortBatch();
+    //! Queue a wallet transaction for re-classification in the unspent and listing indexes; see setUnspentTxs
+    void MarkTxDirty(const uint256& hash) const;
+    uint64_t GetAddressBookGeneration() const { return nAddressBookGeneration; }
+
+    /**
+     * Transactions not confirmed in the active chain at or below nHeight:
+     * unconfirmed and conflicted ones, then those confirmed above nHeight in
+     * ascending order. Requires cs_main and cs_wallet.
+     */
+    std::vector<const CWalletTx*> GetTxsSinceHeight(int nHeight) const;
+    //! Transactions with an output paying to dest, by hash. Requires cs_main and cs_wallet.
+    std::vector<const CWalletTx*> GetTxsByDestination(const CTxDestination& dest) const;
     bool AddToWallet(const CWalletTx& wtxIn, bool fFlushOnClose=true);
     bool LoadToWallet(const CWalletTx& wtxIn);
     void SyncTransaction(const CTransaction& tx, const CBlockIndex *pindex, int posInBlock) override;
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlockIndex* pIndex, int posInBlock, bool fUpdate);
-    CBlockIndex* ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
+    //! pfAlreadyScanning, if given, is set when NULL was returned because another rescan is running
+    CBlockIndex* ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false, CBlockIndex* pindexStop = NULL, bool* pfAlreadyScanning = NULL);
+    //! Ask a running rescan to stop after the current block; where it stopped is kept for a later resume
+    void AbortRescan() { fAbortRescan = true; }
+    bool IsAbortingRescan() const { return fAbortRescan; }
+    bool IsScanning() const { return fScanningWallet; }
+    //! First block an interrupted rescan did not get to, or NULL if there is nothing to resume
+    CBlockIndex* GetRescanResumePoint() const;
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(int64_t nBestBlockTime, CConnman* connman) override;
     std::vector<uint256> ResendWalletTransactionsBefore(int64_t nTime, CConnman* connman);
@@ -840,6 +1049,12 @@ public:
 
     bool NewKeyPool();
     bool TopUpKeyPool(unsigned int kpSize = 0);
+    /**
+     * Get the keypool topped up from the request path. When the background
+     * refill thread runs, this only wakes it up, and keys are derived
+     * inline only if the pool has run empty.
+     */
+    void RequestKeyPoolTopUp();
     void ReserveKeyFromKeyPool(int64_t& nIndex, CKeyPool& keypool);
     void KeepKey(int64_t nIndex);
     void ReturnKey(int64_t nIndex);
@@ -995,6 +1210,38 @@ public:
     bool SetHDMasterKey(const CPubKey& key);
 };
 
+/**
+ * Begins a wallet batch and aborts it if the scope is left without Commit(),
+ * e.g. by an exception. Must be destroyed while cs_wallet is still held.
+ * IsActive() is false if a batch was already open, which is then left to its
+ * owner.
+ */
+class CWalletBatchScope
+{
+private:
+    CWallet& wallet;
+    bool fActive;
+
+public:
+    explicit CWalletBatchScope(CWallet& walletIn) : wallet(walletIn), fActive(walletIn.BeginBatch()) {}
+
+    ~CWalletBatchScope()
+    {
+        if (fActive)
+            wallet.AbortBatch();
+    }
+
+    bool IsActive() const { return fActive; }
+
+    bool Commit()
+    {
+        if (!fActive)
+            return true;
+        fActive = false;
+        return wallet.CommitBatch();
+    }
+};
+
 /** A key allocated from the key pool. */
 class CReserveKey : public CReserveScript
 {
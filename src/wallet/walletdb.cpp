@@ -16,6 +16,7 @@
 #include "wallet/wallet.h"
 
 #include <atomic>
+#include <thread>
 
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
@@ -149,6 +150,23 @@ bool CWalletDB::ReadBestBlock(CBlockLocator& locator)
     return Read(std::string("bestblock_nomerkle"), locator);
 }
 
+bool CWalletDB::WriteRescanResume(const CBlockLocator& locator)
+{
+    nWalletDBUpdateCounter++;
+    return Write(std::string("rescanresume"), locator);
+}
+
+bool CWalletDB::ReadRescanResume(CBlockLocator& locator)
+{
+    return Read(std::string("rescanresume"), locator);
+}
+
+bool CWalletDB::EraseRescanResume()
+{
+    nWalletDBUpdateCounter++;
+    return Erase(std::string("rescanresume"));
+}
+
 bool CWalletDB::WriteOrderPosNext(int64_t nOrderPosNext)
 {
     nWalletDBUpdateCounter++;
@@ -220,7 +238,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error(std::string(__func__) + ": cannot create DB cursor");
     bool setRange = true;
@@ -237,7 +255,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
             break;
         else if (ret != 0)
         {
-            pcursor->close();
+            delete pcursor;
             throw runtime_error(std::string(__func__) + ": error scanning DB");
         }
 
@@ -256,7 +274,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
         entries.push_back(acentry);
     }
 
-    pcursor->close();
+    delete pcursor;
 }
 
 class CWalletScanState {
@@ -278,6 +296,54 @@ public:
     }
 };
 
+/**
+ * Parse a "tx" record, with the type already read from ssKey. This does
+ * not touch the wallet, so records can be parsed on several threads.
+ */
+static bool
+ReadWalletTx(CDataStream& ssKey, CDataStream& ssValue, CWalletTx& wtx,
+             bool& fUpgraded, string& strErr)
+{
+    uint256 hash;
+    ssKey >> hash;
+    ssValue >> wtx;
+    CValidationState state;
+    if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    // Undo serialize changes in 31600
+    fUpgraded = false;
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
+static void
+LoadWalletTx(CWallet* pwallet, CWalletTx& wtx, bool fUpgraded, CWalletScanState& wss)
+{
+    if (fUpgraded)
+        wss.vWalletUpgrade.push_back(wtx.GetHash());
+    if (wtx.nOrderPos == -1)
+        wss.fAnyUnordered = true;
+    pwallet->LoadToWallet(wtx);
+}
+
 bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              CWalletScanState &wss, string& strType, string& strErr)
@@ -301,38 +367,11 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "tx")
         {
-            uint256 hash;
-            ssKey >> hash;
             CWalletTx wtx;
-            ssValue >> wtx;
-            CValidationState state;
-            if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgraded;
+            if (!ReadWalletTx(ssKey, ssValue, wtx, fUpgraded, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            pwallet->LoadToWallet(wtx);
+            LoadWalletTx(pwallet, wtx, fUpgraded, wss);
         }
         else if (strType == "acentry")
         {
@@ -552,6 +591,62 @@ static bool IsKeyType(string strType)
             strType == "mkey" || strType == "ckey");
 }
 
+namespace {
+/** A "tx" record read during LoadWallet, waiting to be parsed */
+struct CPendingWalletTx
+{
+    CDataStream ssKey;
+    CDataStream ssValue;
+    CWalletTx wtx;
+    bool fOk;
+    bool fUpgraded;
+    string strErr;
+
+    CPendingWalletTx(CDataStream&& ssKeyIn, CDataStream&& ssValueIn) : ssKey(std::move(ssKeyIn)), ssValue(std::move(ssValueIn)), fOk(false), fUpgraded(false) {}
+};
+
+/**
+ * Parse the pending transaction records on up to nThreads threads, then
+ * load them into the wallet in their original order. Returns false if any
+ * record was unreadable.
+ */
+bool LoadPendingWalletTxs(CWallet* pwallet, std::vector<CPendingWalletTx>& vPending, CWalletScanState& wss, int nThreads)
+{
+    std::atomic<size_t> nNext(0);
+    auto worker = [&]() {
+        size_t i;
+        while ((i = nNext++) < vPending.size()) {
+            CPendingWalletTx& entry = vPending[i];
+            try {
+                string strType;
+                entry.ssKey >> strType;
+                entry.fOk = ReadWalletTx(entry.ssKey, entry.ssValue, entry.wtx, entry.fUpgraded, entry.strErr);
+            } catch (...) {
+                entry.fOk = false;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nThreads && (size_t)i * WALLET_LOAD_TXS_PER_THREAD < vPending.size(); ++i)
+        threads.emplace_back(worker);
+    worker();
+    BOOST_FOREACH(std::thread& thread, threads)
+        thread.join();
+
+    bool fAllOk = true;
+    BOOST_FOREACH(CPendingWalletTx& entry, vPending) {
+        if (entry.fOk)
+            LoadWalletTx(pwallet, entry.wtx, entry.fUpgraded, wss);
+        else
+            fAllOk = false;
+        if (!entry.strErr.empty())
+            LogPrintf("%s\n", entry.strErr);
+    }
+    vPending.clear();
+    return fAllOk;
+}
+}
+
 DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
 {
     pwallet->vchDefaultKey = CPubKey();
@@ -570,19 +665,37 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
         }
 
+        // Transaction records are the bulk of a large wallet. They are
+        // collected in batches and parsed in parallel; the batch is loaded
+        // before any other record so records are still applied in order.
+        int nThreads = std::max(1, std::min(GetNumCores(), MAX_WALLET_LOAD_THREADS));
+        std::vector<CPendingWalletTx> vPending;
+        vPending.reserve(WALLET_LOAD_TX_BATCH);
+        int64_t nStart = GetTimeMillis();
+        size_t nTxRecords = 0;
+
         while (true)
         {
             // Read next record
             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
             int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+            if (ret != 0 || ssKey.size() < 3 || memcmp(ssKey.data(), "\x02tx", 3) != 0 || vPending.size() >= WALLET_LOAD_TX_BATCH)
+            {
+                if (!vPending.empty() && !LoadPendingWalletTxs(pwallet, vPending, wss, nThreads))
+                {
+                    // Rescan if there is a bad transaction record:
+                    fNoncriticalErrors = true;
+                    SoftSetBoolArg("-rescan", true);
+                }
+            }
             if (ret == DB_NOTFOUND)
                 break;
             else if (ret != 0)
@@ -590,6 +703,12 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
                 LogPrintf("Error reading next record from wallet database\n");
                 return DB_CORRUPT;
             }
+            if (ssKey.size() >= 3 && memcmp(ssKey.data(), "\x02tx", 3) == 0)
+            {
+                vPending.emplace_back(std::move(ssKey), std::move(ssValue));
+                nTxRecords++;
+                continue;
+            }
 
             // Try to be tolerant of single corrupt records:
             string strType, strErr;
@@ -611,7 +730,8 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
             if (!strErr.empty())
                 LogPrintf("%s\n", strErr);
         }
-        pcursor->close();
+        delete pcursor;
+        LogPrint("db", "%s: loaded %u transactions on %d threads in %dms\n", __func__, nTxRecords, nThreads, GetTimeMillis() - nStart);
     }
     catch (const boost::thread_interrupted&) {
         throw;
@@ -676,7 +796,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
@@ -710,7 +830,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
                 vWtx.push_back(wtx);
             }
         }
-        pcursor->close();
+        delete pcursor;
     }
     catch (const boost::thread_interrupted&) {
         throw;
@@ -18,6 +18,12 @@
 #include <vector>
 
 static const bool DEFAULT_FLUSHWALLET = true;
+//! Number of transaction records parsed together while loading a wallet
+static const size_t WALLET_LOAD_TX_BATCH = 4096;
+//! Transaction records needed per additional thread parsing them
+static const size_t WALLET_LOAD_TXS_PER_THREAD = 256;
+//! Maximum number of threads parsing transaction records while loading a wallet
+static const int MAX_WALLET_LOAD_THREADS = 8;
 
 class CAccount;
 class CAccountingEntry;
@@ -141,6 +147,10 @@ public:
     bool WriteBestBlock(const CBlockLocator& locator);
     bool ReadBestBlock(CBlockLocator& locator);
 
+    bool WriteRescanResume(const CBlockLocator& locator);
+    bool ReadRescanResume(CBlockLocator& locator);
+    bool EraseRescanResume();
+
     bool WriteOrderPosNext(int64_t nOrderPosNext);
 
     bool WriteDefaultKey(const CPubKey& vchPubKey);
@@ -0,0 +1,439 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "wallet/walletlog.h"
+
+#include "crypto/common.h"
+#include "hash.h"
+#include "util.h"
+
+#include <limits>
+#include <string.h>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+#include <boost/filesystem.hpp>
+
+namespace {
+
+const unsigned char LOG_FILE_MAGIC[8] = {'e', 'b', 'w', 'l', 'o', 'g', '0', '1'};
+const uint32_t BATCH_MAGIC = 0x47424c57;
+const uint32_t RECORD_ERASED = 0xffffffff;
+const size_t BATCH_HEADER_SIZE = 12;
+const size_t BATCH_TRAILER_SIZE = 8;
+const size_t RECORD_HEADER_SIZE = 8;
+//! Batch size used when rewriting the log during compaction
+const size_t COMPACT_BATCH_SIZE = 1 << 20;
+
+uint64_t BatchChecksum(const unsigned char* batch, size_t nPayload)
+{
+    return CSipHasher(0x6562776c6f673031ULL, 0x77616c6c65746c67ULL).Write(batch, BATCH_HEADER_SIZE + nPayload).Finalize();
+}
+
+/** Serializes records into a single batch with its header and checksum */
+class CBatchWriter
+{
+private:
+    CSerializeData buf;
+    uint32_t nRecords;
+
+public:
+    CBatchWriter() : buf(BATCH_HEADER_SIZE), nRecords(0) {}
+
+    void Add(const CWalletLog::Key& key, bool fErase, const CWalletLog::Value& value)
+    {
+        size_t nOffset = buf.size();
+        buf.resize(nOffset + RECORD_HEADER_SIZE);
+        WriteLE32((unsigned char*)&buf[nOffset], key.size());
+        WriteLE32((unsigned char*)&buf[nOffset + 4], fErase ? RECORD_ERASED : value.size());
+        buf.insert(buf.end(), key.begin(), key.end());
+        if (!fErase)
+            buf.insert(buf.end(), value.begin(), value.end());
+        nRecords++;
+    }
+
+    bool empty() const { return nRecords == 0; }
+    size_t size() const { return buf.size(); }
+
+    const CSerializeData& Finish()
+    {
+        unsigned char* data = (unsigned char*)&buf[0];
+        WriteLE32(data, BATCH_MAGIC);
+        WriteLE32(data + 4, nRecords);
+        WriteLE32(data + 8, buf.size() - BATCH_HEADER_SIZE);
+        uint64_t nChecksum = BatchChecksum(data, buf.size() - BATCH_HEADER_SIZE);
+        buf.resize(buf.size() + BATCH_TRAILER_SIZE);
+        WriteLE64((unsigned char*)&buf[buf.size() - BATCH_TRAILER_SIZE], nChecksum);
+        return buf;
+    }
+};
+
+/** Check that a complete, intact batch starts at pos, and return where it ends */
+bool CheckBatch(const unsigned char* data, uint64_t size, uint64_t pos, uint64_t& nEnd)
+{
+    if (size - pos < BATCH_HEADER_SIZE + BATCH_TRAILER_SIZE || ReadLE32(data + pos) != BATCH_MAGIC)
+        return false;
+    uint64_t nPayload = ReadLE32(data + pos + 8);
+    if (size - pos - BATCH_HEADER_SIZE - BATCH_TRAILER_SIZE < nPayload)
+        return false;
+    nEnd = pos + BATCH_HEADER_SIZE + nPayload + BATCH_TRAILER_SIZE;
+    return ReadLE64(data + nEnd - BATCH_TRAILER_SIZE) == BatchChecksum(data + pos, nPayload);
+}
+
+/**
+ * Whether the data from pos on, which failed to check as a batch, can be the
+ * remainder of an interrupted append: a batch that reaches the end of the file,
+ * or space the file was extended by that was never written.
+ */
+bool IsTornTail(const unsigned char* data, uint64_t size, uint64_t pos)
+{
+    if (size - pos < BATCH_HEADER_SIZE)
+        return true;
+    if (ReadLE32(data + pos) == BATCH_MAGIC)
+        return pos + BATCH_HEADER_SIZE + ReadLE32(data + pos + 8) + BATCH_TRAILER_SIZE >= size;
+    for (; pos < size; pos++) {
+        if (data[pos] != 0)
+            return false;
+    }
+    return true;
+}
+
+bool WriteAll(FILE* file, const CSerializeData& buf)
+{
+    return fwrite(buf.data(), 1, buf.size(), file) == buf.size();
+}
+
+} // namespace
+
+CWalletLog::CWalletLog(const boost::filesystem::path& pathIn) : path(pathIn), file(NULL), nFileSize(0), nLiveSize(0), fSyncNeeded(false)
+{
+}
+
+CWalletLog::~CWalletLog()
+{
+    Close();
+}
+
+void CWalletLog::Apply(const Key& key, bool fErase, const Value& value)
+{
+    std::map<Key, Value>::iterator it = mapRecords.find(key);
+    if (it != mapRecords.end()) {
+        nLiveSize -= RECORD_HEADER_SIZE + it->first.size() + it->second.size();
+        if (fErase) {
+            mapRecords.erase(it);
+            return;
+        }
+        it->second = value;
+    } else {
+        if (fErase)
+            return;
+        mapRecords.insert(std::make_pair(key, value));
+    }
+    nLiveSize += RECORD_HEADER_SIZE + key.size() + value.size();
+}
+
+bool CWalletLog::Replay(const unsigned char* data, uint64_t size, bool fSalvage, uint64_t& nValidSize)
+{
+    if (size < sizeof(LOG_FILE_MAGIC) || memcmp(data, LOG_FILE_MAGIC, sizeof(LOG_FILE_MAGIC)) != 0)
+        return error("%s: %s is not a wallet log", __func__, path.string());
+
+    uint64_t pos = sizeof(LOG_FILE_MAGIC);
+    nValidSize = pos;
+    while (pos < size) {
+        uint64_t nEnd;
+        if (!CheckBatch(data, size, pos, nEnd)) {
+            // A batch that fails to check is fine at the end of the file,
+            // where it is the remainder of an interrupted write. Anywhere
+            // else it means the file is damaged.
+            uint64_t nNext = pos + 1;
+            for (; nNext + BATCH_HEADER_SIZE <= size; nNext++) {
+                if (ReadLE32(data + nNext) == BATCH_MAGIC && CheckBatch(data, size, nNext, nEnd))
+                    break;
+            }
+            const bool fFound = nNext + BATCH_HEADER_SIZE <= size;
+            if (!fFound && IsTornTail(data, size, pos)) {
+                LogPrintf("%s: discarding %u bytes of incomplete data at the end of %s\n", __func__, size - pos, path.string());
+                break;
+            }
+            if (!fSalvage)
+                return error("%s: corrupt data at offset %u of %s", __func__, pos, path.string());
+            if (!fFound) {
+                LogPrintf("%s: discarding %u bytes of corrupt data at the end of %s\n", __func__, size - pos, path.string());
+                break;
+            }
+            LogPrintf("%s: skipping %u bytes of corrupt data at offset %u of %s\n", __func__, nNext - pos, pos, path.string());
+            pos = nNext;
+        }
+
+        // Parse the whole batch before applying any of it
+        const unsigned char* pbatch = data + pos;
+        const unsigned char* pend = data + nEnd - BATCH_TRAILER_SIZE;
+        uint32_t nRecords = ReadLE32(pbatch + 4);
+        std::vector<std::pair<const unsigned char*, uint32_t> > vRecords;
+        vRecords.reserve(nRecords);
+        const unsigned char* p = pbatch + BATCH_HEADER_SIZE;
+        for (uint32_t i = 0; i < nRecords; i++) {
+            if (pend - p < (ptrdiff_t)RECORD_HEADER_SIZE)
+                return error("%s: malformed batch at offset %u of %s", __func__, pos, path.string());
+            uint64_t nKeySize = ReadLE32(p);
+            uint32_t nValueSize = ReadLE32(p + 4);
+            uint64_t nSize = RECORD_HEADER_SIZE + nKeySize + (nValueSize == RECORD_ERASED ? 0 : nValueSize);
+            if ((uint64_t)(pend - p) < nSize)
+                return error("%s: malformed batch at offset %u of %s", __func__, pos, path.string());
+            vRecords.push_back(std::make_pair(p, nValueSize));
+            p += nSize;
+        }
+        if (p != pend)
+            return error("%s: malformed batch at offset %u of %s", __func__, pos, path.string());
+
+        for (size_t i = 0; i < vRecords.size(); i++) {
+            const unsigned char* pkey = vRecords[i].first + RECORD_HEADER_SIZE;
+            Key key(pkey, pkey + ReadLE32(vRecords[i].first));
+            if (vRecords[i].second == RECORD_ERASED) {
+                Apply(key, true, Value());
+            } else {
+                const unsigned char* pvalue = pkey + key.size();
+                Apply(key, false, Value(pvalue, pvalue + vRecords[i].second));
+            }
+        }
+        pos = nEnd;
+        nValidSize = pos;
+    }
+    return true;
+}
+
+bool CWalletLog::Open(bool fSalvage)
+{
+    LOCK(cs);
+    if (file)
+        return true;
+
+    boost::system::error_code ec;
+    uint64_t size = boost::filesystem::exists(path) ? boost::filesystem::file_size(path, ec) : 0;
+    if (ec)
+        return error("%s: can't determine size of %s", __func__, path.string());
+
+    file = fopen(path.string().c_str(), size ? "rb+" : "wb+");
+    if (!file)
+        return error("%s: can't open %s", __func__, path.string());
+
+    if (size == 0) {
+        if (fwrite(LOG_FILE_MAGIC, 1, sizeof(LOG_FILE_MAGIC), file) != sizeof(LOG_FILE_MAGIC)) {
+            Close();
+            return error("%s: can't write to %s", __func__, path.string());
+        }
+        FileCommit(file);
+        nFileSize = nLiveSize = sizeof(LOG_FILE_MAGIC);
+        return true;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    nLiveSize = sizeof(LOG_FILE_MAGIC);
+    uint64_t nValidSize = 0;
+    bool fOk;
+#ifndef WIN32
+    void* pmap = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (pmap == MAP_FAILED) {
+        Close();
+        return error("%s: can't map %s", __func__, path.string());
+    }
+    posix_madvise(pmap, size, POSIX_MADV_SEQUENTIAL);
+    fOk = Replay((const unsigned char*)pmap, size, fSalvage, nValidSize);
+    munmap(pmap, size);
+#else
+    std::vector<unsigned char> vData(size);
+    fOk = fread(vData.data(), 1, size, file) == size && Replay(vData.data(), size, fSalvage, nValidSize);
+#endif
+    if (!fOk) {
+        Close();
+        return false;
+    }
+
+    if (nValidSize < size && !TruncateFile(file, nValidSize)) {
+        Close();
+        return error("%s: can't truncate %s", __func__, path.string());
+    }
+    fseek(file, 0, SEEK_END);
+    nFileSize = nValidSize;
+    LogPrint("db", "%s: loaded %u records from %s in %dms\n", __func__, mapRecords.size(), path.string(), GetTimeMillis() - nStart);
+
+    // Salvaging may have skipped corrupt data in the middle of the file,
+    // which must not be there the next time it is opened.
+    if (fSalvage)
+        return Compact();
+    return true;
+}
+
+void CWalletLog::Close()
+{
+    LOCK(cs);
+    if (file) {
+        if (fSyncNeeded)
+            FileCommit(file);
+        fclose(file);
+        file = NULL;
+    }
+    mapRecords.clear();
+    nFileSize = nLiveSize = 0;
+    fSyncNeeded = false;
+}
+
+bool CWalletLog::Read(const Key& key, Value& value) const
+{
+    LOCK(cs);
+    std::map<Key, Value>::const_iterator it = mapRecords.find(key);
+    if (it == mapRecords.end())
+        return false;
+    value = it->second;
+    return true;
+}
+
+bool CWalletLog::Exists(const Key& key) const
+{
+    LOCK(cs);
+    return mapRecords.count(key) != 0;
+}
+
+bool CWalletLog::Next(Key& key, Value& value, bool fInclusive) const
+{
+    LOCK(cs);
+    std::map<Key, Value>::const_iterator it = fInclusive ? mapRecords.lower_bound(key) : mapRecords.upper_bound(key);
+    if (it == mapRecords.end())
+        return false;
+    key = it->first;
+    value = it->second;
+    return true;
+}
+
+bool CWalletLog::Commit(const Batch& batch)
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+    if (batch.empty())
+        return true;
+
+    CBatchWriter writer;
+    for (Batch::const_iterator it = batch.begin(); it != batch.end(); ++it)
+        writer.Add(it->first, it->second.first, it->second.second);
+    if (writer.size() > std::numeric_limits<uint32_t>::max())
+        return error("%s: batch of %u bytes is too large", __func__, writer.size());
+    const CSerializeData& buf = writer.Finish();
+
+    if (!WriteAll(file, buf) || fflush(file) != 0) {
+        // Don't leave a partial batch in the middle of the file
+        TruncateFile(file, nFileSize);
+        fseek(file, 0, SEEK_END);
+        return error("%s: failed to write to %s", __func__, path.string());
+    }
+    nFileSize += buf.size();
+    fSyncNeeded = true;
+
+    for (Batch::const_iterator it = batch.begin(); it != batch.end(); ++it)
+        Apply(it->first, it->second.first, it->second.second);
+    return true;
+}
+
+bool CWalletLog::Sync()
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+    if (fSyncNeeded) {
+        FileCommit(file);
+        fSyncNeeded = false;
+    }
+    return true;
+}
+
+bool CWalletLog::NeedsCompaction() const
+{
+    LOCK(cs);
+    return file && nFileSize > WALLETLOG_MIN_COMPACT_SIZE && nFileSize > 2 * nLiveSize;
+}
+
+bool CWalletLog::Compact(const char* pszSkip)
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path pathTmp = path.string() + ".compact";
+    FILE* fileTmp = fopen(pathTmp.string().c_str(), "wb");
+    if (!fileTmp)
+        return error("%s: can't create %s", __func__, pathTmp.string());
+
+    size_t nSkipLen = pszSkip ? strlen(pszSkip) : 0;
+    std::vector<Key> vSkipped;
+    uint64_t nNewSize = sizeof(LOG_FILE_MAGIC);
+    bool fOk = fwrite(LOG_FILE_MAGIC, 1, sizeof(LOG_FILE_MAGIC), fileTmp) == sizeof(LOG_FILE_MAGIC);
+    CBatchWriter writer;
+    for (std::map<Key, Value>::const_iterator it = mapRecords.begin(); fOk && it != mapRecords.end(); ++it) {
+        if (pszSkip && memcmp(it->first.data(), pszSkip, std::min(it->first.size(), nSkipLen)) == 0) {
+            vSkipped.push_back(it->first);
+            continue;
+        }
+        writer.Add(it->first, false, it->second);
+        if (writer.size() >= COMPACT_BATCH_SIZE) {
+            const CSerializeData& buf = writer.Finish();
+            fOk = WriteAll(fileTmp, buf);
+            nNewSize += buf.size();
+            writer = CBatchWriter();
+        }
+    }
+    if (fOk && !writer.empty()) {
+        const CSerializeData& buf = writer.Finish();
+        fOk = WriteAll(fileTmp, buf);
+        nNewSize += buf.size();
+    }
+    if (fOk)
+        FileCommit(fileTmp);
+    fclose(fileTmp);
+    if (!fOk) {
+        boost::filesystem::remove(pathTmp);
+        return error("%s: failed to write %s", __func__, pathTmp.string());
+    }
+
+    fclose(file);
+    file = NULL;
+    const bool fRenamed = RenameOver(pathTmp, path);
+    if (fRenamed) {
+        // The old file is gone once the rename is on disk
+        DirectoryCommit(path.parent_path());
+    } else {
+        boost::system::error_code ec;
+        boost::filesystem::remove(pathTmp, ec);
+    }
+    // Either way, the file at path holds all records
+    file = fopen(path.string().c_str(), "rb+");
+    if (!file) {
+        mapRecords.clear();
+        return error("%s: can't reopen %s", __func__, path.string());
+    }
+    fseek(file, 0, SEEK_END);
+    if (!fRenamed)
+        return error("%s: can't rename %s over %s", __func__, pathTmp.string(), path.string());
+    nFileSize = nNewSize;
+    fSyncNeeded = false;
+
+    for (size_t i = 0; i < vSkipped.size(); i++)
+        Apply(vSkipped[i], true, Value());
+    LogPrint("db", "%s: compacted %s to %u records, %u bytes in %dms\n", __func__, path.string(), mapRecords.size(), nFileSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+size_t CWalletLog::GetRecordCount() const
+{
+    LOCK(cs);
+    return mapRecords.size();
+}
+
+uint64_t CWalletLog::GetFileSize() const
+{
+    LOCK(cs);
+    return nFileSize;
+}
@@ -0,0 +1,97 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLET_WALLETLOG_H
+#define BITCOIN_WALLET_WALLETLOG_H
+
+#include "support/allocators/zeroafterfree.h"
+#include "sync.h"
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+/** Compact the log once it is larger than this and mostly dead records */
+static const uint64_t WALLETLOG_MIN_COMPACT_SIZE = 1 << 20;
+
+/**
+ * Append-only key/value record log, used as an alternative to Berkeley DB
+ * for wallet files (-walletbackend=log).
+ *
+ * The file starts with an 8 byte magic and is followed by batches:
+ *   magic (4) | record count (4) | payload size (4) | payload | SipHash (8)
+ * where the payload is a sequence of records:
+ *   key size (4) | value size (4, ERASED for erases) | key | value
+ *
+ * A batch is written with a single write and only takes effect once its
+ * checksum is complete, so a transaction is either fully present after a
+ * crash or not at all; a torn batch at the end of the file is truncated
+ * away on open. Durability is grouped: Commit() hands the batch to the OS
+ * and Sync() fsyncs everything written since the previous call, which the
+ * wallet flush thread does periodically and on shutdown.
+ *
+ * All live records are kept in an ordered in-memory index, so reads never
+ * touch the disk and cursors iterate in the same order as the Berkeley DB
+ * btree. Overwritten and erased records are reclaimed by Compact(), which
+ * writes the live records to a new file and renames it over the log.
+ */
+class CWalletLog
+{
+public:
+    typedef std::vector<unsigned char> Key;
+    typedef CSerializeData Value;
+    /** Writes (or erases, if the flag is set) applied atomically by Commit() */
+    typedef std::map<Key, std::pair<bool, Value> > Batch;
+
+    explicit CWalletLog(const boost::filesystem::path& pathIn);
+    ~CWalletLog();
+
+    /**
+     * Open the log, creating it if it does not exist, and replay it into
+     * memory. A checksum failure anywhere but at the end of the file is
+     * an error unless fSalvage is set, in which case corrupt batches are
+     * skipped and the following ones are still replayed.
+     */
+    bool Open(bool fSalvage = false);
+    void Close();
+
+    bool Read(const Key& key, Value& value) const;
+    bool Exists(const Key& key) const;
+    /** Find the first record after key (or at it, if fInclusive) */
+    bool Next(Key& key, Value& value, bool fInclusive) const;
+
+    bool Commit(const Batch& batch);
+    bool Sync();
+
+    bool NeedsCompaction() const;
+    /** Rewrite the log with only its live records, dropping keys starting with pszSkip */
+    bool Compact(const char* pszSkip = NULL);
+
+    size_t GetRecordCount() const;
+    uint64_t GetFileSize() const;
+    const boost::filesystem::path& GetPath() const { return path; }
+
+private:
+    mutable CCriticalSection cs;
+    const boost::filesystem::path path;
+    FILE* file;
+    std::map<Key, Value> mapRecords;
+    //! Bytes in the file, and bytes a compacted file would need
+    uint64_t nFileSize;
+    uint64_t nLiveSize;
+    bool fSyncNeeded;
+
+    CWalletLog(const CWalletLog&);
+    CWalletLog& operator=(const CWalletLog&);
+
+    bool Replay(const unsigned char* data, uint64_t size, bool fSalvage, uint64_t& nValidSize);
+    void Apply(const Key& key, bool fErase, const Value& value);
+};
+
+#endif // BITCOIN_WALLET_WALLETLOG_H
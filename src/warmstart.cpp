@@ -0,0 +1,167 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "warmstart.h"
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "coins.h"
+#include "hash.h"
+#include "script/sigcache.h"
+#include "streams.h"
+#include "sync.h"
+#include "txdb.h"
+#include "util.h"
+#include "utiltime.h"
+#include "validation.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+
+static const uint64_t WARMSTART_VERSION = 1;
+
+/** Coins are read back in txid order, this many at a time, most recently used first */
+static const size_t WARMSTART_COINS_BATCH = 10000;
+
+namespace {
+
+boost::filesystem::path GetWarmStartPath()
+{
+    return GetDataDir() / "warmstart.dat";
+}
+
+/** What a flush leaves in the coins cache; a warm start fills it no further */
+size_t GetWarmCoinsUsage()
+{
+    return nCoinCacheUsage * COINS_CACHE_KEEP_PERCENT / 100 / DB_PEAK_USAGE_FACTOR;
+}
+
+template <typename T>
+void WriteHashed(CAutoFile& file, CHashWriter& hasher, const T& obj)
+{
+    file << obj;
+    hasher << obj;
+}
+
+template <typename T>
+void ReadHashed(CAutoFile& file, CHashWriter& hasher, T& obj)
+{
+    file >> obj;
+    hasher << obj;
+}
+
+} // namespace
+
+bool DumpWarmStart()
+{
+    const int64_t nStart = GetTimeMillis();
+    uint256 hashBestBlock;
+    std::vector<uint256> vCoins;
+    {
+        LOCK(cs_main);
+        if (pcoinsTip == NULL)
+            return false;
+        hashBestBlock = pcoinsTip->GetBestBlock();
+        pcoinsTip->GetHotCoins(vCoins, GetWarmCoinsUsage());
+    }
+    if (hashBestBlock.IsNull())
+        return false;
+    uint256 nonceSigCache;
+    std::vector<uint256> vSigCache;
+    DumpSignatureCache(nonceSigCache, vSigCache);
+
+    const boost::filesystem::path path = GetWarmStartPath();
+    const boost::filesystem::path pathTmp = path.string() + ".new";
+    try {
+        CAutoFile file(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return error("%s: failed to open %s", __func__, pathTmp.string());
+
+        // Everything is covered by a trailing checksum, as the signature
+        // cache entries are trusted once loaded
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        WriteHashed(file, hasher, FLATDATA(Params().MessageStart()));
+        WriteHashed(file, hasher, WARMSTART_VERSION);
+        WriteHashed(file, hasher, hashBestBlock);
+        WriteHashed(file, hasher, vCoins);
+        WriteHashed(file, hasher, nonceSigCache);
+        WriteHashed(file, hasher, vSigCache);
+        file << hasher.GetHash();
+        FileCommit(file.Get());
+        file.fclose();
+    } catch (const std::exception& e) {
+        return error("%s: failed to write %s: %s", __func__, pathTmp.string(), e.what());
+    }
+    if (!RenameOver(pathTmp, path))
+        return error("%s: failed to rename %s", __func__, pathTmp.string());
+    LogPrintf("Wrote warm start file: %u coins, %u signature cache entries, %dms\n",
+        vCoins.size(), vSigCache.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadWarmStart()
+{
+    const int64_t nStart = GetTimeMillis();
+    const boost::filesystem::path path = GetWarmStartPath();
+    CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return false;
+
+    unsigned char pchMessageStart[4];
+    uint64_t nVersion;
+    uint256 hashBestBlock;
+    std::vector<uint256> vCoins;
+    uint256 nonceSigCache;
+    std::vector<uint256> vSigCache;
+    try {
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        ReadHashed(file, hasher, FLATDATA(pchMessageStart));
+        if (memcmp(pchMessageStart, Params().MessageStart(), sizeof(pchMessageStart)))
+            throw std::runtime_error("written for another network");
+        ReadHashed(file, hasher, nVersion);
+        if (nVersion != WARMSTART_VERSION)
+            throw std::runtime_error(strprintf("unknown version %u", nVersion));
+        ReadHashed(file, hasher, hashBestBlock);
+        ReadHashed(file, hasher, vCoins);
+        ReadHashed(file, hasher, nonceSigCache);
+        ReadHashed(file, hasher, vSigCache);
+        uint256 hashChecksum;
+        file >> hashChecksum;
+        if (hashChecksum != hasher.GetHash())
+            throw std::runtime_error("checksum mismatch");
+    } catch (const std::exception& e) {
+        file.fclose();
+        boost::filesystem::remove(path);
+        return error("%s: ignoring %s: %s", __func__, path.string(), e.what());
+    }
+    file.fclose();
+    boost::filesystem::remove(path);
+
+    // Signature validity does not depend on the chain state
+    LoadSignatureCache(nonceSigCache, vSigCache);
+
+    size_t nCoins = 0;
+    {
+        LOCK(cs_main);
+        if (hashBestBlock != pcoinsTip->GetBestBlock()) {
+            LogPrintf("%s: the chain state moved on since %s was written, not loading coins\n", __func__, path.string());
+            vCoins.clear();
+        }
+        // Reading a batch in txid order reads the database mostly sequentially
+        const size_t nMaxUsage = GetWarmCoinsUsage();
+        for (size_t i = 0; i < vCoins.size() && pcoinsTip->DynamicMemoryUsage() < nMaxUsage; i += WARMSTART_COINS_BATCH) {
+            const std::vector<uint256>::iterator itEnd = vCoins.begin() + std::min(vCoins.size(), i + WARMSTART_COINS_BATCH);
+            std::sort(vCoins.begin() + i, itEnd);
+            for (std::vector<uint256>::const_iterator it = vCoins.begin() + i; it != itEnd; ++it) {
+                if (pcoinsTip->HaveCoins(*it))
+                    nCoins++;
+            }
+        }
+    }
+    LogPrintf("Loaded warm start file: %u coins, %u signature cache entries, %dms\n",
+        nCoins, vSigCache.size(), GetTimeMillis() - nStart);
+    return true;
+}
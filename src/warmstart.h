@@ -0,0 +1,27 @@
+// Copyright (c) 2017 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WARMSTART_H
+#define BITCOIN_WARMSTART_H
+
+//! Default for -warmstart
+static const bool DEFAULT_WARMSTART = false;
+
+/**
+ * Write the txids of the most recently used coins in pcoinsTip and the
+ * entries of the signature cache to warmstart.dat, for LoadWarmStart on the
+ * next start. Meant for shutdown, after the coins were flushed.
+ */
+bool DumpWarmStart();
+
+/**
+ * Refill the coins and signature caches from warmstart.dat, if there is one.
+ * The file is removed once read, so it is only used by the start right after
+ * the shutdown that wrote it. Coins are only loaded if the chain state is
+ * still at the block the file was written at. Must be called before blocks or
+ * transactions are validated.
+ */
+bool LoadWarmStart();
+
+#endif // BITCOIN_WARMSTART_H